@@ -11,6 +11,12 @@
 #include <string.h>
 #include <time.h>
 
+#include "Stereo_Sequence.hpp"
+#include "Stereo_ThreadPool.hpp"
+#include "Stereo_Chessboard.hpp"
+#include "Stereo_CornerCache.hpp"
+#include "Stereo_Trace.hpp"
+
 using namespace cv;
 using namespace std;
 
@@ -66,13 +72,20 @@ static void help()
            "     [-a <aspectRatio>]      # fix aspect ratio (fx/fy)\n"
            "     [-p]                     # fix the principal point at the center\n"
            "     [-v]                     # flip the captured images around the horizontal axis\n"
+           "     [-side <left|right>]     # the camera to take from a .sseq recording (left by default)\n"
            "     [-V]                     # use a video file, and not an image list, uses\n"
            "                              # [input_data] string for the video file name\n"
            "     [-su]                    # show undistorted images after calibration\n"
+           "     [-c <corner_cache>]      # cache of the detections of stored images (<input_data>.corners by default)\n"
+           "     [-nc]                    # detect without the corner cache\n"
+           "     [-t <threads>]           # threads detecting the views of an image list (one per CPU by default)\n"
+           "     [-trace <trace.json>]    # Chrome trace of the time spent per stage and thread (STEREO_ENABLE_TRACE builds)\n"
+           "     [-trace-summary <file>]  # p50/p95/p99 per stage as JSON\n"
            "     [input_data]             # input data, one of the following:\n"
            "                              #  - text file with a list of the images of the board\n"
            "                              #    the text file can be generated with imagelist_creator\n"
            "                              #  - name of video file with a video of the board\n"
+           "                              #  - a .sseq stereo recording of Cam_Capture (see -side)\n"
            "                              # if input_data not specified, a live view from the camera is used\n"
            "\n" );
     printf("\n%s",usage);
@@ -153,6 +166,7 @@ static bool runCalibration( vector<vector<Point2f> > imagePoints,
     
     objectPoints.resize(imagePoints.size(),objectPoints[0]);
     
+    STEREO_TRACE_SCOPE("calibrateCamera");
     double rms = calibrateCamera(objectPoints, imagePoints, imageSize, cameraMatrix,
                                  distCoeffs, rvecs, tvecs, flags|CALIB_FIX_K4|CALIB_FIX_K5);
     ///*|CALIB_FIX_K3*/|CALIB_FIX_K4|CALIB_FIX_K5);
@@ -264,6 +278,63 @@ static bool readStringList( const string& filename, vector<string>& l )
 }
 
 
+//finds the calibration pattern in view (gray in viewGray); chessboard corners are refined to sub-pixel accuracy
+static bool detectPattern(const Mat& view, const Mat& viewGray, Size boardSize, Pattern pattern, vector<Point2f>& pointbuf)
+{
+    switch( pattern )
+    {
+        case CHESSBOARD:
+            //low resolution first, refined at full resolution
+            return stereoFindChessboard( viewGray, boardSize, pointbuf, 1,
+                                         CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_FAST_CHECK | CALIB_CB_NORMALIZE_IMAGE);
+        case CIRCLES_GRID:
+            return findCirclesGrid( view, boardSize, pointbuf );
+        case ASYMMETRIC_CIRCLES_GRID:
+            return findCirclesGrid( view, boardSize, pointbuf, CALIB_CB_ASYMMETRIC_GRID );
+    }
+    return false;
+}
+
+//detections of every stored image in list order, on a pool of nthreads (0: one per CPU);
+//an image that cannot be read has an empty imageSize
+static void detectImageList(const vector<string>& imageList, Size boardSize, Pattern pattern, bool flipVertical,
+                            int nthreads, StereoCornerCache& cache, vector<StereoCornerRecord>& detections)
+{
+    detections.assign(imageList.size(), StereoCornerRecord());
+    StereoWorkStealingPool pool(nthreads);
+    StereoProgress progress("detecting", (int)imageList.size());
+    pool.run((int)imageList.size(), [&](int i, int)
+    {
+        StereoCornerRecord& d = detections[i];
+        //looked up in the corner cache by the image contents
+        uint64 key = 0;
+        if( cache.isOpened() )
+        {
+            uint64 h = stereoImageContentHash(imageList[i]);
+            key = h ? StereoCornerCache::key(h, boardSize, pattern, flipVertical) : 0;
+        }
+        if( !key || !cache.lookup(key, d) )
+        {
+            Mat view, viewGray;
+            {
+                STEREO_TRACE_SCOPE("imread");
+                view = stereoImread(imageList[i], 1);
+            }
+            if( !view.empty() )
+            {
+                if( flipVertical )
+                    flip( view, view, 0 );
+                cvtColor(view, viewGray, COLOR_BGR2GRAY);
+                d.imageSize = view.size();
+                d.found = detectPattern(view, viewGray, boardSize, pattern, d.corners);
+                if( key )
+                    cache.insert(key, d);
+            }
+        }
+        progress.step();
+    });
+}
+
 static bool runAndSave(const string& outputFilename,
                        const vector<vector<Point2f> >& imagePoints,
                        Size imageSize, Size boardSize, Pattern patternType, float squareSize,
@@ -310,13 +381,22 @@ int main( int argc, char** argv )
     bool flipVertical = false;
     bool showUndistorted = false;
     bool videofile = false;
+    bool cameraInput = false;
+    int sequenceSide = 0;
     int delay = 1000;
-    clock_t prevTimestamp = 0;
+    int64 prevTimestamp = 0;
     int mode = DETECTION;
     int cameraId = 0;
     vector<vector<Point2f> > imagePoints;
     vector<string> imageList;
     Pattern pattern = CHESSBOARD;
+    string cacheFilename;
+    bool useCache = true;
+    int nthreads = 0;
+    const char* traceFilename = "";
+    const char* traceSummaryFilename = "";
+    //written when main() returns, after the detector thread has stopped
+    StereoTraceSession trace;
     
     if( argc < 2 )
     {
@@ -390,6 +470,16 @@ int main( int argc, char** argv )
         {
             flipVertical = true;
         }
+        else if( strcmp( s, "-side" ) == 0 )
+        {
+            i++;
+            if( !strcmp( argv[i], "left" ) )
+                sequenceSide = 0;
+            else if( !strcmp( argv[i], "right" ) )
+                sequenceSide = 1;
+            else
+                return fprintf( stderr, "Invalid side: must be left or right\n" ), -1;
+        }
         else if( strcmp( s, "-V" ) == 0 )
         {
             videofile = true;
@@ -398,6 +488,27 @@ int main( int argc, char** argv )
         {
             outputFilename = argv[++i];
         }
+        else if( strcmp( s, "-c" ) == 0 )
+        {
+            cacheFilename = argv[++i];
+        }
+        else if( strcmp( s, "-nc" ) == 0 )
+        {
+            useCache = false;
+        }
+        else if( strcmp( s, "-t" ) == 0 )
+        {
+            if( sscanf( argv[++i], "%d", &nthreads ) != 1 || nthreads < 0 )
+                return fprintf( stderr, "Invalid number of threads\n" ), -1;
+        }
+        else if( strcmp( s, "-trace" ) == 0 )
+        {
+            traceFilename = argv[++i];
+        }
+        else if( strcmp( s, "-trace-summary" ) == 0 )
+        {
+            traceSummaryFilename = argv[++i];
+        }
         else if( strcmp( s, "-su" ) == 0 )
         {
             showUndistorted = true;
@@ -412,16 +523,25 @@ int main( int argc, char** argv )
         else
             return fprintf( stderr, "Unknown option %s", s ), -1;
     }
+    trace.open(traceFilename, traceSummaryFilename);
     
     if( inputFilename )
     {
-        if( !videofile && readStringList(inputFilename, imageList) )
+        if( !videofile && stereoIsSequenceFile(inputFilename) )
+        {
+            if( stereoSequenceImageList(inputFilename, imageList, sequenceSide) && !imageList.empty() )
+                mode = CAPTURING;
+        }
+        else if( !videofile && readStringList(inputFilename, imageList) )
             mode = CAPTURING;
         else
             capture.open(inputFilename);
     }
     else
+    {
         capture.open(cameraId);
+        cameraInput = true;
+    }
     
     if( !capture.isOpened() && imageList.empty() )
         return fprintf( stderr, "Could not initialize video (%d) capture\n",cameraId ), -2;
@@ -432,21 +552,73 @@ int main( int argc, char** argv )
     if( capture.isOpened() )
         printf( "%s", liveCaptureHelp );
     
+    //detections of stored images are cached next to the image list unless told otherwise
+    StereoCornerCache cache;
+    if( !imageList.empty() && useCache )
+    {
+        if( cacheFilename.empty() )
+            cacheFilename = string(inputFilename) + ".corners";
+        if( !cache.open(cacheFilename) )
+            fprintf( stderr, "%s is not a corner cache, detecting without it\n", cacheFilename.c_str() );
+    }
+    
+    //stored images are detected up front on every core and calibrated right away
+    if( !imageList.empty() )
+    {
+        vector<StereoCornerRecord> detections;
+        detectImageList(imageList, boardSize, pattern, flipVertical, nthreads, cache, detections);
+        if( cache.isOpened() && !cache.flush() )
+            fprintf( stderr, "Could not write the corner cache %s\n", cacheFilename.c_str() );
+        for( i = 0; i < (int)detections.size(); i++ )
+        {
+            const StereoCornerRecord& d = detections[i];
+            if( d.imageSize == Size() )
+                fprintf( stderr, "Could not read %s\n", imageList[i].c_str() );
+            else if( imageSize != Size() && d.imageSize != imageSize )
+                fprintf( stderr, "%s does not have the size of the first image, skipped\n", imageList[i].c_str() );
+            else
+            {
+                imageSize = d.imageSize;
+                if( d.found )
+                    imagePoints.push_back(d.corners);
+            }
+        }
+        printf( "%d of %d views with the pattern\n", (int)imagePoints.size(), (int)imageList.size() );
+        if( imagePoints.size() > 0 &&
+            runAndSave(outputFilename, imagePoints, imageSize,
+                       boardSize, pattern, squareSize, aspectRatio,
+                       flags, cameraMatrix, distCoeffs,
+                       writeExtrinsics, writePoints) )
+            mode = CALIBRATED;
+    }
+    
     namedWindow( "Image View", 1 );
     
-    for(i = 0;;i++)
+    //live capture: detection runs on its own thread against the newest frame, while this
+    //loop keeps grabbing and showing at camera rate; the corners lag by one detection.
+    //Video files are detected frame by frame, none of their views is skipped
+    StereoBackgroundDetector::Detect detect = [&](const Mat& frame, vector<Point2f>& corners)
+    {
+        Mat gray;
+        cvtColor(frame, gray, COLOR_BGR2GRAY);
+        return detectPattern(frame, gray, boardSize, pattern, corners);
+    };
+    Ptr<StereoBackgroundDetector> detector;
+    if( cameraInput && capture.isOpened() )
+        detector = makePtr<StereoBackgroundDetector>(detect);
+    bool found = false;
+    vector<Point2f> pointbuf;
+    
+    for(i = 0; capture.isOpened(); i++)
     {
-        Mat view, viewGray;
+        Mat view, view0;
         bool blink = false;
         
-        if( capture.isOpened() )
         {
-            Mat view0;
+            STEREO_TRACE_SCOPE("capture");
             capture >> view0;
             view0.copyTo(view);
         }
-        else if( i < (int)imageList.size() )
-            view = imread(imageList[i], 1);
         
         if(view.empty())
         {
@@ -463,36 +635,22 @@ int main( int argc, char** argv )
         if( flipVertical )
             flip( view, view, 0 );
         
-        vector<Point2f> pointbuf;
-        cvtColor(view, viewGray, COLOR_BGR2GRAY);
-        
-        bool found;
-        switch( pattern )
+        bool fresh = true;
+        if( detector )
         {
-            case CHESSBOARD:
-                found = findChessboardCorners( view, boardSize, pointbuf,
-                                              CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_FAST_CHECK | CALIB_CB_NORMALIZE_IMAGE);
-                break;
-            case CIRCLES_GRID:
-                found = findCirclesGrid( view, boardSize, pointbuf );
-                break;
-            case ASYMMETRIC_CIRCLES_GRID:
-                found = findCirclesGrid( view, boardSize, pointbuf, CALIB_CB_ASYMMETRIC_GRID );
-                break;
-            default:
-                return fprintf( stderr, "Unknown pattern type\n" ), -1;
+            detector->submit(view.clone());
+            fresh = detector->poll(found, pointbuf);
         }
+        else
+            found = detect(view, pointbuf);
         
-        // improve the found corners' coordinate accuracy
-        if( pattern == CHESSBOARD && found) cornerSubPix( viewGray, pointbuf, Size(11,11),
-                                                         Size(-1,-1), TermCriteria( TermCriteria::EPS+TermCriteria::COUNT, 30, 0.1 ));
-        
-        if( mode == CAPTURING && found &&
-           (!capture.isOpened() || clock() - prevTimestamp > delay*1e-3*CLOCKS_PER_SEC) )
+        //wall time: clock() would also count the detector thread
+        if( mode == CAPTURING && fresh && found &&
+           (getTickCount() - prevTimestamp)*1000 > delay*getTickFrequency() )
         {
             imagePoints.push_back(pointbuf);
-            prevTimestamp = clock();
-            blink = capture.isOpened();
+            prevTimestamp = getTickCount();
+            blink = true;
         }
         
         if(found)
@@ -525,7 +683,7 @@ int main( int argc, char** argv )
         }
         
         imshow("Image View", view);
-        int key = 0xff & waitKey(capture.isOpened() ? 50 : 500);
+        int key = 0xff & waitKey(detector ? 1 : 50);
         
         if( (key & 255) == 27 )
             break;
@@ -533,7 +691,7 @@ int main( int argc, char** argv )
         if( key == 'u' && mode == CALIBRATED )
             undistortImage = !undistortImage;
         
-        if( capture.isOpened() && key == 'g' )
+        if( key == 'g' )
         {
             mode = CAPTURING;
             imagePoints.clear();
@@ -548,8 +706,6 @@ int main( int argc, char** argv )
                 mode = CALIBRATED;
             else
                 mode = DETECTION;
-            if( !capture.isOpened() )
-                break;
         }
     }
     
@@ -562,7 +718,7 @@ int main( int argc, char** argv )
         
         for( i = 0; i < (int)imageList.size(); i++ )
         {
-            view = imread(imageList[i], 1);
+            view = stereoImread(imageList[i], 1);
             if(view.empty())
                 continue;
             //undistort( view, rview, cameraMatrix, distCoeffs, cameraMatrix );
@@ -13,6 +13,10 @@
 
 #include "opencv2/highgui/highgui.hpp"
 
+#include "Stereo_CameraSync.hpp"
+#include "Stereo_Sequence.hpp"
+#include "Stereo_Trace.hpp"
+
 using namespace std;
 using namespace cv;
 
@@ -24,37 +28,118 @@ std::string format(int nr, int places)
     return str.str();
 }
 
-int main()
+static void print_help()
+{
+    printf("\nUsage: Cam_Capture [--tolerance=<ms>] [--record=<recording.sseq>] [--record-png]\n"
+           "[--trace=<trace.json>] [--trace-summary=<summary.json>]\n"
+           "Cameras 2 (left) and 0 (right) are grabbed on their own threads and paired by timestamp;\n"
+           "frames further apart than the tolerance (default 10ms) are not paired. SPACE saves a pair, ESC quits.\n"
+           "--record appends every displayed pair with its timestamp to a stereo sequence file, raw or\n"
+           "with fast lossless PNG compression (--record-png).\n"
+           "--trace writes the time of every grab, display and save as a Chrome trace, --trace-summary p50/p95/p99\n"
+           "per stage (builds with STEREO_ENABLE_TRACE).\n");
+}
+
+int main(int argc, char** argv)
 {
-    VideoCapture cam[] = { VideoCapture(0), VideoCapture(2) };
+    double tolerance_ms = 10;
+    const char* record_filename = 0;
+    int record_codec = STEREO_SEQ_RAW;
+    const char* trace_filename = "";
+    const char* trace_summary_filename = "";
+    //written when main() returns, after the grab threads have stopped
+    StereoTraceSession trace;
+    for( int i = 1; i < argc; i++ )
+    {
+        if( strncmp(argv[i], "--tolerance=", 12) == 0 && sscanf(argv[i] + 12, "%lf", &tolerance_ms) == 1 && tolerance_ms >= 0 )
+            continue;
+        if( strncmp(argv[i], "--record=", 9) == 0 )
+            record_filename = argv[i] + 9;
+        else if( strcmp(argv[i], "--record-png") == 0 )
+            record_codec = STEREO_SEQ_PNG;
+        else if( strncmp(argv[i], "--trace=", 8) == 0 )
+            trace_filename = argv[i] + 8;
+        else if( strncmp(argv[i], "--trace-summary=", 16) == 0 )
+            trace_summary_filename = argv[i] + 16;
+        else
+        {
+            print_help();
+            return -1;
+        }
+    }
+    trace.open(trace_filename, trace_summary_filename);
+    
+    StereoSequenceWriter recording;
+    if (record_filename && !recording.open(record_filename, record_codec))
+    {
+        printf("Error: could not create %s\n", record_filename);
+        return -1;
+    }
     
-    if (!cam[0].isOpened() || !cam[1].isOpened())
+    //camera 0 is saved as the right image, camera 2 as the left one
+    StereoSyncCameraSource cam(2, 0, tolerance_ms);
+    
+    if (!cam.isOpened())
         return -1;
     
     cv::Mat frame[2];
     
     int count = 0;
+    int64 lastReport = getTickCount();
     
+    //display and saving only consume pairs; when they are slow, pairs are dropped, the grab threads never wait
     while (true)
     {
-        cam[0].grab();
-        cam[1].grab();
-        
-        cam[0].retrieve(frame[0]);
-        cam[1].retrieve(frame[1]);
-        
-        imshow("Cam 0:", frame[0]);
-        imshow("Cam 1:", frame[1]);
-        
+        int64 ticks;
+        if (cam.tryRead(frame[1], frame[0], ticks))
+        {
+            {
+                STEREO_TRACE_SCOPE("display");
+                imshow("Cam 0:", frame[0]);
+                imshow("Cam 1:", frame[1]);
+            }
+            
+            STEREO_TRACE_SCOPE("record");
+            if (recording.isOpened() && !recording.write(frame[1], frame[0], ticks))
+            {
+                printf("Error: could not write to %s, recording stopped\n", record_filename);
+                recording.close();
+            }
+        }
+        else if (cam.finished())
+            break;
         
-        if (cv::waitKey(1) == 32) // 32 == spacebar
+        int key = cv::waitKey(1);
+        if (key == 32 && !frame[0].empty()) // 32 == spacebar
         {
+            STEREO_TRACE_SCOPE("imwrite");
             imwrite("../data/" + format(count, 4) + "R.png", frame[0]);
             imwrite("../data/" + format(count, 4) + "L.png", frame[1]);
             
             count++;
         }
+        else if (key == 27)
+            break;
+        
+        if (getTickCount() - lastReport > getTickFrequency())
+        {
+            StereoSkewStats s = cam.stats();
+            printf("pairs %lld, skew mean %.2fms p50 %.2fms p95 %.2fms max %.2fms, unmatched L %lld R %lld, "
+                   "dropped L %lld R %lld pairs %lld\n", (long long)s.pairs, s.meanMs, s.p50Ms, s.p95Ms, s.maxMs,
+                   (long long)s.unmatched[0], (long long)s.unmatched[1], (long long)s.dropped[0], (long long)s.dropped[1],
+                   (long long)s.droppedPairs);
+            lastReport = getTickCount();
+        }
     }
     
+    cam.stop();
+    if (recording.isOpened())
+    {
+        int frames = recording.frames();
+        if (recording.close())
+            printf("%d pairs recorded to %s\n", frames, record_filename);
+        else
+            printf("Error: could not finish %s\n", record_filename);
+    }
     return 0;
 }
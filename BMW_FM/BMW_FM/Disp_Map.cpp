@@ -13,6 +13,21 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/core/utility.hpp"
 
+#include "Stereo_SimdBM.hpp"
+#include "Stereo_SGM.hpp"
+#include "Stereo_Census.hpp"
+#include "Stereo_ThreadPool.hpp"
+#include "Stereo_RectifyCache.hpp"
+#include "Stereo_PointCloud.hpp"
+#include "Stereo_CameraSync.hpp"
+#include "Stereo_Sequence.hpp"
+#include "Stereo_Temporal.hpp"
+#include "Stereo_Pyramid.hpp"
+#include "Stereo_Tiling.hpp"
+#include "Stereo_Matchers.hpp"
+#include "Stereo_OutOfCore.hpp"
+#include "Stereo_Trace.hpp"
+#include "Stereo_Morphology.hpp"
 
 #include <stdio.h>
 
@@ -25,30 +40,816 @@ using namespace std;
 static void print_help()
 {
     printf("\nDemo stereo matching converting L and R images into disparity and point clouds\n");
-    printf("\nUsage: stereo_match <left_image> <right_image> [--algorithm=bm|sgbm|hh|sgbm3way] [--blocksize=<block_size>]\n"
+    printf("\nUsage: stereo_match <left_image> <right_image> [--algorithm=bm|sgbm|hh|sgbm3way|simdbm|sgm|sgmstrip|census] [--blocksize=<block_size>]\n"
+           "[--cost=bt|census] [--census=5x5|7x7|9x7]\n"
            "[--max-disparity=<max_disparity>] [--scale=scale_factor>] [-i <intrinsic_filename>] [-e <extrinsic_filename>]\n"
-           "[--no-display] [-o <disparity_image>] [-p <point_cloud_file>]\n");
+           "[--no-display] [-o <disparity_image>] [-p <point_cloud_file>]\n"
+           "[--rectify-cache=<file>] [--no-rectify-cache] (default cache: <extrinsic_filename>.rmap)\n"
+           "[--cloud-format=ply|raw|xyz] [--cloud-color] [--cloud-disparity] (default format: from the -p extension, ply in batch mode)\n"
+           "Clouds are reprojected from the disparity in pixels (the int16 maps divided by 16, the --refine floats as they are),\n"
+           "so Z is in the units of the calibration and points beyond 10000 of them are dropped, with or without --refine.\n"
+           "[--pyramid=<levels>] [--pyramid-radius=<px>] (match at 1/2^levels and refine within +-px per finer level, default 2;\n"
+           "the finer levels match SAD on the x-sobel image whatever the algorithm, with its uniqueness ratio and left-right check)\n"
+           "[--refine[=parabola|equiangular]] [--refine-radius=<0..3>] [--refine-lr=<px>] [--confidence=<file>] (float disparities:\n"
+           "left-right check within px (default 1, < 0: off) and sub-pixel fit on a (2*radius+1)^2 SAD window, default 2,\n"
+           "plus a 0..1 confidence; -o <file.pfm> and --confidence=<file.pfm> keep them as floats, in batch, sequence\n"
+           "and live mode -o <dir> also gets <name>_disp.pfm and <name>_conf.png)\n"
+           "[--tiles[=<width>x<height>]] [--tile-overlap=<px>] [--threads=<n>] (match tiles of the frame concurrently; default:\n"
+           "four full-width bands per thread, a width or height of 0 spans the frame; not in batch mode)\n"
+           "\nOut-of-core mode (no display): stereo_match <left> <right> --out-of-core [--max-memory=<MB>] [--raw-size=<width>x<height>]\n"
+           "[--algorithm=...] [--tiles[=...]] -o <disparity.tif|disparity.raw>\n"
+           "A rectified pair of uncompressed 8-bit TIFFs, binary PGMs or raw files of the given size is mapped and matched in\n"
+           "bands of rows sized to keep the process under <MB> (default 1024); the disparities (int16, x16) are streamed to -o.\n"
+           "\nBatch mode (no display): stereo_match --batch <image_list.xml|directory> [--threads=<n>] [--algorithm=...]\n"
+           "[-i <intrinsic_filename>] [-e <extrinsic_filename>] [-o <disparity_dir>] [-p <point_cloud_dir>]\n"
+           "The list holds left and right images alternating, like Stereo_Calib's; a directory is paired by NNNNL/NNNNR file names;\n"
+           "a .sseq recording from Cam_Capture --record is read frame by frame.\n"
+           "\nLive mode: stereo_match --live[=<left_camera>,<right_camera>] [--algorithm=...] [-i <intrinsic_filename>] [-e <extrinsic_filename>]\n"
+           "[--live-source=<image_list.xml|directory|recording.sseq>] [--live-fps=<fps>] [--live-loop] [--live-frames=<n>] [--live-tolerance=<ms>] [--no-display] [-o <disparity_dir>]\n"
+           "Cameras default to 2 (left) and 0 (right) as in Cam_Capture and are paired by grab time (default tolerance 10ms);\n"
+           "--live-source replays stereo pairs as a fake camera (default 30 fps).\n"
+           "\nSequence mode: stereo_match --sequence=<image_list.xml|directory|recording.sseq|left_video,right_video> [--algorithm=...]\n"
+           "[--temporal[=<margin>]] [--keyframe=<n>] [-i <intrinsic_filename>] [-e <extrinsic_filename>] [--no-display] [-o <disparity_dir>] [-p <point_cloud_dir>]\n"
+           "Every frame is matched in order. With --temporal (simdbm only) each band of rows searches the previous frame's\n"
+           "disparities widened by <margin> pixels (default 8); every <n>-th frame (default 10) searches the full range.\n"
+           "\nAll modes: [--config=<tuned.yml>] [--config-ms=<ms>] use the settings Stereo_Tune found: the most accurate on its\n"
+           "front, or the most accurate within <ms> per frame; --algorithm still overrides the algorithm. The budget is compared\n"
+           "with Stereo_Tune's times: one frame matched alone with the thread count it ran at (threads in the config).\n"
+           "[--trace=<trace.json>] [--trace-summary=<summary.json>] record the time of every stage on every thread\n"
+           "(builds with STEREO_ENABLE_TRACE); the trace opens in chrome://tracing, the summary holds p50/p95/p99 per stage.\n");
     printf("\nUserguide: In terminal, cd to /Users/LH_Mac/Desktop/BMW_FMRL_Image_Depth/OpenCV TR/Opencv tutorial/build/Debug, type ./Opencv\ tutorial LEFT_IMAGE_PATH RIGHT_IMAGE_PATH --algorithm=sgbm");
 }
 
 
 
-static void saveXYZ(const char* filename, const Mat& mat)
+//point cloud output: -p file format (by extension unless --cloud-format is given) and extra per-point fields
+struct DispCloudOptions
 {
-    const double max_z = 1.0e4;
-    FILE* fp = fopen(filename, "wt");
-    for(int y = 0; y < mat.rows; y++)
+    DispCloudOptions() : format(-1), color(false), disparity(false) {}
+    int format;
+    bool color;
+    bool disparity;
+};
+
+//reprojects while writing, no full-frame xyz
+static bool savePointCloud(const string& filename, const Mat& dispcal, const Mat& img, const Mat& Q,
+                           const DispCloudOptions& opts)
+{
+    STEREO_TRACE_SCOPE("point cloud");
+    int format = opts.format >= 0 ? opts.format : stereoCloudFormatFromName(filename);
+    if( !stereoWriteDisparityCloud(filename, dispcal, Q, opts.color ? img : Mat(), opts.disparity, format) )
+    {
+        printf("Error: could not write %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+//--tiles: every frame is matched in tiles by a pool of its own; batch mode already keeps
+//every thread busy with one pair each and ignores it
+struct DispTileOptions
+{
+    DispTileOptions() : enabled(false), threads(0), overlap(-1) {}
+    bool enabled;
+    int threads;
+    Size size;
+    int overlap;
+};
+
+
+//8-bit display disparity (from the CV_16S map or the CV_32F one of --refine) followed by the erosion
+//and dilation set in the parameters, fused into one pass over bands of rows (Stereo_Morphology.hpp)
+static void postProcessDisparity(const Mat& dispcal, const DispParams& p, int alg, Mat& disp8Udilate)
+{
+    STEREO_TRACE_SCOPE("convert/erode/dilate");
+    double scale = dispcal.type() == CV_32F ? 255./p.number_of_disparities :
+        alg != STEREO_VAR ? 255/(p.number_of_disparities*16.) : 1.;
+    stereoScaleErodeDilate(dispcal, scale, std::max(p.erosion_size, 0), std::max(p.dilation_size, 0), disp8Udilate);
+}
+
+static bool saveDisparityImage(const string& filename, const Mat& disp8U)
+{
+    STEREO_TRACE_SCOPE("imwrite");
+    return imwrite(filename, disp8U);
+}
+
+static bool hasExtension(const string& filename, const char* ext)
+{
+    size_t n = strlen(ext);
+    return filename.size() >= n && strcasecmp(filename.c_str() + filename.size() - n, ext) == 0;
+}
+
+//-o: a .pfm file gets the disparities in pixels (CV_16S or the CV_32F of --refine), anything else the display image
+static bool saveDisparity(const string& filename, const Mat& disp, const Mat& disp8U)
+{
+    if( !hasExtension(filename, ".pfm") )
+        return saveDisparityImage(filename, disp8U);
+    STEREO_TRACE_SCOPE("imwrite");
+    Mat f = disp;
+    if( disp.type() != CV_32F )
+        disp.convertTo(f, CV_32F, disp.type() == CV_16S ? 1./StereoMatcher::DISP_SCALE : 1.);
+    return stereoWritePFM(filename, f);
+}
+
+//--confidence: as PFM for a .pfm file name, otherwise as an 8-bit image (x255)
+static bool saveConfidence(const string& filename, const Mat& confidence)
+{
+    STEREO_TRACE_SCOPE("imwrite");
+    if( hasExtension(filename, ".pfm") )
+        return stereoWritePFM(filename, confidence);
+    Mat c8U;
+    confidence.convertTo(c8U, CV_8U, 255);
+    return imwrite(filename, c8U);
+}
+
+//the outputs of one frame in a -o directory: <base>_disp.png, and with --refine (a CV_32F disp)
+//also <base>_disp.pfm and <base>_conf.png
+static void saveDisparityFrame(const string& base, const Mat& disp, const Mat& confidence, const Mat& disp8U)
+{
+    saveDisparityImage(base + "_disp.png", disp8U);
+    if( disp.type() != CV_32F )
+        return;
+    saveDisparity(base + "_disp.pfm", disp, disp8U);
+    saveConfidence(base + "_conf.png", confidence);
+}
+
+
+//the tuning loop as three stages with dirty tracking against the parameters of the previous run:
+//matching costs (block size, disparity range, pre-filter), disparity selection and speckle
+//filtering (uniqueness, disp12MaxDiff, speckle window) and morphology (kernel sizes). Only
+//the sgm (full) and census matchers can keep their costs; the others (simdbm included, whose
+//window sums are consumed band by band and never stored) rerun the whole match whenever the
+//selection is dirty, and report it as one "match" time.
+struct DispPipeline
+{
+    DispPipeline() : valid(false) {}
+    
+    //returns false when nothing had to be recomputed
+    bool update(DispMatchers& matchers, const DispParams& p, int alg, const Mat& img1, const Mat& img2, Rect roi1, Rect roi2)
     {
-        for(int x = 0; x < mat.cols; x++)
+        bool costDirty = !valid || p.BlockSize != last.BlockSize || p.number_of_disparities != last.number_of_disparities ||
+            p.pre_filter_size != last.pre_filter_size || p.pre_filter_cap != last.pre_filter_cap ||
+            p.min_disparity != last.min_disparity || p.texture_threshold != last.texture_threshold ||
+            p.pyramid_levels != last.pyramid_levels || p.pyramid_radius != last.pyramid_radius;
+        bool selectDirty = costDirty || p.uniqueness_ratio != last.uniqueness_ratio || p.max_diff != last.max_diff ||
+            p.speckle_window_size != last.speckle_window_size;
+        bool morphDirty = selectDirty || p.erosion_size != last.erosion_size || p.dilation_size != last.dilation_size;
+        if( !morphDirty )
+            return false;
+        
+        int64 t0 = getTickCount(), t1 = t0, t2 = t0;
+        bool split = matchers.hasCostVolume(alg);
+        if( selectDirty )
         {
-            Vec3f point = mat.at<Vec3f>(y, x);
-            if(fabs(point[2] - max_z) < FLT_EPSILON || fabs(point[2]) > max_z) continue;
-            fprintf(fp, "%f %f %f\n", point[0], point[1], point[2]);
+            matchers.configure(p, alg, roi1, roi2);
+            if( split )
+            {
+                if( costDirty )
+                    matchers.computeCostVolume(alg, img1, img2);
+                t1 = getTickCount();
+                matchers.selectDisparity(alg, dispcal);
+            }
+            else
+                matchers.compute(alg, img1, img2, dispcal);
         }
+        t2 = getTickCount();
+        if( selectDirty && p.refine >= 0 )
+            matchers.refine(alg, img1, img2, dispcal, dispf, confidence);
+        int64 t3 = getTickCount();
+        postProcessDisparity(disparity(), p, alg, disp8U);
+        int64 t4 = getTickCount();
+        
+        double f = 1000/getTickFrequency();
+        char refined[64] = "";
+        if( p.refine >= 0 )
+            snprintf(refined, sizeof(refined), "refinement %s%.1fms, ", selectDirty ? "" : "cached ", (t3 - t2)*f);
+        char matched[96];
+        if( split )
+            snprintf(matched, sizeof(matched), "cost %s%.1fms, selection %s%.1fms", costDirty ? "" : "cached ", (t1 - t0)*f,
+                     selectDirty ? "" : "cached ", (t2 - t1)*f);
+        else
+            snprintf(matched, sizeof(matched), "match %s%.1fms", selectDirty ? "" : "cached ", (t2 - t0)*f);
+        printf("Time elapsed: %fms (%s, %smorphology %.1fms)\n", (t4 - t0)*f, matched, refined, (t4 - t3)*f);
+        last = p;
+        valid = true;
+        return true;
+    }
+    
+    //the CV_32F disparities with --refine, otherwise the matcher's CV_16S ones
+    const Mat& disparity() const { return dispf.empty() ? dispcal : dispf; }
+    
+    Mat dispcal, dispf, confidence, disp8U;
+    DispParams last;
+    bool valid;
+};
+
+
+//the maps come from cache_filename when it was built for the same calibration, image size and scale;
+//otherwise they are computed and the cache is rewritten. cache_filename may be 0.
+static bool loadRectification(const char* intrinsic_filename, const char* extrinsic_filename, const char* cache_filename,
+                              Size img_size, float scale, StereoRectification& rect)
+{
+    // reading intrinsic parameters
+    FileStorage fs(intrinsic_filename, FileStorage::READ);
+    if(!fs.isOpened())
+    {
+        printf("Failed to open file %s\n", intrinsic_filename);
+        return false;
     }
-    fclose(fp);
+    
+    Mat M1, D1, M2, D2;
+    fs["M1"] >> M1;
+    fs["D1"] >> D1;
+    fs["M2"] >> M2;
+    fs["D2"] >> D2;
+    
+    fs.open(extrinsic_filename, FileStorage::READ);
+    if(!fs.isOpened())
+    {
+        printf("Failed to open file %s\n", extrinsic_filename);
+        return false;
+    }
+    
+    Mat R, T, R1, P1, R2, P2;
+    fs["R"] >> R;
+    fs["T"] >> T;
+    
+    uint64 key = stereoRectifyKey(M1, D1, M2, D2, R, T, img_size, scale);
+    if( cache_filename && stereoLoadRectifyCache(cache_filename, key, img_size, rect) )
+    {
+        printf("rectification maps loaded from %s\n", cache_filename);
+        return true;
+    }
+    
+    STEREO_TRACE_SCOPE("rectification maps");
+    M1 *= scale;
+    M2 *= scale;
+    
+    stereoRectify( M1, D1, M2, D2, img_size, R, T, R1, R2, P1, P2, rect.Q, CALIB_ZERO_DISPARITY, -1, img_size, &rect.roi1, &rect.roi2 );
+    
+    initUndistortRectifyMap(M1, D1, R1, P1, img_size, CV_16SC2, rect.map11, rect.map12);
+    initUndistortRectifyMap(M2, D2, R2, P2, img_size, CV_16SC2, rect.map21, rect.map22);
+    
+    if( cache_filename && !stereoSaveRectifyCache(cache_filename, key, rect) )
+        printf("Warning: could not write the rectification cache %s\n", cache_filename);
+    return true;
 }
 
+//camera or video frames to the matcher's input: grayscale when color_mode is 0, then scaled
+static void prepareFrame(Mat& img, int color_mode, float scale)
+{
+    STEREO_TRACE_SCOPE("prepare frame");
+    if( color_mode == 0 && img.channels() == 3 )
+        cvtColor(img, img, COLOR_BGR2GRAY);
+    if( scale != 1.f )
+        resize(img, img, Size(), scale, scale, scale < 1 ? INTER_AREA : INTER_CUBIC);
+}
+
+static void rectifyPair(const StereoRectification& rect, Mat& img1, Mat& img2)
+{
+    STEREO_TRACE_SCOPE("remap");
+    Mat img1r, img2r;
+    remap(img1, img1r, rect.map11, rect.map12, INTER_LINEAR);
+    remap(img2, img2r, rect.map21, rect.map22, INTER_LINEAR);
+    
+    img1 = img1r;
+    img2 = img2r;
+}
+
+static bool readPair(const string& filename1, const string& filename2, int color_mode, float scale, Mat& img1, Mat& img2)
+{
+    {
+        STEREO_TRACE_SCOPE("imread");
+        img1 = stereoImread(filename1, color_mode);
+        img2 = stereoImread(filename2, color_mode);
+    }
+    if( img1.empty() || img2.empty() )
+        return false;
+    
+    //input scale factor
+    if (scale != 1.f)
+    {
+        STEREO_TRACE_SCOPE("resize");
+        Mat temp1, temp2;
+        int method = scale < 1 ? INTER_AREA : INTER_CUBIC;
+        resize(img1, temp1, Size(), scale, scale, method);
+        img1 = temp1;
+        resize(img2, temp2, Size(), scale, scale, method);
+        img2 = temp2;
+    }
+    return true;
+}
+
+
+static bool readStringList( const string& filename, vector<string>& l )
+{
+    l.resize(0);
+    FileStorage fs(filename, FileStorage::READ);
+    if( !fs.isOpened() )
+        return false;
+    FileNode n = fs.getFirstTopLevelNode();
+    if( n.type() != FileNode::SEQ )
+        return false;
+    FileNodeIterator it = n.begin(), it_end = n.end();
+    for( ; it != it_end; ++it )
+        l.push_back((string)*it);
+    return true;
+}
+
+//file name without directory and extension; <name>_<frame>L|R for a sequence frame
+static string baseName(const string& path)
+{
+    string sequence;
+    int frame, side;
+    if( stereoParseSequenceRef(path, sequence, frame, side) )
+        return baseName(sequence) + "_" + path.substr(path.find_last_of('#') + 1);
+    size_t slash = path.find_last_of("/\\");
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == string::npos ? name : name.substr(0, dot);
+}
+
+//an image list in the Stereo_Calib format (left and right images alternating), a .sseq
+//recording, or a directory of Cam_Capture output where NNNNL.<ext> goes with NNNNR.<ext>
+static bool listStereoPairs(const string& source, vector<string>& left, vector<string>& right)
+{
+    left.clear();
+    right.clear();
+    vector<string> imagelist;
+    if( stereoIsSequenceFile(source) ? stereoSequenceImageList(source, imagelist) && !imagelist.empty() :
+        readStringList(source, imagelist) )
+    {
+        if( imagelist.size() % 2 != 0 )
+        {
+            printf("Error: the image list contains odd (non-even) number of elements\n");
+            return false;
+        }
+        for( size_t i = 0; i < imagelist.size(); i += 2 )
+        {
+            left.push_back(imagelist[i]);
+            right.push_back(imagelist[i+1]);
+        }
+        return true;
+    }
+    
+    vector<String> files;
+    glob(source, files, false);
+    std::sort(files.begin(), files.end());
+    for( size_t i = 0; i < files.size(); i++ )
+    {
+        string l = files[i];
+        size_t dot = l.find_last_of('.'), slash = l.find_last_of("/\\");
+        if( dot == string::npos || dot == 0 || (slash != string::npos && dot <= slash + 1) || l[dot-1] != 'L' )
+            continue;
+        string r = l;
+        r[dot-1] = 'R';
+        if( std::binary_search(files.begin(), files.end(), String(r)) )
+        {
+            left.push_back(l);
+            right.push_back(r);
+        }
+    }
+    return !left.empty();
+}
+
+
+//headless mode: every pair of the list is read, rectified, matched and written out by a
+//pool of workers that each own their matchers and buffers
+static int runBatch(const char* batch_source, int alg, const DispParams& params, bool census_cost, int census_window,
+                    int color_mode, float scale, const char* intrinsic_filename, const char* extrinsic_filename,
+                    const char* rectify_cache, const char* disparity_dir, const char* point_cloud_dir,
+                    const DispCloudOptions& cloud, int nthreads)
+{
+    vector<string> left, right;
+    if( !listStereoPairs(batch_source, left, right) )
+    {
+        printf("Command-line parameter error: no stereo pairs found in %s\n", batch_source);
+        return -1;
+    }
+    
+    StereoRectification rect;
+    if( intrinsic_filename )
+    {
+        Mat first1, first2;
+        if( !readPair(left[0], right[0], color_mode, scale, first1, first2) )
+        {
+            printf("Error: could not load %s / %s\n", left[0].c_str(), right[0].c_str());
+            return -1;
+        }
+        if( !loadRectification(intrinsic_filename, extrinsic_filename, rectify_cache, first1.size(), scale, rect) )
+            return -1;
+    }
+    
+    StereoWorkStealingPool pool(nthreads);
+    //every worker matches one whole pair, so keep OpenCV's own loops from competing with the pool
+    int cv_threads = getNumThreads();
+    if( pool.size() > 1 )
+        setNumThreads(1);
+    
+    struct Worker
+    {
+        Worker(bool census_cost, int census_window) : matchers(census_cost, census_window) {}
+        DispMatchers matchers;
+        Mat img1, img2, dispcal, dispf, confidence, disp8U;
+    };
+    vector<Ptr<Worker> > workers;
+    for( int w = 0; w < pool.size(); w++ )
+    {
+        workers.push_back(makePtr<Worker>(census_cost, census_window));
+        workers.back()->matchers.configure(params, alg, rect.roi1, rect.roi2);
+    }
+    
+    int npairs = (int)left.size();
+    vector<uchar> ok(npairs, 0);
+    printf("batch: %d pairs on %d workers\n", npairs, pool.size());
+    
+    int64 t = getTickCount();
+    pool.run(npairs, [&](int i, int w)
+    {
+        STEREO_TRACE_SCOPE("pair");
+        Worker& wk = *workers[w];
+        if( !readPair(left[i], right[i], color_mode, scale, wk.img1, wk.img2) )
+        {
+            printf("Error: could not load %s / %s\n", left[i].c_str(), right[i].c_str());
+            return;
+        }
+        if( intrinsic_filename )
+        {
+            if( wk.img1.size() != rect.map11.size() )
+            {
+                printf("Error: %s does not have the calibrated image size\n", left[i].c_str());
+                return;
+            }
+            rectifyPair(rect, wk.img1, wk.img2);
+        }
+        wk.matchers.compute(alg, wk.img1, wk.img2, wk.dispcal);
+        if( params.refine >= 0 )
+            wk.matchers.refine(alg, wk.img1, wk.img2, wk.dispcal, wk.dispf, wk.confidence);
+        const Mat& disp = params.refine >= 0 ? wk.dispf : wk.dispcal;
+        
+        string name = baseName(left[i]);
+        if( disparity_dir )
+        {
+            postProcessDisparity(disp, params, alg, wk.disp8U);
+            saveDisparityFrame(string(disparity_dir) + "/" + name, disp, wk.confidence, wk.disp8U);
+        }
+        if( point_cloud_dir )
+        {
+            const char* ext = cloud.format == STEREO_CLOUD_XYZ ? ".xyz" : cloud.format == STEREO_CLOUD_RAW ? ".raw" : ".ply";
+            if( !savePointCloud(string(point_cloud_dir) + "/" + name + ext, disp, wk.img1, rect.Q, cloud) )
+                return;
+        }
+        ok[i] = 1;
+    });
+    t = getTickCount() - t;
+    setNumThreads(cv_threads);
+    
+    double secs = t/getTickFrequency();
+    int done = (int)std::count(ok.begin(), ok.end(), 1);
+    printf("batch: %d of %d pairs in %.2fs, %.2f pairs/s\n", done, npairs, secs, done/std::max(secs, 1e-9));
+    return done == npairs ? 0 : -1;
+}
+
+
+//live mode: capture, rectification and matching each run on their own thread, linked by
+//rings that drop frames when the next stage is busy; this thread is the sink that shows
+//and saves the disparities and reports latency and frame rate
+static int runLive(int left_camera, int right_camera, double live_tolerance, const char* live_source, double live_fps, bool live_loop,
+                   int max_frames, int alg, const DispParams& params, bool census_cost, int census_window,
+                   int color_mode, float scale, const char* intrinsic_filename, const char* extrinsic_filename,
+                   const char* rectify_cache, const char* disparity_dir, bool no_display, const DispTileOptions& tiling)
+{
+    //one pair up front for the image size the calibration has to match
+    Ptr<StereoFrameSource> source;
+    Mat probe1, probe2;
+    if( live_source )
+    {
+        vector<string> left, right;
+        if( !listStereoPairs(live_source, left, right) || !readPair(left[0], right[0], color_mode, scale, probe1, probe2) )
+        {
+            printf("Command-line parameter error: no stereo pairs found in %s\n", live_source);
+            return -1;
+        }
+        source = makePtr<StereoFileSource>(left, right, live_fps, live_loop, color_mode);
+    }
+    else
+    {
+        Ptr<StereoSyncCameraSource> cameras = makePtr<StereoSyncCameraSource>(left_camera, right_camera, live_tolerance);
+        if( !cameras->isOpened() || !cameras->read(probe1, probe2) )
+        {
+            printf("Error: could not open cameras %d and %d\n", left_camera, right_camera);
+            return -1;
+        }
+        if( scale != 1.f )
+            resize(probe1, probe1, Size(), scale, scale, scale < 1 ? INTER_AREA : INTER_CUBIC);
+        source = cameras;
+    }
+    
+    StereoRectification rect;
+    if( intrinsic_filename && !loadRectification(intrinsic_filename, extrinsic_filename, rectify_cache, probe1.size(), scale, rect) )
+        return -1;
+    
+    DispMatchers matchers(census_cost, census_window);
+    if( tiling.enabled )
+        matchers.enableTiles(tiling.threads, tiling.size, tiling.overlap);
+    matchers.configure(params, alg, rect.roi1, rect.roi2);
+    
+    StereoLivePipeline pipeline(source);
+    pipeline.addStage("rectify", [&](StereoFrame& f)
+    {
+        prepareFrame(f.left, color_mode, scale);
+        prepareFrame(f.right, color_mode, scale);
+        if( intrinsic_filename )
+        {
+            if( f.left.size() != rect.map11.size() )
+                CV_Error(Error::StsBadSize, "the frame does not have the calibrated image size");
+            rectifyPair(rect, f.left, f.right);
+        }
+    });
+    pipeline.addStage("match", [&](StereoFrame& f)
+    {
+        matchers.compute(alg, f.left, f.right, f.disparity);
+        if( params.refine >= 0 )
+        {
+            Mat disp;
+            matchers.refine(alg, f.left, f.right, f.disparity, disp, f.confidence);
+            f.disparity = disp;
+        }
+    });
+    pipeline.start();
+    
+    Mat disp8U;
+    int64 lastReport = getTickCount();
+    int frames = 0;
+    for(;;)
+    {
+        StereoFrame f;
+        bool got = pipeline.pop(f, 100);
+        if( got )
+        {
+            postProcessDisparity(f.disparity, params, alg, disp8U);
+            if( disparity_dir )
+            {
+                char name[32];
+                snprintf(name, sizeof(name), "/%06lld", (long long)f.id);
+                saveDisparityFrame(string(disparity_dir) + name, f.disparity, f.confidence, disp8U);
+            }
+            if( !no_display )
+            {
+                imshow("left", f.left);
+                imshow("disparity", disp8U);
+            }
+            pipeline.finished(f);
+            if( max_frames > 0 && ++frames >= max_frames )
+                pipeline.stop();
+        }
+        bool finished = !got && pipeline.done();
+        
+        if( !no_display && waitKey(1) == 27 )
+            pipeline.stop();
+        
+        if( getTickCount() - lastReport > getTickFrequency() || finished )
+        {
+            StereoPipelineStats s = pipeline.stats();
+            printf("live: %lld frames, %.1f fps, latency mean %.1fms p50 %.1fms p95 %.1fms max %.1fms, dropped before",
+                   (long long)s.delivered, s.fps, s.latencyMean, s.latencyP50, s.latencyP95, s.latencyMax);
+            for( size_t i = 0; i < s.dropped.size(); i++ )
+                printf(" %s %lld", i < s.stageNames.size() ? s.stageNames[i].c_str() : "sink", (long long)s.dropped[i]);
+            for( size_t i = 0; i < s.stageMs.size(); i++ )
+                printf(i == 0 ? ", stages %s %.1fms" : " %s %.1fms", s.stageNames[i].c_str(), s.stageMs[i]);
+            printf("\n");
+            lastReport = getTickCount();
+        }
+        if( finished )
+            break;
+    }
+    pipeline.stop();
+    return 0;
+}
+
+//sequence mode: the frames of a recording, image list or video pair matched one after the other.
+//With temporal_margin >= 0 the simdbm search of every band of rows is narrowed to the previous
+//frame's disparities there, with a full-range keyframe every keyframe frames
+static int runSequence(const char* sequence_source, int alg, const DispParams& params, bool census_cost, int census_window,
+                       int color_mode, float scale, const char* intrinsic_filename, const char* extrinsic_filename,
+                       const char* rectify_cache, const char* disparity_dir, const char* point_cloud_dir,
+                       const DispCloudOptions& cloud, bool no_display, int temporal_margin, int keyframe,
+                       const DispTileOptions& tiling)
+{
+    Ptr<StereoFrameSource> source;
+    string src = sequence_source;
+    size_t comma = src.find(',');
+    if( comma != string::npos )
+    {
+        Ptr<StereoVideoSource> videos = makePtr<StereoVideoSource>(src.substr(0, comma), src.substr(comma + 1));
+        if( !videos->isOpened() )
+        {
+            printf("Command-line parameter error: could not open the videos %s\n", sequence_source);
+            return -1;
+        }
+        source = videos;
+    }
+    else
+    {
+        vector<string> left, right;
+        if( !listStereoPairs(src, left, right) )
+        {
+            printf("Command-line parameter error: no stereo pairs found in %s\n", sequence_source);
+            return -1;
+        }
+        source = makePtr<StereoFileSource>(left, right, 0, false, color_mode);
+    }
+    
+    bool temporal = temporal_margin >= 0;
+    if( temporal && (alg != STEREO_SIMDBM || params.pyramid_levels > 0) )
+    {
+        printf("sequence: --temporal needs --algorithm=simdbm without --pyramid, every frame searches the full range\n");
+        temporal = false;
+    }
+    if( temporal && tiling.enabled )
+        printf("sequence: --temporal matches whole frames with their band ranges, --tiles is ignored\n");
+    StereoTemporalRange ranges(32, std::max(temporal_margin, 0), keyframe);
+    
+    StereoRectification rect;
+    DispMatchers matchers(census_cost, census_window);
+    if( tiling.enabled && !temporal )
+        matchers.enableTiles(tiling.threads, tiling.size, tiling.overlap);
+    Mat img1, img2, dispcal, dispf, confidence, disp8U;
+    int frames = 0;
+    double totalMs = 0, totalSearched = 0;
+    for( ; source->read(img1, img2); frames++ )
+    {
+        prepareFrame(img1, color_mode, scale);
+        prepareFrame(img2, color_mode, scale);
+        if( frames == 0 )
+        {
+            if( intrinsic_filename && !loadRectification(intrinsic_filename, extrinsic_filename, rectify_cache, img1.size(), scale, rect) )
+                return -1;
+            matchers.configure(params, alg, rect.roi1, rect.roi2);
+        }
+        if( intrinsic_filename )
+        {
+            if( img1.size() != rect.map11.size() )
+            {
+                printf("Error: frame %d does not have the calibrated image size\n", frames);
+                return -1;
+            }
+            rectifyPair(rect, img1, img2);
+        }
+        
+        int64 t = getTickCount();
+        if( temporal )
+        {
+            STEREO_TRACE_SCOPE("compute");
+            const vector<Vec2i>& r = ranges.next(img1.rows, matchers.simdbm->getMinDisparity(), matchers.simdbm->getNumDisparities());
+            matchers.simdbm->computeRanges(img1, img2, dispcal, r);
+            ranges.update(dispcal);
+        }
+        else
+            matchers.compute(alg, img1, img2, dispcal);
+        if( params.refine >= 0 )
+            matchers.refine(alg, img1, img2, dispcal, dispf, confidence);
+        const Mat& disp = params.refine >= 0 ? dispf : dispcal;
+        double ms = (getTickCount() - t)*1000/getTickFrequency();
+        double searched = temporal ? ranges.searchedFraction() : 1;
+        totalMs += ms;
+        totalSearched += searched;
+        printf("frame %d: %.1fms, %.0f%% of the disparity range searched%s\n", frames, ms, searched*100,
+               temporal && ranges.lastWasKeyframe() ? " (keyframe)" : "");
+        
+        char name[32];
+        snprintf(name, sizeof(name), "/%06d", frames);
+        postProcessDisparity(disp, params, alg, disp8U);
+        if( disparity_dir )
+            saveDisparityFrame(string(disparity_dir) + name, disp, confidence, disp8U);
+        if( point_cloud_dir )
+        {
+            const char* ext = cloud.format == STEREO_CLOUD_XYZ ? ".xyz" : cloud.format == STEREO_CLOUD_RAW ? ".raw" : ".ply";
+            savePointCloud(string(point_cloud_dir) + name + ext, disp, img1, rect.Q, cloud);
+        }
+        if( !no_display )
+        {
+            imshow("left", img1);
+            imshow("disparity", disp8U);
+            if( waitKey(1) == 27 )
+            {
+                frames++;
+                break;
+            }
+        }
+    }
+    
+    if( frames > 0 )
+        printf("sequence: %d frames, %.1fms per frame, %.0f%% of the disparity range searched on average\n",
+               frames, totalMs/frames, totalSearched/frames*100);
+    return frames > 0 ? 0 : -1;
+}
+
+
+//bytes the matcher of alg needs per row of a band and once per thread, for the out-of-core planner
+static void outOfCoreMemory(int alg, int width, int numDisparities, int threads, size_t& perRow, size_t& perThread)
+{
+    size_t W = width, WD = (size_t)width*numDisparities;
+    //the two bands, the disparities and the pre-filtered or reversed copies
+    perRow = 12*W;
+    perThread = 4*WD;
+    if( alg == STEREO_CENSUS )
+        perRow += 16*W;                 //the census transforms of both views
+    else if( alg == STEREO_SGM )
+        perRow += 6*WD;                 //costs and both sweeps, the whole band
+    else if( alg == STEREO_HH )
+        perRow += 4*WD;                 //full dynamic programming keeps costs and sums of every row
+    else if( alg == STEREO_SGBM || alg == STEREO_3WAY || alg == STEREO_SGM_STRIP )
+        perThread = 32*WD;              //path sums of a few rows per direction
+    perThread *= threads;
+}
+
+//out-of-core mode: a rectified pair far larger than memory is mapped, matched in bands of rows sized
+//to max_memory and the disparities (CV_16S, x16) are streamed to disparity_filename
+static int runOutOfCore(const char* left_filename, const char* right_filename, Size raw_size, double max_memory_mb,
+                        int alg, const DispParams& params, bool census_cost, int census_window,
+                        const char* disparity_filename, const DispTileOptions& tiling)
+{
+    StereoBandReader left, right;
+    if( !left.open(left_filename, raw_size) || !right.open(right_filename, raw_size) )
+    {
+        printf("Command-line parameter error: could not map the input images (uncompressed 8-bit TIFF, binary PGM, or raw with --raw-size=<w>x<h>)\n");
+        return -1;
+    }
+    Size size = left.size();
+    if( right.size() != size )
+    {
+        printf("Error: the left and right images must have the same size\n");
+        return -1;
+    }
+    
+    DispMatchers matchers(census_cost, census_window);
+    if( tiling.enabled )
+        matchers.enableTiles(tiling.threads, tiling.size, tiling.overlap);
+    matchers.configure(params, alg, Rect(), Rect());
+    Ptr<StereoMatcher> m = matchers.matcher(alg);
+    int numD = m->getNumDisparities();
+    int overlap = m->getBlockSize()/2 + (tiling.overlap >= 0 ? tiling.overlap : matchers.contextMargin(alg));
+    
+    //whatever the process holds already, the matcher's buffers, then bands as tall as the rest allows
+    int threads = tiling.enabled ? (int)matchers.tileWorkers.size() : std::max(getNumThreads(), 1);
+    size_t perRow, perThread;
+    outOfCoreMemory(alg, size.width, numD, threads, perRow, perThread);
+    perRow += (size_t)size.width*(left.channels() + right.channels()) + (tiling.enabled ? 4*(size_t)size.width : 0);
+    double budget = max_memory_mb*(1 << 20) - (double)stereoPeakRSS() - (double)perThread -
+        (double)perRow*(2*overlap + std::max(left.tileRows(), right.tileRows()));
+    int band = (int)std::min(budget/perRow, (double)size.height);
+    if( band < std::max(overlap, 16) )
+    {
+        printf("Error: --max-memory=%.0f is too small for %d x %d with %d disparities, give at least %.0fMB\n",
+               max_memory_mb, size.width, size.height, numD,
+               max_memory_mb + ((double)std::max(overlap, 16)*perRow - budget)/(1 << 20) + 1);
+        return -1;
+    }
+    
+    StereoBandWriter writer;
+    if( !writer.open(disparity_filename, size) )
+    {
+        printf("Error: could not create %s\n", disparity_filename);
+        return -1;
+    }
+    int nbands = (size.height + band - 1)/band;
+    printf("out-of-core: %d x %d in %d bands of %d rows (+%d overlap)\n", size.width, size.height, nbands, band, overlap);
+    
+    Mat img1, img2, dispcal;
+    int64 t = getTickCount();
+    for( int i = 0; i < nbands; i++ )
+    {
+        int y0 = i*band, y1 = std::min(y0 + band, size.height);
+        int a = std::max(y0 - overlap, 0), b = std::min(y1 + overlap, size.height);
+        {
+            STEREO_TRACE_SCOPE("read band");
+            left.read(a, b, img1);
+            right.read(a, b, img2);
+        }
+        matchers.compute(alg, img1, img2, dispcal);
+        STEREO_TRACE_SCOPE("write band");
+        if( !writer.write(dispcal.rowRange(y0 - a, y1 - a)) )
+        {
+            printf("Error: could not write %s\n", disparity_filename);
+            return -1;
+        }
+        //the next band starts overlap rows above y1
+        left.release(y1 - overlap);
+        right.release(y1 - overlap);
+        printf("band %d/%d: rows %d-%d, peak RSS %.0fMB\n", i + 1, nbands, y0, y1, stereoPeakRSS()/1048576.);
+    }
+    if( !writer.close() )
+    {
+        printf("Error: could not write %s\n", disparity_filename);
+        return -1;
+    }
+    double sec = (getTickCount() - t)/getTickFrequency();
+    printf("out-of-core: %.1fs, %.1f Mpixel/s, peak RSS %.0fMB of %.0fMB allowed\n", sec, size.area()/sec*1e-6,
+           stereoPeakRSS()/1048576., max_memory_mb);
+    return 0;
+}
 
 
 int main(int argc, char** argv)
@@ -61,9 +862,39 @@ int main(int argc, char** argv)
     //const char* blocksize_opt = "--blocksize=";
     const char* nodisplay_opt = "--no-display";
     const char* scale_opt = "--scale=";
+    const char* cost_opt = "--cost=";
+    const char* census_opt = "--census=";
+    const char* threads_opt = "--threads=";
+    const char* rectify_cache_opt = "--rectify-cache=";
+    const char* cloud_format_opt = "--cloud-format=";
+    const char* live_opt = "--live";
+    const char* live_source_opt = "--live-source=";
+    const char* live_fps_opt = "--live-fps=";
+    const char* live_frames_opt = "--live-frames=";
+    const char* live_tolerance_opt = "--live-tolerance=";
+    const char* sequence_opt = "--sequence=";
+    const char* temporal_opt = "--temporal";
+    const char* keyframe_opt = "--keyframe=";
+    const char* pyramid_opt = "--pyramid=";
+    const char* pyramid_radius_opt = "--pyramid-radius=";
+    const char* tiles_opt = "--tiles";
+    const char* tile_overlap_opt = "--tile-overlap=";
+    const char* max_memory_opt = "--max-memory=";
+    const char* raw_size_opt = "--raw-size=";
+    const char* trace_opt = "--trace=";
+    const char* trace_summary_opt = "--trace-summary=";
+    const char* config_opt = "--config=";
+    const char* config_ms_opt = "--config-ms=";
+    const char* refine_opt = "--refine";
+    const char* refine_radius_opt = "--refine-radius=";
+    const char* refine_lr_opt = "--refine-lr=";
+    const char* confidence_opt = "--confidence=";
+    
+    //written when main() returns, after everything traced has finished
+    StereoTraceSession trace;
     
     //if the input is less than 3 items (executable name, left image, right image),print_help. This will happen when directly click the executable
-    if(argc < 3)
+    if(argc < 2 || (argc < 3 && strncmp(argv[1], live_opt, strlen(live_opt)) != 0 && strncmp(argv[1], sequence_opt, strlen(sequence_opt)) != 0))
     {
         print_help();
         return 0;
@@ -74,15 +905,40 @@ int main(int argc, char** argv)
     const char* extrinsic_filename = 0;
     const char* disparity_filename = 0;
     const char* point_cloud_filename = 0;
+    const char* trace_filename = "";
+    const char* trace_summary_filename = "";
+    const char* config_filename = 0;
+    double config_ms = 0;
+    int refine = -1;
+    StereoRefineOptions refine_options;
+    const char* confidence_filename = 0;
+    const char* batch_source = 0;
+    const char* sequence_source = 0;
+    int temporal_margin = -1;
+    int pyramid_levels = 0, pyramid_radius = 2;
+    DispTileOptions tiling;
+    int keyframe = 10;
+    bool out_of_core = false;
+    double max_memory = 1024;
+    Size raw_size;
+    const char* live_source = 0;
+    bool live = false;
+    int left_camera = 2, right_camera = 0;
+    double live_fps = 30;
+    double live_tolerance = 10;
+    bool live_loop = false;
+    int live_frames = 0;
+    const char* rectify_cache = 0;
+    bool use_rectify_cache = true;
     
-    enum { STEREO_BM=0, STEREO_SGBM=1, STEREO_HH=2, STEREO_VAR=3, STEREO_3WAY=4 };
     int alg = STEREO_SGBM;
+    bool alg_given = false;
     bool no_display = false;
     float scale = 1.f;
-    
-    
-    Ptr<StereoBM> bm = StereoBM::create();
-    Ptr<StereoSGBM> sgbm = StereoSGBM::create(0,16,3);
+    bool census_cost = false;
+    int census_window = STEREO_CENSUS_9x7;
+    int nthreads = 0;
+    DispCloudOptions cloud;
     
     for( int i = 1; i < argc; i++ )
     {
@@ -103,13 +959,18 @@ int main(int argc, char** argv)
             strcmp(_alg, "sgbm") == 0 ? STEREO_SGBM :
             strcmp(_alg, "hh") == 0 ? STEREO_HH :
             strcmp(_alg, "var") == 0 ? STEREO_VAR :
-            strcmp(_alg, "sgbm3way") == 0 ? STEREO_3WAY : -1;
+            strcmp(_alg, "sgbm3way") == 0 ? STEREO_3WAY :
+            strcmp(_alg, "simdbm") == 0 ? STEREO_SIMDBM :
+            strcmp(_alg, "sgm") == 0 ? STEREO_SGM :
+            strcmp(_alg, "sgmstrip") == 0 ? STEREO_SGM_STRIP :
+            strcmp(_alg, "census") == 0 ? STEREO_CENSUS : -1;
             if( alg < 0 )
             {
                 printf("Command-line parameter error: Unknown stereo algorithm\n\n");
                 print_help();
                 return -1;
             }
+            alg_given = true;
         }
         
         else if( strncmp(argv[i], scale_opt, strlen(scale_opt)) == 0 )
@@ -121,8 +982,223 @@ int main(int argc, char** argv)
             }
         }
         
+        else if( strncmp(argv[i], cost_opt, strlen(cost_opt)) == 0 )
+        {
+            const char* _cost = argv[i] + strlen(cost_opt);
+            if( strcmp(_cost, "census") != 0 && strcmp(_cost, "bt") != 0 )
+            {
+                printf("Command-line parameter error: Unknown matching cost (--cost=bt|census)\n");
+                return -1;
+            }
+            census_cost = strcmp(_cost, "census") == 0;
+        }
+        
+        else if( strncmp(argv[i], census_opt, strlen(census_opt)) == 0 )
+        {
+            census_window = stereoCensusWindowFromName(argv[i] + strlen(census_opt));
+            if( census_window < 0 )
+            {
+                printf("Command-line parameter error: The census window (--census=<...>) must be 5x5, 7x7 or 9x7\n");
+                return -1;
+            }
+        }
+        
+        else if( strncmp(argv[i], threads_opt, strlen(threads_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(threads_opt), "%d", &nthreads ) != 1 || nthreads < 0 )
+            {
+                printf("Command-line parameter error: The number of threads (--threads=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        
+        else if( strncmp(argv[i], rectify_cache_opt, strlen(rectify_cache_opt)) == 0 )
+            rectify_cache = argv[i] + strlen(rectify_cache_opt);
+        else if( strcmp(argv[i], "--no-rectify-cache" ) == 0 )
+            use_rectify_cache = false;
+        else if( strncmp(argv[i], cloud_format_opt, strlen(cloud_format_opt)) == 0 )
+        {
+            const char* _format = argv[i] + strlen(cloud_format_opt);
+            cloud.format = strcmp(_format, "ply") == 0 ? STEREO_CLOUD_PLY :
+            strcmp(_format, "raw") == 0 ? STEREO_CLOUD_RAW :
+            strcmp(_format, "xyz") == 0 ? STEREO_CLOUD_XYZ : -1;
+            if( cloud.format < 0 )
+            {
+                printf("Command-line parameter error: Unknown point cloud format (--cloud-format=ply|raw|xyz)\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], live_source_opt, strlen(live_source_opt)) == 0 )
+        {
+            live = true;
+            live_source = argv[i] + strlen(live_source_opt);
+        }
+        else if( strncmp(argv[i], live_fps_opt, strlen(live_fps_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(live_fps_opt), "%lf", &live_fps ) != 1 || live_fps < 0 )
+            {
+                printf("Command-line parameter error: The frame rate (--live-fps=<...>) must be a non-negative number, 0 for as fast as possible\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], live_frames_opt, strlen(live_frames_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(live_frames_opt), "%d", &live_frames ) != 1 || live_frames < 0 )
+            {
+                printf("Command-line parameter error: The number of frames (--live-frames=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], live_tolerance_opt, strlen(live_tolerance_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(live_tolerance_opt), "%lf", &live_tolerance ) != 1 || live_tolerance < 0 )
+            {
+                printf("Command-line parameter error: The pairing tolerance (--live-tolerance=<ms>) must be a non-negative number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], sequence_opt, strlen(sequence_opt)) == 0 )
+            sequence_source = argv[i] + strlen(sequence_opt);
+        else if( strcmp(argv[i], temporal_opt) == 0 )
+            temporal_margin = 8;
+        else if( strncmp(argv[i], temporal_opt, strlen(temporal_opt)) == 0 && argv[i][strlen(temporal_opt)] == '=' )
+        {
+            if( sscanf( argv[i] + strlen(temporal_opt) + 1, "%d", &temporal_margin ) != 1 || temporal_margin < 0 )
+            {
+                printf("Command-line parameter error: The motion margin (--temporal=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], keyframe_opt, strlen(keyframe_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(keyframe_opt), "%d", &keyframe ) != 1 || keyframe < 0 )
+            {
+                printf("Command-line parameter error: The keyframe interval (--keyframe=<...>) must be a non-negative integer, 0 for none\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], pyramid_opt, strlen(pyramid_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(pyramid_opt), "%d", &pyramid_levels ) != 1 || pyramid_levels < 0 || pyramid_levels > 4 )
+            {
+                printf("Command-line parameter error: The pyramid levels (--pyramid=<...>) must be an integer from 0 to 4\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], pyramid_radius_opt, strlen(pyramid_radius_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(pyramid_radius_opt), "%d", &pyramid_radius ) != 1 || pyramid_radius < 1 )
+            {
+                printf("Command-line parameter error: The pyramid search radius (--pyramid-radius=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strcmp(argv[i], tiles_opt) == 0 )
+            tiling.enabled = true;
+        else if( strncmp(argv[i], tiles_opt, strlen(tiles_opt)) == 0 && argv[i][strlen(tiles_opt)] == '=' )
+        {
+            tiling.enabled = true;
+            if( sscanf( argv[i] + strlen(tiles_opt) + 1, "%dx%d", &tiling.size.width, &tiling.size.height ) != 2 ||
+                tiling.size.width < 0 || tiling.size.height < 0 )
+            {
+                printf("Command-line parameter error: The tile size (--tiles=<width>x<height>) must be two non-negative integers\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], tile_overlap_opt, strlen(tile_overlap_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(tile_overlap_opt), "%d", &tiling.overlap ) != 1 || tiling.overlap < 0 )
+            {
+                printf("Command-line parameter error: The tile overlap (--tile-overlap=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strcmp(argv[i], "--out-of-core" ) == 0 )
+            out_of_core = true;
+        else if( strncmp(argv[i], max_memory_opt, strlen(max_memory_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(max_memory_opt), "%lf", &max_memory ) != 1 || max_memory <= 0 )
+            {
+                printf("Command-line parameter error: The memory limit (--max-memory=<MB>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], raw_size_opt, strlen(raw_size_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(raw_size_opt), "%dx%d", &raw_size.width, &raw_size.height ) != 2 ||
+                raw_size.width <= 0 || raw_size.height <= 0 )
+            {
+                printf("Command-line parameter error: The raw image size (--raw-size=<width>x<height>) must be two positive integers\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], trace_opt, strlen(trace_opt)) == 0 )
+            trace_filename = argv[i] + strlen(trace_opt);
+        else if( strncmp(argv[i], trace_summary_opt, strlen(trace_summary_opt)) == 0 )
+            trace_summary_filename = argv[i] + strlen(trace_summary_opt);
+        else if( strcmp(argv[i], refine_opt) == 0 )
+            refine = STEREO_SUBPIXEL_PARABOLA;
+        else if( strncmp(argv[i], refine_opt, strlen(refine_opt)) == 0 && argv[i][strlen(refine_opt)] == '=' )
+        {
+            const char* _fit = argv[i] + strlen(refine_opt) + 1;
+            refine = strcmp(_fit, "parabola") == 0 ? STEREO_SUBPIXEL_PARABOLA :
+            strcmp(_fit, "equiangular") == 0 ? STEREO_SUBPIXEL_EQUIANGULAR : -2;
+            if( refine < -1 )
+            {
+                printf("Command-line parameter error: The sub-pixel fit (--refine=<...>) must be parabola or equiangular\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], refine_radius_opt, strlen(refine_radius_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(refine_radius_opt), "%d", &refine_options.radius ) != 1 ||
+                refine_options.radius < 0 || refine_options.radius > 3 )
+            {
+                printf("Command-line parameter error: The refinement window radius (--refine-radius=<...>) must be 0 to 3\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], refine_lr_opt, strlen(refine_lr_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(refine_lr_opt), "%lf", &refine_options.maxDiff ) != 1 )
+            {
+                printf("Command-line parameter error: The left-right tolerance (--refine-lr=<...>) must be a number of pixels\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], confidence_opt, strlen(confidence_opt)) == 0 )
+            confidence_filename = argv[i] + strlen(confidence_opt);
+        else if( strncmp(argv[i], config_opt, strlen(config_opt)) == 0 )
+            config_filename = argv[i] + strlen(config_opt);
+        else if( strncmp(argv[i], config_ms_opt, strlen(config_ms_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(config_ms_opt), "%lf", &config_ms ) != 1 || config_ms <= 0 )
+            {
+                printf("Command-line parameter error: The time budget (--config-ms=<...>) must be a positive number of milliseconds\n");
+                return -1;
+            }
+        }
+        else if( strcmp(argv[i], "--live-loop" ) == 0 )
+            live_loop = true;
+        else if( strcmp(argv[i], live_opt) == 0 )
+            live = true;
+        else if( strncmp(argv[i], live_opt, strlen(live_opt)) == 0 && argv[i][strlen(live_opt)] == '=' )
+        {
+            live = true;
+            if( sscanf( argv[i] + strlen(live_opt) + 1, "%d,%d", &left_camera, &right_camera ) != 2 )
+            {
+                printf("Command-line parameter error: The cameras (--live=<left>,<right>) must be two device indices\n");
+                return -1;
+            }
+        }
+        else if( strcmp(argv[i], "--cloud-color" ) == 0 )
+            cloud.color = true;
+        else if( strcmp(argv[i], "--cloud-disparity" ) == 0 )
+            cloud.disparity = true;
         else if( strcmp(argv[i], nodisplay_opt) == 0 )
             no_display = true;
+        else if( strcmp(argv[i], "--batch" ) == 0 )
+            batch_source = argv[++i];
         else if( strcmp(argv[i], "-i" ) == 0 )
             intrinsic_filename = argv[++i];
         else if( strcmp(argv[i], "-e" ) == 0 )
@@ -137,11 +1213,12 @@ int main(int argc, char** argv)
             return -1;
         }
     }
+    trace.open(trace_filename, trace_summary_filename);
     
     
     
     
-    if( !img1_filename || !img2_filename )
+    if( !batch_source && !live && !sequence_source && (!img1_filename || !img2_filename) )
     {
         printf("Command-line parameter error: both left and right images must be specified\n");
         return -1;
@@ -159,260 +1236,142 @@ int main(int argc, char** argv)
         return -1;
     }
     
-    int color_mode = alg == STEREO_BM ? 0 : -1;
-    Mat img1 = imread(img1_filename, color_mode);
-    Mat img2 = imread(img2_filename, color_mode);
-    
-    
-    if (img1.empty())
+    DispParams params;
+    if( config_ms > 0 && !config_filename )
     {
-        printf("Command-line parameter error: could not load the first input image file\n");
+        printf("Command-line parameter error: --config-ms needs --config=<tuned.yml>\n");
         return -1;
     }
-    if (img2.empty())
+    if( config_filename )
     {
-        printf("Command-line parameter error: could not load the second input image file\n");
+        int config_alg = alg;
+        if( !dispLoadConfig(config_filename, config_ms, config_alg, params) )
+        {
+            printf("Error: could not read tuned settings%s from %s\n", config_ms > 0 ? " within the time budget" : "", config_filename);
+            return -1;
+        }
+        if( !alg_given )
+            alg = config_alg;
+        printf("config: %s, block %d, %d disparities, uniqueness %d, speckle window %d\n", dispAlgorithmName(alg),
+               params.BlockSize, params.number_of_disparities, params.uniqueness_ratio, params.speckle_window_size);
+    }
+    params.pyramid_levels = pyramid_levels;
+    params.pyramid_radius = pyramid_radius;
+    if( pyramid_levels > 0 && alg == STEREO_VAR )
+    {
+        printf("Command-line parameter error: --pyramid does not apply to --algorithm=var\n");
         return -1;
     }
-    
-    //input scale factor
-    if (scale != 1.f)
+    params.refine = refine;
+    params.refine_options = refine_options;
+    if( refine >= 0 && alg == STEREO_VAR )
     {
-        Mat temp1, temp2;
-        int method = scale < 1 ? INTER_AREA : INTER_CUBIC;
-        resize(img1, temp1, Size(), scale, scale, method);
-        img1 = temp1;
-        resize(img2, temp2, Size(), scale, scale, method);
-        img2 = temp2;
+        printf("Command-line parameter error: --refine does not apply to --algorithm=var\n");
+        return -1;
+    }
+    if( confidence_filename && (refine < 0 || batch_source || live || sequence_source) )
+    {
+        printf("Command-line parameter error: --confidence=<file> needs --refine and a single pair (-o <dir> holds it in the other modes)\n");
+        return -1;
     }
     
-    Size img_size = img1.size();
+    int color_mode = alg == STEREO_BM || alg == STEREO_SIMDBM || alg == STEREO_SGM || alg == STEREO_SGM_STRIP || alg == STEREO_CENSUS ? 0 : -1;
     
-    Rect roi1, roi2;
-    Mat Q;
+    if( alg == STEREO_SIMDBM )
+        printf("simdbm: using %s kernels\n", stereoSimdLevelName(stereoSimdLevel()));
+    if( alg == STEREO_CENSUS || (census_cost && (alg == STEREO_SGM || alg == STEREO_SGM_STRIP)) )
+        printf("census: %s window, %s popcount\n", stereoCensusWindowName(census_window),
+               StereoCensusCost(census_window).usesPopcnt() ? "hardware" : "software");
     
-    if( intrinsic_filename )
+    //rectification maps are cached next to the extrinsics unless told otherwise
+    string default_rectify_cache = extrinsic_filename ? string(extrinsic_filename) + ".rmap" : string();
+    if( !use_rectify_cache )
+        rectify_cache = 0;
+    else if( !rectify_cache && extrinsic_filename )
+        rectify_cache = default_rectify_cache.c_str();
+    
+    tiling.threads = nthreads;
+    if( tiling.enabled && batch_source )
+        printf("batch: --tiles ignored, the pairs already run on %s threads\n", nthreads > 0 ? "the --threads" : "all");
+    
+    if( (batch_source || sequence_source) && cloud.format < 0 )
+        cloud.format = STEREO_CLOUD_PLY;
+    if( sequence_source )
+        return runSequence(sequence_source, alg, params, census_cost, census_window, color_mode, scale,
+                           intrinsic_filename, extrinsic_filename, rectify_cache, disparity_filename, point_cloud_filename,
+                           cloud, no_display, temporal_margin, keyframe, tiling);
+    if( live )
+        return runLive(left_camera, right_camera, live_tolerance, live_source, live_fps, live_loop, live_frames, alg, params,
+                       census_cost, census_window, color_mode, scale, intrinsic_filename, extrinsic_filename,
+                       rectify_cache, disparity_filename, no_display, tiling);
+    if( batch_source )
+        return runBatch(batch_source, alg, params, census_cost, census_window, color_mode, scale,
+                        intrinsic_filename, extrinsic_filename, rectify_cache, disparity_filename, point_cloud_filename,
+                        cloud, nthreads);
+    
+    if( out_of_core )
     {
-        // reading intrinsic parameters
-        FileStorage fs(intrinsic_filename, FileStorage::READ);
-        if(!fs.isOpened())
-        {
-            printf("Failed to open file %s\n", intrinsic_filename);
-            return -1;
-        }
-        
-        Mat M1, D1, M2, D2;
-        fs["M1"] >> M1;
-        fs["D1"] >> D1;
-        fs["M2"] >> M2;
-        fs["D2"] >> D2;
-        
-        M1 *= scale;
-        M2 *= scale;
-        
-        fs.open(extrinsic_filename, FileStorage::READ);
-        if(!fs.isOpened())
+        if( intrinsic_filename || point_cloud_filename || !disparity_filename || scale != 1.f || alg == STEREO_VAR || refine >= 0 )
         {
-            printf("Failed to open file %s\n", extrinsic_filename);
+            printf("Command-line parameter error: --out-of-core needs a rectified pair and -o, and does not take -i/-e, -p, --scale, --refine or --algorithm=var\n");
             return -1;
         }
-        
-        Mat R, T, R1, P1, R2, P2;
-        fs["R"] >> R;
-        fs["T"] >> T;
-        
-        stereoRectify( M1, D1, M2, D2, img_size, R, T, R1, R2, P1, P2, Q, CALIB_ZERO_DISPARITY, -1, img_size, &roi1, &roi2 );
-        
-        Mat map11, map12, map21, map22;
-        initUndistortRectifyMap(M1, D1, R1, P1, img_size, CV_16SC2, map11, map12);
-        initUndistortRectifyMap(M2, D2, R2, P2, img_size, CV_16SC2, map21, map22);
-        
-        Mat img1r, img2r;
-        remap(img1, img1r, map11, map12, INTER_LINEAR);
-        remap(img2, img2r, map21, map22, INTER_LINEAR);
-        
-        img1 = img1r;
-        img2 = img2r;
+        return runOutOfCore(img1_filename, img2_filename, raw_size, max_memory, alg, params, census_cost, census_window,
+                            disparity_filename, tiling);
     }
     
-    //disparity map parameters
-    int BlockSize = 5;
-    int number_of_disparities = 80;
-    int pre_filter_size = 5;
-    int pre_filter_cap = 23;
-    int min_disparity = 1;
-    int texture_threshold = 500;
-    int uniqueness_ratio = 0;
-    int max_diff = 100;
-    int speckle_window_size = -10;
+    Mat img1, img2;
+    if( !readPair(img1_filename, img2_filename, color_mode, scale, img1, img2) )
+    {
+        printf("Command-line parameter error: could not load the input image files\n");
+        return -1;
+    }
+    
+    Size img_size = img1.size();
+    
+    StereoRectification rect;
+    
+    if( intrinsic_filename )
+    {
+        if( !loadRectification(intrinsic_filename, extrinsic_filename, rectify_cache, img_size, scale, rect) )
+            return -1;
+        rectifyPair(rect, img1, img2);
+    }
     
-    //tracking bar parameters
-    int erosion_size = 0;
-    int dilation_size = 0;
+    DispMatchers matchers(census_cost, census_window);
+    if( tiling.enabled )
+        matchers.enableTiles(tiling.threads, tiling.size, tiling.overlap);
     
     namedWindow("disparity map", 50);
     //create disparitymap tracking bar
-    createTrackbar("WindowSize", "disparity map", & BlockSize, 50, NULL);
-    createTrackbar("no_of_disparities", "disparity map", &number_of_disparities,255, NULL);
-    createTrackbar("filter_size", "disparity map", &pre_filter_size,255, NULL);
-    createTrackbar("filter_cap", "disparity map", &pre_filter_cap,63, NULL);
-    createTrackbar("min_disparity", "disparity map", &min_disparity,60, NULL);
-    createTrackbar("texture_thresh", "disparity map", &texture_threshold,2000, NULL);
-    createTrackbar("uniquness", "disparity map", &uniqueness_ratio,30, NULL);
-    createTrackbar("disp12MaxDiff", "disparity map", &max_diff,100, NULL);
-    createTrackbar("Speckle Window", "disparity map", &speckle_window_size,50, NULL);
+    createTrackbar("WindowSize", "disparity map", &params.BlockSize, 50, NULL);
+    createTrackbar("no_of_disparities", "disparity map", &params.number_of_disparities,255, NULL);
+    createTrackbar("filter_size", "disparity map", &params.pre_filter_size,255, NULL);
+    createTrackbar("filter_cap", "disparity map", &params.pre_filter_cap,63, NULL);
+    createTrackbar("min_disparity", "disparity map", &params.min_disparity,60, NULL);
+    createTrackbar("texture_thresh", "disparity map", &params.texture_threshold,2000, NULL);
+    createTrackbar("uniquness", "disparity map", &params.uniqueness_ratio,30, NULL);
+    createTrackbar("disp12MaxDiff", "disparity map", &params.max_diff,100, NULL);
+    createTrackbar("Speckle Window", "disparity map", &params.speckle_window_size,50, NULL);
     
     /// Create Erosion Trackbar
-    createTrackbar( "Erode Kernel size", "disparity map", &erosion_size, 25, NULL);
+    createTrackbar( "Erode Kernel size", "disparity map", &params.erosion_size, 25, NULL);
     
     /// Create Dilation Trackbar
-    createTrackbar( "Dilate Kernel size", "disparity map", &dilation_size, 25, NULL);
+    createTrackbar( "Dilate Kernel size", "disparity map", &params.dilation_size, 25, NULL);
     
     
+    //recompute as soon as a tracking bar moves, only the stages that depend on it; ESC quits
+    DispPipeline pipeline;
     while(1)
     {
-        int i1, p1;
-        i1 = BlockSize;
-        if(i1%2==0 && i1>=7)
+        if( !pipeline.update(matchers, params, alg, img1, img2, rect.roi1, rect.roi2) )
         {
-            p1 = i1-1;
-            bm->setBlockSize(p1);
-            sgbm->setBlockSize(p1);
+            if( waitKey(30) == 27 )
+                break;
+            continue;
         }
         
-        if(i1%2!=0 && i1>=7)
-        {
-            p1 = i1;
-            bm->setBlockSize(p1);
-            sgbm->setBlockSize(p1);
-        }
-        
-        int i2, p2;
-        i2 = number_of_disparities;
-        if(i2%16!=0 && i2>16)
-        {
-            p2 = i2 - i2%16;
-            bm->setNumDisparities(p2);
-            sgbm->setNumDisparities(p2);
-        }
-        if(i2%16==0 && i2>16)
-        {
-            p2 = i2;
-            bm->setNumDisparities(p2);
-            sgbm->setNumDisparities(p2);
-        }
-        if(i2<=16)
-        {
-            p2 = 16;
-            bm->setNumDisparities(p2);
-            sgbm->setNumDisparities(p2);
-        }
-        
-        int i3, p3;
-        i3 = pre_filter_cap;
-        if(i3%2==0 && i3>=7)
-        {
-            p3 = i3-1;
-            bm->setPreFilterCap(p3);
-            sgbm->setPreFilterCap(p3);
-        }
-        if(i3<7)
-        {
-            p3 = 7;
-            bm->setPreFilterCap(p3);
-            sgbm->setPreFilterCap(p3);
-            
-        }
-        if(i3%2!=0 && i3>=7)
-        {
-            p3 =	i3;
-            bm->setPreFilterCap(p3);
-            sgbm->setPreFilterCap(p3);
-        }
-        
-        int i4, p4;
-        i4 = speckle_window_size;
-        p4 = i4;
-        bm->setSpeckleWindowSize(i4);
-        sgbm->setSpeckleWindowSize(i4);
-        
-        int i5, p5;
-        i5 = min_disparity;
-        p5 = -i5;
-        bm->setMinDisparity(p5);
-        sgbm->setMinDisparity(p5);
-        
-        int i6, p6;
-        i6 = texture_threshold;
-        p6 = i6;
-        bm->setTextureThreshold(p6);
-        
-        int i7, p7;
-        i7 = uniqueness_ratio;
-        p7 = i7;
-        bm->setUniquenessRatio(p7);
-        sgbm->setUniquenessRatio(p7);
-        
-        int i8;
-        float p8;
-        i8 = max_diff;
-        p8 = 0.01*((float)i8);
-        bm->setDisp12MaxDiff(p8);
-        sgbm->setDisp12MaxDiff(p8);
-        
-        
-        bm->setROI1(roi1);
-        bm->setROI2(roi2);
-        bm->setSpeckleRange(32);
-        
-        //int cn = img1.channels();
-        
-        
-        if(alg==STEREO_HH)
-            sgbm->setMode(StereoSGBM::MODE_HH);
-        else if(alg==STEREO_SGBM)
-            sgbm->setMode(StereoSGBM::MODE_SGBM);
-        
-        
-        
-        
-        Mat dispcal, disp8U, disp8Uerode, disp8Udilate;
-        
-        int64 t = getTickCount();
-        if( alg == STEREO_BM ){
-            
-            bm->compute(img1, img2, dispcal);
-        }
-        else if( alg == STEREO_SGBM || alg == STEREO_HH || alg == STEREO_3WAY )
-            sgbm->compute(img1, img2, dispcal);
-        t = getTickCount() - t;
-        printf("Time elapsed: %fms\n", t*1000/getTickFrequency());
-        
-        
-        if( alg != STEREO_VAR )
-            dispcal.convertTo(disp8U, CV_8U, 255/(number_of_disparities*16.));
-        else
-            dispcal.convertTo(disp8U, CV_8U);
-        
-        
-        Mat element1 = getStructuringElement( MORPH_ELLIPSE,
-                                             Size( 2*erosion_size + 1, 2*erosion_size+1 ),
-                                             Point( erosion_size, erosion_size ) );
-        
-        // Apply the erosion operation
-        erode( disp8U, disp8Uerode, element1 );
-        //dilation and erodation
-        Mat element2 = getStructuringElement( MORPH_ELLIPSE,
-                                             Size( 2*dilation_size + 1, 2*dilation_size+1 ),
-                                             Point( dilation_size, dilation_size ) );
-        /// Apply the dilation operation
-        dilate( disp8Uerode, disp8Udilate, element2 );
-        
-        
-        
-        
-        
-        
         if( !no_display )
         {
             namedWindow("left", 1);
@@ -420,34 +1379,27 @@ int main(int argc, char** argv)
             namedWindow("right", 1);
             imshow("right", img2);
             namedWindow("disparity", 0);
-            imshow("disparity", disp8Udilate);
-            printf("press any key to continue...");
-            fflush(stdout);
-            waitKey();
-            printf("\n");
+            imshow("disparity", pipeline.disp8U);
         }
         
         //write the disparity matrix into a file
         if(disparity_filename)
-            imwrite(disparity_filename, disp8Udilate);
+            saveDisparity(disparity_filename, pipeline.disparity(), pipeline.disp8U);
+        if(confidence_filename)
+            saveConfidence(confidence_filename, pipeline.confidence);
         
         if(point_cloud_filename)
         {
             printf("storing the point cloud...");
             fflush(stdout);
-            Mat xyz;
-            reprojectImageTo3D(dispcal, xyz, Q, true);
-            saveXYZ(point_cloud_filename, xyz);
+            savePointCloud(point_cloud_filename, pipeline.disparity(), img1, rect.Q, cloud);
             printf("\n");
         }
+        
+        if( no_display )
+            break;
     }
     
     
     return 0;
 }
-
-
-
-
-
-
@@ -0,0 +1,385 @@
+//
+//  Stereo_Bench.cpp
+//  BMW_FM
+//
+//  Runs every matcher over a set of rectified pairs and reports time per
+//  frame, throughput in megapixel-disparities per second, peak memory and,
+//  for pairs with a ground-truth disparity map, bad-pixel share and mean
+//  end-point error, as a table and as CSV/JSON for tracking regressions.
+//
+
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_Matchers.hpp"
+#include "Stereo_Metrics.hpp"
+#include "Stereo_Sequence.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+
+static const char* const bench_algorithms[] = { "bm", "sgbm", "hh", "sgbm3way", "simdbm", "sgm", "sgmstrip", "census" };
+
+static void print_help()
+{
+    printf("\nStereo matcher benchmark: time, throughput, peak memory and accuracy per algorithm and pair\n");
+    printf("\nUsage: stereo_bench [--pair=<left>,<right>[,<ground_truth>]]... [--data=<dir>]\n"
+           "[--algorithms=bm,sgbm,hh,sgbm3way,simdbm,sgm,sgmstrip,census] [--runs=<n>] [--warmup=<n>]\n"
+           "[--max-disparity=<n>] [--blocksize=<n>] [--scale=<factor>] [--threads=<n>] [--cost=bt|census]\n"
+           "[--bad=<pixels>] [--gt-scale=<factor>] [--csv=<file>] [--json=<file>]\n");
+    printf("\nWithout --pair the rectified pair in <dir>/real_images is used (<dir> defaults to data).\n"
+           "Ground truth: .pfm in pixels, 16-bit PNG in pixels x 256 (KITTI), 8-bit gray in pixels x --gt-scale;\n"
+           "0 or infinity marks unknown pixels. Pairs without it report speed and memory only.\n");
+}
+
+struct BenchPair
+{
+    string left, right, gt;
+};
+
+struct BenchResult
+{
+    string pair, algorithm;
+    Size size;
+    int disparities;
+    int runs;
+    double msMedian, msMin;
+    double mdePerSecond;
+    double peakMB;
+    bool accuracy;
+    StereoAccuracy acc;
+};
+
+static double median(vector<double> v)
+{
+    sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n == 0 ? 0 : n % 2 ? v[n/2] : 0.5*(v[n/2 - 1] + v[n/2]);
+}
+
+static vector<string> splitList(const string& s)
+{
+    vector<string> items;
+    size_t start = 0;
+    for(;;)
+    {
+        size_t comma = s.find(',', start);
+        items.push_back(s.substr(start, comma == string::npos ? string::npos : comma - start));
+        if( comma == string::npos )
+            return items;
+        start = comma + 1;
+    }
+}
+
+static void writeCSV(FILE* f, const vector<BenchResult>& results)
+{
+    fprintf(f, "pair,algorithm,width,height,disparities,runs,ms_median,ms_min,mde_per_s,peak_rss_mb,bad_pct,epe,density_pct\n");
+    for( size_t i = 0; i < results.size(); i++ )
+    {
+        const BenchResult& r = results[i];
+        fprintf(f, "%s,%s,%d,%d,%d,%d,%.3f,%.3f,%.2f,%.1f,", r.pair.c_str(), r.algorithm.c_str(), r.size.width, r.size.height,
+                r.disparities, r.runs, r.msMedian, r.msMin, r.mdePerSecond, r.peakMB);
+        if( r.accuracy )
+            fprintf(f, "%.3f,%.4f,%.2f\n", r.acc.bad*100, r.acc.epe, r.acc.density*100);
+        else
+            fprintf(f, ",,\n");
+    }
+}
+
+static void writeJSON(FILE* f, const vector<BenchResult>& results, int threads, bool perAlgorithmPeak, double badThreshold)
+{
+    fprintf(f, "{\n  \"threads\": %d,\n  \"simd\": \"%s\",\n  \"peak_rss_scope\": \"%s\",\n  \"bad_threshold\": %g,\n  \"results\": [",
+            threads, stereoSimdLevelName(stereoSimdLevel()), perAlgorithmPeak ? "algorithm" : "process", badThreshold);
+    for( size_t i = 0; i < results.size(); i++ )
+    {
+        const BenchResult& r = results[i];
+        fprintf(f, "%s\n    {\"pair\": \"%s\", \"algorithm\": \"%s\", \"width\": %d, \"height\": %d, \"disparities\": %d, \"runs\": %d, "
+                "\"ms_median\": %.3f, \"ms_min\": %.3f, \"mde_per_s\": %.2f, \"peak_rss_mb\": %.1f", i ? "," : "",
+                r.pair.c_str(), r.algorithm.c_str(), r.size.width, r.size.height, r.disparities, r.runs,
+                r.msMedian, r.msMin, r.mdePerSecond, r.peakMB);
+        if( r.accuracy )
+            fprintf(f, ", \"bad_pct\": %.3f, \"epe\": %.4f, \"density_pct\": %.2f}", r.acc.bad*100, r.acc.epe, r.acc.density*100);
+        else
+            fprintf(f, ", \"bad_pct\": null, \"epe\": null, \"density_pct\": null}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* pair_opt = "--pair=";
+    const char* data_opt = "--data=";
+    const char* algorithms_opt = "--algorithms=";
+    const char* runs_opt = "--runs=";
+    const char* warmup_opt = "--warmup=";
+    const char* maxdisp_opt = "--max-disparity=";
+    const char* blocksize_opt = "--blocksize=";
+    const char* scale_opt = "--scale=";
+    const char* threads_opt = "--threads=";
+    const char* cost_opt = "--cost=";
+    const char* bad_opt = "--bad=";
+    const char* gt_scale_opt = "--gt-scale=";
+    const char* csv_opt = "--csv=";
+    const char* json_opt = "--json=";
+
+    vector<BenchPair> pairs;
+    string data_dir = "data";
+    vector<string> algorithms(bench_algorithms, bench_algorithms + sizeof(bench_algorithms)/sizeof(bench_algorithms[0]));
+    int runs = 5, warmup = 1;
+    int nthreads = 0;
+    float scale = 1.f;
+    bool census_cost = false;
+    double bad_threshold = 2, gt_scale = 0;
+    const char* csv_filename = 0;
+    const char* json_filename = 0;
+    DispParams params;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0 )
+        {
+            print_help();
+            return 0;
+        }
+        else if( strncmp(argv[i], pair_opt, strlen(pair_opt)) == 0 )
+        {
+            vector<string> items = splitList(argv[i] + strlen(pair_opt));
+            if( items.size() < 2 || items.size() > 3 )
+            {
+                printf("Command-line parameter error: --pair=<left>,<right>[,<ground_truth>]\n");
+                return -1;
+            }
+            BenchPair p;
+            p.left = items[0];
+            p.right = items[1];
+            if( items.size() == 3 )
+                p.gt = items[2];
+            pairs.push_back(p);
+        }
+        else if( strncmp(argv[i], data_opt, strlen(data_opt)) == 0 )
+            data_dir = argv[i] + strlen(data_opt);
+        else if( strncmp(argv[i], algorithms_opt, strlen(algorithms_opt)) == 0 )
+        {
+            algorithms = splitList(argv[i] + strlen(algorithms_opt));
+            for( size_t k = 0; k < algorithms.size(); k++ )
+                if( dispAlgorithmFromName(algorithms[k]) < 0 || dispAlgorithmFromName(algorithms[k]) == STEREO_VAR )
+                {
+                    printf("Command-line parameter error: Unknown or unsupported stereo algorithm %s\n", algorithms[k].c_str());
+                    return -1;
+                }
+        }
+        else if( strncmp(argv[i], runs_opt, strlen(runs_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(runs_opt), "%d", &runs ) != 1 || runs < 1 )
+            {
+                printf("Command-line parameter error: The number of timed runs (--runs=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], warmup_opt, strlen(warmup_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(warmup_opt), "%d", &warmup ) != 1 || warmup < 0 )
+            {
+                printf("Command-line parameter error: The number of warm-up runs (--warmup=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], maxdisp_opt, strlen(maxdisp_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(maxdisp_opt), "%d", &params.number_of_disparities ) != 1 || params.number_of_disparities < 1 )
+            {
+                printf("Command-line parameter error: The max disparity (--max-disparity=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], blocksize_opt, strlen(blocksize_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(blocksize_opt), "%d", &params.BlockSize ) != 1 || params.BlockSize < 1 )
+            {
+                printf("Command-line parameter error: The block size (--blocksize=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], scale_opt, strlen(scale_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(scale_opt), "%f", &scale ) != 1 || scale <= 0 )
+            {
+                printf("Command-line parameter error: The scale factor (--scale=<...>) must be a positive floating-point number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], threads_opt, strlen(threads_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(threads_opt), "%d", &nthreads ) != 1 || nthreads < 0 )
+            {
+                printf("Command-line parameter error: The number of threads (--threads=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], cost_opt, strlen(cost_opt)) == 0 )
+        {
+            const char* _cost = argv[i] + strlen(cost_opt);
+            if( strcmp(_cost, "census") != 0 && strcmp(_cost, "bt") != 0 )
+            {
+                printf("Command-line parameter error: Unknown matching cost (--cost=bt|census)\n");
+                return -1;
+            }
+            census_cost = strcmp(_cost, "census") == 0;
+        }
+        else if( strncmp(argv[i], bad_opt, strlen(bad_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(bad_opt), "%lf", &bad_threshold ) != 1 || bad_threshold <= 0 )
+            {
+                printf("Command-line parameter error: The bad-pixel threshold (--bad=<pixels>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], gt_scale_opt, strlen(gt_scale_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(gt_scale_opt), "%lf", &gt_scale ) != 1 || gt_scale <= 0 )
+            {
+                printf("Command-line parameter error: The ground-truth scale (--gt-scale=<...>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], csv_opt, strlen(csv_opt)) == 0 )
+            csv_filename = argv[i] + strlen(csv_opt);
+        else if( strncmp(argv[i], json_opt, strlen(json_opt)) == 0 )
+            json_filename = argv[i] + strlen(json_opt);
+        else
+        {
+            printf("Command-line parameter error: unknown option %s\n", argv[i]);
+            print_help();
+            return -1;
+        }
+    }
+
+    if( pairs.empty() )
+    {
+        BenchPair p;
+        p.left = data_dir + "/real_images/rectified_left.jpg";
+        p.right = data_dir + "/real_images/rectified_right.jpg";
+        pairs.push_back(p);
+    }
+    if( nthreads > 0 )
+        setNumThreads(nthreads);
+
+    bool per_algorithm_peak = stereoResetPeakRSS();
+    printf("bench: %d threads, %s kernels, %d warm-up and %d timed runs%s\n", getNumThreads(),
+           stereoSimdLevelName(stereoSimdLevel()), warmup, runs, per_algorithm_peak ? "" : ", peak memory of the whole process");
+    printf("%-24s %-9s %10s %10s %10s %9s %8s %8s\n", "pair", "algorithm", "ms", "min ms", "MDE/s", "peak MB", "bad %", "EPE");
+
+    vector<BenchResult> results;
+    for( size_t i = 0; i < pairs.size(); i++ )
+    {
+        const BenchPair& pair = pairs[i];
+        //gray for the matchers that work on intensity, as loaded for the sgbm family
+        Mat gray1, gray2, color1, color2;
+        gray1 = stereoImread(pair.left, IMREAD_GRAYSCALE);
+        gray2 = stereoImread(pair.right, IMREAD_GRAYSCALE);
+        color1 = stereoImread(pair.left, IMREAD_UNCHANGED);
+        color2 = stereoImread(pair.right, IMREAD_UNCHANGED);
+        if( gray1.empty() || gray2.empty() || color1.empty() || color2.empty() || gray1.size() != gray2.size() )
+        {
+            printf("%s: could not load the pair, skipped\n", pair.left.c_str());
+            continue;
+        }
+        if( scale != 1.f )
+        {
+            int method = scale < 1 ? INTER_AREA : INTER_CUBIC;
+            resize(gray1, gray1, Size(), scale, scale, method);
+            resize(gray2, gray2, Size(), scale, scale, method);
+            resize(color1, color1, Size(), scale, scale, method);
+            resize(color2, color2, Size(), scale, scale, method);
+        }
+
+        Mat gt;
+        if( !pair.gt.empty() && !stereoReadGroundTruth(pair.gt, gt, gt_scale) )
+            printf("%s: not a ground-truth disparity map (PFM, 16-bit PNG or 8-bit gray), speed only\n", pair.gt.c_str());
+
+        string name = pair.left;
+        size_t slash = name.find_last_of("/\\");
+        if( slash != string::npos )
+            name = name.substr(slash + 1);
+
+        for( size_t k = 0; k < algorithms.size(); k++ )
+        {
+            int alg = dispAlgorithmFromName(algorithms[k]);
+            bool color = !(alg == STEREO_BM || alg == STEREO_SIMDBM || alg == STEREO_SGM || alg == STEREO_SGM_STRIP || alg == STEREO_CENSUS);
+            const Mat& img1 = color ? color1 : gray1;
+            const Mat& img2 = color ? color2 : gray2;
+
+            stereoResetPeakRSS();
+            DispMatchers matchers(census_cost, STEREO_CENSUS_9x7);
+            matchers.configure(params, alg, Rect(), Rect());
+            Ptr<StereoMatcher> m = matchers.matcher(alg);
+
+            Mat dispcal;
+            for( int w = 0; w < warmup; w++ )
+                matchers.compute(alg, img1, img2, dispcal);
+            vector<double> times;
+            for( int r = 0; r < runs; r++ )
+            {
+                int64 t = getTickCount();
+                matchers.compute(alg, img1, img2, dispcal);
+                times.push_back((getTickCount() - t)*1000./getTickFrequency());
+            }
+
+            BenchResult res;
+            res.pair = name;
+            res.algorithm = algorithms[k];
+            res.size = img1.size();
+            res.disparities = m->getNumDisparities();
+            res.runs = runs;
+            res.msMedian = median(times);
+            res.msMin = *min_element(times.begin(), times.end());
+            res.mdePerSecond = (double)res.size.area()*res.disparities/(res.msMedian*1e-3)/1e6;
+            res.peakMB = stereoPeakRSS()/(1024.*1024.);
+            res.accuracy = !gt.empty();
+            if( res.accuracy )
+                res.acc = stereoEvaluateDisparity(dispcal, m->getMinDisparity(), gt, bad_threshold);
+            results.push_back(res);
+
+            printf("%-24s %-9s %10.2f %10.2f %10.1f %9.1f", res.pair.c_str(), res.algorithm.c_str(), res.msMedian, res.msMin,
+                   res.mdePerSecond, res.peakMB);
+            if( res.accuracy )
+                printf(" %8.2f %8.3f\n", res.acc.bad*100, res.acc.epe);
+            else
+                printf(" %8s %8s\n", "-", "-");
+        }
+    }
+
+    if( csv_filename )
+    {
+        FILE* f = fopen(csv_filename, "w");
+        if( !f )
+        {
+            printf("Error: could not write %s\n", csv_filename);
+            return -1;
+        }
+        writeCSV(f, results);
+        fclose(f);
+    }
+    if( json_filename )
+    {
+        FILE* f = fopen(json_filename, "w");
+        if( !f )
+        {
+            printf("Error: could not write %s\n", json_filename);
+            return -1;
+        }
+        writeJSON(f, results, getNumThreads(), per_algorithm_peak, bad_threshold);
+        fclose(f);
+    }
+    return results.empty() ? -1 : 0;
+}
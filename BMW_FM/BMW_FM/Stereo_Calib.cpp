@@ -16,6 +16,13 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+#include "Stereo_Sequence.hpp"
+#include "Stereo_ThreadPool.hpp"
+#include "Stereo_Chessboard.hpp"
+#include "Stereo_CornerCache.hpp"
+#include "Stereo_ImageCache.hpp"
+#include "Stereo_Trace.hpp"
+
 #include <vector>
 #include <string>
 #include <algorithm>
@@ -40,13 +47,18 @@ static int print_help()
     "         matrix separately) stereo. \n"
     " Calibrate the cameras and display the\n"
     " rectified results along with the computed disparity images.   \n" << endl;
-    cout << "Usage:\n ./stereo_calib -w board_width -h board_height [-nr /*dot not view results*/] <image list XML/YML file>\n" << endl;
+    cout << "Usage:\n ./stereo_calib -w board_width -h board_height [-nr /*dot not view results*/] [-t threads /*0: one per CPU*/]\n"
+    "   [-c corner_cache /*default: <image list>.corners*/] [-nc /*no corner cache*/]\n"
+    "   [-m MB /*decoded views kept for the rectified preview, default 512*/]\n"
+    "   [-trace trace.json /*Chrome trace per stage and thread, STEREO_ENABLE_TRACE builds*/] [-trace-summary summary.json /*p50/p95/p99 per stage*/]\n"
+    "   <image list XML/YML file | recording.sseq>\n" << endl;
     return 0;
 }
 
 //check if items in imagelist is paired
 static void
-StereoCalib(const vector<string>& imagelist, Size boardSize,bool displayCorners = false, bool useCalibrated=true, bool showRectified=true)
+StereoCalib(const vector<string>& imagelist, Size boardSize,bool displayCorners = false, bool useCalibrated=true, bool showRectified=true, int nthreads=0,
+            const string& cacheFilename=string(), int imageCacheMB=512)
 {
     if( imagelist.size() % 2 != 0 )
     {
@@ -70,49 +82,96 @@ StereoCalib(const vector<string>& imagelist, Size boardSize,bool displayCorners
     imagePoints[1].resize(nimages);
     vector<string> goodImageList;
     
-    //read images, check if sizes of images are the same
-    for( i = j = 0; i < nimages; i++ )
+    //detect the boards of every pair on the pool, one task per pair
+    struct PairDetection
     {
-        for( k = 0; k < 2; k++ )
+        PairDetection() { found[0] = found[1] = false; }
+        bool found[2];
+        Size size[2];                   //empty when the image could not be read
+        vector<Point2f> corners[2];
+    };
+    vector<PairDetection> detections(nimages);
+    StereoCornerCache cache;
+    if( !cacheFilename.empty() && !cache.open(cacheFilename) )
+        cout << cacheFilename << " is not a corner cache, detecting without it\n";
+    StereoWorkStealingPool pool(nthreads);
+    StereoImageCache images((size_t)imageCacheMB << 20);
+    StereoProgress progress("detecting chessboards", nimages);
+    pool.run(nimages, [&](int pair, int)
+    {
+        PairDetection& d = detections[pair];
+        Mat decoded[2];
+        for( int view = 0; view < 2; view++ )
         {
-            const string& filename = imagelist[i*2+k];
-            Mat img = imread(filename, 0);
-            if(img.empty())
-                break;
-            if( imageSize == Size() )
-                imageSize = img.size();
-            else if( img.size() != imageSize )
+            const string& filename = imagelist[pair*2+view];
+            StereoCornerRecord r;
+            uint64 key = 0;
+            if( cache.isOpened() )
             {
-                cout << "The image " << filename << " has the size different from the first image size. Skipping the pair\n";
-                break;
+                uint64 h = stereoImageContentHash(filename);
+                key = h ? StereoCornerCache::key(h, boardSize, 0, maxScale) : 0;
             }
-            bool found = false;
-            vector<Point2f>& corners = imagePoints[k][j];
-            for( int scale = 1; scale <= maxScale; scale++ )
+            if( !key || !cache.lookup(key, r) )
             {
-                Mat timg;
-                if( scale == 1 )
-                    timg = img;
-                else
-                    resize(img, timg, Size(), scale, scale);
-                found = findChessboardCorners(timg, boardSize, corners,
-                                              CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_NORMALIZE_IMAGE);
-                if( found )
+                Mat img;
+                {
+                    STEREO_TRACE_SCOPE("imread");
+                    img = stereoImread(filename, 0);
+                }
+                if( img.empty() )
+                    break;
+                decoded[view] = img;
+                r.imageSize = img.size();
+                //a second image of another size is skipped anyway
+                if( view == 1 && img.size() != d.size[0] )
                 {
-                    if( scale > 1 )
-                    {
-                        Mat cornersMat(corners);
-                        cornersMat *= 1./scale;
-                    }
+                    d.size[view] = r.imageSize;
                     break;
                 }
+                r.found = stereoFindChessboard(img, boardSize, r.corners, maxScale);
+                if( key )
+                    cache.insert(key, r);
+            }
+            d.size[view] = r.imageSize;
+            d.found[view] = r.found;
+            d.corners[view].swap(r.corners);
+            if( !d.found[view] )
+                break;
+        }
+        //the views of a good pair are decoded again for the rectified preview
+        if( showRectified && d.found[0] && d.found[1] )
+            for( int view = 0; view < 2; view++ )
+                if( !decoded[view].empty() )
+                    images.put(imagelist[pair*2+view], decoded[view]);
+        progress.step();
+    });
+    if( cache.isOpened() )
+    {
+        cout << "corner cache: " << cache.hits() << " of " << cache.hits() + cache.misses() << " images reused\n";
+        if( !cache.flush() )
+            cout << "Error: can not write the corner cache " << cacheFilename << endl;
+    }
+    
+    //collect in list order, the first image read fixes the size
+    for( i = j = 0; i < nimages; i++ )
+    {
+        PairDetection& d = detections[i];
+        for( k = 0; k < 2 && d.size[k] != Size(); k++ )
+        {
+            const string& filename = imagelist[i*2+k];
+            if( imageSize == Size() )
+                imageSize = d.size[k];
+            else if( d.size[k] != imageSize )
+            {
+                cout << "The image " << filename << " has the size different from the first image size. Skipping the pair\n";
+                break;
             }
             if( displayCorners )
             {
                 cout << filename << endl;
-                Mat cimg, cimg1;
+                Mat img = stereoImread(filename, 0), cimg, cimg1;
                 cvtColor(img, cimg, COLOR_GRAY2BGR);
-                drawChessboardCorners(cimg, boardSize, corners, found);
+                drawChessboardCorners(cimg, boardSize, d.corners[k], d.found[k]);
                 double sf = 640./MAX(img.rows, img.cols);
                 resize(cimg, cimg1, Size(), sf, sf);
                 imshow("corners", cimg1);
@@ -120,16 +179,11 @@ StereoCalib(const vector<string>& imagelist, Size boardSize,bool displayCorners
                 if( c == 27 || c == 'q' || c == 'Q' ) //Allow ESC to quit
                     exit(-1);
             }
-            else
-                putchar('.');
-            if( !found )
-                break;
-            cornerSubPix(img, corners, Size(11,11), Size(-1,-1),
-                         TermCriteria(TermCriteria::COUNT+TermCriteria::EPS,
-                                      30, 0.01));
         }
-        if( k == 2 )
+        if( k == 2 && d.found[0] && d.found[1] )
         {
+            imagePoints[0][j].swap(d.corners[0]);
+            imagePoints[1][j].swap(d.corners[1]);
             goodImageList.push_back(imagelist[i*2]);
             goodImageList.push_back(imagelist[i*2+1]);
             j++;
@@ -161,17 +215,21 @@ StereoCalib(const vector<string>& imagelist, Size boardSize,bool displayCorners
     cameraMatrix[1] = initCameraMatrix2D(objectPoints,imagePoints[1],imageSize,0);
     Mat R, T, E, F;
     
-    double rms = stereoCalibrate(objectPoints, imagePoints[0], imagePoints[1],
-                                 cameraMatrix[0], distCoeffs[0],
-                                 cameraMatrix[1], distCoeffs[1],
-                                 imageSize, R, T, E, F,
-                                 CALIB_FIX_ASPECT_RATIO +
-                                 CALIB_ZERO_TANGENT_DIST +
-                                 CALIB_USE_INTRINSIC_GUESS +
-                                 CALIB_SAME_FOCAL_LENGTH +
-                                 CALIB_RATIONAL_MODEL +
-                                 CALIB_FIX_K3 + CALIB_FIX_K4 + CALIB_FIX_K5,
-                                 TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 100, 1e-5) );
+    double rms;
+    {
+        STEREO_TRACE_SCOPE("stereoCalibrate");
+        rms = stereoCalibrate(objectPoints, imagePoints[0], imagePoints[1],
+                              cameraMatrix[0], distCoeffs[0],
+                              cameraMatrix[1], distCoeffs[1],
+                              imageSize, R, T, E, F,
+                              CALIB_FIX_ASPECT_RATIO +
+                              CALIB_ZERO_TANGENT_DIST +
+                              CALIB_USE_INTRINSIC_GUESS +
+                              CALIB_SAME_FOCAL_LENGTH +
+                              CALIB_RATIONAL_MODEL +
+                              CALIB_FIX_K3 + CALIB_FIX_K4 + CALIB_FIX_K5,
+                              TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 100, 1e-5) );
+    }
     cout << "done with RMS error=" << rms << endl;
     
     // CALIBRATION QUALITY CHECK
@@ -273,8 +331,11 @@ StereoCalib(const vector<string>& imagelist, Size boardSize,bool displayCorners
     }
     
     //Precompute maps for cv::remap()
-    initUndistortRectifyMap(cameraMatrix[0], distCoeffs[0], R1, P1, imageSize, CV_16SC2, rmap[0][0], rmap[0][1]);
-    initUndistortRectifyMap(cameraMatrix[1], distCoeffs[1], R2, P2, imageSize, CV_16SC2, rmap[1][0], rmap[1][1]);
+    {
+        STEREO_TRACE_SCOPE("rectification maps");
+        initUndistortRectifyMap(cameraMatrix[0], distCoeffs[0], R1, P1, imageSize, CV_16SC2, rmap[0][0], rmap[0][1]);
+        initUndistortRectifyMap(cameraMatrix[1], distCoeffs[1], R2, P2, imageSize, CV_16SC2, rmap[1][0], rmap[1][1]);
+    }
     
     Mat canvas;
     double sf;
@@ -294,18 +355,32 @@ StereoCalib(const vector<string>& imagelist, Size boardSize,bool displayCorners
         canvas.create(h*2, w, CV_8UC3);
     }
     
+    //every view rectified and shrunk up front on the pool, most of them from the images kept since detection
+    vector<Mat> previews(nimages*2);
+    StereoProgress rectifying("rectifying previews", nimages*2);
+    pool.run(nimages*2, [&](int view, int)
+    {
+        Mat img, rimg;
+        if( !images.get(goodImageList[view], img) )
+            img = stereoImread(goodImageList[view], 0);
+        if( !img.empty() )
+        {
+            STEREO_TRACE_SCOPE("remap preview");
+            remap(img, rimg, rmap[view%2][0], rmap[view%2][1], INTER_LINEAR);
+            resize(rimg, previews[view], Size(w, h), 0, 0, INTER_AREA);
+        }
+        rectifying.step();
+    });
+    
     for( i = 0; i < nimages; i++ )
     {
         for( k = 0; k < 2; k++ )
         {
-            
-            Mat img = imread(goodImageList[i*2+k], 0), rimg, cimg;
-            remap(img, rimg, rmap[k][0], rmap[k][1], INTER_LINEAR);
-//            imwrite("/Users/LH_Mac/Desktop/1.jpg", rimg);
-//            imwrite("/Users/LH_Mac/Desktop/2.jpg", img);
-            cvtColor(rimg, cimg, COLOR_GRAY2BGR);
             Mat canvasPart = !isVerticalStereo ? canvas(Rect(w*k, 0, w, h)) : canvas(Rect(0, h*k, w, h));
-            resize(cimg, canvasPart, canvasPart.size(), 0, 0, INTER_AREA);
+            if( previews[i*2+k].empty() )
+                canvasPart = Scalar::all(0);
+            else
+                cvtColor(previews[i*2+k], canvasPart, COLOR_GRAY2BGR);
             if( useCalibrated )
             {
                 Rect vroi(cvRound(validRoi[k].x*sf), cvRound(validRoi[k].y*sf),
@@ -348,6 +423,13 @@ int main(int argc, char** argv)
     Size boardSize;
     string imagelistfn;
     bool showRectified = true;
+    int nthreads = 0;
+    string cacheFilename;
+    bool useCache = true;
+    int imageCacheMB = 512;
+    string traceFilename, traceSummaryFilename;
+    //written when main() returns
+    StereoTraceSession trace;
     
     for( int i = 1; i < argc; i++ )
     {
@@ -369,6 +451,30 @@ int main(int argc, char** argv)
         }
         else if( string(argv[i]) == "-nr" )
             showRectified = false;
+        else if( string(argv[i]) == "-c" && i + 1 < argc )
+            cacheFilename = argv[++i];
+        else if( string(argv[i]) == "-nc" )
+            useCache = false;
+        else if( string(argv[i]) == "-m" )
+        {
+            if( i + 1 >= argc || sscanf(argv[++i], "%d", &imageCacheMB) != 1 || imageCacheMB < 0 )
+            {
+                cout << "invalid image memory" << endl;
+                return print_help();
+            }
+        }
+        else if( string(argv[i]) == "-t" )
+        {
+            if( i + 1 >= argc || sscanf(argv[++i], "%d", &nthreads) != 1 || nthreads < 0 )
+            {
+                cout << "invalid number of threads" << endl;
+                return print_help();
+            }
+        }
+        else if( string(argv[i]) == "-trace" && i + 1 < argc )
+            traceFilename = argv[++i];
+        else if( string(argv[i]) == "-trace-summary" && i + 1 < argc )
+            traceSummaryFilename = argv[++i];
         else if( string(argv[i]) == "--help" )
             return print_help();
         else if( argv[i][0] == '-' )
@@ -379,6 +485,7 @@ int main(int argc, char** argv)
         else
             imagelistfn = argv[i];
     }
+    trace.open(traceFilename, traceSummaryFilename);
     
     if( imagelistfn == "" )
     {
@@ -392,14 +499,19 @@ int main(int argc, char** argv)
     }
     
     vector<string> imagelist;
-    bool ok = readStringList(imagelistfn, imagelist);
+    bool ok = stereoIsSequenceFile(imagelistfn) ? stereoSequenceImageList(imagelistfn, imagelist) : readStringList(imagelistfn, imagelist);
     if(!ok || imagelist.empty())
     {
         cout << "can not open " << imagelistfn << " or the string list is empty" << endl;
         return print_help();
     }
     
-    StereoCalib(imagelist, boardSize,false, true, showRectified);
+    //detections are cached next to the image list unless told otherwise
+    if( !useCache )
+        cacheFilename.clear();
+    else if( cacheFilename.empty() )
+        cacheFilename = imagelistfn + ".corners";
+    StereoCalib(imagelist, boardSize,false, true, showRectified, nthreads, cacheFilename, imageCacheMB);
     return 0;
 }
 
@@ -0,0 +1,255 @@
+//
+//  Stereo_CameraSync.hpp
+//  BMW_FM
+//
+//  Synchronised stereo capture. Every camera has its own grab thread that
+//  stamps each frame with getTickCount() as soon as grab() returns, so one
+//  camera never waits for the other one's decode. A pairing thread matches
+//  left and right frames by nearest timestamp within a tolerance and hands
+//  the pairs to the consumer through a ring that drops pairs when the
+//  consumer (display, saving, matching) falls behind; acquisition itself
+//  never blocks on it.
+//
+
+#ifndef Stereo_CameraSync_hpp
+#define Stereo_CameraSync_hpp
+
+#include "opencv2/videoio.hpp"
+
+#include "Stereo_Pipeline.hpp"
+#include "Stereo_Trace.hpp"
+
+#include <deque>
+#include <cstdlib>
+
+using namespace cv;
+
+
+struct StereoStampedFrame
+{
+    StereoStampedFrame() : ticks(0), seq(-1) {}
+    Mat image;
+    int64 ticks;    //getTickCount() right after grab()
+    int64 seq;
+};
+
+//grab() + retrieve() of one camera on a dedicated thread into a ring of stamped frames
+class StereoGrabThread
+{
+public:
+    StereoGrabThread(int camera_id, int ringCapacity = 4)
+    : cap(camera_id), frames(ringCapacity), stopping(false) {}
+
+    ~StereoGrabThread() { stop(); }
+
+    bool isOpened() const { return cap.isOpened(); }
+
+    void start() { thread = std::thread(&StereoGrabThread::loop, this); }
+
+    void stop()
+    {
+        stopping = true;
+        if( thread.joinable() )
+            thread.join();
+    }
+
+    StereoSpscRing<StereoStampedFrame>& output() { return frames; }
+
+protected:
+    void loop()
+    {
+        for( int64 seq = 0; !stopping; seq++ )
+        {
+            StereoStampedFrame f;
+            {
+                STEREO_TRACE_SCOPE("grab");
+                if( !cap.grab() )
+                    break;
+            }
+            f.ticks = getTickCount();
+            f.seq = seq;
+            STEREO_TRACE_SCOPE("retrieve");
+            if( !cap.retrieve(f.image) || f.image.empty() )
+                break;
+            frames.tryPush(f);
+        }
+        frames.close();
+    }
+
+    VideoCapture cap;
+    StereoSpscRing<StereoStampedFrame> frames;
+    std::thread thread;
+    std::atomic<bool> stopping;
+};
+
+struct StereoSkewStats
+{
+    int64 pairs;
+    int64 unmatched[2];     //left, right frames that found no partner within the tolerance
+    int64 dropped[2];       //left, right frames lost because the pairing thread fell behind
+    int64 droppedPairs;     //pairs the consumer did not take in time
+    double meanMs, p50Ms, p95Ms, maxMs;     //|t_left - t_right| of the paired frames; percentiles over the recent pairs
+};
+
+//two grab threads and a pairing thread; read() returns the next pair
+class StereoSyncCameraSource : public StereoFrameSource
+{
+public:
+    StereoSyncCameraSource(int left_id, int right_id, double tolerance_ms_ = 10, int ringCapacity = 4)
+    : tolerance((int64)(tolerance_ms_*getTickFrequency()/1000)), pairs(ringCapacity), stopping(false),
+    npairs(0), skewSum(0), skewMax(0)
+    {
+        cams[0] = makePtr<StereoGrabThread>(left_id, ringCapacity);
+        cams[1] = makePtr<StereoGrabThread>(right_id, ringCapacity);
+        unmatched[0] = unmatched[1] = 0;
+        if( isOpened() )
+        {
+            cams[0]->start();
+            cams[1]->start();
+            pairer = std::thread(&StereoSyncCameraSource::pairLoop, this);
+        }
+    }
+
+    ~StereoSyncCameraSource() { stop(); }
+
+    bool isOpened() const { return cams[0]->isOpened() && cams[1]->isOpened(); }
+
+    void stop()
+    {
+        stopping = true;
+        cams[0]->stop();
+        cams[1]->stop();
+        if( pairer.joinable() )
+            pairer.join();
+    }
+
+    bool read(Mat& left, Mat& right)
+    {
+        int64 ticks;
+        return readStamped(left, right, ticks);
+    }
+
+    //ticks is the grab time of the earlier frame of the pair
+    bool readStamped(Mat& left, Mat& right, int64& ticks)
+    {
+        while( !tryRead(left, right, ticks) )
+        {
+            if( finished() )
+                return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        return true;
+    }
+
+    //the next pair if one is waiting, without blocking
+    bool tryRead(Mat& left, Mat& right, int64& ticks)
+    {
+        StereoFrame f;
+        if( !pairs.tryPop(f) )
+            return false;
+        left = f.left;
+        right = f.right;
+        ticks = f.captureTicks;
+        return true;
+    }
+
+    //a camera stopped delivering (or never opened) and every pair was read
+    bool finished() const { return !isOpened() || pairs.isDone(); }
+
+    StereoSkewStats stats() const
+    {
+        StereoSkewStats s;
+        for( int i = 0; i < 2; i++ )
+            s.dropped[i] = cams[i]->output().droppedCount();
+        s.droppedPairs = pairs.droppedCount();
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        s.pairs = npairs;
+        s.unmatched[0] = unmatched[0];
+        s.unmatched[1] = unmatched[1];
+        s.meanMs = npairs > 0 ? skewSum/npairs : 0;
+        s.maxMs = skewMax;
+        std::vector<double> r = recent;
+        s.p50Ms = stereoPercentile(r, 0.5);
+        s.p95Ms = stereoPercentile(r, 0.95);
+        return s;
+    }
+
+protected:
+    enum { STEREO_SKEW_WINDOW = 1000 };
+
+    //pairs the oldest frames of the two queues: the older frame is dropped when it cannot
+    //match (the other camera is already further ahead than the tolerance) or when the next
+    //frame of its own camera is already known to be closer to the partner
+    void pairLoop()
+    {
+        std::deque<StereoStampedFrame> queue[2];
+        for(;;)
+        {
+            bool idle = true, done = false;
+            for( int i = 0; i < 2; i++ )
+            {
+                StereoStampedFrame f;
+                while( cams[i]->output().tryPop(f) )
+                {
+                    queue[i].push_back(f);
+                    idle = false;
+                }
+                done |= cams[i]->output().isDone() && queue[i].empty();
+            }
+            if( done || stopping )
+                break;
+
+            while( !queue[0].empty() && !queue[1].empty() )
+            {
+                int older = queue[0].front().ticks <= queue[1].front().ticks ? 0 : 1, other = 1 - older;
+                int64 skew = queue[other].front().ticks - queue[older].front().ticks;
+                bool closerNext = queue[older].size() > 1 &&
+                    std::abs(queue[other].front().ticks - queue[older][1].ticks) <= skew;
+                if( skew > tolerance || closerNext )
+                {
+                    queue[older].pop_front();
+                    std::lock_guard<std::mutex> lock(statsMutex);
+                    unmatched[older]++;
+                    continue;
+                }
+
+                StereoFrame p;
+                p.id = npairs;
+                p.left = queue[0].front().image;
+                p.right = queue[1].front().image;
+                p.captureTicks = queue[older].front().ticks;
+                queue[0].pop_front();
+                queue[1].pop_front();
+                pairs.tryPush(p);
+
+                double ms = skew*1000/getTickFrequency();
+                std::lock_guard<std::mutex> lock(statsMutex);
+                skewSum += ms;
+                skewMax = std::max(skewMax, ms);
+                if( recent.size() < STEREO_SKEW_WINDOW )
+                    recent.push_back(ms);
+                else
+                    recent[npairs % STEREO_SKEW_WINDOW] = ms;
+                npairs++;
+            }
+            if( idle )
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        pairs.close();
+    }
+
+    Ptr<StereoGrabThread> cams[2];
+    int64 tolerance;
+    StereoSpscRing<StereoFrame> pairs;
+    std::thread pairer;
+    std::atomic<bool> stopping;
+
+    mutable std::mutex statsMutex;
+    int64 npairs;
+    int64 unmatched[2];
+    double skewSum, skewMax;
+    std::vector<double> recent;
+};
+
+#endif /* Stereo_CameraSync_hpp */
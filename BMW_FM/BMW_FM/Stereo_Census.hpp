@@ -0,0 +1,446 @@
+//
+//  Stereo_Census.hpp
+//  BMW_FM
+//
+//  Census transform matching cost. Each pixel is described by one bit per
+//  window neighbour (set when the neighbour is darker than the centre), so
+//  the cost only depends on the local intensity order and is unaffected by
+//  gain/offset differences between the two cameras. Codes are packed into
+//  32-bit words for the 5x5 window and 64-bit words for 7x7 and 9x7, and
+//  compared with a hardware popcount where the CPU has one.
+//
+//  StereoCensusCost plugs into StereoSGM; StereoCensus is a standalone
+//  winner-takes-all matcher on box-aggregated census costs.
+//
+
+#ifndef Stereo_Census_hpp
+#define Stereo_Census_hpp
+
+#include "Stereo_SGM.hpp"
+
+#include <vector>
+
+using namespace cv;
+
+
+enum
+{
+    STEREO_CENSUS_5x5 = 0,
+    STEREO_CENSUS_7x7 = 1,
+    STEREO_CENSUS_9x7 = 2
+};
+
+static inline void stereoCensusWindow(int window, int& w, int& h)
+{
+    w = window == STEREO_CENSUS_5x5 ? 5 : window == STEREO_CENSUS_7x7 ? 7 : 9;
+    h = window == STEREO_CENSUS_5x5 ? 5 : 7;
+}
+
+static inline const char* stereoCensusWindowName(int window)
+{
+    return window == STEREO_CENSUS_5x5 ? "5x5" : window == STEREO_CENSUS_7x7 ? "7x7" : "9x7";
+}
+
+//parses "5x5", "7x7" or "9x7"; -1 otherwise
+static inline int stereoCensusWindowFromName(const char* name)
+{
+    return strcmp(name, "5x5") == 0 ? STEREO_CENSUS_5x5 :
+    strcmp(name, "7x7") == 0 ? STEREO_CENSUS_7x7 :
+    strcmp(name, "9x7") == 0 ? STEREO_CENSUS_9x7 : -1;
+}
+
+
+static inline int stereoPopcount(unsigned v)
+{
+#if defined(STEREO_SIMD_NEON)
+    return __builtin_popcount(v);
+#else
+    v = v - ((v >> 1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+    return (int)((((v + (v >> 4)) & 0x0f0f0f0fu)*0x01010101u) >> 24);
+#endif
+}
+
+static inline int stereoPopcount(uint64 v)
+{
+#if defined(STEREO_SIMD_NEON)
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    return (int)((((v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL)*0x0101010101010101ULL) >> 56);
+#endif
+}
+
+//cost[x*ndisp + d] = popcount(l[x] ^ r[width - 1 - x + d]); r is the mirrored right row
+template<typename T> static void stereoHammingRowScalar(const T* l, const T* r, int width, int ndisp, ushort* cost)
+{
+    for( int x = 0; x < width; x++, cost += ndisp )
+    {
+        const T lx = l[x];
+        const T* rx = r + width - 1 - x;
+        for( int d = 0; d < ndisp; d++ )
+            cost[d] = (ushort)stereoPopcount(lx ^ rx[d]);
+    }
+}
+
+#if defined(STEREO_TARGET_POPCNT)
+STEREO_TARGET_POPCNT static void stereoHammingRowPopcnt(const unsigned* l, const unsigned* r, int width, int ndisp, ushort* cost)
+{
+    for( int x = 0; x < width; x++, cost += ndisp )
+    {
+        const unsigned lx = l[x];
+        const unsigned* rx = r + width - 1 - x;
+        for( int d = 0; d < ndisp; d++ )
+            cost[d] = (ushort)__builtin_popcount(lx ^ rx[d]);
+    }
+}
+
+STEREO_TARGET_POPCNT static void stereoHammingRowPopcnt(const uint64* l, const uint64* r, int width, int ndisp, ushort* cost)
+{
+    for( int x = 0; x < width; x++, cost += ndisp )
+    {
+        const uint64 lx = l[x];
+        const uint64* rx = r + width - 1 - x;
+        for( int d = 0; d < ndisp; d++ )
+            cost[d] = (ushort)__builtin_popcountll(lx ^ rx[d]);
+    }
+}
+#endif
+
+
+//census codes of img rows [y0, y1); when mirror is set, row y of dst is
+//code(y, clamp(width - 1 - minDisparity - k)) for k in [0, dstWidth) like StereoSimdBM's rightRev
+template<typename T> static void stereoCensusRows(const Mat& img, int w, int h, int y0, int y1,
+                                                  bool mirror, int minDisparity, T* dst, int dstWidth)
+{
+    const int width = img.cols, height = img.rows, rx = w/2, ry = h/2;
+    std::vector<T> codes(width);
+    std::vector<const uchar*> rows(h);
+    std::vector<int> xofs((size_t)width*w);
+    for( int x = 0; x < width; x++ )
+        for( int i = 0; i < w; i++ )
+            xofs[(size_t)x*w + i] = std::min(std::max(x + i - rx, 0), width - 1);
+
+    for( int y = y0; y < y1; y++ )
+    {
+        for( int j = 0; j < h; j++ )
+            rows[j] = img.ptr<uchar>(std::min(std::max(y + j - ry, 0), height - 1));
+        const uchar* c = rows[ry];
+        for( int x = 0; x < width; x++ )
+        {
+            const int* xo = &xofs[(size_t)x*w];
+            const int centre = c[x];
+            T code = 0;
+            for( int j = 0; j < h; j++ )
+            {
+                const uchar* row = rows[j];
+                for( int i = 0; i < w; i++ )
+                {
+                    if( j == ry && i == rx )
+                        continue;
+                    code = (T)((code << 1) | (row[xo[i]] < centre));
+                }
+            }
+            codes[x] = code;
+        }
+
+        T* out = dst + (size_t)(y - y0)*dstWidth;
+        if( !mirror )
+            memcpy(out, &codes[0], width*sizeof(T));
+        else
+            for( int k = 0; k < dstWidth; k++ )
+                out[k] = codes[std::min(std::max(width - 1 - minDisparity - k, 0), width - 1)];
+    }
+}
+
+
+class StereoCensusCost : public StereoBlockCost
+{
+public:
+    StereoCensusCost(int window_ = STEREO_CENSUS_9x7, int blockSize_ = 1)
+    : StereoBlockCost(blockSize_), window(window_)
+    {
+        CV_Assert( window == STEREO_CENSUS_5x5 || window == STEREO_CENSUS_7x7 || window == STEREO_CENSUS_9x7 );
+        CV_Assert( blockSize*blockSize*bits() <= USHRT_MAX );
+#if defined(STEREO_TARGET_POPCNT)
+        usePopcnt = useOptimized() && checkHardwareSupport(CV_CPU_POPCNT);
+#else
+        usePopcnt = false;
+#endif
+    }
+
+    //number of bits per code, i.e. the largest per-pixel cost
+    int bits() const
+    {
+        int w, h;
+        stereoCensusWindow(window, w, h);
+        return w*h - 1;
+    }
+
+    int getWindow() const { return window; }
+
+    //true when the Hamming distances run on the POPCNT instruction
+    bool usesPopcnt() const { return usePopcnt; }
+
+    void prepare(const Mat& left, const Mat& right, int minDisparity_, int numDisparities_)
+    {
+        CV_Assert( left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size() );
+        minDisparity = minDisparity_;
+        numDisparities = numDisparities_;
+        width = left.cols;
+        height = left.rows;
+        rightWidth = width + numDisparities - 1;
+        if( window == STEREO_CENSUS_5x5 )
+        {
+            left32.resize((size_t)width*height);
+            right32.resize((size_t)rightWidth*height);
+        }
+        else
+        {
+            left64.resize((size_t)width*height);
+            right64.resize((size_t)rightWidth*height);
+        }
+        parallel_for_(Range(0, height), TransformInvoker(*this, left, right), stereoNumThreads() > 1 ? -1. : 1.);
+    }
+
+    void defaultPenalties(int& P1, int& P2) const
+    {
+        P1 = std::max(bits()/6, 1)*blockSize*blockSize;
+        P2 = bits()*2*blockSize*blockSize;
+    }
+
+protected:
+    struct TransformInvoker : public ParallelLoopBody
+    {
+        TransformInvoker(StereoCensusCost& c_, const Mat& left_, const Mat& right_)
+        : c(&c_), left(left_), right(right_) {}
+
+        void operator()(const Range& range) const
+        {
+            int w, h;
+            stereoCensusWindow(c->window, w, h);
+            if( c->window == STEREO_CENSUS_5x5 )
+            {
+                stereoCensusRows(left, w, h, range.start, range.end, false, 0, &c->left32[(size_t)range.start*c->width], c->width);
+                stereoCensusRows(right, w, h, range.start, range.end, true, c->minDisparity,
+                                 &c->right32[(size_t)range.start*c->rightWidth], c->rightWidth);
+            }
+            else
+            {
+                stereoCensusRows(left, w, h, range.start, range.end, false, 0, &c->left64[(size_t)range.start*c->width], c->width);
+                stereoCensusRows(right, w, h, range.start, range.end, true, c->minDisparity,
+                                 &c->right64[(size_t)range.start*c->rightWidth], c->rightWidth);
+            }
+        }
+
+        StereoCensusCost* c;
+        Mat left, right;
+    };
+
+    void pixelCostRow(int y, ushort* cost) const
+    {
+        if( window == STEREO_CENSUS_5x5 )
+        {
+            const unsigned* l = &left32[(size_t)y*width];
+            const unsigned* r = &right32[(size_t)y*rightWidth];
+#if defined(STEREO_TARGET_POPCNT)
+            if( usePopcnt )
+                stereoHammingRowPopcnt(l, r, width, numDisparities, cost);
+            else
+#endif
+            stereoHammingRowScalar(l, r, width, numDisparities, cost);
+        }
+        else
+        {
+            const uint64* l = &left64[(size_t)y*width];
+            const uint64* r = &right64[(size_t)y*rightWidth];
+#if defined(STEREO_TARGET_POPCNT)
+            if( usePopcnt )
+                stereoHammingRowPopcnt(l, r, width, numDisparities, cost);
+            else
+#endif
+            stereoHammingRowScalar(l, r, width, numDisparities, cost);
+        }
+    }
+
+    int window;
+    int rightWidth;
+    bool usePopcnt;
+    std::vector<unsigned> left32, right32;
+    std::vector<uint64> left64, right64;
+};
+
+
+//winner-takes-all on census costs summed over blockSize x blockSize
+class StereoCensus : public StereoMatcher
+{
+public:
+    static Ptr<StereoCensus> create(int numDisparities = 64, int blockSize = 5, int window = STEREO_CENSUS_9x7)
+    {
+        Ptr<StereoCensus> census = makePtr<StereoCensus>();
+        census->setNumDisparities(numDisparities);
+        census->setBlockSize(blockSize);
+        census->setWindow(window);
+        return census;
+    }
+
+    StereoCensus()
+    {
+        minDisparity = 0;
+        numDisparities = 64;
+        blockSize = 5;
+        window = STEREO_CENSUS_9x7;
+        uniquenessRatio = 10;
+        disp12MaxDiff = 1;
+        speckleWindowSize = 0;
+        speckleRange = 0;
+        volumeMinDisparity = volumeNumDisparities = 0;
+    }
+
+    //streams the costs through small row bands; nothing of the cost volume is kept
+    void compute(InputArray leftarr, InputArray rightarr, OutputArray disparr)
+    {
+        Mat left, right;
+        stereoGrayInput(leftarr, rightarr, left, right);
+
+        disparr.create(left.size(), CV_16S);
+        Mat disp = disparr.getMat();
+        disp = Scalar::all((minDisparity - 1)*StereoMatcher::DISP_SCALE);
+
+        StereoCensusCost cost(window, blockSize);
+        cost.prepare(left, right, minDisparity, numDisparities);
+        int nstripes = std::max(1, std::min(stereoNumThreads()*4, disp.rows/8));
+        parallel_for_(Range(0, nstripes), SelectInvoker(*this, &cost, 0, disp, nstripes), nstripes);
+
+        if( speckleWindowSize > 0 )
+            filterSpeckles(disp, (minDisparity - 1)*StereoMatcher::DISP_SCALE, speckleWindowSize, speckleRange, slidingSumBuf);
+    }
+
+    //keeps the whole aggregated W x H x D cost volume so selectDisparity() can be rerun
+    //after changing only the uniqueness ratio, disp12MaxDiff or the speckle filter
+    void computeCostVolume(InputArray leftarr, InputArray rightarr)
+    {
+        Mat left, right;
+        stereoGrayInput(leftarr, rightarr, left, right);
+
+        StereoCensusCost cost(window, blockSize);
+        cost.prepare(left, right, minDisparity, numDisparities);
+        volumeSize = left.size();
+        volumeMinDisparity = minDisparity;
+        volumeNumDisparities = numDisparities;
+        size_t rowStep = (size_t)left.cols*numDisparities;
+        volume.resize(rowStep*left.rows);
+        int nstripes = std::max(1, std::min(stereoNumThreads()*4, left.rows/8));
+        parallel_for_(Range(0, nstripes), StereoCostInvoker(cost, &volume[0], rowStep, left.rows, nstripes), nstripes);
+    }
+
+    //selection and speckle filtering on the last computeCostVolume(), which must have used the same disparity range
+    void selectDisparity(OutputArray disparr)
+    {
+        CV_Assert( !volume.empty() && volumeMinDisparity == minDisparity && volumeNumDisparities == numDisparities );
+        disparr.create(volumeSize, CV_16S);
+        Mat disp = disparr.getMat();
+        disp = Scalar::all((minDisparity - 1)*StereoMatcher::DISP_SCALE);
+
+        int nstripes = std::max(1, std::min(stereoNumThreads()*4, disp.rows/8));
+        parallel_for_(Range(0, nstripes), SelectInvoker(*this, 0, &volume[0], disp, nstripes), nstripes);
+
+        if( speckleWindowSize > 0 )
+            filterSpeckles(disp, (minDisparity - 1)*StereoMatcher::DISP_SCALE, speckleWindowSize, speckleRange, slidingSumBuf);
+    }
+
+    int getMinDisparity() const { return minDisparity; }
+    void setMinDisparity(int minDisparity_) { minDisparity = minDisparity_; }
+
+    int getNumDisparities() const { return numDisparities; }
+    void setNumDisparities(int numDisparities_)
+    {
+        CV_Assert( numDisparities_ > 0 && numDisparities_ % 16 == 0 );
+        numDisparities = numDisparities_;
+    }
+
+    int getBlockSize() const { return blockSize; }
+    void setBlockSize(int blockSize_)
+    {
+        CV_Assert( blockSize_ % 2 == 1 && blockSize_ <= 31 );
+        blockSize = blockSize_;
+    }
+
+    int getSpeckleWindowSize() const { return speckleWindowSize; }
+    void setSpeckleWindowSize(int speckleWindowSize_) { speckleWindowSize = speckleWindowSize_; }
+
+    int getSpeckleRange() const { return speckleRange; }
+    void setSpeckleRange(int speckleRange_) { speckleRange = speckleRange_; }
+
+    int getDisp12MaxDiff() const { return disp12MaxDiff; }
+    void setDisp12MaxDiff(int disp12MaxDiff_) { disp12MaxDiff = disp12MaxDiff_; }
+
+    int getUniquenessRatio() const { return uniquenessRatio; }
+    void setUniquenessRatio(int uniquenessRatio_) { uniquenessRatio = uniquenessRatio_; }
+
+    int getWindow() const { return window; }
+    void setWindow(int window_)
+    {
+        CV_Assert( window_ == STEREO_CENSUS_5x5 || window_ == STEREO_CENSUS_7x7 || window_ == STEREO_CENSUS_9x7 );
+        window = window_;
+    }
+
+    String getDefaultName() const { return "StereoMatcher.Census"; }
+
+protected:
+    struct SelectInvoker : public ParallelLoopBody
+    {
+        //rows come from volume when it is given, otherwise they are computed band by band from cost
+        SelectInvoker(const StereoCensus& census_, const StereoCensusCost* cost_, const ushort* volume_, Mat& disp_, int nstripes_)
+        : census(census_), cost(cost_), volume(volume_), disp(&disp_), nstripes(nstripes_) {}
+
+        void operator()(const Range& range) const
+        {
+            const int width = disp->cols, height = disp->rows, D = census.numDisparities;
+            const int x0 = std::max(0, census.minDisparity + D - 1), x1 = width + std::min(0, census.minDisparity);
+            if( x0 >= x1 )
+                return;
+            const int y0 = (int)((int64)height*range.start/nstripes), y1 = (int)((int64)height*range.end/nstripes);
+            const size_t rowStep = (size_t)width*D;
+            std::vector<ushort> buf(volume ? 0 : rowStep*BAND_ROWS);
+            std::vector<int> scratch;
+            for( int y = y0; y < y1; y += BAND_ROWS )
+            {
+                int n = std::min((int)BAND_ROWS, y1 - y);
+                const ushort* rows = volume ? volume + y*rowStep : &buf[0];
+                if( !volume )
+                    cost->computeRows(y, y + n, &buf[0], rowStep);
+                for( int i = 0; i < n; i++ )
+                    stereoSelectDisparityRow(rows + i*rowStep, x0, x1, width, census.minDisparity, D,
+                                             census.uniquenessRatio, census.disp12MaxDiff, disp->ptr<short>(y + i), scratch);
+            }
+        }
+
+        enum { BAND_ROWS = 16 };
+
+        const StereoCensus& census;
+        const StereoCensusCost* cost;
+        const ushort* volume;
+        Mat* disp;
+        int nstripes;
+    };
+
+    int minDisparity;
+    int numDisparities;
+    int blockSize;
+    int window;
+    int uniquenessRatio;
+    int disp12MaxDiff;
+    int speckleWindowSize;
+    int speckleRange;
+    Mat slidingSumBuf;
+
+    //aggregated costs of the last computeCostVolume()
+    std::vector<ushort> volume;
+    Size volumeSize;
+    int volumeMinDisparity;
+    int volumeNumDisparities;
+};
+
+#endif /* Stereo_Census_hpp */
@@ -0,0 +1,194 @@
+//
+//  Stereo_Chessboard.hpp
+//  BMW_FM
+//
+//  Chessboard detection shared by the calibration tools: a low-resolution
+//  first findChessboardCorners search with sub-pixel refinement at full
+//  resolution, safe to run on many images at once, a thread-safe progress
+//  and ETA readout for long detection runs, and a background detector that
+//  keeps live capture at camera rate.
+//
+
+#ifndef Stereo_Chessboard_hpp
+#define Stereo_Chessboard_hpp
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_Trace.hpp"
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <stdio.h>
+
+using namespace cv;
+
+
+//looks for the board on gray shrunk to about maxSide pixels first, then at full size, and only then
+//upsampled up to maxScale; every attempt uses CALIB_CB_FAST_CHECK so frames without a board are
+//rejected cheaply. Corners found at low resolution are refined there, mapped back and refined
+//again at full resolution, so they are as accurate as a full-size detection. corners hold the
+//last attempt when the board is not found.
+static inline bool stereoFindChessboard(const Mat& gray, Size boardSize, std::vector<Point2f>& corners, int maxScale = 2,
+                                        int flags = CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_NORMALIZE_IMAGE, int maxSide = 1280)
+{
+    STEREO_TRACE_SCOPE("find chessboard");
+    TermCriteria criteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01);
+    flags |= CALIB_CB_FAST_CHECK;
+    bool found = false;
+    double shrink = maxSide > 0 ? (double)maxSide/std::max(gray.cols, gray.rows) : 1;
+    if( shrink < 0.75 )
+    {
+        Mat small;
+        resize(gray, small, Size(), shrink, shrink, INTER_AREA);
+        found = findChessboardCorners(small, boardSize, corners, flags);
+        if( found )
+        {
+            cornerSubPix(small, corners, Size(3,3), Size(-1,-1), criteria);
+            //pixel centres of the shrunk image sit at (x + 0.5)*sx - 0.5 in the full one
+            double sx = (double)gray.cols/small.cols, sy = (double)gray.rows/small.rows;
+            for( size_t i = 0; i < corners.size(); i++ )
+                corners[i] = Point2f((float)((corners[i].x + 0.5)*sx - 0.5), (float)((corners[i].y + 0.5)*sy - 0.5));
+        }
+    }
+    for( int scale = 1; scale <= maxScale && !found; scale++ )
+    {
+        Mat timg;
+        if( scale == 1 )
+            timg = gray;
+        else
+            resize(gray, timg, Size(), scale, scale);
+        found = findChessboardCorners(timg, boardSize, corners, flags);
+        if( found && scale > 1 )
+        {
+            Mat cornersMat(corners);
+            cornersMat *= 1./scale;
+        }
+    }
+    if( found )
+        cornerSubPix(gray, corners, Size(11,11), Size(-1,-1), criteria);
+    return found;
+}
+
+//"label: done/total, elapsed, ETA" on one line, updated as items finish on any thread
+class StereoProgress
+{
+public:
+    StereoProgress(const char* label_, int total_) : label(label_), total(total_), done(0), start(getTickCount()) {}
+
+    //one more item finished; the line ends once all of them have
+    void step()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done++;
+        double elapsed = (getTickCount() - start)/getTickFrequency();
+        double eta = elapsed/done*(total - done);
+        printf("\r%s: %d/%d, %.1fs elapsed, ETA %.1fs   ", label, done, total, elapsed, eta);
+        if( done == total )
+            printf("\n");
+        fflush(stdout);
+    }
+
+protected:
+    const char* label;
+    int total, done;
+    int64 start;
+    std::mutex mutex;
+};
+
+//runs a detection on its own thread against the newest frame handed to it. Frames submitted while
+//a detection runs replace each other, so acquisition and display keep the camera rate and the
+//results lag by about one detection.
+class StereoBackgroundDetector
+{
+public:
+    //detect(frame, corners) returns whether the pattern was found
+    typedef std::function<bool(const Mat&, std::vector<Point2f>&)> Detect;
+
+    explicit StereoBackgroundDetector(const Detect& detect_)
+    : detect(detect_), hasFrame(false), hasResult(false), stopping(false), resultFound(false)
+    {
+        worker = std::thread(&StereoBackgroundDetector::loop, this);
+    }
+
+    ~StereoBackgroundDetector()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    //frame is kept by reference: the caller must not write to it afterwards
+    void submit(const Mat& frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = frame;
+        hasFrame = true;
+        wake.notify_one();
+    }
+
+    //the result of a detection that finished since the last call, if any
+    bool poll(bool& found, std::vector<Point2f>& corners)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if( !hasResult )
+            return false;
+        hasResult = false;
+        found = resultFound;
+        corners.swap(resultCorners);
+        return true;
+    }
+
+protected:
+    void loop()
+    {
+        for(;;)
+        {
+            Mat frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]{ return stopping || hasFrame; });
+                if( stopping )
+                    return;
+                frame = pending;
+                pending.release();
+                hasFrame = false;
+            }
+            std::vector<Point2f> corners;
+            bool found = false;
+            try
+            {
+                found = detect(frame, corners);
+            }
+            catch(const cv::Exception& e)
+            {
+                fprintf(stderr, "detection failed: %s\n", e.what());
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            resultFound = found;
+            resultCorners.swap(corners);
+            hasResult = true;
+        }
+    }
+
+    Detect detect;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    Mat pending;
+    bool hasFrame, hasResult, stopping, resultFound;
+    std::vector<Point2f> resultCorners;
+
+private:
+    StereoBackgroundDetector(const StereoBackgroundDetector&);
+    StereoBackgroundDetector& operator=(const StereoBackgroundDetector&);
+};
+
+#endif /* Stereo_Chessboard_hpp */
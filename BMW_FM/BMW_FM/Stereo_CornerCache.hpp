@@ -0,0 +1,211 @@
+//
+//  Stereo_CornerCache.hpp
+//  BMW_FM
+//
+//  On-disk cache of calibration pattern detections, so rerunning a
+//  calibration with other solver flags skips straight to the solver. Every
+//  record is keyed by the image contents, the board size, the pattern type
+//  and a variant for anything else the detection depends on, and holds the
+//  refined corners (or that the board was not found) with the image size.
+//  The file is append-only: new views add records at the end, and a file
+//  cut short by a crash loses only its last record.
+//
+
+#ifndef Stereo_CornerCache_hpp
+#define Stereo_CornerCache_hpp
+
+#include "opencv2/core.hpp"
+
+#include "Stereo_Hash.hpp"
+#include "Stereo_MappedFile.hpp"
+#include "Stereo_Sequence.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+
+using namespace cv;
+
+
+static const char STEREO_CORNER_CACHE_MAGIC[8] = { 'S', 'T', 'C', 'O', 'R', 'N', '0', '1' };
+
+//contents of an image file, or of the frame a recording reference names; 0 if it cannot be read
+static inline uint64 stereoImageContentHash(const std::string& name)
+{
+    std::string filename;
+    int frame, side;
+    if( stereoParseSequenceRef(name, filename, frame, side) )
+    {
+        Mat img = stereoImread(name, IMREAD_UNCHANGED);
+        return img.empty() ? 0 : stereoHashMat(img);
+    }
+    StereoMappedFile file;
+    if( !file.open(name) )
+        return 0;
+    file.advise(0, file.size(), MADV_SEQUENTIAL);
+    return stereoHashBytes(file.data(), file.size());
+}
+
+struct StereoCornerRecord
+{
+    StereoCornerRecord() : found(false) {}
+    bool found;
+    Size imageSize;
+    std::vector<Point2f> corners;
+};
+
+class StereoCornerCache
+{
+public:
+    StereoCornerCache() : hitCount(0), missCount(0), rewrite(false) {}
+
+    //key of one detection; variant covers detector settings that change the corners, e.g. flipping
+    static uint64 key(uint64 contentHash, Size boardSize, int pattern, int variant = 0)
+    {
+        uint64 h = stereoHashString("stereoFindChessboard low-res-first v1");
+        h = stereoHashValue(contentHash, h);
+        h = stereoHashValue(boardSize.width, h);
+        h = stereoHashValue(boardSize.height, h);
+        h = stereoHashValue(pattern, h);
+        return stereoHashValue(variant, h);
+    }
+
+    //reads the records of filename if it exists; false only if it exists but is not a corner cache
+    bool open(const std::string& filename_)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        filename = filename_;
+        records.clear();
+        pending.clear();
+        rewrite = false;
+        StereoMappedFile file;
+        if( !file.open(filename) )
+        {
+            //written from scratch on the first flush()
+            rewrite = true;
+            return true;
+        }
+        const uchar* p = file.data();
+        size_t size = file.size(), pos = sizeof(STEREO_CORNER_CACHE_MAGIC);
+        if( size < pos || memcmp(p, STEREO_CORNER_CACHE_MAGIC, pos) != 0 )
+        {
+            filename.clear();
+            return false;
+        }
+        while( pos < size )
+        {
+            Header hdr;
+            if( size - pos < sizeof(hdr) )
+                break;
+            memcpy(&hdr, p + pos, sizeof(hdr));
+            size_t bytes = (size_t)std::max(hdr.count, 0)*sizeof(Point2f);
+            if( hdr.count < 0 || size - pos - sizeof(hdr) < bytes )
+                break;
+            StereoCornerRecord& r = records[hdr.key];
+            r.found = hdr.found != 0;
+            r.imageSize = Size(hdr.width, hdr.height);
+            r.corners.resize(hdr.count);
+            if( bytes )
+                memcpy(&r.corners[0], p + pos + sizeof(hdr), bytes);
+            pos += sizeof(hdr) + bytes;
+        }
+        //a torn last record is dropped by writing the file anew
+        rewrite = pos != size;
+        return true;
+    }
+
+    bool isOpened() const { return !filename.empty(); }
+
+    //thread-safe
+    bool lookup(uint64 k, StereoCornerRecord& r)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<uint64, StereoCornerRecord>::const_iterator it = records.find(k);
+        if( it == records.end() )
+        {
+            missCount++;
+            return false;
+        }
+        hitCount++;
+        r = it->second;
+        return true;
+    }
+
+    //thread-safe; kept in memory until flush()
+    void insert(uint64 k, const StereoCornerRecord& r)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if( records.insert(std::make_pair(k, r)).second )
+            pending.push_back(k);
+    }
+
+    //appends the records inserted since open() or the last flush(); a new or damaged file is
+    //written to a temporary file first so a concurrent reader never sees half a cache
+    bool flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if( filename.empty() || (pending.empty() && !rewrite) )
+            return true;
+        std::string tmpname = filename + ".tmp";
+        FILE* fp = fopen(rewrite ? tmpname.c_str() : filename.c_str(), rewrite ? "wb" : "ab");
+        if( !fp )
+            return false;
+        bool ok = true;
+        if( rewrite )
+        {
+            ok = fwrite(STEREO_CORNER_CACHE_MAGIC, sizeof(STEREO_CORNER_CACHE_MAGIC), 1, fp) == 1;
+            for( std::map<uint64, StereoCornerRecord>::const_iterator it = records.begin(); it != records.end() && ok; ++it )
+                ok = writeRecord(fp, it->first, it->second);
+        }
+        else
+        {
+            for( size_t i = 0; i < pending.size() && ok; i++ )
+                ok = writeRecord(fp, pending[i], records[pending[i]]);
+        }
+        ok = fclose(fp) == 0 && ok;
+        if( ok && rewrite )
+            ok = rename(tmpname.c_str(), filename.c_str()) == 0;
+        if( ok )
+        {
+            pending.clear();
+            rewrite = false;
+        }
+        return ok;
+    }
+
+    int hits() const { return hitCount; }
+    int misses() const { return missCount; }
+
+protected:
+    struct Header
+    {
+        uint64 key;
+        int found;
+        int width, height;
+        int count;
+    };
+
+    static bool writeRecord(FILE* fp, uint64 k, const StereoCornerRecord& r)
+    {
+        Header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.key = k;
+        hdr.found = r.found;
+        hdr.width = r.imageSize.width;
+        hdr.height = r.imageSize.height;
+        hdr.count = (int)r.corners.size();
+        return fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+            (r.corners.empty() || fwrite(&r.corners[0], sizeof(Point2f), r.corners.size(), fp) == r.corners.size());
+    }
+
+    std::string filename;
+    std::map<uint64, StereoCornerRecord> records;
+    std::vector<uint64> pending;
+    int hitCount, missCount;
+    bool rewrite;
+    std::mutex mutex;
+};
+
+#endif /* Stereo_CornerCache_hpp */
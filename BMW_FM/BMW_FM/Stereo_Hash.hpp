@@ -0,0 +1,56 @@
+//
+//  Stereo_Hash.hpp
+//  BMW_FM
+//
+//  64-bit FNV-1a hashing of raw bytes and matrices, used to key on-disk
+//  caches. Not cryptographic; it only has to notice that an input changed.
+//
+
+#ifndef Stereo_Hash_hpp
+#define Stereo_Hash_hpp
+
+#include "opencv2/core.hpp"
+
+#include <string>
+#include <stdio.h>
+
+static const uint64 STEREO_HASH_SEED = 14695981039346656037ULL;
+
+static inline uint64 stereoHashBytes(const void* data, size_t size, uint64 h = STEREO_HASH_SEED)
+{
+    const uchar* p = (const uchar*)data;
+    for( size_t i = 0; i < size; i++ )
+        h = (h ^ p[i])*1099511628211ULL;
+    return h;
+}
+
+template<typename T> static inline uint64 stereoHashValue(const T& v, uint64 h = STEREO_HASH_SEED)
+{
+    return stereoHashBytes(&v, sizeof(v), h);
+}
+
+static inline uint64 stereoHashString(const std::string& s, uint64 h = STEREO_HASH_SEED)
+{
+    return stereoHashBytes(s.data(), s.size(), stereoHashValue((uint64)s.size(), h));
+}
+
+//type, size and contents; two matrices with equal values hash equally however they are laid out in memory
+static inline uint64 stereoHashMat(const cv::Mat& m, uint64 h = STEREO_HASH_SEED)
+{
+    h = stereoHashValue(m.type(), h);
+    h = stereoHashValue(m.rows, h);
+    h = stereoHashValue(m.cols, h);
+    size_t rowSize = (size_t)m.cols*m.elemSize();
+    for( int y = 0; y < m.rows; y++ )
+        h = stereoHashBytes(m.ptr(y), rowSize, h);
+    return h;
+}
+
+static inline std::string stereoHashHex(uint64 h)
+{
+    char buf[17];
+    sprintf(buf, "%016llx", (unsigned long long)h);
+    return buf;
+}
+
+#endif /* Stereo_Hash_hpp */
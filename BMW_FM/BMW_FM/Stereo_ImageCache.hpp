@@ -0,0 +1,79 @@
+//
+//  Stereo_ImageCache.hpp
+//  BMW_FM
+//
+//  Memory-budgeted cache of decoded images by file name, so a tool that
+//  reads the same views twice (detection, then a preview) decodes them
+//  once. Least recently used images are evicted once the budget is
+//  exceeded; a miss simply means reading the file again. Thread-safe.
+//
+
+#ifndef Stereo_ImageCache_hpp
+#define Stereo_ImageCache_hpp
+
+#include "opencv2/core.hpp"
+
+#include <string>
+#include <list>
+#include <map>
+#include <mutex>
+
+using namespace cv;
+
+
+class StereoImageCache
+{
+public:
+    explicit StereoImageCache(size_t budget_ = (size_t)512 << 20) : budget(budget_), used(0) {}
+
+    //img is shared, not copied: callers must not write to it afterwards
+    void put(const std::string& name, const Mat& img)
+    {
+        size_t bytes = img.total()*img.elemSize();
+        std::lock_guard<std::mutex> lock(mutex);
+        erase(name);
+        if( img.empty() || bytes > budget )
+            return;
+        entries.push_front(Entry(name, img));
+        index[name] = entries.begin();
+        used += bytes;
+        while( used > budget )
+            erase(entries.back().first);
+    }
+
+    //true and the image if it is cached; it becomes the most recently used
+    bool get(const std::string& name, Mat& img)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::string, std::list<Entry>::iterator>::iterator it = index.find(name);
+        if( it == index.end() )
+            return false;
+        entries.splice(entries.begin(), entries, it->second);
+        img = it->second->second;
+        return true;
+    }
+
+    size_t size() const { return used; }
+    size_t getBudget() const { return budget; }
+
+protected:
+    typedef std::pair<std::string, Mat> Entry;
+
+    //the mutex is held
+    void erase(const std::string& name)
+    {
+        std::map<std::string, std::list<Entry>::iterator>::iterator it = index.find(name);
+        if( it == index.end() )
+            return;
+        used -= it->second->second.total()*it->second->second.elemSize();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    size_t budget, used;
+    std::list<Entry> entries;       //most recently used first
+    std::map<std::string, std::list<Entry>::iterator> index;
+    std::mutex mutex;
+};
+
+#endif /* Stereo_ImageCache_hpp */
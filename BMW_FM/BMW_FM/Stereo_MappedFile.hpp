@@ -0,0 +1,79 @@
+//
+//  Stereo_MappedFile.hpp
+//  BMW_FM
+//
+//  Read-only memory mapping of a whole file. Pages are mapped copy-on-write,
+//  so Mat headers pointing into the mapping can be handed to OpenCV
+//  functions that take non-const data without touching the file.
+//
+
+#ifndef Stereo_MappedFile_hpp
+#define Stereo_MappedFile_hpp
+
+#include "opencv2/core.hpp"
+
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class StereoMappedFile
+{
+public:
+    StereoMappedFile() : addr(0), length(0) {}
+    ~StereoMappedFile() { close(); }
+
+    bool open(const std::string& filename)
+    {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if( fd < 0 )
+            return false;
+        struct stat st;
+        if( fstat(fd, &st) == 0 && st.st_size > 0 )
+        {
+            void* p = mmap(0, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if( p != MAP_FAILED )
+            {
+                addr = (uchar*)p;
+                length = (size_t)st.st_size;
+            }
+        }
+        ::close(fd);
+        return addr != 0;
+    }
+
+    void close()
+    {
+        if( addr )
+            munmap(addr, length);
+        addr = 0;
+        length = 0;
+    }
+
+    //MADV_* hint for the byte range [ofs, ofs + size)
+    void advise(size_t ofs, size_t size, int advice) const
+    {
+        if( !addr || ofs >= length )
+            return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = ofs/page*page;
+        madvise(addr + start, std::min(ofs + size, length) - start, advice);
+    }
+
+    bool isOpened() const { return addr != 0; }
+    uchar* data() const { return addr; }
+    size_t size() const { return length; }
+
+protected:
+    uchar* addr;
+    size_t length;
+
+private:
+    StereoMappedFile(const StereoMappedFile&);
+    StereoMappedFile& operator=(const StereoMappedFile&);
+};
+
+#endif /* Stereo_MappedFile_hpp */
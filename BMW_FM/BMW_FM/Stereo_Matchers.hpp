@@ -0,0 +1,463 @@
+//
+//  Stereo_Matchers.hpp
+//  BMW_FM
+//
+//  The stereo algorithms Disp_Map offers and the parameters they share:
+//  DispParams holds the user-facing settings and DispMatchers one instance
+//  of every matcher configured from them, so the matching tool, the
+//  benchmark and the tuner run exactly the same setup. Tuned settings are
+//  saved as a FileStorage config that Disp_Map loads with --config.
+//
+
+#ifndef Stereo_Matchers_hpp
+#define Stereo_Matchers_hpp
+
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "Stereo_SimdBM.hpp"
+#include "Stereo_SGM.hpp"
+#include "Stereo_Census.hpp"
+#include "Stereo_Pyramid.hpp"
+#include "Stereo_Tiling.hpp"
+#include "Stereo_Refine.hpp"
+#include "Stereo_Trace.hpp"
+
+#include <vector>
+#include <string>
+
+using namespace cv;
+
+
+enum { STEREO_BM=0, STEREO_SGBM=1, STEREO_HH=2, STEREO_VAR=3, STEREO_3WAY=4, STEREO_SIMDBM=5, STEREO_SGM=6, STEREO_SGM_STRIP=7, STEREO_CENSUS=8 };
+
+
+//disparity map parameters, the interactive mode binds its tracking bars to these
+struct DispParams
+{
+    DispParams()
+    {
+        BlockSize = 5;
+        number_of_disparities = 80;
+        pre_filter_size = 5;
+        pre_filter_cap = 23;
+        min_disparity = 1;
+        texture_threshold = 500;
+        uniqueness_ratio = 0;
+        max_diff = 100;
+        speckle_window_size = -10;
+        erosion_size = 0;
+        dilation_size = 0;
+        pyramid_levels = 0;
+        pyramid_radius = 2;
+        refine = -1;
+    }
+    
+    int BlockSize;
+    int number_of_disparities;
+    int pre_filter_size;
+    int pre_filter_cap;
+    int min_disparity;
+    int texture_threshold;
+    int uniqueness_ratio;
+    int max_diff;
+    int speckle_window_size;
+    int erosion_size;
+    int dilation_size;
+    int pyramid_levels;     //coarse-to-fine search, 0: off
+    int pyramid_radius;
+    int refine;             //STEREO_SUBPIXEL_* of the float refinement (Stereo_Refine.hpp), -1: off
+    StereoRefineOptions refine_options;
+};
+
+static const char* const DISP_ALGORITHM_NAMES[] = { "bm", "sgbm", "hh", "var", "sgbm3way", "simdbm", "sgm", "sgmstrip", "census" };
+
+//--algorithm= name of alg and back; -1 for an unknown name
+static inline const char* dispAlgorithmName(int alg)
+{
+    return alg >= 0 && alg <= STEREO_CENSUS ? DISP_ALGORITHM_NAMES[alg] : "";
+}
+
+static inline int dispAlgorithmFromName(const std::string& name)
+{
+    for( int alg = 0; alg <= STEREO_CENSUS; alg++ )
+        if( name == DISP_ALGORITHM_NAMES[alg] )
+            return alg;
+    return -1;
+}
+
+//the matching settings of p into the open map of fs; the display-only morphology and the
+//pyramid, which has its own options, are left out
+static inline void dispWriteParams(FileStorage& fs, int alg, const DispParams& p)
+{
+    fs << "algorithm" << dispAlgorithmName(alg);
+    fs << "BlockSize" << p.BlockSize;
+    fs << "number_of_disparities" << p.number_of_disparities;
+    fs << "pre_filter_size" << p.pre_filter_size;
+    fs << "pre_filter_cap" << p.pre_filter_cap;
+    fs << "min_disparity" << p.min_disparity;
+    fs << "texture_threshold" << p.texture_threshold;
+    fs << "uniqueness_ratio" << p.uniqueness_ratio;
+    fs << "max_diff" << p.max_diff;
+    fs << "speckle_window_size" << p.speckle_window_size;
+}
+
+//reads what dispWriteParams wrote; settings missing from node keep their value in p
+static inline bool dispReadParams(const FileNode& node, int& alg, DispParams& p)
+{
+    if( !node.isMap() )
+        return false;
+    std::string name;
+    node["algorithm"] >> name;
+    alg = dispAlgorithmFromName(name);
+    if( alg < 0 )
+        return false;
+    const char* keys[] = { "BlockSize", "number_of_disparities", "pre_filter_size", "pre_filter_cap", "min_disparity",
+        "texture_threshold", "uniqueness_ratio", "max_diff", "speckle_window_size" };
+    int* values[] = { &p.BlockSize, &p.number_of_disparities, &p.pre_filter_size, &p.pre_filter_cap, &p.min_disparity,
+        &p.texture_threshold, &p.uniqueness_ratio, &p.max_diff, &p.speckle_window_size };
+    for( int i = 0; i < (int)(sizeof(keys)/sizeof(keys[0])); i++ )
+        if( !node[keys[i]].empty() )
+            node[keys[i]] >> *values[i];
+    return true;
+}
+
+//one setting of a Stereo_Tune config: its "front" lists the Pareto-optimal settings, most accurate
+//first. Picks the most accurate one measured at no more than max_ms per frame (any when max_ms <= 0);
+//the times are of one frame matched alone with the config's "threads".
+static inline bool dispLoadConfig(const std::string& filename, double max_ms, int& alg, DispParams& p)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    if( !fs.isOpened() )
+        return false;
+    FileNode front = fs["front"];
+    if( !front.isSeq() )
+        return false;
+    for( FileNodeIterator it = front.begin(); it != front.end(); ++it )
+    {
+        FileNode entry = *it;
+        double ms = 0;
+        entry["ms"] >> ms;
+        if( max_ms <= 0 || ms <= max_ms )
+            return dispReadParams(entry, alg, p);
+    }
+    return false;
+}
+
+
+//one instance of every matcher, all set up from the same DispParams
+struct DispMatchers
+{
+    DispMatchers(bool census_cost, int census_window) : censusCost(census_cost), censusWindow(census_window), tileOverlap(-1)
+    {
+        bm = StereoBM::create();
+        sgbm = StereoSGBM::create(0,16,3);
+        simdbm = StereoSimdBM::create();
+        sgm = StereoSGM::create();
+        census = StereoCensus::create();
+        
+        census->setWindow(census_window);
+        if( census_cost )
+            sgm->setCost(makePtr<StereoCensusCost>(census_window, 1));
+    }
+    
+    void configure(const DispParams& p, int alg, Rect roi1, Rect roi2)
+    {
+        int i1, p1;
+        i1 = p.BlockSize;
+        if(i1%2==0 && i1>=7)
+        {
+            p1 = i1-1;
+            bm->setBlockSize(p1);
+            sgbm->setBlockSize(p1);
+            simdbm->setBlockSize(p1);
+            sgm->setBlockSize(std::min(p1, 11));
+            census->setBlockSize(std::min(p1, 31));
+        }
+        
+        if(i1%2!=0 && i1>=7)
+        {
+            p1 = i1;
+            bm->setBlockSize(p1);
+            sgbm->setBlockSize(p1);
+            simdbm->setBlockSize(p1);
+            sgm->setBlockSize(std::min(p1, 11));
+            census->setBlockSize(std::min(p1, 31));
+        }
+        
+        int i2, p2;
+        i2 = p.number_of_disparities;
+        if(i2%16!=0 && i2>16)
+        {
+            p2 = i2 - i2%16;
+            bm->setNumDisparities(p2);
+            sgbm->setNumDisparities(p2);
+            simdbm->setNumDisparities(p2);
+            sgm->setNumDisparities(p2);
+            census->setNumDisparities(p2);
+        }
+        if(i2%16==0 && i2>16)
+        {
+            p2 = i2;
+            bm->setNumDisparities(p2);
+            sgbm->setNumDisparities(p2);
+            simdbm->setNumDisparities(p2);
+            sgm->setNumDisparities(p2);
+            census->setNumDisparities(p2);
+        }
+        if(i2<=16)
+        {
+            p2 = 16;
+            bm->setNumDisparities(p2);
+            sgbm->setNumDisparities(p2);
+            simdbm->setNumDisparities(p2);
+            sgm->setNumDisparities(p2);
+            census->setNumDisparities(p2);
+        }
+        
+        int i3, p3;
+        i3 = p.pre_filter_cap;
+        if(i3%2==0 && i3>=7)
+        {
+            p3 = i3-1;
+            bm->setPreFilterCap(p3);
+            sgbm->setPreFilterCap(p3);
+            simdbm->setPreFilterCap(p3);
+            sgm->setPreFilterCap(p3);
+        }
+        if(i3<7)
+        {
+            p3 = 7;
+            bm->setPreFilterCap(p3);
+            sgbm->setPreFilterCap(p3);
+            simdbm->setPreFilterCap(p3);
+            sgm->setPreFilterCap(p3);
+            
+        }
+        if(i3%2!=0 && i3>=7)
+        {
+            p3 =	i3;
+            bm->setPreFilterCap(p3);
+            sgbm->setPreFilterCap(p3);
+            simdbm->setPreFilterCap(p3);
+            sgm->setPreFilterCap(p3);
+        }
+        
+        int i4;
+        i4 = p.speckle_window_size;
+        bm->setSpeckleWindowSize(i4);
+        sgbm->setSpeckleWindowSize(i4);
+        simdbm->setSpeckleWindowSize(i4);
+        sgm->setSpeckleWindowSize(i4);
+        census->setSpeckleWindowSize(i4);
+        
+        int i5, p5;
+        i5 = p.min_disparity;
+        p5 = -i5;
+        bm->setMinDisparity(p5);
+        sgbm->setMinDisparity(p5);
+        simdbm->setMinDisparity(p5);
+        sgm->setMinDisparity(p5);
+        census->setMinDisparity(p5);
+        
+        int i6, p6;
+        i6 = p.texture_threshold;
+        p6 = i6;
+        bm->setTextureThreshold(p6);
+        simdbm->setTextureThreshold(p6);
+        
+        int i7, p7;
+        i7 = p.uniqueness_ratio;
+        p7 = i7;
+        bm->setUniquenessRatio(p7);
+        sgbm->setUniquenessRatio(p7);
+        simdbm->setUniquenessRatio(p7);
+        sgm->setUniquenessRatio(p7);
+        census->setUniquenessRatio(p7);
+        
+        int i8;
+        float p8;
+        i8 = p.max_diff;
+        p8 = 0.01*((float)i8);
+        bm->setDisp12MaxDiff(p8);
+        sgbm->setDisp12MaxDiff(p8);
+        simdbm->setDisp12MaxDiff(p8);
+        sgm->setDisp12MaxDiff(p8);
+        census->setDisp12MaxDiff(p8);
+        
+        
+        bm->setROI1(roi1);
+        bm->setROI2(roi2);
+        bm->setSpeckleRange(32);
+        simdbm->setSpeckleRange(32);
+        sgm->setSpeckleRange(32);
+        census->setSpeckleRange(32);
+        
+        //int cn = img1.channels();
+        
+        
+        if(alg==STEREO_HH)
+            sgbm->setMode(StereoSGBM::MODE_HH);
+        else if(alg==STEREO_SGBM)
+            sgbm->setMode(StereoSGBM::MODE_SGBM);
+        else if(alg==STEREO_3WAY)
+            sgbm->setMode(StereoSGBM::MODE_SGBM_3WAY);
+        else if(alg==STEREO_SGM)
+            sgm->setMode(StereoSGM::MODE_FULL);
+        else if(alg==STEREO_SGM_STRIP)
+            sgm->setMode(StereoSGM::MODE_STRIP);
+        
+        pyramid.setLevels(p.pyramid_levels);
+        pyramid.setRadius(p.pyramid_radius);
+        pyramid.setTextureThreshold(p.texture_threshold);
+        pyramid.setUniquenessRatio(p.uniqueness_ratio);
+        pyramid.setPreFilterCap(simdbm->getPreFilterCap());
+        
+        refineOptions = p.refine_options;
+        if( p.refine >= 0 )
+            refineOptions.subpixel = p.refine;
+        
+        tileRoi1 = roi1;
+        tileRoi2 = roi2;
+        for( size_t w = 0; w < tileWorkers.size(); w++ )
+            tileWorkers[w]->configure(p, alg, roi1, roi2);
+    }
+    
+    //splits every frame into tiles matched concurrently by nthreads workers with their own matchers
+    //(see Stereo_Tiling.hpp); overlap < 0 picks the context the algorithm needs. Before configure().
+    void enableTiles(int nthreads, Size tile_size, int overlap)
+    {
+        tiles = makePtr<StereoTiledExecutor>(nthreads, tile_size);
+        tileOverlap = overlap;
+        tileWorkers.clear();
+        for( int w = 0; w < tiles->size(); w++ )
+            tileWorkers.push_back(makePtr<DispMatchers>(censusCost, censusWindow));
+    }
+    
+    Ptr<StereoMatcher> matcher(int alg) const
+    {
+        if( alg == STEREO_BM )
+            return bm;
+        if( alg == STEREO_SGBM || alg == STEREO_HH || alg == STEREO_3WAY )
+            return sgbm;
+        if( alg == STEREO_SIMDBM )
+            return simdbm;
+        if( alg == STEREO_SGM || alg == STEREO_SGM_STRIP )
+            return sgm;
+        if( alg == STEREO_CENSUS )
+            return census;
+        return Ptr<StereoMatcher>();
+    }
+    
+    void compute(int alg, const Mat& img1, const Mat& img2, Mat& dispcal)
+    {
+        STEREO_TRACE_SCOPE("compute");
+        computeFrame(alg, img1, img2, dispcal);
+    }
+    
+    //compute() without its trace span, for the tiles that have their own
+    void computeFrame(int alg, const Mat& img1, const Mat& img2, Mat& dispcal)
+    {
+        if( tiles && alg != STEREO_VAR )
+            computeTiles(alg, img1, img2, dispcal);
+        else if( pyramid.getLevels() > 0 && alg != STEREO_VAR )
+            pyramid.compute(matcher(alg), img1, img2, dispcal);
+        else if( alg == STEREO_BM ){
+            
+            bm->compute(img1, img2, dispcal);
+        }
+        else if( alg == STEREO_SGBM || alg == STEREO_HH || alg == STEREO_3WAY )
+            sgbm->compute(img1, img2, dispcal);
+        else if( alg == STEREO_SIMDBM )
+            simdbm->compute(img1, img2, dispcal);
+        else if( alg == STEREO_SGM || alg == STEREO_SGM_STRIP )
+            sgm->compute(img1, img2, dispcal);
+        else if( alg == STEREO_CENSUS )
+            census->compute(img1, img2, dispcal);
+    }
+    
+    //the in-tree matchers that can keep their costs and redo only the disparity selection
+    bool hasCostVolume(int alg) const
+    {
+        return !tiles && pyramid.getLevels() == 0 && (alg == STEREO_SGM || alg == STEREO_CENSUS);
+    }
+    
+    //context beyond the block a crop needs to match like the full frame: the x-sobel pre-filter,
+    //the census window, and for the path-based matchers a stretch of their paths
+    int contextMargin(int alg) const
+    {
+        int margin = alg == STEREO_CENSUS ? 5 : alg == STEREO_BM || alg == STEREO_SIMDBM ? 1 : 64;
+        return margin << pyramid.getLevels();
+    }
+    
+    void computeTiles(int alg, const Mat& img1, const Mat& img2, Mat& dispcal)
+    {
+        Ptr<StereoMatcher> m = matcher(alg);
+        int overlap = tileOverlap;
+        if( overlap < 0 )
+        {
+            //2-D tiles also keep the pixels the left-right check looks at
+            overlap = contextMargin(alg);
+            if( tiles->getTileSize().width > 0 && m->getDisp12MaxDiff() >= 0 )
+                overlap = std::max(overlap, m->getNumDisparities() << pyramid.getLevels());
+        }
+        tiles->compute(img1, img2, dispcal, m->getMinDisparity(), m->getNumDisparities(), m->getBlockSize(), overlap,
+                       [&](int w, const StereoTile& tile, const Mat& l, const Mat& r, Mat& d)
+        {
+            STEREO_TRACE_SCOPE("compute tile");
+            DispMatchers& wk = *tileWorkers[w];
+            if( alg == STEREO_BM )
+            {
+                //the valid areas of the rectified views, relative to the crop
+                Rect roi1 = tileRoi1 & tile.in, roi2 = tileRoi2 & tile.in;
+                wk.bm->setROI1(tileRoi1.area() > 0 ? Rect(roi1.tl() - tile.in.tl(), roi1.size()) : Rect());
+                wk.bm->setROI2(tileRoi2.area() > 0 ? Rect(roi2.tl() - tile.in.tl(), roi2.size()) : Rect());
+            }
+            wk.computeFrame(alg, l, r, d);
+        });
+    }
+    
+    void computeCostVolume(int alg, const Mat& img1, const Mat& img2)
+    {
+        STEREO_TRACE_SCOPE("cost volume");
+        if( alg == STEREO_SGM )
+            sgm->computeCostVolume(img1, img2);
+        else if( alg == STEREO_CENSUS )
+            census->computeCostVolume(img1, img2);
+    }
+    
+    void selectDisparity(int alg, Mat& dispcal)
+    {
+        STEREO_TRACE_SCOPE("select disparity");
+        if( alg == STEREO_SGM )
+            sgm->selectDisparity(dispcal);
+        else if( alg == STEREO_CENSUS )
+            census->selectDisparity(dispcal);
+    }
+    
+    //the CV_16S map of compute() or selectDisparity() as CV_32F pixels with a confidence per pixel, for the
+    //images it was matched on; the refinement of configure()'s DispParams. Not for STEREO_VAR.
+    void refine(int alg, const Mat& img1, const Mat& img2, const Mat& dispcal, Mat& disp, Mat& confidence) const
+    {
+        STEREO_TRACE_SCOPE("refine");
+        Ptr<StereoMatcher> m = matcher(alg);
+        CV_Assert( m );
+        stereoRefineDisparity(img1, img2, dispcal, m->getMinDisparity(), m->getNumDisparities(), refineOptions, disp, confidence);
+    }
+    
+    Ptr<StereoBM> bm;
+    Ptr<StereoSGBM> sgbm;
+    Ptr<StereoSimdBM> simdbm;
+    Ptr<StereoSGM> sgm;
+    Ptr<StereoCensus> census;
+    StereoPyramid pyramid;
+    
+    bool censusCost;
+    int censusWindow;
+    Ptr<StereoTiledExecutor> tiles;
+    std::vector<Ptr<DispMatchers> > tileWorkers;
+    int tileOverlap;
+    Rect tileRoi1, tileRoi2;
+    StereoRefineOptions refineOptions;
+};
+
+#endif /* Stereo_Matchers_hpp */
@@ -0,0 +1,219 @@
+//
+//  Stereo_Metrics.hpp
+//  BMW_FM
+//
+//  Measurements for benchmarks and long runs: the peak resident set size
+//  of the process (resettable on Linux, so every measured section gets its
+//  own peak), ground-truth disparity loading (PFM, KITTI-style 16-bit PNG,
+//  8-bit gray with a scale) and the usual accuracy figures: the share of
+//  bad pixels beyond a threshold and the mean end-point error, or where
+//  there is no ground truth, the share of left-right inconsistent pixels.
+//
+
+#ifndef Stereo_Metrics_hpp
+#define Stereo_Metrics_hpp
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/calib3d.hpp"
+
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <sys/resource.h>
+
+using namespace cv;
+
+
+//peak resident set size of the process, since the last stereoResetPeakRSS() where that is supported
+static inline size_t stereoPeakRSS()
+{
+#if defined(__linux__)
+    //VmHWM follows resets, ru_maxrss does not
+    FILE* f = fopen("/proc/self/status", "r");
+    if( f )
+    {
+        char line[256];
+        size_t kb = 0;
+        while( fgets(line, sizeof(line), f) )
+            if( sscanf(line, "VmHWM: %zu kB", &kb) == 1 )
+                break;
+        fclose(f);
+        if( kb )
+            return kb*1024;
+    }
+#endif
+    struct rusage ru;
+    if( getrusage(RUSAGE_SELF, &ru) != 0 )
+        return 0;
+#if defined(__APPLE__)
+    return (size_t)ru.ru_maxrss;
+#else
+    return (size_t)ru.ru_maxrss*1024;
+#endif
+}
+
+//starts a new peak at the current resident size; false where the system keeps one peak per process
+static inline bool stereoResetPeakRSS()
+{
+#if defined(__linux__)
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if( !f )
+        return false;
+    bool ok = fputs("5", f) >= 0;
+    return fclose(f) == 0 && ok;
+#else
+    return false;
+#endif
+}
+
+//reads a ground-truth disparity map as CV_32F pixels, 0 where it is unknown. PFM files hold
+//pixels (infinity unknown); 16-bit PNGs are KITTI style, pixels x scale (default 256, 0 unknown);
+//8-bit gray images are pixels x scale (default 1, 0 unknown). scale <= 0 picks the default.
+static inline bool stereoReadGroundTruth(const std::string& filename, Mat& gt, double scale = 0)
+{
+    size_t dot = filename.rfind('.');
+    std::string ext = dot == std::string::npos ? std::string() : filename.substr(dot);
+    if( ext == ".pfm" || ext == ".PFM" )
+    {
+        FILE* f = fopen(filename.c_str(), "rb");
+        if( !f )
+            return false;
+        char type[3] = {0};
+        int w = 0, h = 0;
+        double endian = 0;
+        bool ok = fscanf(f, "%2s %d %d %lf", type, &w, &h, &endian) == 4 && strcmp(type, "Pf") == 0 && w > 0 && h > 0 &&
+            fgetc(f) != EOF;
+        if( ok )
+        {
+            //rows bottom to top; a negative scale means little-endian floats
+            gt.create(h, w, CV_32F);
+            for( int y = h - 1; y >= 0 && ok; y-- )
+                ok = fread(gt.ptr<float>(y), sizeof(float), w, f) == (size_t)w;
+            uint32_t probe = 1;
+            bool little = *(uchar*)&probe == 1;
+            if( ok && (endian < 0) != little )
+                for( int y = 0; y < h; y++ )
+                {
+                    uchar* p = gt.ptr(y);
+                    for( int x = 0; x < w*4; x += 4 )
+                    {
+                        std::swap(p[x], p[x + 3]);
+                        std::swap(p[x + 1], p[x + 2]);
+                    }
+                }
+        }
+        fclose(f);
+        if( !ok )
+            return false;
+        for( int y = 0; y < h; y++ )
+        {
+            float* p = gt.ptr<float>(y);
+            for( int x = 0; x < w; x++ )
+                if( !(p[x] > 0 && p[x] < FLT_MAX) )
+                    p[x] = 0;
+        }
+        return true;
+    }
+
+    Mat raw = imread(filename, IMREAD_UNCHANGED);
+    if( raw.empty() || raw.channels() != 1 || (raw.depth() != CV_8U && raw.depth() != CV_16U) )
+        return false;
+    if( scale <= 0 )
+        scale = raw.depth() == CV_16U ? 256 : 1;
+    raw.convertTo(gt, CV_32F, 1./scale);
+    return true;
+}
+
+struct StereoAccuracy
+{
+    StereoAccuracy() : bad(0), epe(0), density(0), pixels(0) {}
+    double bad;         //share of the known pixels off by more than the threshold or without an estimate
+    double epe;         //mean absolute error in pixels over the known pixels that have an estimate
+    double density;     //share of the known pixels that have an estimate
+    int pixels;         //known pixels
+};
+
+//disp is a CV_16S map (x16) of a matcher searching from minDisparity; gt as from stereoReadGroundTruth,
+//resized to disp (and its disparities scaled with it) when the sizes differ
+static inline StereoAccuracy stereoEvaluateDisparity(const Mat& disp, int minDisparity, const Mat& gt0, double badThreshold)
+{
+    CV_Assert( disp.type() == CV_16S && gt0.type() == CV_32F );
+    Mat gt = gt0;
+    if( gt.size() != disp.size() )
+    {
+        Mat resized;
+        resize(gt0, resized, disp.size(), 0, 0, INTER_NEAREST);
+        resized.convertTo(gt, CV_32F, (double)disp.cols/gt0.cols);
+    }
+    StereoAccuracy a;
+    int64 bad = 0, estimated = 0;
+    double err = 0;
+    int invalid = minDisparity*StereoMatcher::DISP_SCALE;
+    for( int y = 0; y < disp.rows; y++ )
+    {
+        const short* d = disp.ptr<short>(y);
+        const float* g = gt.ptr<float>(y);
+        for( int x = 0; x < disp.cols; x++ )
+        {
+            if( g[x] <= 0 )
+                continue;
+            a.pixels++;
+            if( d[x] < invalid )
+            {
+                bad++;
+                continue;
+            }
+            double e = fabs(d[x]*(1./StereoMatcher::DISP_SCALE) - g[x]);
+            estimated++;
+            err += e;
+            bad += e > badThreshold;
+        }
+    }
+    if( a.pixels > 0 )
+    {
+        a.bad = (double)bad/a.pixels;
+        a.density = (double)estimated/a.pixels;
+    }
+    a.epe = estimated > 0 ? err/estimated : 0;
+    return a;
+}
+
+//the disparities of the right view from a matcher that only produces left-view ones: matching the
+//mirrored right image against the mirrored left image gives the right view's disparities mirrored
+static inline void stereoRightDisparity(const Ptr<StereoMatcher>& matcher, const Mat& left, const Mat& right, Mat& dispRight)
+{
+    Mat l, r, d;
+    flip(right, l, 1);
+    flip(left, r, 1);
+    matcher->compute(l, r, d);
+    flip(d, dispRight, 1);
+}
+
+//accuracy without ground truth: the share of pixels whose left-view disparity is missing or does not
+//point to a right-view disparity within maxDiff pixels of it. Both maps CV_16S (x16).
+static inline double stereoLeftRightError(const Mat& dispLeft, const Mat& dispRight, int minDisparity, double maxDiff)
+{
+    CV_Assert( dispLeft.type() == CV_16S && dispRight.type() == CV_16S && dispLeft.size() == dispRight.size() );
+    int invalid = minDisparity*StereoMatcher::DISP_SCALE;
+    int tolerance = cvRound(maxDiff*StereoMatcher::DISP_SCALE);
+    int64 bad = 0;
+    for( int y = 0; y < dispLeft.rows; y++ )
+    {
+        const short* dl = dispLeft.ptr<short>(y);
+        const short* dr = dispRight.ptr<short>(y);
+        for( int x = 0; x < dispLeft.cols; x++ )
+        {
+            int d = dl[x];
+            //round to the nearest right-view pixel
+            int xr = x - ((d + StereoMatcher::DISP_SCALE/2) >> StereoMatcher::DISP_SHIFT);
+            bad += d < invalid || xr < 0 || xr >= dispLeft.cols || dr[xr] < invalid || std::abs(dr[xr] - d) > tolerance;
+        }
+    }
+    return dispLeft.empty() ? 0 : (double)bad/dispLeft.total();
+}
+
+#endif /* Stereo_Metrics_hpp */
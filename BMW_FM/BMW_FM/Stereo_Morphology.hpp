@@ -0,0 +1,298 @@
+//
+//  Stereo_Morphology.hpp
+//  BMW_FM
+//
+//  The display post-processing of Disp_Map in one pass: scaling to 8 bits,
+//  erosion and dilation with elliptical elements, run band by band of rows
+//  so the intermediates of a band stay in cache and bands run in parallel.
+//
+//  Ellipses up to 7x7 are applied point by point with OpenCV's own kernel.
+//  Larger ones are approximated by an octagon, the Minkowski sum of a
+//  horizontal, a vertical and two diagonal lines, and every line is a
+//  van Herk/Gil-Werman min/max filter: three comparisons per pixel whatever
+//  its length, so the cost stays flat up to the 51x51 of the trackbars.
+//  Borders behave as in cv::erode/cv::dilate (outside pixels are ignored).
+//
+
+#ifndef Stereo_Morphology_hpp
+#define Stereo_Morphology_hpp
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+using namespace cv;
+
+
+//radius up to which the ellipse is applied exactly
+enum { STEREO_MORPH_EXACT_RADIUS = 3 };
+
+struct StereoErodeOp
+{
+    static uchar identity() { return 255; }
+    uchar operator()(uchar a, uchar b) const { return std::min(a, b); }
+};
+
+struct StereoDilateOp
+{
+    static uchar identity() { return 0; }
+    uchar operator()(uchar a, uchar b) const { return std::max(a, b); }
+};
+
+//a band of rows with pad columns on both sides; everything outside the image holds the identity
+//of the next operation, so the band can be filtered as a whole
+struct StereoMorphBand
+{
+    void create(int rows_, int cols_)
+    {
+        rows = rows_;
+        cols = cols_;
+        data.resize((size_t)rows*cols);
+    }
+    uchar* row(int y) { return &data[(size_t)y*cols]; }
+    const uchar* row(int y) const { return &data[(size_t)y*cols]; }
+
+    std::vector<uchar> data;
+    int rows, cols;
+};
+
+//van Herk/Gil-Werman along the rows: dst = op over [x - r, x + r] of src, g and h are scratch. The
+//running ops are serial along a row, so GROUP rows are swept side by side to overlap their chains.
+template<typename Op> static inline void stereoMorphRows(const StereoMorphBand& src, StereoMorphBand& dst, int r,
+                                                         std::vector<uchar>& g, std::vector<uchar>& h)
+{
+    enum { GROUP = 8 };
+    Op op;
+    const int L = src.cols, k = 2*r + 1;
+    g.resize((size_t)L*GROUP);
+    h.resize((size_t)L*GROUP);
+    for( int y0 = 0; y0 < src.rows; y0 += GROUP )
+    {
+        const int n = std::min((int)GROUP, src.rows - y0);
+        const uchar* s[GROUP];
+        uchar* gr[GROUP];
+        uchar* hr[GROUP];
+        for( int j = 0; j < n; j++ )
+        {
+            s[j] = src.row(y0 + j);
+            gr[j] = &g[(size_t)j*L];
+            hr[j] = &h[(size_t)j*L];
+        }
+        //running op from the start (g) and to the end (h) of every block of k columns
+        for( int b0 = 0; b0 < L; b0 += k )
+        {
+            int b1 = std::min(b0 + k, L);
+            for( int j = 0; j < n; j++ )
+            {
+                gr[j][b0] = s[j][b0];
+                hr[j][b1 - 1] = s[j][b1 - 1];
+            }
+            for( int i = b0 + 1; i < b1; i++ )
+                for( int j = 0; j < n; j++ )
+                    gr[j][i] = op(gr[j][i - 1], s[j][i]);
+            for( int i = b1 - 2; i >= b0; i-- )
+                for( int j = 0; j < n; j++ )
+                    hr[j][i] = op(hr[j][i + 1], s[j][i]);
+        }
+        for( int j = 0; j < n; j++ )
+        {
+            uchar* d = dst.row(y0 + j);
+            //the first and last r columns are pad, they only need some value
+            for( int i = 0; i < r && i < L; i++ )
+                d[i] = d[L - 1 - i] = Op::identity();
+            for( int i = r; i < L - r; i++ )
+                d[i] = op(hr[j][i - r], gr[j][i + r]);
+        }
+    }
+}
+
+//the same down the columns (dx = 0) or the diagonals (dx = +-1: the line through (x + t*dx, y + t)).
+//Rows are combined whole, so the inner loops run along memory. g and h are scratch bands.
+template<typename Op> static inline void stereoMorphLines(const StereoMorphBand& src, StereoMorphBand& dst, int r, int dx,
+                                                          StereoMorphBand& g, StereoMorphBand& h)
+{
+    Op op;
+    const int L = src.cols, R = src.rows, k = 2*r + 1;
+    g.create(R, L);
+    h.create(R, L);
+    //columns where the previous element of a line is inside the band
+    const int x0 = std::max(dx, 0), x1 = L + std::min(dx, 0);
+    for( int y = 0; y < R; y++ )
+    {
+        const uchar* s = src.row(y);
+        uchar* gy = g.row(y);
+        if( y % k == 0 )
+        {
+            memcpy(gy, s, L);
+            continue;
+        }
+        const uchar* gp = g.row(y - 1) - dx;
+        for( int i = 0; i < x0; i++ )
+            gy[i] = s[i];
+        for( int i = x0; i < x1; i++ )
+            gy[i] = op(gp[i], s[i]);
+        for( int i = x1; i < L; i++ )
+            gy[i] = s[i];
+    }
+    const int x2 = std::max(-dx, 0), x3 = L + std::min(-dx, 0);
+    for( int y = R - 1; y >= 0; y-- )
+    {
+        const uchar* s = src.row(y);
+        uchar* hy = h.row(y);
+        if( y % k == k - 1 || y == R - 1 )
+        {
+            memcpy(hy, s, L);
+            continue;
+        }
+        const uchar* hn = h.row(y + 1) + dx;
+        for( int i = 0; i < x2; i++ )
+            hy[i] = s[i];
+        for( int i = x2; i < x3; i++ )
+            hy[i] = op(hn[i], s[i]);
+        for( int i = x3; i < L; i++ )
+            hy[i] = s[i];
+    }
+    //the window of (x, y) is h at its first element and g at its last; the first and
+    //last r rows and columns are margin the caller does not use
+    const int c0 = r, c1 = L - r;
+    for( int y = 0; y < R; y++ )
+    {
+        uchar* d = dst.row(y);
+        if( y < r || y >= R - r || c0 >= c1 )
+        {
+            memset(d, Op::identity(), L);
+            continue;
+        }
+        const uchar* ha = h.row(y - r) - r*dx;
+        const uchar* gb = g.row(y + r) + r*dx;
+        memset(d, Op::identity(), c0);
+        for( int i = c0; i < c1; i++ )
+            d[i] = op(ha[i], gb[i]);
+        memset(d + c1, Op::identity(), L - c1);
+    }
+}
+
+//a small element point by point: dst = op over the set (dx, dy) of kernel of src(x + dx, y + dy)
+template<typename Op> static inline void stereoMorphKernel(const StereoMorphBand& src, StereoMorphBand& dst, const Mat& kernel)
+{
+    Op op;
+    const int L = src.cols, R = src.rows, ry = kernel.rows/2, rx = kernel.cols/2;
+    for( int y = 0; y < R; y++ )
+    {
+        uchar* d = dst.row(y);
+        memset(d, Op::identity(), L);
+        if( y < ry || y >= R - ry )
+            continue;
+        for( int ky = 0; ky < kernel.rows; ky++ )
+            for( int kx = 0; kx < kernel.cols; kx++ )
+            {
+                if( !kernel.at<uchar>(ky, kx) )
+                    continue;
+                const uchar* s = src.row(y + ky - ry) + kx - rx;
+                for( int i = rx; i < L - rx; i++ )
+                    d[i] = op(d[i], s[i]);
+            }
+    }
+}
+
+//the MORPH_ELLIPSE of 2*radius + 1 on a band with at least radius pad rows and columns; tmp, g and h are scratch
+template<typename Op> static inline void stereoMorphEllipse(StereoMorphBand& band, int radius, StereoMorphBand& tmp,
+                                                            StereoMorphBand& g, StereoMorphBand& h)
+{
+    if( radius <= 0 )
+        return;
+    tmp.create(band.rows, band.cols);
+    if( radius <= STEREO_MORPH_EXACT_RADIUS )
+    {
+        Mat kernel = getStructuringElement(MORPH_ELLIPSE, Size(2*radius + 1, 2*radius + 1), Point(radius, radius));
+        stereoMorphKernel<Op>(band, tmp, kernel);
+        std::swap(band.data, tmp.data);
+        return;
+    }
+    //octagon: a square of half-size a plus a diamond of radius 2b, sized so both the axis and the
+    //diagonal extent match the circle (a + 2b = radius, 2a + 2b = radius*sqrt(2))
+    int b = cvRound(radius*(1 - M_SQRT1_2)), a = radius - 2*b;
+    stereoMorphRows<Op>(band, tmp, a, g.data, h.data);
+    stereoMorphLines<Op>(tmp, band, a, 0, g, h);
+    stereoMorphLines<Op>(band, tmp, b, 1, g, h);
+    stereoMorphLines<Op>(tmp, band, b, -1, g, h);
+}
+
+class StereoPostProcessInvoker : public ParallelLoopBody
+{
+public:
+    StereoPostProcessInvoker(const Mat& src_, double scale_, int erosion_, int dilation_, Mat& dst_, int bandRows_)
+    : src(src_), scale(scale_), erosion(erosion_), dilation(dilation_), dst(dst_), bandRows(bandRows_) {}
+
+    void operator()(const Range& range) const
+    {
+        const int W = src.cols, H = src.rows, pad = std::max(std::max(erosion, dilation), 1);
+        StereoMorphBand band, tmp, g, h;
+        for( int i = range.start; i < range.end; i++ )
+        {
+            //output rows [o0, o1); the dilation needs the eroded rows `dilation` around them, the
+            //erosion the scaled rows `erosion` around those
+            int o0 = i*bandRows, o1 = std::min(o0 + bandRows, H);
+            int e0 = o0 - dilation, s0 = e0 - erosion, s1 = o1 + dilation + erosion;
+            band.create(s1 - s0, W + 2*pad);
+
+            //scale; rows and columns outside the image are ignored by the erosion
+            memset(&band.data[0], StereoErodeOp::identity(), band.data.size());
+            int y0 = std::max(s0, 0), y1 = std::min(s1, H);
+            if( y0 < y1 )
+            {
+                Mat inner(y1 - y0, W, CV_8U, band.row(y0 - s0) + pad, band.cols);
+                src.rowRange(y0, y1).convertTo(inner, CV_8U, scale);
+            }
+
+            stereoMorphEllipse<StereoErodeOp>(band, erosion, tmp, g, h);
+
+            //the eroded image ends at the image border: outside it is ignored by the dilation
+            for( int y = 0; y < band.rows; y++ )
+            {
+                uchar* r = band.row(y);
+                if( y + s0 < 0 || y + s0 >= H )
+                    memset(r, StereoDilateOp::identity(), band.cols);
+                else
+                {
+                    memset(r, StereoDilateOp::identity(), pad);
+                    memset(r + pad + W, StereoDilateOp::identity(), pad);
+                }
+            }
+
+            stereoMorphEllipse<StereoDilateOp>(band, dilation, tmp, g, h);
+
+            for( int y = o0; y < o1; y++ )
+                memcpy(dst.ptr(y), band.row(y - s0) + pad, W);
+        }
+    }
+
+protected:
+    const Mat& src;
+    double scale;
+    int erosion, dilation;
+    Mat& dst;
+    int bandRows;
+};
+
+//dst = dilate(erode(src x scale as CV_8U, ellipse 2*erosion + 1), ellipse 2*dilation + 1) in one
+//pass over bands of rows. Matches convertTo + erode + dilate with getStructuringElement(MORPH_ELLIPSE)
+//exactly up to radius STEREO_MORPH_EXACT_RADIUS; larger radii use the octagon approximation.
+static inline void stereoScaleErodeDilate(const Mat& src, double scale, int erosion, int dilation, Mat& dst)
+{
+    CV_Assert( src.channels() == 1 && erosion >= 0 && dilation >= 0 );
+    dst.create(src.size(), CV_8U);
+    if( src.empty() )
+        return;
+    //bands several times taller than the margin they recompute
+    int margin = erosion + dilation;
+    int bandRows = std::max(32, 4*margin);
+    int nbands = (src.rows + bandRows - 1)/bandRows;
+    parallel_for_(Range(0, nbands), StereoPostProcessInvoker(src, scale, erosion, dilation, dst, bandRows), nbands);
+}
+
+#endif /* Stereo_Morphology_hpp */
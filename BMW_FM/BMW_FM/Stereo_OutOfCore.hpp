@@ -0,0 +1,421 @@
+//
+//  Stereo_OutOfCore.hpp
+//  BMW_FM
+//
+//  Band-by-band input and output for stereo pairs too large to hold in
+//  memory. Inputs are memory-mapped: uncompressed TIFF (strips or tiles,
+//  classic or BigTIFF, 8-bit gray or chunky RGB/RGBA), binary PGM, or raw
+//  8-bit files of a given size. Rows are read a band at a time and the file
+//  pages behind the rows no later band needs are dropped again, so the
+//  resident size follows the band rather than the image. Disparities are
+//  streamed to an uncompressed 16-bit signed TIFF (BigTIFF past 4GB) or a
+//  raw little-endian int16 file.
+//
+
+#ifndef Stereo_OutOfCore_hpp
+#define Stereo_OutOfCore_hpp
+
+#include "opencv2/core/core.hpp"
+
+#include "Stereo_MappedFile.hpp"
+#include "Stereo_Metrics.hpp"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+using namespace cv;
+
+
+//8-bit rows of a memory-mapped image, converted to gray
+class StereoBandReader
+{
+public:
+    StereoBandReader() : samples(1) {}
+
+    //rawSize: width and height of a headerless 8-bit file, only used for names that are neither TIFF nor PGM
+    bool open(const std::string& filename, Size rawSize = Size())
+    {
+        chunks.clear();
+        imageSize = Size();
+        if( !file.open(filename) )
+            return false;
+        const uchar* p = file.data();
+        bool ok = false;
+        if( file.size() >= 8 && ((p[0] == 'I' && p[1] == 'I') || (p[0] == 'M' && p[1] == 'M')) )
+            ok = parseTiff();
+        else if( file.size() >= 2 && p[0] == 'P' && p[1] == '5' )
+            ok = parsePgm();
+        else if( rawSize.area() > 0 && file.size() >= (size_t)rawSize.width*rawSize.height )
+        {
+            imageSize = rawSize;
+            samples = 1;
+            addChunk(0, 0, imageSize.height, 0, imageSize.width, imageSize.width);
+            ok = true;
+        }
+        if( !ok )
+        {
+            file.close();
+            chunks.clear();
+        }
+        return ok;
+    }
+
+    bool isOpened() const { return file.isOpened(); }
+    Size size() const { return imageSize; }
+    //bytes per pixel in the file
+    int channels() const { return samples; }
+
+    //rows of a tile that stay mapped after the rows above them are released; 0 for strips
+    int tileRows() const
+    {
+        int rows = 0;
+        for( size_t i = 0; i < chunks.size(); i++ )
+            if( chunks[i].x0 != 0 || chunks[i].x1 != imageSize.width )
+                rows = std::max(rows, chunks[i].y1 - chunks[i].y0);
+        return rows;
+    }
+
+    //rows [y0, y1) as a CV_8U image
+    void read(int y0, int y1, Mat& band) const
+    {
+        CV_Assert( 0 <= y0 && y0 < y1 && y1 <= imageSize.height );
+        band.create(y1 - y0, imageSize.width, CV_8U);
+        for( size_t i = 0; i < chunks.size(); i++ )
+        {
+            const Chunk& c = chunks[i];
+            int a = std::max(c.y0, y0), b = std::min(c.y1, y1);
+            for( int y = a; y < b; y++ )
+            {
+                const uchar* src = file.data() + c.offset + (size_t)(y - c.y0)*c.stride;
+                uchar* dst = band.ptr<uchar>(y - y0) + c.x0;
+                int n = c.x1 - c.x0;
+                if( samples == 1 )
+                    memcpy(dst, src, n);
+                else
+                {
+                    //ITU-R BT.601 weights, same fixed point as cvtColor
+                    for( int x = 0; x < n; x++, src += samples )
+                        dst[x] = (uchar)((src[0]*4899 + src[1]*9617 + src[2]*1868 + (1 << 13)) >> 14);
+                }
+            }
+        }
+    }
+
+    //no row above y will be read again: drops their file pages from memory
+    void release(int y) const
+    {
+        for( size_t i = 0; i < chunks.size(); i++ )
+        {
+            const Chunk& c = chunks[i];
+            if( c.y0 >= y )
+                continue;
+            //rows of a full-width chunk are contiguous, a tile goes once all of it is done
+            if( c.x0 == 0 && c.x1 == imageSize.width )
+                file.advise(c.offset, (size_t)(std::min(y, c.y1) - c.y0)*c.stride, MADV_DONTNEED);
+            else if( c.y1 <= y )
+                file.advise(c.offset, (size_t)(c.y1 - c.y0)*c.stride, MADV_DONTNEED);
+        }
+    }
+
+protected:
+    struct Chunk
+    {
+        size_t offset, stride;
+        int y0, y1, x0, x1;
+    };
+
+    bool addChunk(size_t offset, int y0, int y1, int x0, int x1, size_t stride)
+    {
+        Chunk c;
+        c.offset = offset;
+        c.stride = stride;
+        c.y0 = y0;
+        c.y1 = y1;
+        c.x0 = x0;
+        c.x1 = x1;
+        if( offset > file.size() || (size_t)(y1 - y0)*stride > file.size() - offset )
+            return false;
+        chunks.push_back(c);
+        return true;
+    }
+
+    bool parsePgm()
+    {
+        const char* p = (const char*)file.data();
+        size_t n = file.size(), i = 2;
+        int v[3];
+        for( int k = 0; k < 3; k++ )
+        {
+            while( i < n && (isspace((uchar)p[i]) || p[i] == '#') )
+            {
+                if( p[i] == '#' )
+                    while( i < n && p[i] != '\n' )
+                        i++;
+                else
+                    i++;
+            }
+            v[k] = 0;
+            for( ; i < n && isdigit((uchar)p[i]); i++ )
+                v[k] = v[k]*10 + (p[i] - '0');
+        }
+        if( i >= n || v[0] <= 0 || v[1] <= 0 || v[2] <= 0 || v[2] > 255 )
+            return false;
+        imageSize = Size(v[0], v[1]);
+        samples = 1;
+        return addChunk(i + 1, 0, imageSize.height, 0, imageSize.width, imageSize.width);
+    }
+
+    uint64 get(size_t ofs, int bytes) const
+    {
+        const uchar* p = file.data() + ofs;
+        uint64 v = 0;
+        for( int i = 0; i < bytes; i++ )
+            v |= (uint64)p[bigEndian ? bytes - 1 - i : i] << (8*i);
+        return v;
+    }
+
+    //values of one IFD entry (SHORT, LONG or LONG8)
+    bool tagValues(size_t entry, bool bigtiff, std::vector<uint64>& values) const
+    {
+        int type = (int)get(entry + 2, 2), size = type == 3 ? 2 : type == 4 ? 4 : type == 16 ? 8 : 0;
+        uint64 count = bigtiff ? get(entry + 4, 8) : get(entry + 4, 4);
+        if( size == 0 || count == 0 || count > file.size() )
+            return false;
+        size_t inlineBytes = bigtiff ? 8 : 4, field = entry + (bigtiff ? 12 : 8);
+        size_t ofs = count*size <= inlineBytes ? field : (size_t)get(field, bigtiff ? 8 : 4);
+        if( ofs > file.size() || count*size > file.size() - ofs )
+            return false;
+        values.resize((size_t)count);
+        for( size_t i = 0; i < values.size(); i++ )
+            values[i] = get(ofs + i*size, size);
+        return true;
+    }
+
+    bool parseTiff()
+    {
+        bigEndian = file.data()[0] == 'M';
+        int version = (int)get(2, 2);
+        bool bigtiff = version == 43;
+        if( version != 42 && !bigtiff )
+            return false;
+        size_t ifd = (size_t)(bigtiff ? get(8, 8) : get(4, 4));
+        if( ifd + 8 > file.size() )
+            return false;
+        size_t count = (size_t)(bigtiff ? get(ifd, 8) : get(ifd, 2)), entrySize = bigtiff ? 20 : 12;
+        size_t first = ifd + (bigtiff ? 8 : 2);
+        if( first + count*entrySize > file.size() )
+            return false;
+
+        int width = 0, height = 0, bits = 8, compression = 1, planar = 1, rowsPerStrip = INT_MAX, tileWidth = 0, tileHeight = 0;
+        samples = 1;
+        std::vector<uint64> offsets, v;
+        for( size_t e = 0; e < count; e++ )
+        {
+            size_t entry = first + e*entrySize;
+            int tag = (int)get(entry, 2);
+            if( tag != 273 && tag != 324 && tag != 256 && tag != 257 && tag != 258 && tag != 259 &&
+                tag != 277 && tag != 278 && tag != 284 && tag != 322 && tag != 323 )
+                continue;
+            if( !tagValues(entry, bigtiff, v) )
+                return false;
+            switch( tag )
+            {
+            case 256: width = (int)v[0]; break;
+            case 257: height = (int)v[0]; break;
+            case 258: bits = (int)v[0]; break;
+            case 259: compression = (int)v[0]; break;
+            case 277: samples = (int)v[0]; break;
+            case 278: rowsPerStrip = (int)std::min(v[0], (uint64)INT_MAX); break;
+            case 284: planar = (int)v[0]; break;
+            case 322: tileWidth = (int)v[0]; break;
+            case 323: tileHeight = (int)v[0]; break;
+            default: offsets = v;   //273 StripOffsets, 324 TileOffsets
+            }
+        }
+        if( width <= 0 || height <= 0 || bits != 8 || compression != 1 || (planar != 1 && samples > 1) ||
+            (samples != 1 && samples != 3 && samples != 4) || offsets.empty() )
+        {
+            fprintf(stderr, "out-of-core: only uncompressed 8-bit gray or interleaved RGB TIFFs can be mapped\n");
+            return false;
+        }
+        imageSize = Size(width, height);
+
+        if( tileWidth > 0 && tileHeight > 0 )
+        {
+            int across = (width + tileWidth - 1)/tileWidth, down = (height + tileHeight - 1)/tileHeight;
+            if( offsets.size() < (size_t)across*down )
+                return false;
+            for( int ty = 0; ty < down; ty++ )
+                for( int tx = 0; tx < across; tx++ )
+                    if( !addChunk((size_t)offsets[ty*across + tx], ty*tileHeight, std::min((ty + 1)*tileHeight, height),
+                                  tx*tileWidth, std::min((tx + 1)*tileWidth, width), (size_t)tileWidth*samples) )
+                        return false;
+            return true;
+        }
+        rowsPerStrip = std::min(rowsPerStrip, height);
+        if( offsets.size() < (size_t)((height + rowsPerStrip - 1)/rowsPerStrip) )
+            return false;
+        for( int s = 0; s*rowsPerStrip < height; s++ )
+            if( !addChunk((size_t)offsets[s], s*rowsPerStrip, std::min((s + 1)*rowsPerStrip, height),
+                          0, width, (size_t)width*samples) )
+                return false;
+        return true;
+    }
+
+    StereoMappedFile file;
+    Size imageSize;
+    int samples;
+    bool bigEndian;
+    std::vector<Chunk> chunks;
+};
+
+//CV_16S rows appended to a TIFF (names ending in .tif/.tiff) or raw int16 file
+class StereoBandWriter
+{
+public:
+    StereoBandWriter() : f(0), tiff(false), bigtiff(false), rowsWritten(0), rowsPerStrip(0) {}
+    ~StereoBandWriter() { close(); }
+
+    bool open(const std::string& filename, Size size)
+    {
+        close();
+        f = fopen(filename.c_str(), "wb");
+        if( !f )
+            return false;
+        imageSize = size;
+        rowsWritten = 0;
+        size_t dot = filename.rfind('.');
+        std::string ext = dot == std::string::npos ? std::string() : filename.substr(dot);
+        tiff = ext == ".tif" || ext == ".tiff" || ext == ".TIF" || ext == ".TIFF";
+        if( !tiff )
+            return true;
+
+        //strips of about 256KB
+        size_t rowBytes = (size_t)size.width*2;
+        rowsPerStrip = (int)std::max((size_t)1, std::min((size_t)size.height, ((size_t)256 << 10)/rowBytes));
+        bigtiff = rowBytes*size.height + (size_t)size.height*16 + 4096 > 0xffffffffULL;
+        char header[16] = { 'I', 'I' };
+        header[2] = bigtiff ? 43 : 42;
+        if( bigtiff )
+            header[4] = 8;  //offset size
+        return fwrite(header, 1, bigtiff ? 16 : 8, f) == (size_t)(bigtiff ? 16 : 8);
+    }
+
+    bool isOpened() const { return f != 0; }
+
+    bool write(const Mat& rows)
+    {
+        CV_Assert( f && rows.type() == CV_16S && rows.cols == imageSize.width && rowsWritten + rows.rows <= imageSize.height );
+        std::vector<char> buf((size_t)rows.cols*2);
+        for( int y = 0; y < rows.rows; y++ )
+        {
+            const short* s = rows.ptr<short>(y);
+            char* p = &buf[0];
+            for( int x = 0; x < rows.cols; x++ )
+                p = putLE16(p, s[x]);
+            if( fwrite(&buf[0], 1, buf.size(), f) != buf.size() )
+                return false;
+        }
+        rowsWritten += rows.rows;
+        return true;
+    }
+
+    //finishes the file; false if it is incomplete or could not be written
+    bool close()
+    {
+        if( !f )
+            return true;
+        bool ok = rowsWritten == imageSize.height && (!tiff || writeDirectory());
+        ok = fclose(f) == 0 && ok;
+        f = 0;
+        return ok;
+    }
+
+protected:
+    static char* putLE16(char* p, short v)
+    {
+        p[0] = (char)(v & 0xff);
+        p[1] = (char)((v >> 8) & 0xff);
+        return p + 2;
+    }
+
+    static void putLE(std::vector<char>& out, uint64 v, int bytes)
+    {
+        for( int i = 0; i < bytes; i++ )
+            out.push_back((char)((v >> (8*i)) & 0xff));
+    }
+
+    //strip tables and the IFD after the pixels, then the header points at the IFD
+    bool writeDirectory()
+    {
+        int64 dataStart = bigtiff ? 16 : 8, end = ftello(f);
+        int nstrips = (imageSize.height + rowsPerStrip - 1)/rowsPerStrip, osize = bigtiff ? 8 : 4;
+        size_t stripBytes = stripBytesOf(0);
+        std::vector<char> tables;
+        for( int s = 0; s < nstrips; s++ )
+            putLE(tables, dataStart + (uint64)s*stripBytes, osize);
+        for( int s = 0; s < nstrips; s++ )
+            putLE(tables, stripBytesOf(s), osize);
+        int64 offsetsAt = end, countsAt = end + (int64)nstrips*osize, ifdAt = end + (int64)tables.size();
+        ifdAt += ifdAt & 1;
+        if( tables.size() & 1 )
+            tables.push_back(0);
+
+        //entries sorted by tag: tag, type, count, value (or offset)
+        struct Entry { int tag, type; uint64 count, value; };
+        int longType = bigtiff ? 16 : 4;
+        Entry entries[] = {
+            { 256, 4, 1, (uint64)imageSize.width },
+            { 257, 4, 1, (uint64)imageSize.height },
+            { 258, 3, 1, 16 },
+            { 259, 3, 1, 1 },                       //no compression
+            { 262, 3, 1, 1 },                       //black is zero
+            { 273, longType, (uint64)nstrips, nstrips == 1 ? (uint64)dataStart : (uint64)offsetsAt },
+            { 277, 3, 1, 1 },
+            { 278, 4, 1, (uint64)rowsPerStrip },
+            { 279, longType, (uint64)nstrips, nstrips == 1 ? (uint64)stripBytes : (uint64)countsAt },
+            { 284, 3, 1, 1 },
+            { 339, 3, 1, 2 },                       //signed integers
+        };
+        int nentries = (int)(sizeof(entries)/sizeof(entries[0]));
+        std::vector<char> ifd;
+        putLE(ifd, nentries, bigtiff ? 8 : 2);
+        for( int i = 0; i < nentries; i++ )
+        {
+            putLE(ifd, entries[i].tag, 2);
+            putLE(ifd, entries[i].type, 2);
+            putLE(ifd, entries[i].count, bigtiff ? 8 : 4);
+            //SHORT values sit left-aligned in the value field
+            int vsize = entries[i].type == 3 ? 2 : osize;
+            putLE(ifd, entries[i].value, vsize);
+            putLE(ifd, 0, osize - vsize);
+        }
+        putLE(ifd, 0, osize);   //no next IFD
+
+        std::vector<char> ofs;
+        putLE(ofs, (uint64)ifdAt, osize);
+        return fwrite(&tables[0], 1, tables.size(), f) == tables.size() &&
+            fwrite(&ifd[0], 1, ifd.size(), f) == ifd.size() &&
+            fseeko(f, bigtiff ? 8 : 4, SEEK_SET) == 0 && fwrite(&ofs[0], 1, ofs.size(), f) == ofs.size();
+    }
+
+    size_t stripBytesOf(int s) const
+    {
+        return (size_t)(std::min((s + 1)*rowsPerStrip, imageSize.height) - s*rowsPerStrip)*imageSize.width*2;
+    }
+
+    FILE* f;
+    Size imageSize;
+    bool tiff, bigtiff;
+    int rowsWritten, rowsPerStrip;
+
+private:
+    StereoBandWriter(const StereoBandWriter&);
+    StereoBandWriter& operator=(const StereoBandWriter&);
+};
+
+#endif /* Stereo_OutOfCore_hpp */
@@ -0,0 +1,377 @@
+//
+//  Stereo_Pipeline.hpp
+//  BMW_FM
+//
+//  Live stereo pipeline: a capture thread feeds a chain of stages (rectify,
+//  match, ...) that each run on their own thread, connected by bounded
+//  lock-free single-producer/single-consumer rings. When a ring is full the
+//  producer drops the frame instead of waiting, so a slow stage costs frames
+//  rather than latency. The caller is the sink: it pops finished frames and
+//  reports back when it is done with them, which closes the end-to-end
+//  latency measurement.
+//
+//  Frame sources are the synchronised cameras of Stereo_CameraSync.hpp or a
+//  list of stereo pairs replayed at a fixed frame rate, which behaves like a
+//  camera and makes the pipeline testable without hardware.
+//
+
+#ifndef Stereo_Pipeline_hpp
+#define Stereo_Pipeline_hpp
+
+#include "opencv2/core/utility.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/videoio.hpp"
+
+#include "Stereo_Sequence.hpp"
+
+#include <string>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <stdio.h>
+
+using namespace cv;
+
+
+//bounded ring for one producer thread and one consumer thread; no locks, the
+//slot between tail and head belongs to whichever side is allowed to touch it
+template<typename T> class StereoSpscRing
+{
+public:
+    explicit StereoSpscRing(int capacity)
+    : slots(std::max(capacity, 1) + 1), head(0), tail(0), closed(false), pushed(0), dropped(0) {}
+
+    //producer: false (and the value counted as dropped) when the ring is full
+    bool tryPush(const T& v)
+    {
+        size_t h = head.load(std::memory_order_relaxed), next = (h + 1) % slots.size();
+        if( next == tail.load(std::memory_order_acquire) )
+        {
+            dropped++;
+            return false;
+        }
+        slots[h] = v;
+        head.store(next, std::memory_order_release);
+        pushed++;
+        return true;
+    }
+
+    //consumer: false when the ring is empty
+    bool tryPop(T& v)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if( t == head.load(std::memory_order_acquire) )
+            return false;
+        v = slots[t];
+        slots[t] = T();
+        tail.store((t + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+
+    //producer: nothing more will be pushed
+    void close() { closed.store(true, std::memory_order_release); }
+
+    //consumer: closed and drained
+    bool isDone() const
+    {
+        return closed.load(std::memory_order_acquire) &&
+        tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
+    int64 pushedCount() const { return pushed.load(); }
+    int64 droppedCount() const { return dropped.load(); }
+
+protected:
+    std::vector<T> slots;
+    std::atomic<size_t> head, tail;
+    std::atomic<bool> closed;
+    std::atomic<int64> pushed, dropped;
+
+private:
+    StereoSpscRing(const StereoSpscRing&);
+    StereoSpscRing& operator=(const StereoSpscRing&);
+};
+
+//p-quantile of v (reordered), 0 when empty
+static inline double stereoPercentile(std::vector<double>& v, double p)
+{
+    if( v.empty() )
+        return 0;
+    size_t k = std::min((size_t)(p*v.size()), v.size() - 1);
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+struct StereoFrame
+{
+    StereoFrame() : id(-1), captureTicks(0) {}
+    int64 id;
+    int64 captureTicks;     //getTickCount() once both images were grabbed
+    Mat left, right, disparity;
+    Mat confidence;         //with the CV_32F disparity of a refinement, else empty
+};
+
+class StereoFrameSource
+{
+public:
+    virtual ~StereoFrameSource() {}
+    //blocks until the next pair is there; false at the end of the stream or on a camera error
+    virtual bool read(Mat& left, Mat& right) = 0;
+
+    //same, with the getTickCount() at which the pair was taken; sources that stamp
+    //frames at grab time report that instead of the time read() returned
+    virtual bool readStamped(Mat& left, Mat& right, int64& ticks)
+    {
+        bool ok = read(left, right);
+        ticks = getTickCount();
+        return ok;
+    }
+};
+
+//fake camera: replays image pairs (files or sequence frame references) at fps frames per
+//second, as fast as they load when fps <= 0
+class StereoFileSource : public StereoFrameSource
+{
+public:
+    StereoFileSource(const std::vector<std::string>& left_, const std::vector<std::string>& right_,
+                     double fps_ = 30, bool loop_ = false, int flags_ = IMREAD_COLOR)
+    : left(left_), right(right_), fps(fps_), loop(loop_), flags(flags_), next(0), nextTicks(0) {}
+
+    bool read(Mat& l, Mat& r)
+    {
+        if( left.empty() || (next >= left.size() && !loop) )
+            return false;
+        if( next >= left.size() )
+            next = 0;
+
+        if( fps > 0 )
+        {
+            int64 now = getTickCount(), period = (int64)(getTickFrequency()/fps);
+            if( nextTicks == 0 )
+                nextTicks = now;
+            if( nextTicks > now )
+                std::this_thread::sleep_for(std::chrono::microseconds((int64)((nextTicks - now)*1e6/getTickFrequency())));
+            //a late frame does not make the following ones come faster
+            nextTicks = std::max(nextTicks, now) + period;
+        }
+        l = stereoImread(left[next], flags);
+        r = stereoImread(right[next], flags);
+        next++;
+        return !l.empty() && !r.empty();
+    }
+
+protected:
+    std::vector<std::string> left, right;
+    double fps;
+    bool loop;
+    int flags;
+    size_t next;
+    int64 nextTicks;
+};
+
+//a left and a right video file read in lockstep
+class StereoVideoSource : public StereoFrameSource
+{
+public:
+    StereoVideoSource(const std::string& left, const std::string& right) : capLeft(left), capRight(right) {}
+
+    bool isOpened() const { return capLeft.isOpened() && capRight.isOpened(); }
+
+    bool read(Mat& l, Mat& r)
+    {
+        return capLeft.read(l) && capRight.read(r) && !l.empty() && !r.empty();
+    }
+
+protected:
+    VideoCapture capLeft, capRight;
+};
+
+struct StereoPipelineStats
+{
+    int64 captured;         //frames read from the source
+    int64 delivered;        //frames the sink finished
+    std::vector<int64> dropped;         //per ring: ring 0 feeds the first stage, the last one the sink
+    std::vector<std::string> stageNames;
+    std::vector<double> stageMs;        //mean time spent in each stage per frame
+    double fps;             //delivered frames per second since the first delivery
+    double latencyMean, latencyP50, latencyP95, latencyMax;    //capture to finished(), ms, over the recent frames
+};
+
+class StereoLivePipeline
+{
+public:
+    typedef std::function<void(StereoFrame&)> Stage;
+
+    //every ring holds up to ringCapacity frames; small rings keep the latency low
+    explicit StereoLivePipeline(const Ptr<StereoFrameSource>& source_, int ringCapacity_ = 2)
+    : source(source_), ringCapacity(ringCapacity_), stopping(false), started(false),
+    captured(0), delivered(0), firstDelivery(0), lastDelivery(0), latencySum(0), latencyMax(0) {}
+
+    ~StereoLivePipeline() { stop(); }
+
+    //stages run in the order they were added; only before start()
+    void addStage(const std::string& name, const Stage& fn)
+    {
+        CV_Assert( !started );
+        stages.push_back(fn);
+        stageNames.push_back(name);
+    }
+
+    void start()
+    {
+        CV_Assert( !started );
+        started = true;
+        stageTicks.reset(new std::atomic<int64>[stages.size() + 1]);
+        for( size_t i = 0; i <= stages.size(); i++ )
+        {
+            rings.push_back(makePtr<StereoSpscRing<StereoFrame> >(ringCapacity));
+            stageTicks[i] = 0;
+        }
+        threads.push_back(std::thread(&StereoLivePipeline::captureLoop, this));
+        for( size_t i = 0; i < stages.size(); i++ )
+            threads.push_back(std::thread(&StereoLivePipeline::stageLoop, this, (int)i));
+    }
+
+    //stops capturing; the frames already in flight still drain through the stages
+    void stop()
+    {
+        stopping = true;
+        for( size_t i = 0; i < threads.size(); i++ )
+            if( threads[i].joinable() )
+                threads[i].join();
+        threads.clear();
+    }
+
+    //the next processed frame for the sink; false after timeout_ms or at the end of the stream (see done())
+    bool pop(StereoFrame& f, int timeout_ms)
+    {
+        int64 deadline = getTickCount() + (int64)(timeout_ms*getTickFrequency()/1000);
+        for(;;)
+        {
+            if( rings.back()->tryPop(f) )
+                return true;
+            if( rings.back()->isDone() || getTickCount() >= deadline )
+                return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    bool done() const { return started && rings.back()->isDone(); }
+
+    //the sink is through with f; returns its end-to-end latency in ms
+    double finished(const StereoFrame& f)
+    {
+        int64 now = getTickCount();
+        double ms = (now - f.captureTicks)*1000/getTickFrequency();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        if( delivered++ == 0 )
+            firstDelivery = now;
+        lastDelivery = now;
+        latencySum += ms;
+        latencyMax = std::max(latencyMax, ms);
+        if( recent.size() < STEREO_PIPELINE_LATENCY_WINDOW )
+            recent.push_back(ms);
+        else
+            recent[delivered % STEREO_PIPELINE_LATENCY_WINDOW] = ms;
+        return ms;
+    }
+
+    StereoPipelineStats stats() const
+    {
+        StereoPipelineStats s;
+        s.captured = captured.load();
+        s.stageNames = stageNames;
+        for( size_t i = 0; i < rings.size(); i++ )
+        {
+            s.dropped.push_back(rings[i]->droppedCount());
+            if( i < stages.size() )
+                s.stageMs.push_back(stageTicks[i]*1000/getTickFrequency()/std::max(rings[i]->pushedCount(), (int64)1));
+        }
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        s.delivered = delivered;
+        s.fps = delivered > 1 ? (delivered - 1)*getTickFrequency()/std::max(lastDelivery - firstDelivery, (int64)1) : 0;
+        s.latencyMean = delivered > 0 ? latencySum/delivered : 0;
+        s.latencyMax = latencyMax;
+        std::vector<double> l = recent;
+        s.latencyP50 = stereoPercentile(l, 0.5);
+        s.latencyP95 = stereoPercentile(l, 0.95);
+        return s;
+    }
+
+protected:
+    enum { STEREO_PIPELINE_LATENCY_WINDOW = 1000 };
+
+    static void idle() { std::this_thread::sleep_for(std::chrono::microseconds(200)); }
+
+    void captureLoop()
+    {
+        StereoSpscRing<StereoFrame>& out = *rings[0];
+        for( int64 id = 0; !stopping; id++ )
+        {
+            //a fresh frame every time: the previous one may still be in a ring
+            StereoFrame f;
+            if( !source->readStamped(f.left, f.right, f.captureTicks) )
+                break;
+            f.id = id;
+            captured++;
+            out.tryPush(f);
+        }
+        out.close();
+    }
+
+    void stageLoop(int i)
+    {
+        StereoSpscRing<StereoFrame>& in = *rings[i];
+        StereoSpscRing<StereoFrame>& out = *rings[i + 1];
+        for(;;)
+        {
+            StereoFrame f;
+            if( !in.tryPop(f) )
+            {
+                if( in.isDone() )
+                    break;
+                idle();
+                continue;
+            }
+            int64 t = getTickCount();
+            try
+            {
+                stages[i](f);
+            }
+            catch( const std::exception& e )
+            {
+                //cv::Exception or any other std::exception (std::bad_alloc, ...): report and drop the frame
+                printf("live: stage %s failed on frame %lld: %s\n", stageNames[i].c_str(), (long long)f.id, e.what());
+                continue;
+            }
+            stageTicks[i] += getTickCount() - t;
+            out.tryPush(f);
+        }
+        out.close();
+    }
+
+    Ptr<StereoFrameSource> source;
+    int ringCapacity;
+    std::vector<Stage> stages;
+    std::vector<std::string> stageNames;
+    std::vector<Ptr<StereoSpscRing<StereoFrame> > > rings;
+    std::unique_ptr<std::atomic<int64>[]> stageTicks;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping;
+    bool started;
+    std::atomic<int64> captured;
+
+    mutable std::mutex statsMutex;
+    int64 delivered, firstDelivery, lastDelivery;
+    double latencySum, latencyMax;
+    std::vector<double> recent;
+};
+
+#endif /* Stereo_Pipeline_hpp */
@@ -0,0 +1,383 @@
+//
+//  Stereo_PointCloud.hpp
+//  BMW_FM
+//
+//  Point cloud writers. Rows are split into bands that are filtered (max_z)
+//  and encoded in parallel into one buffer per band; the bands are then
+//  written in order with plain fwrite calls, so the file is identical
+//  whatever the thread count. The points either come from the output of
+//  reprojectImageTo3D or are reprojected on the fly from the disparity map
+//  and Q (stereoWriteDisparityCloud), which never builds the CV_32FC3 frame.
+//
+//  Formats:
+//    STEREO_CLOUD_XYZ  text, "x y z" per line (the old saveXYZ output)
+//    STEREO_CLOUD_PLY  binary little-endian PLY: float x, y, z, optional
+//                      uchar red, green, blue and short disparity (x16)
+//    STEREO_CLOUD_RAW  headerless little-endian float32 records: x, y, z,
+//                      optional r, g, b (0..255) and disparity in pixels
+//
+
+#ifndef Stereo_PointCloud_hpp
+#define Stereo_PointCloud_hpp
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_ThreadPool.hpp"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <float.h>
+#include <math.h>
+#include <ctype.h>
+
+using namespace cv;
+
+
+enum
+{
+    STEREO_CLOUD_XYZ = 0,
+    STEREO_CLOUD_PLY = 1,
+    STEREO_CLOUD_RAW = 2
+};
+
+//.ply is PLY, .raw/.bin/.f32 are raw floats, anything else is text
+static inline int stereoCloudFormatFromName(const std::string& filename)
+{
+    size_t dot = filename.find_last_of('.');
+    std::string ext = dot == std::string::npos ? std::string() : filename.substr(dot + 1);
+    for( size_t i = 0; i < ext.size(); i++ )
+        ext[i] = (char)tolower(ext[i]);
+    return ext == "ply" ? STEREO_CLOUD_PLY :
+    ext == "raw" || ext == "bin" || ext == "f32" ? STEREO_CLOUD_RAW : STEREO_CLOUD_XYZ;
+}
+
+//little-endian stores that work on any host
+static inline char* stereoPutLE(char* p, const void* v, int size)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for( int i = 0; i < size; i++ )
+        p[i] = ((const char*)v)[size - 1 - i];
+#else
+    memcpy(p, v, size);
+#endif
+    return p + size;
+}
+
+//the filter saveXYZ has always applied: drops the max_z points reprojectImageTo3D
+//uses for missing disparities, and anything further away
+static inline bool stereoCloudKeep(const Vec3f& point, double max_z)
+{
+    return !(fabs(point[2] - max_z) < FLT_EPSILON || fabs(point[2]) > max_z);
+}
+
+//reprojectImageTo3D(disparity in pixels, xyz, Q, true) followed by the max_z
+//filter, one point at a time. Both maps are taken in pixels: CV_16S ones (x16,
+//as the matchers give them) are divided by DISP_SCALE, CV_32F ones (--refine)
+//used as they are, so Z and the max_z cut do not depend on the map type. For
+//the Q stereoRectify produces (the bottom two rows do not depend on x and y)
+//W and Z only depend on the disparity, so 1/W, Z and the keep decision are
+//tabulated per CV_16S disparity value and X, Y reduce to a per-row plus a
+//per-column term times 1/W. Other Q and CV_32F disparities use the direct
+//formula.
+class StereoReprojector
+{
+public:
+    StereoReprojector(const Mat& disparity_, const Mat& Q, double max_z_)
+    : disparity(disparity_), max_z(max_z_), dmin(0)
+    {
+        CV_Assert( disparity.type() == CV_16S || disparity.type() == CV_32F );
+        scale = disparity.type() == CV_16S ? 1./StereoMatcher::DISP_SCALE : 1.;
+        Mat Q64;
+        Q.convertTo(Q64, CV_64F);
+        CV_Assert( Q64.total() == 16 );
+        memcpy(q, Q64.ptr<double>(), sizeof(q));
+
+        //reprojectImageTo3D treats the smallest disparity of the map as missing
+        minDisparity = 0;
+        if( !disparity.empty() )
+            minMaxIdx(disparity, &minDisparity, 0);
+        minDisparity *= scale;
+
+        colX.resize(disparity.cols);
+        colY.resize(disparity.cols);
+        for( int x = 0; x < disparity.cols; x++ )
+        {
+            colX[x] = q[0]*x;
+            colY[x] = q[4]*x;
+        }
+        rowX.resize(disparity.rows);
+        rowY.resize(disparity.rows);
+        for( int y = 0; y < disparity.rows; y++ )
+        {
+            rowX[y] = q[1]*y + q[3];
+            rowY[y] = q[5]*y + q[7];
+        }
+
+        if( disparity.type() == CV_16S && q[8] == 0 && q[9] == 0 && q[12] == 0 && q[13] == 0 && !disparity.empty() )
+        {
+            double dmax = 0;
+            minMaxIdx(disparity, 0, &dmax);
+            dmin = cvRound(minDisparity/scale);
+            lut.resize((int)dmax - dmin + 1);
+            for( size_t i = 0; i < lut.size(); i++ )
+            {
+                double d = (dmin + (int)i)*scale;
+                Entry& e = lut[i];
+                e.iW = 1./(q[15] + q[14]*d);
+                e.xd = q[2]*d*e.iW;
+                e.yd = q[6]*d*e.iW;
+                float z = (float)((q[11] + q[10]*d)*e.iW);
+                if( fabs(d - minDisparity) <= FLT_EPSILON )
+                    z = STEREO_REPROJECT_BIG_Z;
+                e.z = z;
+                e.keep = stereoCloudKeep(Vec3f(0.f, 0.f, z), max_z);
+            }
+        }
+    }
+
+    Size size() const { return disparity.size(); }
+    bool usesLookup() const { return !lut.empty(); }
+
+    //false when the point at (x, y) is dropped by the max_z filter
+    bool point(int x, int y, Vec3f& p) const
+    {
+        if( !lut.empty() )
+        {
+            const Entry& e = lut[disparity.at<short>(y, x) - dmin];
+            if( !e.keep )
+                return false;
+            p = Vec3f((float)((rowX[y] + colX[x])*e.iW + e.xd), (float)((rowY[y] + colY[x])*e.iW + e.yd), e.z);
+            return true;
+        }
+
+        double d = disparity.type() == CV_16S ? disparity.at<short>(y, x)*scale : (double)disparity.at<float>(y, x);
+        double iW = 1./(q[12]*x + q[13]*y + q[15] + q[14]*d);
+        double Z = (q[8]*x + q[9]*y + q[11] + q[10]*d)*iW;
+        if( fabs(d - minDisparity) <= FLT_EPSILON )
+            Z = STEREO_REPROJECT_BIG_Z;
+        p = Vec3f((float)((rowX[y] + colX[x] + q[2]*d)*iW), (float)((rowY[y] + colY[x] + q[6]*d)*iW), (float)Z);
+        return stereoCloudKeep(p, max_z);
+    }
+
+protected:
+    //the z reprojectImageTo3D gives missing disparities
+    static const int STEREO_REPROJECT_BIG_Z = 10000;
+
+    struct Entry
+    {
+        double iW, xd, yd;
+        float z;
+        bool keep;
+    };
+
+    const Mat& disparity;
+    double max_z;
+    double q[16];
+    double scale;           //to pixels
+    double minDisparity;    //in pixels
+    int dmin;
+    std::vector<double> colX, colY, rowX, rowY;
+    std::vector<Entry> lut;
+};
+
+struct StereoCloudWriter
+{
+    //color: CV_8UC3 (BGR) or CV_8UC1, disparity: CV_16S (x16) or CV_32F (pixels), both optional (empty) and the size of xyz
+    StereoCloudWriter(const Mat& xyz_, const Mat& color_, const Mat& disparity_, int format_, double max_z_)
+    : xyz(xyz_), reproj(0), color(color_), disparity(disparity_), format(format_), max_z(max_z_)
+    {
+        CV_Assert( xyz.type() == CV_32FC3 );
+        checkFields(xyz.size());
+    }
+
+    //points reprojected from the disparity map by r instead of read from an xyz frame
+    StereoCloudWriter(const StereoReprojector& r, const Mat& color_, const Mat& disparity_, int format_, double max_z_)
+    : xyz(emptyMat()), reproj(&r), color(color_), disparity(disparity_), format(format_), max_z(max_z_)
+    {
+        checkFields(r.size());
+    }
+
+    Size size() const { return reproj ? reproj->size() : xyz.size(); }
+
+    size_t recordSize() const
+    {
+        if( format == STEREO_CLOUD_PLY )
+            return 12 + (color.empty() ? 0 : 3) + (disparity.empty() ? 0 : 2);
+        if( format == STEREO_CLOUD_RAW )
+            return 4*(3 + (color.empty() ? 0 : 3) + (disparity.empty() ? 0 : 1));
+        return 0;
+    }
+
+    //appends the kept points of rows [y0, y1) to out; returns their number
+    size_t encodeRows(int y0, int y1, std::vector<char>& out) const
+    {
+        size_t count = 0, rsize = recordSize();
+        char line[128];
+        for( int y = y0; y < y1; y++ )
+        {
+            const Vec3f* p = reproj ? 0 : xyz.ptr<Vec3f>(y);
+            const uchar* c = color.empty() ? 0 : color.ptr<uchar>(y);
+            const uchar* d = disparity.empty() ? 0 : disparity.ptr(y);
+            const bool dfloat = disparity.type() == CV_32F;
+            const int cn = color.empty() ? 0 : color.channels(), width = size().width;
+            Vec3f pt;
+            for( int x = 0; x < width; x++ )
+            {
+                if( reproj ? !reproj->point(x, y, pt) : !stereoCloudKeep(pt = p[x], max_z) )
+                    continue;
+                count++;
+                if( format == STEREO_CLOUD_XYZ )
+                {
+                    int n = snprintf(line, sizeof(line), "%f %f %f\n", pt[0], pt[1], pt[2]);
+                    out.insert(out.end(), line, line + std::min(n, (int)sizeof(line) - 1));
+                    continue;
+                }
+
+                size_t ofs = out.size();
+                out.resize(ofs + rsize);
+                char* q = &out[ofs];
+                for( int k = 0; k < 3; k++ )
+                    q = stereoPutLE(q, &pt[k], 4);
+                uchar rgb[3] = { 0, 0, 0 };
+                if( c )
+                {
+                    const uchar* px = c + x*cn;
+                    rgb[0] = px[cn == 3 ? 2 : 0];
+                    rgb[1] = px[cn == 3 ? 1 : 0];
+                    rgb[2] = px[0];
+                }
+                if( format == STEREO_CLOUD_PLY )
+                {
+                    if( c )
+                    {
+                        memcpy(q, rgb, 3);
+                        q += 3;
+                    }
+                    if( d )
+                    {
+                        short v = dfloat ? saturate_cast<short>(((const float*)d)[x]*StereoMatcher::DISP_SCALE) : ((const short*)d)[x];
+                        q = stereoPutLE(q, &v, 2);
+                    }
+                }
+                else
+                {
+                    for( int k = 0; c && k < 3; k++ )
+                    {
+                        float v = rgb[k];
+                        q = stereoPutLE(q, &v, 4);
+                    }
+                    if( d )
+                    {
+                        float v = dfloat ? ((const float*)d)[x] : ((const short*)d)[x]*(1.f/StereoMatcher::DISP_SCALE);
+                        q = stereoPutLE(q, &v, 4);
+                    }
+                }
+            }
+        }
+        return count;
+    }
+
+    std::string plyHeader(size_t npoints) const
+    {
+        char count[64];
+        snprintf(count, sizeof(count), "element vertex %llu\n", (unsigned long long)npoints);
+        std::string h = std::string("ply\nformat binary_little_endian 1.0\n") + count;
+        h += "property float x\nproperty float y\nproperty float z\n";
+        if( !color.empty() )
+            h += "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+        if( !disparity.empty() )
+            h += "property short disparity\n";
+        return h + "end_header\n";
+    }
+
+    void checkFields(Size sz) const
+    {
+        CV_Assert( color.empty() || (color.size() == sz && (color.type() == CV_8UC3 || color.type() == CV_8UC1)) );
+        CV_Assert( disparity.empty() || (disparity.size() == sz && (disparity.type() == CV_16S || disparity.type() == CV_32F)) );
+    }
+
+    static const Mat& emptyMat()
+    {
+        static const Mat m;
+        return m;
+    }
+
+    const Mat& xyz;
+    const StereoReprojector* reproj;
+    const Mat& color;
+    const Mat& disparity;
+    int format;
+    double max_z;
+};
+
+struct StereoCloudEncodeInvoker : public ParallelLoopBody
+{
+    StereoCloudEncodeInvoker(const StereoCloudWriter& w_, std::vector<std::vector<char> >& bands_, std::vector<size_t>& counts_)
+    : w(w_), bands(&bands_), counts(&counts_) {}
+
+    void operator()(const Range& range) const
+    {
+        int nbands = (int)bands->size(), rows = w.size().height;
+        for( int i = range.start; i < range.end; i++ )
+        {
+            int y0 = (int)((int64)rows*i/nbands), y1 = (int)((int64)rows*(i + 1)/nbands);
+            std::vector<char>& out = (*bands)[i];
+            out.clear();
+            out.reserve((size_t)(y1 - y0)*w.size().width*std::max(w.recordSize(), (size_t)32)/2);
+            (*counts)[i] = w.encodeRows(y0, y1, out);
+        }
+    }
+
+    const StereoCloudWriter& w;
+    std::vector<std::vector<char> >* bands;
+    std::vector<size_t>* counts;
+};
+
+static inline bool stereoWriteCloud(const std::string& filename, const StereoCloudWriter& w, size_t* npoints)
+{
+    int format = w.format;
+    int nbands = std::max(1, std::min(w.size().height, stereoNumThreads()*4));
+    std::vector<std::vector<char> > bands(nbands);
+    std::vector<size_t> counts(nbands, 0);
+    parallel_for_(Range(0, nbands), StereoCloudEncodeInvoker(w, bands, counts));
+
+    size_t total = 0;
+    for( int i = 0; i < nbands; i++ )
+        total += counts[i];
+    if( npoints )
+        *npoints = total;
+
+    FILE* fp = fopen(filename.c_str(), format == STEREO_CLOUD_XYZ ? "wt" : "wb");
+    if( !fp )
+        return false;
+    bool ok = true;
+    if( format == STEREO_CLOUD_PLY )
+    {
+        std::string h = w.plyHeader(total);
+        ok = fwrite(h.data(), 1, h.size(), fp) == h.size();
+    }
+    for( int i = 0; i < nbands && ok; i++ )
+        ok = bands[i].empty() || fwrite(&bands[i][0], 1, bands[i].size(), fp) == bands[i].size();
+    return fclose(fp) == 0 && ok;
+}
+
+//writes the points of xyz (CV_32FC3) whose z passes the max_z filter; color and disparity may be empty.
+//Returns false when the file cannot be written; npoints receives the number of points kept.
+static inline bool stereoWritePointCloud(const std::string& filename, const Mat& xyz, const Mat& color, const Mat& disparity,
+                                         int format, double max_z = 1.0e4, size_t* npoints = 0)
+{
+    return stereoWriteCloud(filename, StereoCloudWriter(xyz, color, disparity, format, max_z), npoints);
+}
+
+//same points as reprojectImageTo3D(disparity in pixels, xyz, Q, true) + stereoWritePointCloud, reprojected
+//while encoding (see StereoReprojector); with_disparity adds the disparity of every point to the records
+static inline bool stereoWriteDisparityCloud(const std::string& filename, const Mat& disparity, const Mat& Q, const Mat& color,
+                                             bool with_disparity, int format, double max_z = 1.0e4, size_t* npoints = 0)
+{
+    StereoReprojector r(disparity, Q, max_z);
+    return stereoWriteCloud(filename, StereoCloudWriter(r, color, with_disparity ? disparity : Mat(), format, max_z), npoints);
+}
+
+#endif /* Stereo_PointCloud_hpp */
@@ -0,0 +1,468 @@
+//
+//  Stereo_Pyramid.hpp
+//  BMW_FM
+//
+//  Coarse-to-fine disparity search. The configured matcher runs on the pair
+//  downsampled levels times (1/2, 1/4, ...) with its disparity range scaled
+//  to match; every finer level then only looks at the disparities within
+//  radius of the doubled estimate of the level below. The costs of those
+//  candidates, taken relative to each pixel's estimate, are summed over the
+//  block with sliding column sums as in StereoSimdBM, so a level costs
+//  O(2*radius + 1) per pixel whatever the block size and disparity range.
+//
+//  Pixels the coarser level left invalid (occlusions, low texture, the left
+//  border) search the range between the nearest valid estimates to their
+//  left and right on the same row, or the full range when the row has none,
+//  with a plain SAD search over that range.
+//
+//  The finer levels always match SAD on the x-sobel image, whatever the
+//  matcher. At full resolution they apply the matcher's disp12MaxDiff as a
+//  left-right check on the costs of the chosen candidates (the lowest cost
+//  landing on a right pixel gives its disparity, as in StereoSGBM) and
+//  setUniquenessRatio's test against the candidates they searched.
+//
+
+#ifndef Stereo_Pyramid_hpp
+#define Stereo_Pyramid_hpp
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_SimdBM.hpp"
+
+#include <vector>
+#include <limits.h>
+
+using namespace cv;
+
+
+static inline int stereoFloorDiv(int a, int b)
+{
+    return a >= 0 ? a/b : -((-a + b - 1)/b);
+}
+
+class StereoPyramid
+{
+public:
+    //levels: number of halvings before the matcher runs (1: 1/2, 2: 1/4);
+    //radius: disparities searched either side of the estimate on the finer levels
+    StereoPyramid(int levels_ = 2, int radius_ = 2)
+    : levels(levels_), radius(radius_), textureThreshold(10), uniquenessRatio(0), preFilterCap(31) {}
+
+    int getLevels() const { return levels; }
+    void setLevels(int levels_) { levels = std::max(levels_, 0); }
+
+    int getRadius() const { return radius; }
+    void setRadius(int radius_) { radius = std::max(radius_, 1); }
+
+    //of the refinement levels, same meaning as in StereoBM
+    int getTextureThreshold() const { return textureThreshold; }
+    void setTextureThreshold(int textureThreshold_) { textureThreshold = textureThreshold_; }
+
+    //of the full-resolution level, same meaning as in StereoBM; 0 turns the test off
+    int getUniquenessRatio() const { return uniquenessRatio; }
+    void setUniquenessRatio(int uniquenessRatio_) { uniquenessRatio = std::max(uniquenessRatio_, 0); }
+
+    int getPreFilterCap() const { return preFilterCap; }
+    void setPreFilterCap(int preFilterCap_)
+    {
+        CV_Assert( preFilterCap_ >= 1 && preFilterCap_ <= 63 );
+        preFilterCap = preFilterCap_;
+    }
+
+    //matcher's disparity range and speckle filter are the full-resolution ones; they are scaled for the
+    //coarse run and put back afterwards. Its block size is kept for the coarse run (it is already wide
+    //there) and halved per level for the refinement, at least 5. disp: CV_16S with 4 fractional bits
+    void compute(const Ptr<StereoMatcher>& matcher, InputArray leftarr, InputArray rightarr, OutputArray disparr)
+    {
+        Mat left = leftarr.getMat(), right = rightarr.getMat();
+        CV_Assert( left.size() == right.size() && left.type() == right.type() );
+        if( levels <= 0 )
+        {
+            matcher->compute(left, right, disparr);
+            return;
+        }
+
+        int minD = matcher->getMinDisparity(), numD = matcher->getNumDisparities();
+        int blockSize = matcher->getBlockSize(), speckleWindow = matcher->getSpeckleWindowSize();
+        int disp12MaxDiff = matcher->getDisp12MaxDiff();
+        int s = 1 << levels;
+
+        //grayscale pyramid for the refinement, the matcher gets the coarsest level of its own input
+        std::vector<Mat> grayL(levels), grayR(levels);
+        if( left.channels() > 1 )
+        {
+            cvtColor(left, grayL[0], COLOR_BGR2GRAY);
+            cvtColor(right, grayR[0], COLOR_BGR2GRAY);
+        }
+        else
+        {
+            grayL[0] = left;
+            grayR[0] = right;
+        }
+        for( int i = 1; i < levels; i++ )
+        {
+            pyrDown(grayL[i - 1], grayL[i]);
+            pyrDown(grayR[i - 1], grayR[i]);
+        }
+        Mat coarseL = left, coarseR = right;
+        for( int i = 0; i < levels; i++ )
+        {
+            pyrDown(coarseL, coarseL);
+            pyrDown(coarseR, coarseR);
+        }
+
+        int cmin = stereoFloorDiv(minD, s), cmax = -stereoFloorDiv(-(minD + numD), s);
+        StereoBM* bm = dynamic_cast<StereoBM*>(matcher.get());
+        Rect roi1, roi2;
+        if( bm )
+        {
+            roi1 = bm->getROI1();
+            roi2 = bm->getROI2();
+            bm->setROI1(Rect(roi1.x/s, roi1.y/s, roi1.width/s, roi1.height/s));
+            bm->setROI2(Rect(roi2.x/s, roi2.y/s, roi2.width/s, roi2.height/s));
+        }
+        matcher->setMinDisparity(cmin);
+        matcher->setNumDisparities(std::max((cmax - cmin + 15) & -16, 16));
+        matcher->setSpeckleWindowSize(speckleWindow/(s*s));
+        Mat coarse;
+        try
+        {
+            matcher->compute(coarseL, coarseR, coarse);
+        }
+        catch( const cv::Exception& )
+        {
+            restore(matcher, bm, minD, numD, speckleWindow, roi1, roi2);
+            throw;
+        }
+        restore(matcher, bm, minD, numD, speckleWindow, roi1, roi2);
+        CV_Assert( coarse.type() == CV_16S );
+
+        Mat_<int> guide(coarse.size());
+        for( int y = 0; y < coarse.rows; y++ )
+        {
+            const short* d = coarse.ptr<short>(y);
+            for( int x = 0; x < coarse.cols; x++ )
+                guide(y, x) = d[x] >= cmin*StereoMatcher::DISP_SCALE ? (d[x] + 8) >> 4 : INT_MIN;
+        }
+
+        for( int level = levels - 1; level >= 0; level-- )
+        {
+            int sl = 1 << level;
+            Size size = grayL[level].size();
+            Mat_<int> up(size);
+            for( int y = 0; y < size.height; y++ )
+            {
+                const int* g = guide[std::min(y/2, guide.rows - 1)];
+                for( int x = 0; x < size.width; x++ )
+                {
+                    int v = g[std::min(x/2, guide.cols - 1)];
+                    up(y, x) = v == INT_MIN ? INT_MIN : v*2;
+                }
+            }
+            if( level == 0 )
+                disparr.create(size, CV_16S);
+            Mat disp = level == 0 ? disparr.getMat() : Mat();
+            refine(grayL[level], grayR[level], up, stereoFloorDiv(minD, sl), -stereoFloorDiv(-(minD + numD), sl) - 1,
+                   std::max(blockSize/sl | 1, 5), guide, level == 0 ? &disp : 0, (minD - 1)*StereoMatcher::DISP_SCALE,
+                   level == 0 ? disp12MaxDiff : -1);
+        }
+
+        if( speckleWindow > 0 )
+        {
+            Mat disp = disparr.getMat();
+            filterSpeckles(disp, (minD - 1)*StereoMatcher::DISP_SCALE, speckleWindow, matcher->getSpeckleRange(), speckleBuf);
+        }
+    }
+
+protected:
+    static void restore(const Ptr<StereoMatcher>& matcher, StereoBM* bm, int minD, int numD, int speckleWindow, Rect roi1, Rect roi2)
+    {
+        matcher->setMinDisparity(minD);
+        matcher->setNumDisparities(numD);
+        matcher->setSpeckleWindowSize(speckleWindow);
+        if( bm )
+        {
+            bm->setROI1(roi1);
+            bm->setROI2(roi2);
+        }
+    }
+
+    //one finer level: guideIn holds the doubled estimates (INT_MIN where invalid), guideOut gets the
+    //integer disparities of this level and disp, when given, the sub-pixel CV_16S result with the
+    //uniqueness test; maxDiff >= 0 adds the left-right check
+    void refine(const Mat& left, const Mat& right, const Mat_<int>& guideIn, int dmin, int dmax, int blockSize,
+                Mat_<int>& guideOut, Mat* disp, int filtered, int maxDiff) const
+    {
+        int height = left.rows, width = left.cols;
+        Mat leftPF, rightPF;
+        simdbmPrefilterXSobel(left, leftPF, preFilterCap);
+        simdbmPrefilterXSobel(right, rightPF, preFilterCap);
+
+        //per pixel: centre of the candidates and the range to search
+        Mat_<int> centre(height, width), lo(height, width), hi(height, width);
+        //rows without any estimate (the block margin at the top and bottom) borrow the nearest row that has one
+        std::vector<int> source(height, -1), prev(width), next(width);
+        for( int y = 0, last = -1; y < height; y++ )
+        {
+            const int* g = guideIn[y];
+            for( int x = 0; x < width && last != y; x++ )
+                if( g[x] != INT_MIN )
+                    last = y;
+            source[y] = last;
+        }
+        for( int y = height - 1, last = -1; y >= 0; y-- )
+        {
+            if( source[y] == y )
+                last = y;
+            else if( last >= 0 && (source[y] < 0 || last - y < y - source[y]) )
+                source[y] = last;
+        }
+        for( int y = 0; y < height; y++ )
+        {
+            const int* g = guideIn[source[y] >= 0 ? source[y] : y];
+            for( int x = 0, last = INT_MIN; x < width; x++ )
+                prev[x] = last = g[x] != INT_MIN ? g[x] : last;
+            for( int x = width - 1, last = INT_MIN; x >= 0; x-- )
+                next[x] = last = g[x] != INT_MIN ? g[x] : last;
+            for( int x = 0; x < width; x++ )
+            {
+                int a = prev[x], b = next[x];
+                if( a == INT_MIN && b == INT_MIN )
+                {
+                    a = dmin + radius;
+                    b = dmax - radius;
+                }
+                else if( a == INT_MIN || (b != INT_MIN && b < a) )
+                    std::swap(a, b);
+                if( b == INT_MIN )
+                    b = a;
+                lo(y, x) = std::max(a - radius, dmin);
+                hi(y, x) = std::min(b + radius, dmax);
+                centre(y, x) = std::min(std::max((lo(y, x) + hi(y, x))/2, dmin), dmax);
+            }
+        }
+
+        guideOut.create(height, width);
+        int nbands = std::max(1, std::min(stereoNumThreads()*2, height/(blockSize*4)));
+        parallel_for_(Range(0, nbands), RefineInvoker(*this, leftPF, rightPF, centre, lo, hi, dmin, dmax, guideOut, disp, blockSize, filtered, maxDiff, nbands),
+                      nbands);
+    }
+
+    //one band of rows. The costs of the 2*radius + 1 candidates around every pixel's centre and its
+    //texture term are kept as column sums over the block height that move down a row at a time,
+    //as in StereoSimdBM, and slide along the row to give the window sums
+    struct RefineInvoker : public ParallelLoopBody
+    {
+        RefineInvoker(const StereoPyramid& pyr_, const Mat& leftPF_, const Mat& rightPF_, const Mat_<int>& centre_,
+                      const Mat_<int>& lo_, const Mat_<int>& hi_, int dmin_, int dmax_, Mat_<int>& guideOut_, Mat* disp_,
+                      int blockSize_, int filtered_, int maxDiff_, int nbands_)
+        : pyr(pyr_), leftPF(leftPF_), rightPF(rightPF_), centre(centre_), lo(lo_), hi(hi_), dmin(dmin_), dmax(dmax_),
+        guideOut(&guideOut_), disp(disp_), blockSize(blockSize_), filtered(filtered_), maxDiff(maxDiff_), nbands(nbands_) {}
+
+        void operator()(const Range& range) const
+        {
+            int height = leftPF.rows, width = leftPF.cols, r = blockSize/2, nk = 2*pyr.radius + 2;
+            std::vector<int> col((size_t)width*nk), sad(nk), disp2(width), disp2cost(width);
+            std::vector<uchar> padded(width + dmax - dmin + 2*pyr.radius + 1);
+            for( int i = range.start; i < range.end; i++ )
+            {
+                int y0 = (int)((int64)height*i/nbands), y1 = (int)((int64)height*(i + 1)/nbands);
+                for( int y = y0; y < y1; y++ )
+                {
+                    int* g = (*guideOut)[y];
+                    short* dptr = disp ? disp->ptr<short>(y) : 0;
+                    for( int x = 0; x < width; x++ )
+                    {
+                        g[x] = INT_MIN;
+                        if( dptr )
+                            dptr[x] = (short)filtered;
+                    }
+                }
+
+                int ystart = std::max(y0, r), yend = std::min(y1, height - r);
+                if( ystart >= yend || width <= 2*r )
+                    continue;
+                std::fill(col.begin(), col.end(), 0);
+                for( int yy = ystart - r; yy < ystart + r; yy++ )
+                    accumulateRow(&col[0], &padded[0], yy, 1);
+                for( int y = ystart; y < yend; y++ )
+                {
+                    accumulateRow(&col[0], &padded[0], y + r, 1);
+                    if( y > ystart )
+                        accumulateRow(&col[0], &padded[0], y - r - 1, -1);
+                    selectRow(y, &col[0], &sad[0], &disp2[0], &disp2cost[0]);
+                }
+            }
+        }
+
+        //col[x][k] += sign*|L(x) - R(x - centre - k + radius)|, col[x][nk - 1] the texture term
+        void accumulateRow(int* col, uchar* padded, int y, int sign) const
+        {
+            int width = leftPF.cols, radius = pyr.radius, nk = 2*radius + 2;
+            const uchar* l = leftPF.ptr<uchar>(y);
+            const uchar* rr = rightPF.ptr<uchar>(y);
+            const int* c = centre[y];
+
+            //the right row with its edge pixels repeated over every offset a candidate can reach
+            int ofs = dmax + radius, npadded = width + dmax - dmin + 2*radius + 1;
+            for( int j = 0; j < npadded; j++ )
+                padded[j] = rr[std::min(std::max(j - ofs, 0), width - 1)];
+            const uchar* rp = padded + ofs + radius;
+            for( int x = 0; x < width; x++, col += nk )
+            {
+                int lv = l[x];
+                const uchar* rx = rp + x - c[x];
+                for( int k = 0; k < nk - 1; k++ )
+                    col[k] += sign*std::abs(lv - rx[-k]);
+                col[nk - 1] += sign*std::abs(lv - pyr.preFilterCap);
+            }
+        }
+
+        //disp2/disp2cost: the disparity of every right pixel of the row and its cost, for the left-right check
+        void selectRow(int y, const int* col, int* sad, int* disp2, int* disp2cost) const
+        {
+            int width = leftPF.cols, radius = pyr.radius, nk = 2*radius + 2, r = blockSize/2;
+            int* g = (*guideOut)[y];
+            short* dptr = disp ? disp->ptr<short>(y) : 0;
+            for( int x = 0; x < width; x++ )
+            {
+                disp2[x] = INT_MIN;
+                disp2cost[x] = INT_MAX;
+            }
+            for( int k = 0; k < nk; k++ )
+                sad[k] = 0;
+            for( int x = 0; x <= 2*r; x++ )
+                for( int k = 0; k < nk; k++ )
+                    sad[k] += col[(size_t)x*nk + k];
+
+            //window sums of the current run of pixels that search beyond the candidates around their centre
+            std::vector<int> colsum, runCost;
+            int runStart = -1, runEnd = -1;
+            for( int x = r; x < width - r; x++ )
+            {
+                if( x > r )
+                {
+                    const int* add = col + (size_t)(x + r)*nk;
+                    const int* sub = col + (size_t)(x - r - 1)*nk;
+                    for( int k = 0; k < nk; k++ )
+                        sad[k] += add[k] - sub[k];
+                }
+                int d0 = lo(y, x), d1 = hi(y, x), n = d1 - d0 + 1, c = centre(y, x);
+                if( n <= 0 || sad[nk - 1] < pyr.textureThreshold )
+                    continue;
+                if( d0 >= c - radius && d1 <= c + radius )
+                {
+                    choose(x, d0, sad + d0 - c + radius, n, g, dptr, disp2, disp2cost);
+                    continue;
+                }
+                if( x > runEnd )
+                {
+                    runStart = x;
+                    runEnd = x;
+                    while( runEnd + 1 < width - r && lo(y, runEnd + 1) == d0 && hi(y, runEnd + 1) == d1 )
+                        runEnd++;
+                    runSums(y, runStart, runEnd, d0, n, colsum, runCost);
+                }
+                choose(x, d0, &runCost[(size_t)(x - runStart)*n], n, g, dptr, disp2, disp2cost);
+            }
+
+            //left-right check: the right pixel a match lands on must see about the same disparity
+            if( maxDiff < 0 )
+                return;
+            for( int x = r; x < width - r; x++ )
+                if( g[x] != INT_MIN && std::abs(disp2[x - g[x]] - g[x]) > maxDiff )
+                {
+                    g[x] = INT_MIN;
+                    if( dptr )
+                        dptr[x] = (short)filtered;
+                }
+        }
+
+        //pixels x0..x1 of row y all lie between the same two valid estimates and search d0..d0+n-1:
+        //their window sums from column sums over the block height, slid along the run
+        void runSums(int y, int x0, int x1, int d0, int n, std::vector<int>& colsum, std::vector<int>& cost) const
+        {
+            int width = leftPF.cols, r = blockSize/2, ncols = x1 - x0 + 1 + 2*r;
+            colsum.assign((size_t)ncols*n, 0);
+            for( int yy = y - r; yy <= y + r; yy++ )
+            {
+                const uchar* l = leftPF.ptr<uchar>(yy);
+                const uchar* rr = rightPF.ptr<uchar>(yy);
+                for( int j = 0; j < ncols; j++ )
+                {
+                    int xx = x0 - r + j, lv = l[xx];
+                    int* cs = &colsum[(size_t)j*n];
+                    for( int i = 0; i < n; i++ )
+                        cs[i] += std::abs(lv - rr[std::min(std::max(xx - d0 - i, 0), width - 1)]);
+                }
+            }
+            cost.assign((size_t)(x1 - x0 + 1)*n, 0);
+            for( int j = 0; j <= 2*r; j++ )
+                for( int i = 0; i < n; i++ )
+                    cost[i] += colsum[(size_t)j*n + i];
+            for( int x = x0 + 1; x <= x1; x++ )
+            {
+                int* cur = &cost[(size_t)(x - x0)*n];
+                const int* prev = cur - n;
+                const int* add = &colsum[(size_t)(x - x0 + 2*r)*n];
+                const int* sub = &colsum[(size_t)(x - x0 - 1)*n];
+                for( int i = 0; i < n; i++ )
+                    cur[i] = prev[i] + add[i] - sub[i];
+            }
+        }
+
+        //lowest of the n costs of disparities d0.., with the uniqueness test and the sub-pixel fit for the final level
+        void choose(int x, int d0, const int* cost, int n, int* g, short* dptr, int* disp2, int* disp2cost) const
+        {
+            int best = 0;
+            for( int i = 1; i < n; i++ )
+                if( cost[i] < cost[best] )
+                    best = i;
+            int d = d0 + best;
+            if( x - d < 0 || x - d >= leftPF.cols )
+                return;
+            if( dptr && pyr.uniquenessRatio > 0 )
+            {
+                //as StereoBM: no other candidate but the neighbours within the ratio of the best
+                int thresh = cost[best] + cost[best]*pyr.uniquenessRatio/100;
+                for( int i = 0; i < n; i++ )
+                    if( (i < best - 1 || i > best + 1) && cost[i] <= thresh )
+                        return;
+            }
+            g[x] = d;
+            if( disp2cost[x - d] > cost[best] )
+            {
+                disp2cost[x - d] = cost[best];
+                disp2[x - d] = d;
+            }
+            if( dptr )
+            {
+                //equiangular fit as in StereoSimdBM, neighbours mirrored at the ends of the range
+                int m = cost[best];
+                int p = n > 1 ? cost[best > 0 ? best - 1 : 1] : m;
+                int q = n > 1 ? cost[best < n - 1 ? best + 1 : n - 2] : m;
+                int denom = p + q - 2*m + std::abs(p - q);
+                dptr[x] = (short)((d*256 + (denom != 0 ? (p - q)*256/denom : 0) + 15) >> 4);
+            }
+        }
+
+        const StereoPyramid& pyr;
+        const Mat& leftPF;
+        const Mat& rightPF;
+        const Mat_<int>& centre;
+        const Mat_<int>& lo;
+        const Mat_<int>& hi;
+        int dmin, dmax;
+        Mat_<int>* guideOut;
+        Mat* disp;
+        int blockSize, filtered, maxDiff, nbands;
+    };
+
+    int levels, radius;
+    int textureThreshold, uniquenessRatio, preFilterCap;
+    Mat speckleBuf;
+};
+
+#endif /* Stereo_Pyramid_hpp */
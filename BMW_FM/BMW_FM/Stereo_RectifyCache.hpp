@@ -0,0 +1,147 @@
+//
+//  Stereo_RectifyCache.hpp
+//  BMW_FM
+//
+//  Binary cache of the finished rectification maps, Q and the valid ROIs.
+//  The file starts with a fixed header holding the calibration key; the four
+//  maps follow at 64-byte aligned offsets and are used in place from an mmap
+//  of the file, so loading costs a few page faults instead of
+//  stereoRectify + initUndistortRectifyMap. A key mismatch (calibration,
+//  image size or scale changed) makes the caller rebuild and overwrite it.
+//
+
+#ifndef Stereo_RectifyCache_hpp
+#define Stereo_RectifyCache_hpp
+
+#include "opencv2/core.hpp"
+
+#include "Stereo_Hash.hpp"
+#include "Stereo_MappedFile.hpp"
+
+#include <string>
+#include <stdio.h>
+
+using namespace cv;
+
+
+//undistort/rectify maps of both cameras; when loaded from a cache the maps point into mapping
+struct StereoRectification
+{
+    Mat map11, map12, map21, map22;
+    Mat Q;
+    Rect roi1, roi2;
+    Ptr<StereoMappedFile> mapping;
+};
+
+struct StereoRectifyCacheHeader
+{
+    char magic[8];
+    uint64 key;
+    int width, height;
+    int roi1[4], roi2[4];
+    double Q[16];
+    int mapType[4];
+    uint64 mapOffset[4];
+};
+
+static const char STEREO_RECTIFY_CACHE_MAGIC[8] = { 'S', 'T', 'R', 'M', 'A', 'P', '0', '1' };
+
+//key of everything the maps depend on; M1/M2 before scaling
+static inline uint64 stereoRectifyKey(const Mat& M1, const Mat& D1, const Mat& M2, const Mat& D2,
+                                      const Mat& R, const Mat& T, Size imageSize, float scale)
+{
+    uint64 h = stereoHashString("stereoRectify CALIB_ZERO_DISPARITY alpha=-1 CV_16SC2");
+    h = stereoHashMat(M1, h);
+    h = stereoHashMat(D1, h);
+    h = stereoHashMat(M2, h);
+    h = stereoHashMat(D2, h);
+    h = stereoHashMat(R, h);
+    h = stereoHashMat(T, h);
+    h = stereoHashValue(imageSize.width, h);
+    h = stereoHashValue(imageSize.height, h);
+    return stereoHashValue(scale, h);
+}
+
+static inline bool stereoLoadRectifyCache(const std::string& filename, uint64 key, Size imageSize, StereoRectification& rect)
+{
+    Ptr<StereoMappedFile> file = makePtr<StereoMappedFile>();
+    if( !file->open(filename) || file->size() < sizeof(StereoRectifyCacheHeader) )
+        return false;
+    StereoRectifyCacheHeader hdr;
+    memcpy(&hdr, file->data(), sizeof(hdr));
+    if( memcmp(hdr.magic, STEREO_RECTIFY_CACHE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.key != key ||
+        hdr.width != imageSize.width || hdr.height != imageSize.height )
+        return false;
+
+    Mat* maps[] = { &rect.map11, &rect.map12, &rect.map21, &rect.map22 };
+    for( int i = 0; i < 4; i++ )
+    {
+        size_t bytes = (size_t)hdr.width*hdr.height*CV_ELEM_SIZE(hdr.mapType[i]);
+        if( hdr.mapOffset[i] % 64 != 0 || hdr.mapOffset[i] + bytes > file->size() )
+            return false;
+    }
+    for( int i = 0; i < 4; i++ )
+        *maps[i] = Mat(hdr.height, hdr.width, hdr.mapType[i], file->data() + hdr.mapOffset[i]);
+    Mat(4, 4, CV_64F, hdr.Q).copyTo(rect.Q);
+    rect.roi1 = Rect(hdr.roi1[0], hdr.roi1[1], hdr.roi1[2], hdr.roi1[3]);
+    rect.roi2 = Rect(hdr.roi2[0], hdr.roi2[1], hdr.roi2[2], hdr.roi2[3]);
+    rect.mapping = file;
+    return true;
+}
+
+//writes to a temporary file first so a concurrent reader never sees half a cache
+static inline bool stereoSaveRectifyCache(const std::string& filename, uint64 key, const StereoRectification& rect)
+{
+    const Mat* maps[] = { &rect.map11, &rect.map12, &rect.map21, &rect.map22 };
+    StereoRectifyCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STEREO_RECTIFY_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.key = key;
+    hdr.width = rect.map11.cols;
+    hdr.height = rect.map11.rows;
+    const Rect* rois[] = { &rect.roi1, &rect.roi2 };
+    int* dst[] = { hdr.roi1, hdr.roi2 };
+    for( int i = 0; i < 2; i++ )
+    {
+        dst[i][0] = rois[i]->x;
+        dst[i][1] = rois[i]->y;
+        dst[i][2] = rois[i]->width;
+        dst[i][3] = rois[i]->height;
+    }
+    Mat Q64;
+    rect.Q.convertTo(Q64, CV_64F);
+    CV_Assert( Q64.total() == 16 );
+    memcpy(hdr.Q, Q64.ptr<double>(), sizeof(hdr.Q));
+    uint64 ofs = (sizeof(hdr) + 63) & ~(uint64)63;
+    for( int i = 0; i < 4; i++ )
+    {
+        CV_Assert( maps[i]->size() == rect.map11.size() );
+        hdr.mapType[i] = maps[i]->type();
+        hdr.mapOffset[i] = ofs;
+        ofs = (ofs + maps[i]->total()*maps[i]->elemSize() + 63) & ~(uint64)63;
+    }
+
+    std::string tmpname = filename + ".tmp";
+    FILE* fp = fopen(tmpname.c_str(), "wb");
+    if( !fp )
+        return false;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    static const char zeros[64] = {0};
+    uint64 pos = sizeof(hdr);
+    for( int i = 0; i < 4 && ok; i++ )
+    {
+        ok = fwrite(zeros, 1, (size_t)(hdr.mapOffset[i] - pos), fp) == hdr.mapOffset[i] - pos;
+        pos = hdr.mapOffset[i];
+        size_t rowSize = maps[i]->cols*maps[i]->elemSize();
+        for( int y = 0; y < maps[i]->rows && ok; y++ )
+            ok = fwrite(maps[i]->ptr(y), 1, rowSize, fp) == rowSize;
+        pos += rowSize*maps[i]->rows;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if( ok && rename(tmpname.c_str(), filename.c_str()) == 0 )
+        return true;
+    remove(tmpname.c_str());
+    return false;
+}
+
+#endif /* Stereo_RectifyCache_hpp */
@@ -0,0 +1,269 @@
+//
+//  Stereo_Refine.hpp
+//  BMW_FM
+//
+//  Post-matching refinement for any matcher: takes its CV_16S map (x16)
+//  and gives CV_32F disparities in pixels plus a confidence in [0, 1],
+//  in one pass over the rows. Per row, the SAD of a small window at the
+//  matched disparity and its two neighbours is computed for every pixel
+//  (one SIMD sum of absolute differences per window row), the right-view
+//  disparities are derived from it as StereoSGBM does (the lowest cost
+//  landing on a right pixel wins), and a second sweep over the same row
+//  buffers applies the left-right check, the sub-pixel fit and the
+//  confidence. Nothing but the two outputs is written at frame size.
+//
+
+#ifndef Stereo_Refine_hpp
+#define Stereo_Refine_hpp
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_Simd.hpp"
+#include "Stereo_ThreadPool.hpp"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <limits.h>
+
+using namespace cv;
+
+
+enum { STEREO_SUBPIXEL_PARABOLA = 0, STEREO_SUBPIXEL_EQUIANGULAR = 1 };
+
+struct StereoRefineOptions
+{
+    StereoRefineOptions() : subpixel(STEREO_SUBPIXEL_PARABOLA), radius(2), maxDiff(1) {}
+    int subpixel;       //STEREO_SUBPIXEL_*: parabola suits smooth (SGM-like) costs, equiangular SAD-like ones
+    int radius;         //the SAD window is 2*radius + 1 square, 0..3
+    double maxDiff;     //left-right tolerance in pixels; < 0 skips the check
+};
+
+//SAD of one window row of at most 8 pixels: the first n bytes of a against those of b
+//(cost at d), b + 1 (d - 1) and b - 1 (d + 1)
+#if defined(STEREO_SIMD_SSE2)
+
+static inline void stereoRefineSadRow(const uchar* a, const uchar* b, int n, int& c0, int& cm, int& cp)
+{
+    static const uchar ones[16] = { 255, 255, 255, 255, 255, 255, 255, 255, 0, 0, 0, 0, 0, 0, 0, 0 };
+    __m128i mask = _mm_loadl_epi64((const __m128i*)(ones + 8 - n));
+    __m128i l = _mm_and_si128(_mm_loadl_epi64((const __m128i*)a), mask);
+    __m128i r0 = _mm_and_si128(_mm_loadl_epi64((const __m128i*)b), mask);
+    //d - 1 in the low half, d + 1 in the high half: one psadbw for both
+    __m128i rmp = _mm_and_si128(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(b + 1)), _mm_loadl_epi64((const __m128i*)(b - 1))),
+                                _mm_unpacklo_epi64(mask, mask));
+    __m128i s0 = _mm_sad_epu8(l, r0);
+    __m128i smp = _mm_sad_epu8(_mm_unpacklo_epi64(l, l), rmp);
+    c0 += _mm_cvtsi128_si32(s0);
+    cm += _mm_cvtsi128_si32(smp);
+    cp += _mm_cvtsi128_si32(_mm_srli_si128(smp, 8));
+}
+
+#elif defined(STEREO_SIMD_NEON)
+
+static inline void stereoRefineSadRow(const uchar* a, const uchar* b, int n, int& c0, int& cm, int& cp)
+{
+    static const uchar ones[16] = { 255, 255, 255, 255, 255, 255, 255, 255, 0, 0, 0, 0, 0, 0, 0, 0 };
+    uint8x8_t mask = vld1_u8(ones + 8 - n);
+    uint8x8_t l = vand_u8(vld1_u8(a), mask);
+    c0 += vaddlv_u8(vabd_u8(l, vand_u8(vld1_u8(b), mask)));
+    cm += vaddlv_u8(vabd_u8(l, vand_u8(vld1_u8(b + 1), mask)));
+    cp += vaddlv_u8(vabd_u8(l, vand_u8(vld1_u8(b - 1), mask)));
+}
+
+#else
+
+static inline void stereoRefineSadRow(const uchar* a, const uchar* b, int n, int& c0, int& cm, int& cp)
+{
+    for( int i = 0; i < n; i++ )
+    {
+        c0 += std::abs(a[i] - b[i]);
+        cm += std::abs(a[i] - b[i + 1]);
+        cp += std::abs(a[i] - b[i - 1]);
+    }
+}
+
+#endif
+
+class StereoRefineInvoker : public ParallelLoopBody
+{
+public:
+    //columns of replicated border on each side of a padded row, enough for the 8-byte loads
+    enum { PAD = 16 };
+
+    StereoRefineInvoker(const Mat& left_, const Mat& right_, const Mat& disp16_, int minD_, int numD_,
+                        const StereoRefineOptions& opts_, Mat& disp_, Mat& conf_, int nstripes_)
+    : left(left_), right(right_), disp16(disp16_), minD(minD_), numD(numD_), opts(opts_), disp(disp_), conf(conf_), nstripes(nstripes_) {}
+
+    void operator()(const Range& range) const
+    {
+        const int width = disp16.cols, height = disp16.rows, r = opts.radius, n = 2*r + 1;
+        const int rowStep = width + 2*PAD;
+        const short INVALID16 = (short)(minD*StereoMatcher::DISP_SCALE);
+        const float INVALID = (float)(minD - 1);
+        const int tolerance = opts.maxDiff < 0 ? -1 : cvRound(opts.maxDiff*StereoMatcher::DISP_SCALE);
+
+        //ring of the n padded gray rows around the current one, for both views
+        std::vector<uchar> lbuf((size_t)n*rowStep), rbuf((size_t)n*rowStep);
+        //per-pixel costs at d, d - 1, d + 1 and the right view of the row
+        std::vector<int> cost((size_t)width*3), disp2cost(width);
+        std::vector<short> disp2(width);
+
+        for( int s = range.start; s < range.end; s++ )
+        {
+            int y0 = (int)((int64)height*s/nstripes), y1 = (int)((int64)height*(s + 1)/nstripes);
+            for( int yy = y0 - r; yy < y0 + r; yy++ )
+                loadRow(yy, &lbuf[0], &rbuf[0], n, rowStep);
+            for( int y = y0; y < y1; y++ )
+            {
+                loadRow(y + r, &lbuf[0], &rbuf[0], n, rowStep);
+                const uchar* lrows[7];
+                const uchar* rrows[7];
+                for( int j = 0; j < n; j++ )
+                {
+                    int slot = ((y - r + j) % n + n) % n;
+                    lrows[j] = &lbuf[(size_t)slot*rowStep] + PAD;
+                    rrows[j] = &rbuf[(size_t)slot*rowStep] + PAD;
+                }
+
+                const short* d16 = disp16.ptr<short>(y);
+                float* dout = disp.ptr<float>(y);
+                float* cf = conf.ptr<float>(y);
+                int* c = &cost[0];
+                for( int x = 0; x < width; x++ )
+                {
+                    disp2[x] = (short)(INVALID16 - StereoMatcher::DISP_SCALE);
+                    disp2cost[x] = INT_MAX;
+                }
+
+                //first sweep: window costs and the right-view disparities
+                for( int x = 0; x < width; x++ )
+                {
+                    int dq = d16[x];
+                    if( dq < INVALID16 )
+                        continue;
+                    int d = (dq + StereoMatcher::DISP_SCALE/2) >> StereoMatcher::DISP_SHIFT;
+                    int xl = std::min(std::max(x - r, 1 - PAD), width + PAD - 9);
+                    int xr = std::min(std::max(x - d - r, 1 - PAD), width + PAD - 9);
+                    int c0 = 0, cm = 0, cp = 0;
+                    for( int j = 0; j < n; j++ )
+                        stereoRefineSadRow(lrows[j] + xl, rrows[j] + xr, n, c0, cm, cp);
+                    c[x*3] = c0;
+                    c[x*3 + 1] = cm;
+                    c[x*3 + 2] = cp;
+                    int x2 = x - d;
+                    if( x2 >= 0 && x2 < width && disp2cost[x2] > c0 )
+                    {
+                        disp2cost[x2] = c0;
+                        disp2[x2] = (short)dq;
+                    }
+                }
+
+                //second sweep: left-right check, sub-pixel fit and confidence
+                for( int x = 0; x < width; x++ )
+                {
+                    int dq = d16[x];
+                    dout[x] = INVALID;
+                    cf[x] = 0.f;
+                    if( dq < INVALID16 )
+                        continue;
+                    int d = (dq + StereoMatcher::DISP_SCALE/2) >> StereoMatcher::DISP_SHIFT;
+                    int x2 = x - d;
+                    if( tolerance >= 0 && (x2 < 0 || x2 >= width || std::abs(disp2[x2] - dq) > tolerance) )
+                        continue;
+                    int c0 = c[x*3], cm = c[x*3 + 1], cp = c[x*3 + 2];
+                    int cmin = std::min(cm, cp);
+                    if( c0 > cmin || d <= minD || d >= minD + numD - 1 )
+                    {
+                        //no minimum at d under this cost (or no neighbour in range): keep the matcher's value
+                        dout[x] = dq*(1.f/StereoMatcher::DISP_SCALE);
+                        continue;
+                    }
+                    int denom = opts.subpixel == STEREO_SUBPIXEL_EQUIANGULAR ? std::max(cm, cp) - c0 : cm + cp - 2*c0;
+                    dout[x] = d + (denom > 0 ? (cm - cp)*0.5f/denom : 0.f);
+                    //how far the neighbours rise above the minimum, relative to them
+                    cf[x] = (float)(cmin - c0)/(cmin + 1);
+                }
+            }
+        }
+    }
+
+protected:
+    //gray row yy (clamped to the image) of both views into its ring slot, borders replicated
+    void loadRow(int yy, uchar* lbuf, uchar* rbuf, int n, int rowStep) const
+    {
+        int slot = (yy % n + n) % n, y = std::min(std::max(yy, 0), left.rows - 1);
+        padRow(left, y, lbuf + (size_t)slot*rowStep);
+        padRow(right, y, rbuf + (size_t)slot*rowStep);
+    }
+
+    static void padRow(const Mat& img, int y, uchar* dst)
+    {
+        const int width = img.cols;
+        if( img.channels() == 1 )
+            memcpy(dst + PAD, img.ptr(y), width);
+        else
+        {
+            Mat gray(1, width, CV_8U, dst + PAD);
+            cvtColor(img.row(y), gray, img.channels() == 4 ? COLOR_BGRA2GRAY : COLOR_BGR2GRAY);
+        }
+        memset(dst, dst[PAD], PAD);
+        memset(dst + PAD + width, dst[PAD + width - 1], PAD);
+    }
+
+    const Mat& left;
+    const Mat& right;
+    const Mat& disp16;
+    int minD, numD;
+    StereoRefineOptions opts;
+    Mat& disp;
+    Mat& conf;
+    int nstripes;
+};
+
+//disp16 is the CV_16S (x16) map a matcher searching [minDisparity, minDisparity + numDisparities) gave for the
+//rectified 8-bit pair left/right (gray or BGR). disp receives CV_32F disparities in pixels, minDisparity - 1
+//where there is none or the left-right check fails; confidence CV_32F in [0, 1], 0 where the disparity is
+//missing or the window cost has no clear minimum at it.
+static inline void stereoRefineDisparity(const Mat& left, const Mat& right, const Mat& disp16, int minDisparity, int numDisparities,
+                                         const StereoRefineOptions& opts, Mat& disp, Mat& confidence)
+{
+    CV_Assert( disp16.type() == CV_16S && left.size() == disp16.size() && right.size() == disp16.size() &&
+               left.type() == right.type() && left.depth() == CV_8U && opts.radius >= 0 && opts.radius <= 3 );
+    disp.create(disp16.size(), CV_32F);
+    confidence.create(disp16.size(), CV_32F);
+    if( disp16.empty() )
+        return;
+    int nstripes = std::max(1, std::min(stereoNumThreads()*4, disp16.rows/8));
+    parallel_for_(Range(0, nstripes), StereoRefineInvoker(left, right, disp16, minDisparity, numDisparities, opts, disp, confidence, nstripes),
+                  nstripes);
+}
+
+//a CV_32F single-channel map as little-endian PFM (rows bottom to top), the format stereoReadGroundTruth reads
+static inline bool stereoWritePFM(const std::string& filename, const Mat& m)
+{
+    CV_Assert( m.type() == CV_32F );
+    FILE* f = fopen(filename.c_str(), "wb");
+    if( !f )
+        return false;
+    bool ok = fprintf(f, "Pf\n%d %d\n-1.0\n", m.cols, m.rows) > 0;
+    uint32_t probe = 1;
+    bool little = *(uchar*)&probe == 1;
+    std::vector<uchar> row((size_t)m.cols*4);
+    for( int y = m.rows - 1; y >= 0 && ok; y-- )
+    {
+        memcpy(&row[0], m.ptr(y), row.size());
+        if( !little )
+            for( size_t x = 0; x < row.size(); x += 4 )
+            {
+                std::swap(row[x], row[x + 3]);
+                std::swap(row[x + 1], row[x + 2]);
+            }
+        ok = fwrite(&row[0], 1, row.size(), f) == row.size();
+    }
+    return fclose(f) == 0 && ok;
+}
+
+#endif /* Stereo_Refine_hpp */
@@ -0,0 +1,728 @@
+//
+//  Stereo_SGM.hpp
+//  BMW_FM
+//
+//  Semi-Global Matching with 16-bit saturating path costs. The matching
+//  cost is pluggable (StereoMatchingCost); the default is Birchfield-Tomasi
+//  on x-sobel pre-filtered images, optionally summed over a small block.
+//
+//  MODE_FULL aggregates 8 paths over the whole W x H x D volume. The paths
+//  are split into a top-down sweep (left, top-left, top, top-right) and a
+//  bottom-up sweep (right, bottom-right, bottom, bottom-left) that run on
+//  two threads at the same time, each with its own sum volume.
+//
+//  MODE_STRIP keeps only a few rows of costs: horizontal strips are matched
+//  independently with 5 paths (left, right, top-left, top, top-right), so
+//  the working memory is about 16 x W x D x 2 bytes per strip in flight,
+//  whatever the image height.
+//
+
+#ifndef Stereo_SGM_hpp
+#define Stereo_SGM_hpp
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_Simd.hpp"
+#include "Stereo_ThreadPool.hpp"
+#include "Stereo_SimdBM.hpp"
+
+#include <vector>
+#include <limits.h>
+
+using namespace cv;
+
+
+//a matching cost laid out as cost[x*numDisparities + d] for disparity minDisparity + d
+class StereoMatchingCost
+{
+public:
+    virtual ~StereoMatchingCost() {}
+
+    //called once per pair before computeRows(); fixes the disparity range of the layout
+    virtual void prepare(const Mat& left, const Mat& right, int minDisparity, int numDisparities) = 0;
+
+    //writes rows [y0, y1) to cost + (y - y0)*rowStep; called concurrently on disjoint rows
+    virtual void computeRows(int y0, int y1, ushort* cost, size_t rowStep) const = 0;
+
+    //P1/P2 that suit the range of this cost
+    virtual void defaultPenalties(int& P1, int& P2) const = 0;
+};
+
+
+//a per-pixel cost summed over a blockSize x blockSize box (replicated at the image border).
+//Subclasses fill in prepare() and pixelCostRow(); sums must fit in a ushort.
+class StereoBlockCost : public StereoMatchingCost
+{
+public:
+    StereoBlockCost(int blockSize_)
+    : blockSize(blockSize_), width(0), height(0), minDisparity(0), numDisparities(16)
+    {
+        CV_Assert( blockSize > 0 && blockSize % 2 == 1 );
+    }
+
+    void computeRows(int y0, int y1, ushort* cost, size_t rowStep) const
+    {
+        const int ndisp = numDisparities, r = blockSize/2;
+        if( blockSize == 1 )
+        {
+            for( int y = y0; y < y1; y++ )
+                pixelCostRow(y, cost + (y - y0)*rowStep);
+            return;
+        }
+
+        //vertical running sums over the block rows, then a horizontal box
+        std::vector<ushort> colbuf((size_t)width*ndisp, 0), rowbuf((size_t)width*ndisp);
+        ushort* col = &colbuf[0];
+        ushort* pix = &rowbuf[0];
+        for( int yy = y0 - r; yy <= y0 + r; yy++ )
+        {
+            pixelCostRow(std::min(std::max(yy, 0), height - 1), pix);
+            addRows(col, pix, (size_t)width*ndisp);
+        }
+        for( int y = y0; y < y1; y++ )
+        {
+            if( y > y0 )
+            {
+                pixelCostRow(std::min(y + r, height - 1), pix);
+                addRows(col, pix, (size_t)width*ndisp);
+                pixelCostRow(std::max(y - r - 1, 0), pix);
+                subRows(col, pix, (size_t)width*ndisp);
+            }
+            ushort* out = cost + (y - y0)*rowStep;
+            for( int d = 0; d < ndisp; d++ )
+                out[d] = 0;
+            for( int x = -r; x <= r; x++ )
+                addRows(out, col + (size_t)std::min(std::max(x, 0), width - 1)*ndisp, ndisp);
+            for( int x = 1; x < width; x++ )
+            {
+                ushort* o = out + (size_t)x*ndisp;
+                memcpy(o, o - ndisp, ndisp*sizeof(o[0]));
+                addRows(o, col + (size_t)std::min(x + r, width - 1)*ndisp, ndisp);
+                subRows(o, col + (size_t)std::max(x - r - 1, 0)*ndisp, ndisp);
+            }
+        }
+    }
+
+protected:
+    //unaggregated costs of row y, cost[x*numDisparities + d]
+    virtual void pixelCostRow(int y, ushort* cost) const = 0;
+
+    static void addRows(ushort* dst, const ushort* src, size_t n)
+    {
+        for( size_t i = 0; i < n; i += 8 )
+            sv16_store(dst + i, sv16_adds(sv16_load(dst + i), sv16_load(src + i)));
+    }
+
+    static void subRows(ushort* dst, const ushort* src, size_t n)
+    {
+        for( size_t i = 0; i < n; i += 8 )
+            sv16_store(dst + i, sv16_sub(sv16_load(dst + i), sv16_load(src + i)));
+    }
+
+    int blockSize;
+    int width, height;
+    int minDisparity;
+    int numDisparities;
+};
+
+
+//Birchfield-Tomasi sampling-insensitive cost on x-sobel pre-filtered images
+class StereoBTCost : public StereoBlockCost
+{
+public:
+    StereoBTCost(int blockSize_ = 1, int preFilterCap_ = 31)
+    : StereoBlockCost(blockSize_), preFilterCap(preFilterCap_)
+    {
+        CV_Assert( blockSize <= 11 );
+    }
+
+    void prepare(const Mat& left, const Mat& right, int minDisparity_, int numDisparities_)
+    {
+        minDisparity = minDisparity_;
+        numDisparities = numDisparities_;
+        width = left.cols;
+        height = left.rows;
+        int ndisp = numDisparities;
+        Mat lpf, rpf;
+        simdbmPrefilterXSobel(left, lpf, preFilterCap);
+        simdbmPrefilterXSobel(right, rpf, preFilterCap);
+
+        //per pixel the value and the min/max of the half-way interpolants to either neighbour;
+        //the right image is mirrored like in StereoSimdBM so disparities run forwards in memory
+        for( int k = 0; k < 3; k++ )
+        {
+            leftBT[k].create(height, width, CV_8U);
+            rightBT[k].create(height, width + ndisp - 1, CV_8U);
+        }
+        std::vector<uchar> rmin(width), rmax(width);
+        for( int y = 0; y < height; y++ )
+        {
+            const uchar* l = lpf.ptr<uchar>(y);
+            const uchar* r = rpf.ptr<uchar>(y);
+            for( int x = 0; x < width; x++ )
+            {
+                int xl = std::max(x - 1, 0), xr = std::min(x + 1, width - 1);
+                int ul = (l[x] + l[xl])/2, ur = (l[x] + l[xr])/2;
+                leftBT[0].ptr<uchar>(y)[x] = l[x];
+                leftBT[1].ptr<uchar>(y)[x] = (uchar)std::min((int)l[x], std::min(ul, ur));
+                leftBT[2].ptr<uchar>(y)[x] = (uchar)std::max((int)l[x], std::max(ul, ur));
+                int vl = (r[x] + r[xl])/2, vr = (r[x] + r[xr])/2;
+                rmin[x] = (uchar)std::min((int)r[x], std::min(vl, vr));
+                rmax[x] = (uchar)std::max((int)r[x], std::max(vl, vr));
+            }
+            uchar* v = rightBT[0].ptr<uchar>(y);
+            uchar* v0 = rightBT[1].ptr<uchar>(y);
+            uchar* v1 = rightBT[2].ptr<uchar>(y);
+            for( int k = 0; k < width + ndisp - 1; k++ )
+            {
+                int xr = std::min(std::max(width - 1 - minDisparity - k, 0), width - 1);
+                v[k] = r[xr];
+                v0[k] = rmin[xr];
+                v1[k] = rmax[xr];
+            }
+        }
+    }
+
+    void defaultPenalties(int& P1, int& P2) const
+    {
+        P1 = 8*blockSize*blockSize;
+        P2 = 32*blockSize*blockSize;
+    }
+
+protected:
+    //min(max(0, u - v1, v0 - u), max(0, v - u1, u0 - v)) for every x and disparity of row y
+    void pixelCostRow(int y, ushort* cost) const
+    {
+        const int ndisp = numDisparities;
+        const uchar *u = leftBT[0].ptr<uchar>(y), *u0 = leftBT[1].ptr<uchar>(y), *u1 = leftBT[2].ptr<uchar>(y);
+        const uchar *v = rightBT[0].ptr<uchar>(y), *v0 = rightBT[1].ptr<uchar>(y), *v1 = rightBT[2].ptr<uchar>(y);
+        for( int x = 0; x < width; x++, cost += ndisp )
+        {
+            sv16 vu = sv16_set(u[x]), vu0 = sv16_set(u0[x]), vu1 = sv16_set(u1[x]);
+            int k = width - 1 - x;
+            for( int d = 0; d < ndisp; d += 8 )
+            {
+                sv16 w = sv16_load_u8(v + k + d), w0 = sv16_load_u8(v0 + k + d), w1 = sv16_load_u8(v1 + k + d);
+                sv16 c0 = sv16_max(sv16_subs(vu, w1), sv16_subs(w0, vu));
+                sv16 c1 = sv16_max(sv16_subs(w, vu1), sv16_subs(vu0, w));
+                sv16_store(cost + d, sv16_min(c0, c1));
+            }
+        }
+    }
+
+    int preFilterCap;
+    Mat leftBT[3], rightBT[3];
+};
+
+
+//Lr(p,d) = C(p,d) + min(Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min_k Lr(p-r,k) + P2) - min_k Lr(p-r,k)
+//Lp has one 0xffff guard element on either side. Adds the result to S (or stores it when initS) and returns min_d Lr.
+static inline int sgmPathUpdate(const ushort* C, const ushort* Lp, int minLp, ushort* Lr,
+                                ushort* S, bool initS, int ndisp, sv16 vP1, int P2)
+{
+    sv16 vminP2 = sv16_set(std::min(minLp + P2, (int)USHRT_MAX)), vminLp = sv16_set(minLp);
+    sv16 best = sv16_set(USHRT_MAX);
+    for( int d = 0; d < ndisp; d += 8 )
+    {
+        sv16 a = sv16_load(Lp + d);
+        sv16 b = sv16_adds(sv16_load(Lp + d - 1), vP1);
+        sv16 c = sv16_adds(sv16_load(Lp + d + 1), vP1);
+        sv16 m = sv16_min(sv16_min(a, b), sv16_min(c, vminP2));
+        sv16 l = sv16_adds(sv16_load(C + d), sv16_sub(m, vminLp));
+        sv16_store(Lr + d, l);
+        sv16_store(S + d, initS ? l : sv16_adds(sv16_load(S + d), l));
+        best = sv16_min(best, l);
+    }
+    return sv16_hmin(best);
+}
+
+
+//path state of one sweep direction group: the previous and current row of the
+//three vertical/diagonal paths plus the running horizontal path
+struct SGMPathBuffers
+{
+    enum { PAD = 8 };
+
+    void create(int validWidth_, int ndisp_)
+    {
+        validWidth = validWidth_;
+        ndisp = ndisp_;
+        dstep = ndisp + PAD*2;
+        for( int i = 0; i < 2; i++ )
+        {
+            vert[i].assign((size_t)3*validWidth*dstep, USHRT_MAX);
+            vertMin[i].assign((size_t)3*validWidth, 0);
+            hor[i].assign(dstep, USHRT_MAX);
+        }
+        zero.assign(dstep, USHRT_MAX);
+        for( int d = 0; d < ndisp; d++ )
+            zero[PAD + d] = 0;
+        cur = 0;
+        hasPrev = false;
+    }
+
+    int validWidth, ndisp, dstep, cur;
+    bool hasPrev;
+    std::vector<ushort> vert[2], hor[2], zero;
+    std::vector<int> vertMin[2];
+};
+
+//one row of a sweep over columns [x0, x1). dir = +1 runs left to right and takes the
+//vertical paths from the row above, dir = -1 runs right to left from the row below.
+//C and S are indexed with absolute x.
+static inline void sgmSweepRow(const ushort* C, ushort* S, int x0, int x1, int dir, bool vertical, bool initS,
+                               SGMPathBuffers& b, int P1, int P2)
+{
+    const int D = b.ndisp, Ds = b.dstep, Wv = x1 - x0, PAD = SGMPathBuffers::PAD;
+    const sv16 vP1 = sv16_set(P1);
+    const ushort* zero = &b.zero[PAD];
+    const ushort* hp = zero;
+    int hmin = 0;
+    ushort* vprev = &b.vert[b.cur ^ 1][0];
+    ushort* vcur = &b.vert[b.cur][0];
+    const int* mprev = &b.vertMin[b.cur ^ 1][0];
+    int* mcur = &b.vertMin[b.cur][0];
+
+    for( int i = 0; i < Wv; i++ )
+    {
+        int xi = dir > 0 ? i : Wv - 1 - i;
+        const ushort* c = C + (size_t)(x0 + xi)*D;
+        ushort* s = S + (size_t)(x0 + xi)*D;
+
+        ushort* hl = &b.hor[i & 1][PAD];
+        hmin = sgmPathUpdate(c, hp, hmin, hl, s, initS, D, vP1, P2);
+        hp = hl;
+
+        if( !vertical )
+            continue;
+        for( int k = 0; k < 3; k++ )
+        {
+            int pxi = xi + (k == 0 ? 0 : k == 1 ? -dir : dir);
+            const ushort* lp = zero;
+            int mp = 0;
+            if( b.hasPrev && pxi >= 0 && pxi < Wv )
+            {
+                lp = vprev + ((size_t)k*Wv + pxi)*Ds + PAD;
+                mp = mprev[k*Wv + pxi];
+            }
+            mcur[k*Wv + xi] = sgmPathUpdate(c, lp, mp, vcur + ((size_t)k*Wv + xi)*Ds + PAD, s, false, D, vP1, P2);
+        }
+    }
+    if( vertical )
+    {
+        b.cur ^= 1;
+        b.hasPrev = true;
+    }
+}
+
+
+//fills rows of a W x H x D cost volume from a prepared cost, nstripes bands of rows
+struct StereoCostInvoker : public ParallelLoopBody
+{
+    StereoCostInvoker(const StereoMatchingCost& c_, ushort* vol_, size_t rowStep_, int height_, int nstripes_)
+    : c(c_), vol(vol_), rowStep(rowStep_), height(height_), nstripes(nstripes_) {}
+
+    void operator()(const Range& range) const
+    {
+        int y0 = (int)((int64)height*range.start/nstripes), y1 = (int)((int64)height*range.end/nstripes);
+        if( y0 < y1 )
+            c.computeRows(y0, y1, vol + (size_t)y0*rowStep, rowStep);
+    }
+
+    const StereoMatchingCost& c;
+    ushort* vol;
+    size_t rowStep;
+    int height, nstripes;
+};
+
+
+//8-bit grayscale versions of a stereo pair for the in-tree matchers
+static inline void stereoGrayInput(InputArray leftarr, InputArray rightarr, Mat& left, Mat& right)
+{
+    left = leftarr.getMat();
+    right = rightarr.getMat();
+    CV_Assert( left.size() == right.size() && left.type() == right.type() );
+    if( left.channels() > 1 )
+    {
+        Mat g1, g2;
+        cvtColor(left, g1, COLOR_BGR2GRAY);
+        cvtColor(right, g2, COLOR_BGR2GRAY);
+        left = g1;
+        right = g2;
+    }
+    CV_Assert( left.depth() == CV_8U );
+}
+
+
+//winner-takes-all over one row of aggregated costs S[x*D + d] for x in [x0, x1) with
+//StereoSGBM's uniqueness test, parabolic sub-pixel fit and left-right check
+static inline void stereoSelectDisparityRow(const ushort* S, int x0, int x1, int width, int minD, int D,
+                                            int uniquenessRatio, int disp12MaxDiff, short* dptr, std::vector<int>& scratch)
+{
+    const short INVALID = (short)((minD - 1)*StereoMatcher::DISP_SCALE);
+    scratch.resize((size_t)width*2);
+    int* disp2 = &scratch[0];
+    int* disp2cost = &scratch[width];
+    for( int x = 0; x < width; x++ )
+    {
+        dptr[x] = INVALID;
+        disp2[x] = INT_MIN;
+        disp2cost[x] = INT_MAX;
+    }
+
+    for( int x = x0; x < x1; x++ )
+    {
+        const ushort* Sp = S + (size_t)x*D;
+        sv16 m = sv16_load(Sp);
+        for( int d = 8; d < D; d += 8 )
+            m = sv16_min(m, sv16_load(Sp + d));
+        int minS = sv16_hmin(m), bestDisp = 0;
+        while( Sp[bestDisp] != minS )
+            bestDisp++;
+
+        if( uniquenessRatio > 0 )
+        {
+            int d = 0;
+            for( ; d < D; d++ )
+                if( Sp[d]*(100 - uniquenessRatio) < minS*100 && std::abs(bestDisp - d) > 1 )
+                    break;
+            if( d < D )
+                continue;
+        }
+
+        int x2 = x - minD - bestDisp;
+        if( x2 >= 0 && x2 < width && disp2cost[x2] > minS )
+        {
+            disp2cost[x2] = minS;
+            disp2[x2] = bestDisp + minD;
+        }
+
+        int d = bestDisp;
+        if( 0 < d && d < D - 1 )
+        {
+            int denom2 = std::max(Sp[d - 1] + Sp[d + 1] - 2*Sp[d], 1);
+            d = d*StereoMatcher::DISP_SCALE + ((Sp[d - 1] - Sp[d + 1])*StereoMatcher::DISP_SCALE + denom2)/(denom2*2);
+        }
+        else
+            d *= StereoMatcher::DISP_SCALE;
+        dptr[x] = (short)(d + minD*StereoMatcher::DISP_SCALE);
+    }
+
+    if( disp12MaxDiff < 0 )
+        return;
+    for( int x = x0; x < x1; x++ )
+    {
+        int d1 = dptr[x];
+        if( d1 == INVALID )
+            continue;
+        int _d = d1 >> StereoMatcher::DISP_SHIFT;
+        int d_ = (d1 + StereoMatcher::DISP_SCALE - 1) >> StereoMatcher::DISP_SHIFT;
+        int _x = x - _d, x_ = x - d_;
+        if( 0 <= _x && _x < width && disp2[_x] >= minD && std::abs(disp2[_x] - _d) > disp12MaxDiff &&
+           0 <= x_ && x_ < width && disp2[x_] >= minD && std::abs(disp2[x_] - d_) > disp12MaxDiff )
+            dptr[x] = INVALID;
+    }
+}
+
+
+class StereoSGM : public StereoMatcher
+{
+public:
+    enum { MODE_FULL = 0, MODE_STRIP = 1 };
+
+    //rows a strip is started above its first output row so its vertical paths have settled
+    enum { STRIP_WARMUP = 32, STRIP_CHUNK = 8 };
+
+    static Ptr<StereoSGM> create(int minDisparity = 0, int numDisparities = 64, int blockSize = 3, int mode = MODE_FULL)
+    {
+        Ptr<StereoSGM> sgm = makePtr<StereoSGM>();
+        sgm->setMinDisparity(minDisparity);
+        sgm->setNumDisparities(numDisparities);
+        sgm->setBlockSize(blockSize);
+        sgm->setMode(mode);
+        return sgm;
+    }
+
+    StereoSGM()
+    {
+        minDisparity = 0;
+        numDisparities = 64;
+        blockSize = 3;
+        preFilterCap = 31;
+        P1 = P2 = 0;
+        uniquenessRatio = 10;
+        disp12MaxDiff = 1;
+        speckleWindowSize = 0;
+        speckleRange = 0;
+        mode = MODE_FULL;
+        volumeMinDisparity = volumeNumDisparities = 0;
+    }
+
+    void compute(InputArray leftarr, InputArray rightarr, OutputArray disparr)
+    {
+        if( mode != MODE_STRIP )
+        {
+            computeCostVolume(leftarr, rightarr);
+            selectDisparity(disparr);
+            return;
+        }
+
+        Mat left, right;
+        stereoGrayInput(leftarr, rightarr, left, right);
+        disparr.create(left.size(), CV_16S);
+        Mat disp = disparr.getMat();
+
+        int p1, p2;
+        Ptr<StereoMatchingCost> c = prepareCost(left, right, p1, p2);
+        computeStrips(*c, disp, p1, p2);
+
+        if( speckleWindowSize > 0 )
+            filterSpeckles(disp, (minDisparity - 1)*StereoMatcher::DISP_SCALE, speckleWindowSize, speckleRange, slidingSumBuf);
+    }
+
+    //first half of a MODE_FULL compute(): aggregates the 8 paths and keeps the sums, so
+    //selectDisparity() can be rerun after changing only the uniqueness ratio, disp12MaxDiff
+    //or the speckle filter. Whatever the mode, this uses the full W x H x D volume.
+    void computeCostVolume(InputArray leftarr, InputArray rightarr)
+    {
+        Mat left, right;
+        stereoGrayInput(leftarr, rightarr, left, right);
+        int p1, p2;
+        Ptr<StereoMatchingCost> c = prepareCost(left, right, p1, p2);
+
+        const int width = left.cols, height = left.rows, D = numDisparities;
+        volumeSize = left.size();
+        volumeMinDisparity = minDisparity;
+        volumeNumDisparities = numDisparities;
+        size_t rowStep = (size_t)width*D, total = rowStep*height;
+        Sfwd.resize(total);
+        Sbwd.resize(total);
+
+        int x0, x1;
+        validColumns(width, x0, x1);
+        if( x0 >= x1 )
+            return;
+        std::vector<ushort> C(total);
+        int nstripes = std::max(1, std::min(stereoNumThreads()*4, height/8));
+        parallel_for_(Range(0, nstripes), StereoCostInvoker(*c, &C[0], rowStep, height, nstripes), nstripes);
+        parallel_for_(Range(0, 2), SweepInvoker(&C[0], &Sfwd[0], &Sbwd[0], width, height, x0, x1, D, p1, p2), std::min(stereoNumThreads(), 2));
+    }
+
+    //second half: winner-takes-all, uniqueness, sub-pixel, left-right check and speckle filter
+    //on the sums of the last computeCostVolume(), which must have used the same disparity range
+    void selectDisparity(OutputArray disparr)
+    {
+        CV_Assert( !Sfwd.empty() && volumeMinDisparity == minDisparity && volumeNumDisparities == numDisparities );
+        disparr.create(volumeSize, CV_16S);
+        Mat disp = disparr.getMat();
+        disp = Scalar::all((minDisparity - 1)*StereoMatcher::DISP_SCALE);
+
+        int x0, x1;
+        validColumns(disp.cols, x0, x1);
+        if( x0 < x1 )
+            parallel_for_(Range(0, disp.rows), SelectInvoker(*this, &Sfwd[0], &Sbwd[0], disp, x0, x1), stereoNumThreads() > 1 ? -1. : 1.);
+
+        if( speckleWindowSize > 0 )
+            filterSpeckles(disp, (minDisparity - 1)*StereoMatcher::DISP_SCALE, speckleWindowSize, speckleRange, slidingSumBuf);
+    }
+
+    int getMinDisparity() const { return minDisparity; }
+    void setMinDisparity(int minDisparity_) { minDisparity = minDisparity_; }
+
+    int getNumDisparities() const { return numDisparities; }
+    void setNumDisparities(int numDisparities_)
+    {
+        CV_Assert( numDisparities_ > 0 && numDisparities_ % 16 == 0 );
+        numDisparities = numDisparities_;
+    }
+
+    int getBlockSize() const { return blockSize; }
+    void setBlockSize(int blockSize_)
+    {
+        CV_Assert( blockSize_ % 2 == 1 && blockSize_ <= 11 );
+        blockSize = blockSize_;
+    }
+
+    int getSpeckleWindowSize() const { return speckleWindowSize; }
+    void setSpeckleWindowSize(int speckleWindowSize_) { speckleWindowSize = speckleWindowSize_; }
+
+    int getSpeckleRange() const { return speckleRange; }
+    void setSpeckleRange(int speckleRange_) { speckleRange = speckleRange_; }
+
+    int getDisp12MaxDiff() const { return disp12MaxDiff; }
+    void setDisp12MaxDiff(int disp12MaxDiff_) { disp12MaxDiff = disp12MaxDiff_; }
+
+    int getPreFilterCap() const { return preFilterCap; }
+    void setPreFilterCap(int preFilterCap_) { preFilterCap = preFilterCap_; }
+
+    int getUniquenessRatio() const { return uniquenessRatio; }
+    void setUniquenessRatio(int uniquenessRatio_) { uniquenessRatio = uniquenessRatio_; }
+
+    //0 picks the cost function's defaults
+    int getP1() const { return P1; }
+    void setP1(int P1_) { P1 = P1_; }
+    int getP2() const { return P2; }
+    void setP2(int P2_) { P2 = P2_; }
+
+    int getMode() const { return mode; }
+    void setMode(int mode_) { mode = mode_; }
+
+    //replaces the default Birchfield-Tomasi cost; blockSize and preFilterCap then no longer apply
+    Ptr<StereoMatchingCost> getCost() const { return cost; }
+    void setCost(const Ptr<StereoMatchingCost>& cost_) { cost = cost_; }
+
+    String getDefaultName() const { return "StereoMatcher.SGM"; }
+
+protected:
+    //the cost to use, prepared for this pair, and its penalties unless P1/P2 are set
+    Ptr<StereoMatchingCost> prepareCost(const Mat& left, const Mat& right, int& p1, int& p2) const
+    {
+        Ptr<StereoMatchingCost> c = cost ? cost : Ptr<StereoMatchingCost>(new StereoBTCost(blockSize, preFilterCap));
+        c->prepare(left, right, minDisparity, numDisparities);
+        p1 = P1;
+        p2 = P2;
+        if( p1 <= 0 || p2 <= 0 )
+            c->defaultPenalties(p1, p2);
+        p2 = std::max(p2, p1 + 1);
+        return c;
+    }
+
+    //columns whose whole disparity range lies inside the right image
+    void validColumns(int width, int& x0, int& x1) const
+    {
+        x0 = std::max(0, minDisparity + numDisparities - 1);
+        x1 = width + std::min(0, minDisparity);
+    }
+
+    struct SweepInvoker : public ParallelLoopBody
+    {
+        SweepInvoker(const ushort* C_, ushort* Sfwd_, ushort* Sbwd_, int width_, int height_, int x0_, int x1_, int ndisp_, int P1_, int P2_)
+        : C(C_), Sfwd(Sfwd_), Sbwd(Sbwd_), width(width_), height(height_), x0(x0_), x1(x1_), ndisp(ndisp_), P1(P1_), P2(P2_) {}
+
+        void operator()(const Range& range) const
+        {
+            size_t rowStep = (size_t)width*ndisp;
+            for( int g = range.start; g < range.end; g++ )
+            {
+                SGMPathBuffers b;
+                b.create(x1 - x0, ndisp);
+                int dir = g == 0 ? 1 : -1;
+                ushort* S = g == 0 ? Sfwd : Sbwd;
+                for( int i = 0; i < height; i++ )
+                {
+                    int y = dir > 0 ? i : height - 1 - i;
+                    sgmSweepRow(C + y*rowStep, S + y*rowStep, x0, x1, dir, true, true, b, P1, P2);
+                }
+            }
+        }
+
+        const ushort* C;
+        ushort *Sfwd, *Sbwd;
+        int width, height, x0, x1, ndisp, P1, P2;
+    };
+
+    struct SelectInvoker : public ParallelLoopBody
+    {
+        SelectInvoker(const StereoSGM& sgm_, const ushort* Sfwd_, const ushort* Sbwd_, Mat& disp_, int x0_, int x1_)
+        : sgm(sgm_), Sfwd(Sfwd_), Sbwd(Sbwd_), disp(&disp_), x0(x0_), x1(x1_) {}
+
+        void operator()(const Range& range) const
+        {
+            const int width = disp->cols, D = sgm.numDisparities;
+            size_t rowStep = (size_t)width*D;
+            std::vector<ushort> S(rowStep);
+            std::vector<int> scratch;
+            for( int y = range.start; y < range.end; y++ )
+            {
+                const ushort* a = Sfwd + y*rowStep;
+                const ushort* b = Sbwd + y*rowStep;
+                for( size_t i = (size_t)x0*D; i < (size_t)x1*D; i += 8 )
+                    sv16_store(&S[i], sv16_adds(sv16_load(a + i), sv16_load(b + i)));
+                stereoSelectDisparityRow(&S[0], x0, x1, width, sgm.minDisparity, D, sgm.uniquenessRatio,
+                                         sgm.disp12MaxDiff, disp->ptr<short>(y), scratch);
+            }
+        }
+
+        const StereoSGM& sgm;
+        const ushort *Sfwd, *Sbwd;
+        Mat* disp;
+        int x0, x1;
+    };
+
+    struct StripInvoker : public ParallelLoopBody
+    {
+        StripInvoker(const StereoSGM& sgm_, const StereoMatchingCost& c_, Mat& disp_, int nstrips_, int P1_, int P2_)
+        : sgm(sgm_), c(c_), disp(&disp_), nstrips(nstrips_), P1(P1_), P2(P2_) {}
+
+        void operator()(const Range& range) const
+        {
+            const int width = disp->cols, height = disp->rows, D = sgm.numDisparities;
+            int x0, x1;
+            sgm.validColumns(width, x0, x1);
+            size_t rowStep = (size_t)width*D;
+            std::vector<ushort> chunk(rowStep*STRIP_CHUNK), S(rowStep);
+            std::vector<int> scratch;
+            SGMPathBuffers fwd, bwd;
+            fwd.create(x1 - x0, D);
+            bwd.create(x1 - x0, D);
+
+            for( int i = range.start; i < range.end; i++ )
+            {
+                int y0 = (int)((int64)height*i/nstrips), y1 = (int)((int64)height*(i + 1)/nstrips);
+                int ys = std::max(0, y0 - (int)STRIP_WARMUP);
+                fwd.hasPrev = false;
+                for( int y = ys; y < y1; y++ )
+                {
+                    int k = (y - ys) % STRIP_CHUNK;
+                    if( k == 0 )
+                        c.computeRows(y, std::min(y + (int)STRIP_CHUNK, y1), &chunk[0], rowStep);
+                    const ushort* C = &chunk[k*rowStep];
+                    sgmSweepRow(C, &S[0], x0, x1, 1, true, true, fwd, P1, P2);
+                    sgmSweepRow(C, &S[0], x0, x1, -1, false, false, bwd, P1, P2);
+                    if( y >= y0 )
+                        stereoSelectDisparityRow(&S[0], x0, x1, width, sgm.minDisparity, D, sgm.uniquenessRatio,
+                                                 sgm.disp12MaxDiff, disp->ptr<short>(y), scratch);
+                }
+            }
+        }
+
+        const StereoSGM& sgm;
+        const StereoMatchingCost& c;
+        Mat* disp;
+        int nstrips, P1, P2;
+    };
+
+    void computeStrips(const StereoMatchingCost& c, Mat& disp, int p1, int p2) const
+    {
+        int x0, x1;
+        validColumns(disp.cols, x0, x1);
+        disp = Scalar::all((minDisparity - 1)*StereoMatcher::DISP_SCALE);
+        if( x0 >= x1 )
+            return;
+        int nstrips = std::max(1, std::min(stereoNumThreads(), disp.rows/(STRIP_WARMUP*2)));
+        parallel_for_(Range(0, nstrips), StripInvoker(*this, c, disp, nstrips, p1, p2), nstrips);
+    }
+
+    int minDisparity;
+    int numDisparities;
+    int blockSize;
+    int preFilterCap;
+    int P1, P2;
+    int uniquenessRatio;
+    int disp12MaxDiff;
+    int speckleWindowSize;
+    int speckleRange;
+    int mode;
+    Ptr<StereoMatchingCost> cost;
+    Mat slidingSumBuf;
+
+    //path sums of the last computeCostVolume()
+    std::vector<ushort> Sfwd, Sbwd;
+    Size volumeSize;
+    int volumeMinDisparity;
+    int volumeNumDisparities;
+};
+
+#endif /* Stereo_SGM_hpp */
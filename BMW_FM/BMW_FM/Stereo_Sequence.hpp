@@ -0,0 +1,465 @@
+//
+//  Stereo_Sequence.hpp
+//  BMW_FM
+//
+//  Stereo sequence files (.sseq): every captured pair in one file instead of
+//  two PNGs per frame. Layout:
+//
+//    header      64 bytes, magic "STRSEQ01", codec, index offset, frame count
+//    frames      at 64-byte aligned offsets: a 64-byte frame header (types,
+//                sizes, payload bytes, timestamp) followed by the left and
+//                the right payload, each 64-byte aligned
+//    index       one {offset, timestamp} entry per frame
+//    trailer     index offset, frame count, magic "STRSEQIX"
+//
+//  Payloads are either raw rows (STEREO_SEQ_RAW) or fast-level PNG
+//  (STEREO_SEQ_PNG, lossless). The writer appends through a chunk buffer and
+//  writes whole chunks, so the file grows in large aligned writes. The
+//  reader maps the file and finds frame i through the index; raw frames are
+//  used in place from the mapping. A file whose writer never got to close()
+//  has no trailer; the reader then rebuilds the index by walking the frame
+//  headers.
+//
+//  Image lists may name frames of a sequence as "<file.sseq>#<frame>L" or
+//  "#<frame>R"; stereoImread() reads those and plain image files alike.
+//
+
+#ifndef Stereo_Sequence_hpp
+#define Stereo_Sequence_hpp
+
+#include "opencv2/core/utility.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include "Stereo_MappedFile.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+using namespace cv;
+
+
+enum
+{
+    STEREO_SEQ_RAW = 0,
+    STEREO_SEQ_PNG = 1
+};
+
+struct StereoSequenceHeader
+{
+    char magic[8];
+    unsigned version;
+    unsigned codec;
+    uint64 indexOffset;     //0 until the writer is closed
+    uint64 frameCount;
+    uchar reserved[32];
+};
+
+struct StereoSequenceFrameHeader
+{
+    char magic[4];
+    unsigned codec;
+    int type[2], width[2], height[2];
+    uint64 bytes[2];        //payload sizes, left and right
+    int64 timestampNs;
+    uchar reserved[8];
+};
+
+struct StereoSequenceIndexEntry
+{
+    uint64 offset;          //of the frame header
+    int64 timestampNs;
+};
+
+struct StereoSequenceTrailer
+{
+    uint64 indexOffset;
+    uint64 frameCount;
+    char magic[8];
+};
+
+static const char STEREO_SEQ_MAGIC[8] = { 'S', 'T', 'R', 'S', 'E', 'Q', '0', '1' };
+static const char STEREO_SEQ_FRAME_MAGIC[4] = { 'S', 'F', 'R', 'M' };
+static const char STEREO_SEQ_INDEX_MAGIC[8] = { 'S', 'T', 'R', 'S', 'E', 'Q', 'I', 'X' };
+
+static inline uint64 stereoSeqAlign(uint64 v) { return (v + 63) & ~(uint64)63; }
+
+//getTickCount() ticks to nanoseconds of the same monotonic clock
+static inline int64 stereoTicksToNs(int64 ticks)
+{
+    return (int64)(ticks*(1e9/getTickFrequency()));
+}
+
+class StereoSequenceWriter
+{
+public:
+    StereoSequenceWriter() : fp(0), codec(STEREO_SEQ_RAW), chunkSize(0), fileOffset(0) {}
+    ~StereoSequenceWriter() { close(); }
+
+    //chunkSize: bytes collected before each write, a multiple of 4096
+    bool open(const std::string& filename, int codec_ = STEREO_SEQ_RAW, size_t chunkSize_ = (size_t)8 << 20)
+    {
+        close();
+        fp = fopen(filename.c_str(), "wb");
+        if( !fp )
+            return false;
+        setvbuf(fp, 0, _IONBF, 0);
+        codec = codec_;
+        chunkSize = std::max((chunkSize_ + 4095) & ~(size_t)4095, (size_t)4096);
+        chunk.reserve(chunkSize);
+        chunk.clear();
+        index.clear();
+        fileOffset = 0;
+
+        StereoSequenceHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, STEREO_SEQ_MAGIC, sizeof(hdr.magic));
+        hdr.version = 1;
+        hdr.codec = (unsigned)codec;
+        return append(&hdr, sizeof(hdr));
+    }
+
+    bool isOpened() const { return fp != 0; }
+    int frames() const { return (int)index.size(); }
+
+    //ticks: getTickCount() at capture time
+    bool write(const Mat& left, const Mat& right, int64 ticks)
+    {
+        CV_Assert( fp );
+        const Mat* imgs[] = { &left, &right };
+        std::vector<uchar> payload[2];
+        StereoSequenceFrameHeader fh;
+        memset(&fh, 0, sizeof(fh));
+        memcpy(fh.magic, STEREO_SEQ_FRAME_MAGIC, sizeof(fh.magic));
+        fh.codec = (unsigned)codec;
+        fh.timestampNs = stereoTicksToNs(ticks);
+        for( int k = 0; k < 2; k++ )
+        {
+            const Mat& m = *imgs[k];
+            fh.type[k] = m.type();
+            fh.width[k] = m.cols;
+            fh.height[k] = m.rows;
+            if( codec == STEREO_SEQ_PNG )
+            {
+                std::vector<int> params(2);
+                params[0] = IMWRITE_PNG_COMPRESSION;
+                params[1] = 1;
+                if( !imencode(".png", m, payload[k], params) )
+                    return false;
+                fh.bytes[k] = payload[k].size();
+            }
+            else
+                fh.bytes[k] = (uint64)m.cols*m.rows*m.elemSize();
+        }
+
+        StereoSequenceIndexEntry e;
+        e.offset = fileOffset + chunk.size();
+        e.timestampNs = fh.timestampNs;
+        bool ok = append(&fh, sizeof(fh));
+        for( int k = 0; k < 2 && ok; k++ )
+        {
+            if( codec == STEREO_SEQ_PNG )
+                ok = append(&payload[k][0], payload[k].size());
+            else
+            {
+                const Mat& m = *imgs[k];
+                size_t rowSize = m.cols*m.elemSize();
+                for( int y = 0; y < m.rows && ok; y++ )
+                    ok = append(m.ptr(y), rowSize);
+            }
+            ok = ok && pad();
+        }
+        if( ok )
+            index.push_back(e);
+        return ok;
+    }
+
+    //writes the index and the trailer and fills in the header
+    bool close()
+    {
+        if( !fp )
+            return true;
+        StereoSequenceTrailer tr;
+        memset(&tr, 0, sizeof(tr));
+        tr.indexOffset = fileOffset + chunk.size();
+        tr.frameCount = index.size();
+        memcpy(tr.magic, STEREO_SEQ_INDEX_MAGIC, sizeof(tr.magic));
+        bool ok = index.empty() || append(&index[0], index.size()*sizeof(index[0]));
+        ok = ok && append(&tr, sizeof(tr)) && flush();
+        if( ok )
+        {
+            StereoSequenceHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr.magic, STEREO_SEQ_MAGIC, sizeof(hdr.magic));
+            hdr.version = 1;
+            hdr.codec = (unsigned)codec;
+            hdr.indexOffset = tr.indexOffset;
+            hdr.frameCount = tr.frameCount;
+            ok = fseek(fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+        }
+        ok = fclose(fp) == 0 && ok;
+        fp = 0;
+        return ok;
+    }
+
+protected:
+    bool append(const void* data, size_t size)
+    {
+        const uchar* p = (const uchar*)data;
+        while( size > 0 )
+        {
+            size_t n = std::min(size, chunkSize - chunk.size());
+            chunk.insert(chunk.end(), p, p + n);
+            p += n;
+            size -= n;
+            if( chunk.size() == chunkSize && !flush() )
+                return false;
+        }
+        return true;
+    }
+
+    bool pad()
+    {
+        static const uchar zeros[64] = {0};
+        uint64 pos = fileOffset + chunk.size();
+        return append(zeros, (size_t)(stereoSeqAlign(pos) - pos));
+    }
+
+    bool flush()
+    {
+        if( chunk.empty() )
+            return true;
+        bool ok = fwrite(&chunk[0], 1, chunk.size(), fp) == chunk.size();
+        fileOffset += chunk.size();
+        chunk.clear();
+        return ok;
+    }
+
+    FILE* fp;
+    int codec;
+    size_t chunkSize;
+    uint64 fileOffset;
+    std::vector<uchar> chunk;
+    std::vector<StereoSequenceIndexEntry> index;
+};
+
+class StereoSequenceReader
+{
+public:
+    bool open(const std::string& filename)
+    {
+        index.clear();
+        if( !file.open(filename) || file.size() < sizeof(StereoSequenceHeader) ||
+            memcmp(file.data(), STEREO_SEQ_MAGIC, sizeof(STEREO_SEQ_MAGIC)) != 0 )
+        {
+            file.close();
+            return false;
+        }
+        if( !readIndex() )
+            rebuildIndex();
+        return true;
+    }
+
+    bool isOpened() const { return file.isOpened(); }
+    int frames() const { return (int)index.size(); }
+    int64 timestampNs(int i) const { return index[i].timestampNs; }
+
+    //side 0 is the left image, 1 the right one. flags as for imread: IMREAD_UNCHANGED
+    //keeps the stored channels, IMREAD_GRAYSCALE / IMREAD_COLOR convert. Raw frames
+    //that need no conversion point into the mapping and stay valid while it is open;
+    //the mapping is private, so writing into them never reaches the file.
+    bool readImage(int i, int side, Mat& img, int flags = IMREAD_UNCHANGED) const
+    {
+        if( i < 0 || i >= frames() || side < 0 || side > 1 )
+            return false;
+        const StereoSequenceFrameHeader& fh = *(const StereoSequenceFrameHeader*)(file.data() + index[i].offset);
+        uint64 ofs = index[i].offset + sizeof(fh) + (side == 1 ? stereoSeqAlign(fh.bytes[0]) : 0);
+        if( ofs > file.size() || fh.bytes[side] > file.size() - ofs )
+            return false;
+        uchar* data = file.data() + ofs;
+
+        Mat m;
+        if( fh.codec == STEREO_SEQ_PNG )
+        {
+            if( fh.bytes[side] > (uint64)INT_MAX )
+                return false;
+            m = imdecode(Mat(1, (int)fh.bytes[side], CV_8U, data), flags);
+        }
+        else
+        {
+            //the header is not trusted: the pixels it declares must fit in the payload
+            if( !validRawFrame(fh.type[side], fh.width[side], fh.height[side], fh.bytes[side]) )
+                return false;
+            m = Mat(fh.height[side], fh.width[side], fh.type[side], data);
+        }
+        if( m.empty() )
+            return false;
+
+        if( flags == IMREAD_GRAYSCALE && m.channels() != 1 )
+            cvtColor(m, img, m.channels() == 4 ? COLOR_BGRA2GRAY : COLOR_BGR2GRAY);
+        else if( flags == IMREAD_COLOR && m.channels() == 1 )
+            cvtColor(m, img, COLOR_GRAY2BGR);
+        else
+            img = m;
+        return true;
+    }
+
+    bool read(int i, Mat& left, Mat& right, int flags = IMREAD_UNCHANGED) const
+    {
+        return readImage(i, 0, left, flags) && readImage(i, 1, right, flags);
+    }
+
+    //asks the kernel to page in frame i ahead of its use
+    void prefetch(int i) const
+    {
+        if( i < 0 || i >= frames() )
+            return;
+        uint64 end = i + 1 < frames() ? index[i + 1].offset : (uint64)file.size();
+        file.advise((size_t)index[i].offset, (size_t)(end - index[i].offset), MADV_WILLNEED);
+    }
+
+protected:
+    //8U or 16U with 1 to 4 channels, as the writer stores them, and no more pixels than bytes
+    static bool validRawFrame(int type, int width, int height, uint64 bytes)
+    {
+        int depth = CV_MAT_DEPTH(type), cn = CV_MAT_CN(type);
+        if( (depth != CV_8U && depth != CV_16U) || cn > 4 || type != CV_MAKETYPE(depth, cn) || width <= 0 || height <= 0 )
+            return false;
+        return (uint64)width*(uint64)height*CV_ELEM_SIZE(type) <= bytes;
+    }
+
+    bool validFrame(uint64 ofs) const
+    {
+        if( ofs % 64 != 0 || ofs + sizeof(StereoSequenceFrameHeader) > file.size() )
+            return false;
+        const StereoSequenceFrameHeader& fh = *(const StereoSequenceFrameHeader*)(file.data() + ofs);
+        return memcmp(fh.magic, STEREO_SEQ_FRAME_MAGIC, sizeof(fh.magic)) == 0 &&
+        ofs + sizeof(fh) + stereoSeqAlign(fh.bytes[0]) + fh.bytes[1] <= file.size();
+    }
+
+    bool readIndex()
+    {
+        if( file.size() < sizeof(StereoSequenceHeader) + sizeof(StereoSequenceTrailer) )
+            return false;
+        StereoSequenceTrailer tr;
+        memcpy(&tr, file.data() + file.size() - sizeof(tr), sizeof(tr));
+        if( memcmp(tr.magic, STEREO_SEQ_INDEX_MAGIC, sizeof(tr.magic)) != 0 ||
+            tr.indexOffset + tr.frameCount*sizeof(StereoSequenceIndexEntry) + sizeof(tr) > file.size() )
+            return false;
+        index.resize((size_t)tr.frameCount);
+        if( !index.empty() )
+            memcpy(&index[0], file.data() + tr.indexOffset, index.size()*sizeof(index[0]));
+        for( size_t i = 0; i < index.size(); i++ )
+            if( !validFrame(index[i].offset) )
+            {
+                index.clear();
+                return false;
+            }
+        return true;
+    }
+
+    //recovery of an unclosed file: frames follow each other at aligned offsets
+    void rebuildIndex()
+    {
+        index.clear();
+        uint64 ofs = stereoSeqAlign(sizeof(StereoSequenceHeader));
+        while( validFrame(ofs) )
+        {
+            const StereoSequenceFrameHeader& fh = *(const StereoSequenceFrameHeader*)(file.data() + ofs);
+            StereoSequenceIndexEntry e;
+            e.offset = ofs;
+            e.timestampNs = fh.timestampNs;
+            index.push_back(e);
+            ofs += sizeof(fh) + stereoSeqAlign(fh.bytes[0]) + stereoSeqAlign(fh.bytes[1]);
+        }
+    }
+
+    StereoMappedFile file;
+    std::vector<StereoSequenceIndexEntry> index;
+};
+
+static inline bool stereoIsSequenceFile(const std::string& filename)
+{
+    return filename.size() > 5 && filename.compare(filename.size() - 5, 5, ".sseq") == 0;
+}
+
+//"<file.sseq>#<frame>L|R" -> file, frame, side (0 left, 1 right)
+static inline bool stereoParseSequenceRef(const std::string& ref, std::string& filename, int& frame, int& side)
+{
+    size_t hash = ref.find_last_of('#');
+    if( hash == std::string::npos || ref.size() < hash + 3 || !stereoIsSequenceFile(ref.substr(0, hash)) )
+        return false;
+    char c = ref[ref.size() - 1];
+    if( c != 'L' && c != 'R' )
+        return false;
+    char* end = 0;
+    long n = strtol(ref.c_str() + hash + 1, &end, 10);
+    if( end != ref.c_str() + ref.size() - 1 || n < 0 )
+        return false;
+    filename = ref.substr(0, hash);
+    frame = (int)n;
+    side = c == 'L' ? 0 : 1;
+    return true;
+}
+
+static inline std::string stereoSequenceRef(const std::string& filename, int frame, int side)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "#%06d%c", frame, side == 0 ? 'L' : 'R');
+    return filename + buf;
+}
+
+//readers stay open (and their frames valid) for the rest of the run
+static inline Ptr<StereoSequenceReader> stereoOpenSequence(const std::string& filename)
+{
+    static std::mutex mutex;
+    static std::map<std::string, Ptr<StereoSequenceReader> > readers;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, Ptr<StereoSequenceReader> >::iterator it = readers.find(filename);
+    if( it != readers.end() )
+        return it->second;
+    Ptr<StereoSequenceReader> r = makePtr<StereoSequenceReader>();
+    if( !r->open(filename) )
+        return Ptr<StereoSequenceReader>();
+    readers[filename] = r;
+    return r;
+}
+
+//frames of a sequence as image references: side 0 or 1 for one camera, -1 for
+//left and right alternating (the Stereo_Calib image list layout)
+static inline bool stereoSequenceImageList(const std::string& filename, std::vector<std::string>& l, int side = -1)
+{
+    l.clear();
+    Ptr<StereoSequenceReader> r = stereoOpenSequence(filename);
+    if( !r )
+        return false;
+    for( int i = 0; i < r->frames(); i++ )
+        for( int k = 0; k < 2; k++ )
+            if( side < 0 || side == k )
+                l.push_back(stereoSequenceRef(filename, i, k));
+    return true;
+}
+
+//imread that also understands sequence frame references
+static inline Mat stereoImread(const std::string& name, int flags = IMREAD_COLOR)
+{
+    std::string filename;
+    int frame, side;
+    if( !stereoParseSequenceRef(name, filename, frame, side) )
+        return imread(name, flags);
+    Mat img;
+    Ptr<StereoSequenceReader> r = stereoOpenSequence(filename);
+    if( r )
+    {
+        r->prefetch(frame + 1);
+        r->readImage(frame, side, img, flags);
+    }
+    return img;
+}
+
+#endif /* Stereo_Sequence_hpp */
@@ -0,0 +1,130 @@
+//
+//  Stereo_Simd.hpp
+//  BMW_FM
+//
+//  Architecture detection and runtime CPU dispatch shared by the in-tree
+//  stereo engines. SSE2 is the x86-64 baseline and NEON the arm64 one;
+//  AVX2 kernels are compiled with a per-function target attribute so the
+//  project does not need -mavx2, and are only selected when the CPU
+//  reports support for them.
+//
+
+#ifndef Stereo_Simd_hpp
+#define Stereo_Simd_hpp
+
+#include "opencv2/core.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define STEREO_SIMD_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define STEREO_SIMD_AVX2 1
+#include <immintrin.h>
+#define STEREO_TARGET_AVX2 __attribute__((target("avx2")))
+#define STEREO_TARGET_POPCNT __attribute__((target("popcnt")))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define STEREO_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+enum StereoSimdLevel
+{
+    STEREO_SIMD_LEVEL_SCALAR = 0,
+    STEREO_SIMD_LEVEL_SSE2 = 1,
+    STEREO_SIMD_LEVEL_NEON = 2,
+    STEREO_SIMD_LEVEL_AVX2 = 3
+};
+
+//best instruction set usable on this machine; cv::setUseOptimized(false) forces the scalar kernels
+static inline int stereoSimdLevel()
+{
+    if( !cv::useOptimized() )
+        return STEREO_SIMD_LEVEL_SCALAR;
+#if defined(STEREO_SIMD_AVX2)
+    if( cv::checkHardwareSupport(CV_CPU_AVX2) )
+        return STEREO_SIMD_LEVEL_AVX2;
+#endif
+#if defined(STEREO_SIMD_SSE2)
+    return STEREO_SIMD_LEVEL_SSE2;
+#elif defined(STEREO_SIMD_NEON)
+    return STEREO_SIMD_LEVEL_NEON;
+#else
+    return STEREO_SIMD_LEVEL_SCALAR;
+#endif
+}
+
+static inline const char* stereoSimdLevelName(int level)
+{
+    return level == STEREO_SIMD_LEVEL_AVX2 ? "AVX2" :
+    level == STEREO_SIMD_LEVEL_SSE2 ? "SSE2" :
+    level == STEREO_SIMD_LEVEL_NEON ? "NEON" : "scalar";
+}
+
+
+//8 x ushort vector on the baseline instruction set, for kernels that do not need
+//runtime dispatch. Unaligned loads and stores throughout.
+#if defined(STEREO_SIMD_SSE2)
+
+typedef __m128i sv16;
+
+static inline sv16 sv16_load(const ushort* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void sv16_store(ushort* p, sv16 v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline sv16 sv16_set(int v) { return _mm_set1_epi16((short)v); }
+static inline sv16 sv16_adds(sv16 a, sv16 b) { return _mm_adds_epu16(a, b); }
+static inline sv16 sv16_subs(sv16 a, sv16 b) { return _mm_subs_epu16(a, b); }
+static inline sv16 sv16_sub(sv16 a, sv16 b) { return _mm_sub_epi16(a, b); }
+static inline sv16 sv16_min(sv16 a, sv16 b) { return _mm_sub_epi16(a, _mm_subs_epu16(a, b)); }
+static inline sv16 sv16_max(sv16 a, sv16 b) { return _mm_adds_epu16(a, _mm_subs_epu16(b, a)); }
+static inline sv16 sv16_load_u8(const uchar* p) { return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128()); }
+static inline int sv16_hmin(sv16 v)
+{
+    v = sv16_min(v, _mm_srli_si128(v, 8));
+    v = sv16_min(v, _mm_srli_si128(v, 4));
+    v = sv16_min(v, _mm_srli_si128(v, 2));
+    return _mm_cvtsi128_si32(v) & 0xffff;
+}
+
+#elif defined(STEREO_SIMD_NEON)
+
+typedef uint16x8_t sv16;
+
+static inline sv16 sv16_load(const ushort* p) { return vld1q_u16(p); }
+static inline void sv16_store(ushort* p, sv16 v) { vst1q_u16(p, v); }
+static inline sv16 sv16_set(int v) { return vdupq_n_u16((ushort)v); }
+static inline sv16 sv16_adds(sv16 a, sv16 b) { return vqaddq_u16(a, b); }
+static inline sv16 sv16_subs(sv16 a, sv16 b) { return vqsubq_u16(a, b); }
+static inline sv16 sv16_sub(sv16 a, sv16 b) { return vsubq_u16(a, b); }
+static inline sv16 sv16_min(sv16 a, sv16 b) { return vminq_u16(a, b); }
+static inline sv16 sv16_max(sv16 a, sv16 b) { return vmaxq_u16(a, b); }
+static inline sv16 sv16_load_u8(const uchar* p) { return vmovl_u8(vld1_u8(p)); }
+static inline int sv16_hmin(sv16 v)
+{
+    uint16x4_t h = vmin_u16(vget_low_u16(v), vget_high_u16(v));
+    h = vpmin_u16(h, h);
+    h = vpmin_u16(h, h);
+    return vget_lane_u16(h, 0);
+}
+
+#else
+
+struct sv16 { ushort v[8]; };
+
+static inline sv16 sv16_load(const ushort* p) { sv16 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+static inline void sv16_store(ushort* p, sv16 v) { memcpy(p, v.v, sizeof(v.v)); }
+static inline sv16 sv16_set(int v) { sv16 r; for( int i = 0; i < 8; i++ ) r.v[i] = (ushort)v; return r; }
+static inline sv16 sv16_adds(sv16 a, sv16 b) { for( int i = 0; i < 8; i++ ) a.v[i] = (ushort)std::min(a.v[i] + b.v[i], 65535); return a; }
+static inline sv16 sv16_subs(sv16 a, sv16 b) { for( int i = 0; i < 8; i++ ) a.v[i] = (ushort)std::max(a.v[i] - b.v[i], 0); return a; }
+static inline sv16 sv16_sub(sv16 a, sv16 b) { for( int i = 0; i < 8; i++ ) a.v[i] = (ushort)(a.v[i] - b.v[i]); return a; }
+static inline sv16 sv16_min(sv16 a, sv16 b) { for( int i = 0; i < 8; i++ ) a.v[i] = std::min(a.v[i], b.v[i]); return a; }
+static inline sv16 sv16_max(sv16 a, sv16 b) { for( int i = 0; i < 8; i++ ) a.v[i] = std::max(a.v[i], b.v[i]); return a; }
+static inline sv16 sv16_load_u8(const uchar* p) { sv16 r; for( int i = 0; i < 8; i++ ) r.v[i] = p[i]; return r; }
+static inline int sv16_hmin(sv16 v) { int m = v.v[0]; for( int i = 1; i < 8; i++ ) m = std::min(m, (int)v.v[i]); return m; }
+
+#endif
+
+#endif /* Stereo_Simd_hpp */
@@ -0,0 +1,779 @@
+//
+//  Stereo_SimdBM.hpp
+//  BMW_FM
+//
+//  SAD block matching on rectified 8-bit pairs with vectorised kernels.
+//  It is a drop-in cv::StereoMatcher: same controls as StereoBM (x-sobel
+//  pre-filter, texture threshold, uniqueness ratio, disp12MaxDiff, speckle
+//  filter) and the same CV_16S output with 4 fractional bits.
+//
+//  For every row the absolute differences of all disparities are kept as
+//  column sums over the block height, D values per pixel laid out next to
+//  each other. Moving one row down adds the new row and removes the old one,
+//  moving one pixel right adds one column and removes another, so the cost
+//  per pixel does not depend on the block size and every update is a
+//  straight vector add over the disparity dimension.
+//
+
+#ifndef Stereo_SimdBM_hpp
+#define Stereo_SimdBM_hpp
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_Simd.hpp"
+#include "Stereo_ThreadPool.hpp"
+
+#include <vector>
+#include <limits.h>
+
+using namespace cv;
+
+
+//per-row kernels, all working on ushort column/window sums laid out as [x][d]
+typedef void (*SimdBMColFunc)(const uchar* lnew, const uchar* rnew, const uchar* lold, const uchar* rold,
+                              ushort* col, int width, int ndisp);
+typedef void (*SimdBMSlideFunc)(ushort* sad, const ushort* add, const ushort* sub, int ndisp);
+typedef int (*SimdBMMinFunc)(const ushort* sad, int ndisp, int* minsad);
+typedef int (*SimdBMCountFunc)(const ushort* sad, int ndisp, int thresh);
+
+struct SimdBMKernels
+{
+    SimdBMColFunc updateCols;
+    SimdBMSlideFunc slide;
+    SimdBMMinFunc findMin;
+    SimdBMCountFunc countLE;
+    int level;
+};
+
+
+//scalar reference kernels
+
+//col[x][d] += |lnew[x] - rnew[W-1-x+d]| - |lold[x] - rold[W-1-x+d]|  (lold == 0: add only)
+static inline void simdbmUpdateColsScalar(const uchar* lnew, const uchar* rnew, const uchar* lold, const uchar* rold,
+                                          ushort* col, int width, int ndisp)
+{
+    for( int x = 0; x < width; x++, col += ndisp )
+    {
+        int ln = lnew[x];
+        const uchar* rn = rnew + width - 1 - x;
+        if( lold )
+        {
+            int lo = lold[x];
+            const uchar* ro = rold + width - 1 - x;
+            for( int d = 0; d < ndisp; d++ )
+                col[d] = (ushort)(col[d] + std::abs(ln - rn[d]) - std::abs(lo - ro[d]));
+        }
+        else
+        {
+            for( int d = 0; d < ndisp; d++ )
+                col[d] = (ushort)(col[d] + std::abs(ln - rn[d]));
+        }
+    }
+}
+
+template<typename SumT> static inline void simdbmSlideScalar(SumT* sad, const ushort* add, const ushort* sub, int ndisp)
+{
+    for( int d = 0; d < ndisp; d++ )
+        sad[d] = (SumT)(sad[d] + add[d] - sub[d]);
+}
+
+template<typename SumT> static inline int simdbmFindMinScalar(const SumT* sad, int ndisp, int* minsad)
+{
+    int best = 0;
+    SumT m = sad[0];
+    for( int d = 1; d < ndisp; d++ )
+        if( sad[d] < m )
+        {
+            m = sad[d];
+            best = d;
+        }
+    *minsad = (int)m;
+    return best;
+}
+
+template<typename SumT> static inline int simdbmCountLEScalar(const SumT* sad, int ndisp, int thresh)
+{
+    int n = 0;
+    for( int d = 0; d < ndisp; d++ )
+        n += (int)sad[d] <= thresh;
+    return n;
+}
+
+static inline void simdbmSlideScalarU16(ushort* sad, const ushort* add, const ushort* sub, int ndisp)
+{
+    simdbmSlideScalar<ushort>(sad, add, sub, ndisp);
+}
+
+static inline int simdbmFindMinScalarU16(const ushort* sad, int ndisp, int* minsad)
+{
+    return simdbmFindMinScalar<ushort>(sad, ndisp, minsad);
+}
+
+static inline int simdbmCountLEScalarU16(const ushort* sad, int ndisp, int thresh)
+{
+    return simdbmCountLEScalar<ushort>(sad, ndisp, thresh);
+}
+
+
+#if defined(STEREO_SIMD_SSE2)
+
+static inline __m128i simdbmAbsDiffU8SSE2(__m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+static inline void simdbmUpdateColsSSE2(const uchar* lnew, const uchar* rnew, const uchar* lold, const uchar* rold,
+                                        ushort* col, int width, int ndisp)
+{
+    const __m128i z = _mm_setzero_si128();
+    for( int x = 0; x < width; x++, col += ndisp )
+    {
+        __m128i ln = _mm_set1_epi8((char)lnew[x]);
+        const uchar* rn = rnew + width - 1 - x;
+        __m128i lo = _mm_set1_epi8((char)(lold ? lold[x] : 0));
+        const uchar* ro = lold ? rold + width - 1 - x : 0;
+        for( int d = 0; d < ndisp; d += 16 )
+        {
+            __m128i ad = simdbmAbsDiffU8SSE2(ln, _mm_loadu_si128((const __m128i*)(rn + d)));
+            __m128i c0 = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(col + d)), _mm_unpacklo_epi8(ad, z));
+            __m128i c1 = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(col + d + 8)), _mm_unpackhi_epi8(ad, z));
+            if( ro )
+            {
+                __m128i ado = simdbmAbsDiffU8SSE2(lo, _mm_loadu_si128((const __m128i*)(ro + d)));
+                c0 = _mm_sub_epi16(c0, _mm_unpacklo_epi8(ado, z));
+                c1 = _mm_sub_epi16(c1, _mm_unpackhi_epi8(ado, z));
+            }
+            _mm_storeu_si128((__m128i*)(col + d), c0);
+            _mm_storeu_si128((__m128i*)(col + d + 8), c1);
+        }
+    }
+}
+
+static inline void simdbmSlideSSE2(ushort* sad, const ushort* add, const ushort* sub, int ndisp)
+{
+    for( int d = 0; d < ndisp; d += 8 )
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)(sad + d));
+        s = _mm_add_epi16(s, _mm_loadu_si128((const __m128i*)(add + d)));
+        s = _mm_sub_epi16(s, _mm_loadu_si128((const __m128i*)(sub + d)));
+        _mm_storeu_si128((__m128i*)(sad + d), s);
+    }
+}
+
+//SSE2 has no unsigned 16-bit min: min(a, b) = a - subs(a, b)
+static inline __m128i simdbmMinU16SSE2(__m128i a, __m128i b)
+{
+    return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+}
+
+static inline int simdbmFirstEqualSSE2(const ushort* sad, int ndisp, int value)
+{
+    __m128i v = _mm_set1_epi16((short)value);
+    for( int d = 0; d < ndisp; d += 8 )
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(sad + d)), v));
+        if( mask )
+        {
+            int i = 0;
+            while( !(mask & (1 << i)) )
+                i++;
+            return d + i/2;
+        }
+    }
+    return 0;
+}
+
+static inline int simdbmFindMinSSE2(const ushort* sad, int ndisp, int* minsad)
+{
+    __m128i m = _mm_loadu_si128((const __m128i*)sad);
+    for( int d = 8; d < ndisp; d += 8 )
+        m = simdbmMinU16SSE2(m, _mm_loadu_si128((const __m128i*)(sad + d)));
+    m = simdbmMinU16SSE2(m, _mm_srli_si128(m, 8));
+    m = simdbmMinU16SSE2(m, _mm_srli_si128(m, 4));
+    m = simdbmMinU16SSE2(m, _mm_srli_si128(m, 2));
+    int value = _mm_cvtsi128_si32(m) & 0xffff;
+    *minsad = value;
+    return simdbmFirstEqualSSE2(sad, ndisp, value);
+}
+
+static inline int simdbmPopcount16(int mask)
+{
+    int n = 0;
+    for( ; mask; mask &= mask - 1 )
+        n++;
+    return n;
+}
+
+static inline int simdbmCountLESSE2(const ushort* sad, int ndisp, int thresh)
+{
+    if( thresh >= USHRT_MAX )
+        return ndisp;
+    __m128i t = _mm_set1_epi16((short)thresh), z = _mm_setzero_si128();
+    int n = 0;
+    for( int d = 0; d < ndisp; d += 8 )
+    {
+        __m128i le = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i*)(sad + d)), t), z);
+        n += simdbmPopcount16(_mm_movemask_epi8(le));
+    }
+    return n/2;
+}
+
+#endif
+
+
+#if defined(STEREO_SIMD_AVX2)
+
+STEREO_TARGET_AVX2 static inline void simdbmUpdateColsAVX2(const uchar* lnew, const uchar* rnew, const uchar* lold, const uchar* rold,
+                                                           ushort* col, int width, int ndisp)
+{
+    for( int x = 0; x < width; x++, col += ndisp )
+    {
+        __m256i ln = _mm256_set1_epi8((char)lnew[x]);
+        const uchar* rn = rnew + width - 1 - x;
+        __m256i lo = _mm256_set1_epi8((char)(lold ? lold[x] : 0));
+        const uchar* ro = lold ? rold + width - 1 - x : 0;
+        int d = 0;
+        for( ; d <= ndisp - 32; d += 32 )
+        {
+            __m256i r = _mm256_loadu_si256((const __m256i*)(rn + d));
+            __m256i ad = _mm256_or_si256(_mm256_subs_epu8(ln, r), _mm256_subs_epu8(r, ln));
+            __m256i c0 = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(col + d)),
+                                          _mm256_cvtepu8_epi16(_mm256_castsi256_si128(ad)));
+            __m256i c1 = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(col + d + 16)),
+                                          _mm256_cvtepu8_epi16(_mm256_extracti128_si256(ad, 1)));
+            if( ro )
+            {
+                __m256i o = _mm256_loadu_si256((const __m256i*)(ro + d));
+                __m256i ado = _mm256_or_si256(_mm256_subs_epu8(lo, o), _mm256_subs_epu8(o, lo));
+                c0 = _mm256_sub_epi16(c0, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(ado)));
+                c1 = _mm256_sub_epi16(c1, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(ado, 1)));
+            }
+            _mm256_storeu_si256((__m256i*)(col + d), c0);
+            _mm256_storeu_si256((__m256i*)(col + d + 16), c1);
+        }
+        //ndisp is a multiple of 16, at most one half-width step remains
+        if( d < ndisp )
+        {
+            __m128i r = _mm_loadu_si128((const __m128i*)(rn + d));
+            __m128i l = _mm256_castsi256_si128(ln);
+            __m128i ad = _mm_or_si128(_mm_subs_epu8(l, r), _mm_subs_epu8(r, l));
+            __m256i c0 = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(col + d)), _mm256_cvtepu8_epi16(ad));
+            if( ro )
+            {
+                __m128i o = _mm_loadu_si128((const __m128i*)(ro + d));
+                __m128i l2 = _mm256_castsi256_si128(lo);
+                __m128i ado = _mm_or_si128(_mm_subs_epu8(l2, o), _mm_subs_epu8(o, l2));
+                c0 = _mm256_sub_epi16(c0, _mm256_cvtepu8_epi16(ado));
+            }
+            _mm256_storeu_si256((__m256i*)(col + d), c0);
+        }
+    }
+}
+
+STEREO_TARGET_AVX2 static inline void simdbmSlideAVX2(ushort* sad, const ushort* add, const ushort* sub, int ndisp)
+{
+    for( int d = 0; d < ndisp; d += 16 )
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(sad + d));
+        s = _mm256_add_epi16(s, _mm256_loadu_si256((const __m256i*)(add + d)));
+        s = _mm256_sub_epi16(s, _mm256_loadu_si256((const __m256i*)(sub + d)));
+        _mm256_storeu_si256((__m256i*)(sad + d), s);
+    }
+}
+
+STEREO_TARGET_AVX2 static inline int simdbmFindMinAVX2(const ushort* sad, int ndisp, int* minsad)
+{
+    __m256i m = _mm256_loadu_si256((const __m256i*)sad);
+    for( int d = 16; d < ndisp; d += 16 )
+        m = _mm256_min_epu16(m, _mm256_loadu_si256((const __m256i*)(sad + d)));
+    __m128i h = _mm_min_epu16(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+    int value = _mm_cvtsi128_si32(_mm_minpos_epu16(h)) & 0xffff;
+    *minsad = value;
+    __m256i v = _mm256_set1_epi16((short)value);
+    for( int d = 0; d < ndisp; d += 16 )
+    {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(sad + d)), v));
+        if( mask )
+            return d + __builtin_ctz(mask)/2;
+    }
+    return 0;
+}
+
+STEREO_TARGET_AVX2 static inline int simdbmCountLEAVX2(const ushort* sad, int ndisp, int thresh)
+{
+    if( thresh >= USHRT_MAX )
+        return ndisp;
+    __m256i t = _mm256_set1_epi16((short)thresh);
+    int n = 0;
+    for( int d = 0; d < ndisp; d += 16 )
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(sad + d));
+        __m256i le = _mm256_cmpeq_epi16(_mm256_min_epu16(s, t), s);
+        n += __builtin_popcount((unsigned)_mm256_movemask_epi8(le));
+    }
+    return n/2;
+}
+
+#endif
+
+
+#if defined(STEREO_SIMD_NEON)
+
+static inline void simdbmUpdateColsNEON(const uchar* lnew, const uchar* rnew, const uchar* lold, const uchar* rold,
+                                        ushort* col, int width, int ndisp)
+{
+    for( int x = 0; x < width; x++, col += ndisp )
+    {
+        uint8x16_t ln = vdupq_n_u8(lnew[x]);
+        const uchar* rn = rnew + width - 1 - x;
+        uint8x16_t lo = vdupq_n_u8(lold ? lold[x] : 0);
+        const uchar* ro = lold ? rold + width - 1 - x : 0;
+        for( int d = 0; d < ndisp; d += 16 )
+        {
+            uint8x16_t r = vld1q_u8(rn + d);
+            uint16x8_t c0 = vabal_u8(vld1q_u16(col + d), vget_low_u8(ln), vget_low_u8(r));
+            uint16x8_t c1 = vabal_u8(vld1q_u16(col + d + 8), vget_high_u8(ln), vget_high_u8(r));
+            if( ro )
+            {
+                uint8x16_t o = vld1q_u8(ro + d);
+                c0 = vsubq_u16(c0, vabdl_u8(vget_low_u8(lo), vget_low_u8(o)));
+                c1 = vsubq_u16(c1, vabdl_u8(vget_high_u8(lo), vget_high_u8(o)));
+            }
+            vst1q_u16(col + d, c0);
+            vst1q_u16(col + d + 8, c1);
+        }
+    }
+}
+
+static inline void simdbmSlideNEON(ushort* sad, const ushort* add, const ushort* sub, int ndisp)
+{
+    for( int d = 0; d < ndisp; d += 8 )
+        vst1q_u16(sad + d, vsubq_u16(vaddq_u16(vld1q_u16(sad + d), vld1q_u16(add + d)), vld1q_u16(sub + d)));
+}
+
+static inline int simdbmFindMinNEON(const ushort* sad, int ndisp, int* minsad)
+{
+    uint16x8_t m = vld1q_u16(sad);
+    for( int d = 8; d < ndisp; d += 8 )
+        m = vminq_u16(m, vld1q_u16(sad + d));
+    uint16x4_t h = vmin_u16(vget_low_u16(m), vget_high_u16(m));
+    h = vpmin_u16(h, h);
+    h = vpmin_u16(h, h);
+    int value = vget_lane_u16(h, 0);
+    *minsad = value;
+    for( int d = 0; d < ndisp; d++ )
+        if( sad[d] == value )
+            return d;
+    return 0;
+}
+
+static inline int simdbmCountLENEON(const ushort* sad, int ndisp, int thresh)
+{
+    if( thresh >= USHRT_MAX )
+        return ndisp;
+    uint16x8_t t = vdupq_n_u16((ushort)thresh), n = vdupq_n_u16(0);
+    for( int d = 0; d < ndisp; d += 8 )
+        n = vsubq_u16(n, vcleq_u16(vld1q_u16(sad + d), t));
+    uint16_t lanes[8];
+    vst1q_u16(lanes, n);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+}
+
+#endif
+
+
+static inline SimdBMKernels getSimdBMKernels(int level)
+{
+    SimdBMKernels k;
+    k.updateCols = simdbmUpdateColsScalar;
+    k.slide = simdbmSlideScalarU16;
+    k.findMin = simdbmFindMinScalarU16;
+    k.countLE = simdbmCountLEScalarU16;
+    k.level = STEREO_SIMD_LEVEL_SCALAR;
+#if defined(STEREO_SIMD_AVX2)
+    if( level >= STEREO_SIMD_LEVEL_AVX2 )
+    {
+        k.updateCols = simdbmUpdateColsAVX2;
+        k.slide = simdbmSlideAVX2;
+        k.findMin = simdbmFindMinAVX2;
+        k.countLE = simdbmCountLEAVX2;
+        k.level = STEREO_SIMD_LEVEL_AVX2;
+        return k;
+    }
+#endif
+#if defined(STEREO_SIMD_SSE2)
+    if( level >= STEREO_SIMD_LEVEL_SSE2 )
+    {
+        k.updateCols = simdbmUpdateColsSSE2;
+        k.slide = simdbmSlideSSE2;
+        k.findMin = simdbmFindMinSSE2;
+        k.countLE = simdbmCountLESSE2;
+        k.level = STEREO_SIMD_LEVEL_SSE2;
+    }
+#endif
+#if defined(STEREO_SIMD_NEON)
+    if( level >= STEREO_SIMD_LEVEL_NEON )
+    {
+        k.updateCols = simdbmUpdateColsNEON;
+        k.slide = simdbmSlideNEON;
+        k.findMin = simdbmFindMinNEON;
+        k.countLE = simdbmCountLENEON;
+        k.level = STEREO_SIMD_LEVEL_NEON;
+    }
+#endif
+    return k;
+}
+
+
+//same response as StereoBM's PREFILTER_XSOBEL: clamp(sobel_x, -cap, cap) + cap
+static inline void simdbmPrefilterXSobel(const Mat& src, Mat& dst, int preFilterCap)
+{
+    dst.create(src.size(), CV_8U);
+    int width = src.cols, height = src.rows;
+    const int OFS = 256*4;
+    uchar tab[OFS*2 + 1];
+    for( int i = 0; i <= OFS*2; i++ )
+        tab[i] = (uchar)(std::min(std::max(i - OFS, -preFilterCap), preFilterCap) + preFilterCap);
+
+    for( int y = 0; y < height; y++ )
+    {
+        const uchar* p0 = src.ptr<uchar>(std::max(y - 1, 0));
+        const uchar* p1 = src.ptr<uchar>(y);
+        const uchar* p2 = src.ptr<uchar>(std::min(y + 1, height - 1));
+        uchar* d = dst.ptr<uchar>(y);
+        for( int x = 0; x < width; x++ )
+        {
+            int xl = std::max(x - 1, 0), xr = std::min(x + 1, width - 1);
+            int v = (p0[xr] - p0[xl]) + 2*(p1[xr] - p1[xl]) + (p2[xr] - p2[xl]);
+            d[x] = tab[v + OFS];
+        }
+    }
+}
+
+
+class StereoSimdBM : public StereoMatcher
+{
+public:
+    //matches StereoBM::create() defaults
+    static Ptr<StereoSimdBM> create(int numDisparities = 0, int blockSize = 21)
+    {
+        Ptr<StereoSimdBM> bm = makePtr<StereoSimdBM>();
+        bm->setNumDisparities(numDisparities);
+        bm->setBlockSize(blockSize);
+        return bm;
+    }
+
+    StereoSimdBM()
+    {
+        minDisparity = 0;
+        numDisparities = 16;
+        blockSize = 21;
+        preFilterCap = 31;
+        textureThreshold = 10;
+        uniquenessRatio = 15;
+        disp12MaxDiff = -1;
+        speckleWindowSize = 0;
+        speckleRange = 0;
+        simdLevel = stereoSimdLevel();
+    }
+
+    void compute(InputArray leftarr, InputArray rightarr, OutputArray disparr)
+    {
+        computeRanges(leftarr, rightarr, disparr, std::vector<Vec2i>());
+    }
+
+    //compute() with the rows split into ranges.size() equal bands, band i (rows
+    //[h*i/n, h*(i+1)/n)) searching only ranges[i] = (minD, numD) within the configured
+    //range; numD is rounded down to a multiple of 16. An empty list searches everything.
+    void computeRanges(InputArray leftarr, InputArray rightarr, OutputArray disparr, const std::vector<Vec2i>& ranges)
+    {
+        Mat left = leftarr.getMat(), right = rightarr.getMat();
+        CV_Assert( left.size() == right.size() && left.type() == right.type() );
+        if( left.channels() > 1 )
+        {
+            Mat g1, g2;
+            cvtColor(left, g1, COLOR_BGR2GRAY);
+            cvtColor(right, g2, COLOR_BGR2GRAY);
+            left = g1;
+            right = g2;
+        }
+        CV_Assert( left.depth() == CV_8U );
+
+        disparr.create(left.size(), CV_16S);
+        Mat disp = disparr.getMat();
+
+        prepare(left, right);
+        computeBands(disp, ranges);
+
+        if( speckleWindowSize > 0 )
+            filterSpeckles(disp, (minDisparity - 1)*StereoMatcher::DISP_SCALE, speckleWindowSize, speckleRange, slidingSumBuf);
+    }
+
+    int getMinDisparity() const { return minDisparity; }
+    void setMinDisparity(int minDisparity_) { minDisparity = minDisparity_; }
+
+    int getNumDisparities() const { return numDisparities; }
+    void setNumDisparities(int numDisparities_)
+    {
+        //the kernels step over disparities 16 at a time
+        CV_Assert( numDisparities_ % 16 == 0 );
+        numDisparities = numDisparities_ > 0 ? numDisparities_ : 64;
+    }
+
+    int getBlockSize() const { return blockSize; }
+    void setBlockSize(int blockSize_)
+    {
+        CV_Assert( blockSize_ % 2 == 1 && blockSize_ >= 5 && blockSize_ <= 255 );
+        blockSize = blockSize_;
+    }
+
+    int getSpeckleWindowSize() const { return speckleWindowSize; }
+    void setSpeckleWindowSize(int speckleWindowSize_) { speckleWindowSize = speckleWindowSize_; }
+
+    int getSpeckleRange() const { return speckleRange; }
+    void setSpeckleRange(int speckleRange_) { speckleRange = speckleRange_; }
+
+    int getDisp12MaxDiff() const { return disp12MaxDiff; }
+    void setDisp12MaxDiff(int disp12MaxDiff_) { disp12MaxDiff = disp12MaxDiff_; }
+
+    int getPreFilterCap() const { return preFilterCap; }
+    void setPreFilterCap(int preFilterCap_)
+    {
+        CV_Assert( preFilterCap_ >= 1 && preFilterCap_ <= 63 );
+        preFilterCap = preFilterCap_;
+    }
+
+    int getTextureThreshold() const { return textureThreshold; }
+    void setTextureThreshold(int textureThreshold_) { textureThreshold = textureThreshold_; }
+
+    int getUniquenessRatio() const { return uniquenessRatio; }
+    void setUniquenessRatio(int uniquenessRatio_) { uniquenessRatio = uniquenessRatio_; }
+
+    //instruction set the kernels run with, defaults to the best one the CPU supports
+    int getSimdLevel() const { return simdLevel; }
+    void setSimdLevel(int level) { simdLevel = std::min(level, stereoSimdLevel()); }
+
+    String getDefaultName() const { return "StereoMatcher.SimdBM"; }
+
+protected:
+    //pre-filters both views and builds the mirrored right image the kernels read from
+    void prepare(const Mat& left, const Mat& right)
+    {
+        int width = left.cols, height = left.rows, ndisp = numDisparities;
+        simdbmPrefilterXSobel(left, leftPF, preFilterCap);
+        simdbmPrefilterXSobel(right, rightPF, preFilterCap);
+
+        //rightRev(y, k) = rightPF(y, W-1-minD-k), so for a left pixel x the right pixels
+        //x-minD-d, d = 0..D-1, are contiguous and start at k = W-1-x
+        rightRev.create(height, width + ndisp - 1, CV_8U);
+        for( int y = 0; y < height; y++ )
+        {
+            const uchar* src = rightPF.ptr<uchar>(y);
+            uchar* dst = rightRev.ptr<uchar>(y);
+            for( int k = 0; k < width + ndisp - 1; k++ )
+                dst[k] = src[std::min(std::max(width - 1 - minDisparity - k, 0), width - 1)];
+        }
+    }
+
+    //runs the matcher in horizontal bands. ranges[i] = (minD, numD) restricts band i to a
+    //sub-range of [minDisparity, minDisparity + numDisparities); empty means full range
+    void computeBands(Mat& disp, const std::vector<Vec2i>& ranges)
+    {
+        int height = leftPF.rows;
+        int nbands = ranges.empty() ? std::max(1, std::min(stereoNumThreads()*2, height/(blockSize*4))) : (int)ranges.size();
+        parallel_for_(Range(0, nbands), BandInvoker(*this, disp, ranges, nbands), nbands);
+    }
+
+    struct BandInvoker : public ParallelLoopBody
+    {
+        BandInvoker(const StereoSimdBM& bm_, Mat& disp_, const std::vector<Vec2i>& ranges_, int nbands_)
+        : bm(bm_), disp(&disp_), ranges(&ranges_), nbands(nbands_) {}
+
+        void operator()(const Range& range) const
+        {
+            int height = bm.leftPF.rows;
+            for( int i = range.start; i < range.end; i++ )
+            {
+                int y0 = (int)((int64)height*i/nbands), y1 = (int)((int64)height*(i + 1)/nbands);
+                int dmin = bm.minDisparity, nd = bm.numDisparities;
+                if( !ranges->empty() )
+                {
+                    dmin = std::max((*ranges)[i][0], bm.minDisparity);
+                    nd = std::min((*ranges)[i][0] + (*ranges)[i][1], bm.minDisparity + bm.numDisparities) - dmin;
+                    nd = std::max(nd, 0) & -16;
+                }
+                bm.processBand(*disp, y0, y1, dmin, nd);
+            }
+        }
+
+        const StereoSimdBM& bm;
+        Mat* disp;
+        const std::vector<Vec2i>* ranges;
+        int nbands;
+    };
+
+    void processBand(Mat& disp, int y0, int y1, int dmin, int nd) const
+    {
+        //largest possible window sum decides whether the ushort kernels can hold it
+        if( blockSize*blockSize*2*preFilterCap <= USHRT_MAX )
+            processBandT<ushort>(disp, y0, y1, dmin, nd);
+        else
+            processBandT<int>(disp, y0, y1, dmin, nd);
+    }
+
+    static void slide(const SimdBMKernels& k, ushort* sad, const ushort* add, const ushort* sub, int nd) { k.slide(sad, add, sub, nd); }
+    static void slide(const SimdBMKernels&, int* sad, const ushort* add, const ushort* sub, int nd) { simdbmSlideScalar<int>(sad, add, sub, nd); }
+    static int findMin(const SimdBMKernels& k, const ushort* sad, int nd, int* minsad) { return k.findMin(sad, nd, minsad); }
+    static int findMin(const SimdBMKernels&, const int* sad, int nd, int* minsad) { return simdbmFindMinScalar<int>(sad, nd, minsad); }
+    static int countLE(const SimdBMKernels& k, const ushort* sad, int nd, int thresh) { return k.countLE(sad, nd, thresh); }
+    static int countLE(const SimdBMKernels&, const int* sad, int nd, int thresh) { return simdbmCountLEScalar<int>(sad, nd, thresh); }
+
+    template<typename SumT> void processBandT(Mat& disp, int y0, int y1, int dmin, int nd) const
+    {
+        const SimdBMKernels k = getSimdBMKernels(simdLevel);
+        const int width = leftPF.cols, height = leftPF.rows, r = blockSize/2;
+        const short FILTERED = (short)((minDisparity - 1)*StereoMatcher::DISP_SCALE);
+        const int doff = dmin - minDisparity;
+
+        for( int y = y0; y < y1; y++ )
+        {
+            short* dptr = disp.ptr<short>(y);
+            for( int x = 0; x < width; x++ )
+                dptr[x] = FILTERED;
+        }
+
+        //columns whose window and full disparity range stay inside both images
+        int xmin = r + std::max(0, dmin + nd - 1), xmax = width - r - std::max(0, -dmin);
+        int ystart = std::max(y0, r), yend = std::min(y1, height - r);
+        if( nd <= 0 || xmin >= xmax || ystart >= yend )
+            return;
+
+        std::vector<ushort> colbuf((size_t)width*nd + 16, 0);
+        std::vector<SumT> sadbuf(nd + 16);
+        std::vector<int> tcol(width, 0), bestD(width), bestCost(width), disp2(width), disp2cost(width);
+        ushort* col = &colbuf[0];
+        SumT* sad = &sadbuf[0];
+
+        //prime the column sums with the block rows above the first output row
+        for( int yy = ystart - r; yy < ystart + r; yy++ )
+            accumulateRow(k, col, &tcol[0], yy, -1, doff, nd);
+
+        for( int y = ystart; y < yend; y++ )
+        {
+            accumulateRow(k, col, &tcol[0], y + r, y > ystart ? y - r - 1 : -1, doff, nd);
+
+            short* dptr = disp.ptr<short>(y);
+            for( int d = 0; d < nd; d++ )
+                sad[d] = 0;
+            int tsum = 0;
+            for( int x = xmin - r; x <= xmin + r; x++ )
+            {
+                const ushort* c = col + (size_t)x*nd;
+                for( int d = 0; d < nd; d++ )
+                    sad[d] = (SumT)(sad[d] + c[d]);
+                tsum += tcol[x];
+            }
+
+            for( int x = xmin; x < xmax; x++ )
+            {
+                if( x > xmin )
+                {
+                    slide(k, sad, col + (size_t)(x + r)*nd, col + (size_t)(x - r - 1)*nd, nd);
+                    tsum += tcol[x + r] - tcol[x - r - 1];
+                }
+                bestD[x] = INT_MIN;
+                if( tsum < textureThreshold )
+                    continue;
+
+                int minsad = 0;
+                int mind = findMin(k, sad, nd, &minsad);
+
+                if( uniquenessRatio > 0 )
+                {
+                    int thresh = minsad + (minsad*uniquenessRatio/100);
+                    int n = countLE(k, sad, nd, thresh);
+                    for( int d = std::max(mind - 1, 0); d <= std::min(mind + 1, nd - 1); d++ )
+                        n -= (int)sad[d] <= thresh;
+                    if( n > 0 )
+                        continue;
+                }
+
+                //equiangular sub-pixel fit, neighbours mirrored at the ends of the range like StereoBM
+                int p = (int)sad[mind > 0 ? mind - 1 : 1];
+                int n = (int)sad[mind < nd - 1 ? mind + 1 : nd - 2];
+                int denom = p + n - 2*minsad + std::abs(p - n);
+                dptr[x] = (short)(((dmin + mind)*256 + (denom != 0 ? (p - n)*256/denom : 0) + 15) >> 4);
+                bestD[x] = dmin + mind;
+                bestCost[x] = minsad;
+            }
+
+            if( disp12MaxDiff >= 0 )
+                checkLeftRight(dptr, &bestD[0], &bestCost[0], &disp2[0], &disp2cost[0], xmin, xmax, FILTERED);
+        }
+    }
+
+    //adds image row ynew to the column sums and removes row yold (if >= 0)
+    void accumulateRow(const SimdBMKernels& k, ushort* col, int* tcol, int ynew, int yold, int doff, int nd) const
+    {
+        const int width = leftPF.cols, cap = preFilterCap;
+        const uchar* lnew = leftPF.ptr<uchar>(ynew);
+        const uchar* rnew = rightRev.ptr<uchar>(ynew) + doff;
+        const uchar* lold = yold >= 0 ? leftPF.ptr<uchar>(yold) : 0;
+        const uchar* rold = yold >= 0 ? rightRev.ptr<uchar>(yold) + doff : 0;
+        k.updateCols(lnew, rnew, lold, rold, col, width, nd);
+        for( int x = 0; x < width; x++ )
+            tcol[x] += std::abs(lnew[x] - cap) - (lold ? std::abs(lold[x] - cap) : 0);
+    }
+
+    //StereoBM's validateDisparity on one row: a pixel survives if the right view,
+    //matched back with the lowest-cost left pixel, lands within disp12MaxDiff of it
+    void checkLeftRight(short* dptr, const int* bestD, const int* bestCost, int* disp2, int* disp2cost,
+                        int xmin, int xmax, short FILTERED) const
+    {
+        const int width = leftPF.cols;
+        for( int x = 0; x < width; x++ )
+        {
+            disp2[x] = INT_MIN;
+            disp2cost[x] = INT_MAX;
+        }
+        for( int x = xmin; x < xmax; x++ )
+        {
+            int d = bestD[x];
+            if( d == INT_MIN )
+                continue;
+            int x2 = x - d;
+            if( x2 >= 0 && x2 < width && disp2cost[x2] > bestCost[x] )
+            {
+                disp2cost[x2] = bestCost[x];
+                disp2[x2] = d;
+            }
+        }
+        for( int x = xmin; x < xmax; x++ )
+        {
+            int d = bestD[x];
+            if( d == INT_MIN )
+                continue;
+            int x2 = x - d;
+            if( x2 >= 0 && x2 < width && disp2[x2] != INT_MIN && std::abs(disp2[x2] - d) > disp12MaxDiff )
+                dptr[x] = FILTERED;
+        }
+    }
+
+    int minDisparity;
+    int numDisparities;
+    int blockSize;
+    int preFilterCap;
+    int textureThreshold;
+    int uniquenessRatio;
+    int disp12MaxDiff;
+    int speckleWindowSize;
+    int speckleRange;
+    int simdLevel;
+
+    Mat leftPF, rightPF, rightRev;
+    Mat slidingSumBuf;
+};
+
+#endif /* Stereo_SimdBM_hpp */
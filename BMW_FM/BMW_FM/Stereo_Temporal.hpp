@@ -0,0 +1,132 @@
+//
+//  Stereo_Temporal.hpp
+//  BMW_FM
+//
+//  Temporal narrowing of the disparity search for image sequences. The
+//  disparities of the previous frame give every band of rows the range its
+//  scene occupied; widened by a motion margin (and merged with the bands
+//  above and below for vertical motion) that range is all the next frame
+//  searches in the band. Every keyframeInterval-th frame, and any band the
+//  previous frame had too few valid disparities in, searches the full
+//  range, so objects entering the view are picked up again.
+//
+//  The ranges are laid out for StereoSimdBM::computeRanges().
+//
+
+#ifndef Stereo_Temporal_hpp
+#define Stereo_Temporal_hpp
+
+#include "opencv2/calib3d.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <limits.h>
+
+using namespace cv;
+
+
+class StereoTemporalRange
+{
+public:
+    //margin in pixels of disparity; keyframeInterval <= 0 never forces a full-range frame
+    StereoTemporalRange(int bandHeight_ = 32, int margin_ = 8, int keyframeInterval_ = 10)
+    : bandHeight(std::max(bandHeight_, 1)), margin(std::max(margin_, 0)), keyframeInterval(keyframeInterval_),
+    frame(0), height(0), minDisparity(0), numDisparities(0), searched(1) {}
+
+    //forget the previous frame, e.g. after a cut in the sequence
+    void reset()
+    {
+        bands.clear();
+        frame = 0;
+    }
+
+    //search ranges for the next frame; empty means the full range (keyframe)
+    const std::vector<Vec2i>& next(int height_, int minDisparity_, int numDisparities_)
+    {
+        bool keyframe = bands.empty() || height_ != height || minDisparity_ != minDisparity ||
+            numDisparities_ != numDisparities || (keyframeInterval > 0 && frame % keyframeInterval == 0);
+        height = height_;
+        minDisparity = minDisparity_;
+        numDisparities = numDisparities_;
+        frame++;
+        ranges.clear();
+        searched = 1;
+        if( keyframe )
+            return ranges;
+
+        int nbands = (int)bands.size();
+        int64 total = 0;
+        for( int i = 0; i < nbands; i++ )
+        {
+            int lo = INT_MAX, hi = INT_MIN;
+            for( int j = std::max(i - 1, 0); j <= std::min(i + 1, nbands - 1); j++ )
+            {
+                lo = std::min(lo, bands[j][0]);
+                hi = std::max(hi, bands[j][1]);
+            }
+            Vec2i r(minDisparity, numDisparities);
+            if( bands[i][0] <= bands[i][1] )
+            {
+                lo -= margin;
+                hi += margin;
+                int nd = std::min((hi - lo + 16) & -16, numDisparities);
+                lo = std::min(std::max(lo, minDisparity), minDisparity + numDisparities - nd);
+                r = Vec2i(lo, nd);
+            }
+            ranges.push_back(r);
+            total += (int64)r[1]*(height*(i + 1)/nbands - height*i/nbands);
+        }
+        searched = (double)total/((double)numDisparities*height);
+        return ranges;
+    }
+
+    //the CV_16S disparity (x16) just computed for the ranges next() returned
+    void update(const Mat& disp)
+    {
+        CV_Assert( disp.type() == CV_16S && disp.rows == height );
+        int nbands = std::max(1, height/bandHeight);
+        bands.assign(nbands, Vec2i(INT_MAX, INT_MIN));
+        std::vector<int> hist(numDisparities + 1);
+        for( int i = 0; i < nbands; i++ )
+        {
+            int y0 = height*i/nbands, y1 = height*(i + 1)/nbands, count = 0;
+            std::fill(hist.begin(), hist.end(), 0);
+            for( int y = y0; y < y1; y++ )
+            {
+                const short* d = disp.ptr<short>(y);
+                for( int x = 0; x < disp.cols; x++ )
+                {
+                    int v = d[x] - minDisparity*StereoMatcher::DISP_SCALE;
+                    if( v < 0 )
+                        continue;
+                    hist[std::min(v/StereoMatcher::DISP_SCALE, numDisparities)]++;
+                    count++;
+                }
+            }
+            //too few matches to trust: full range for this band next time
+            if( count < (y1 - y0)*disp.cols/20 )
+                continue;
+
+            //0.5% of the matches at either end are taken as outliers
+            int cut = count/200, lo = 0, hi = numDisparities;
+            for( int acc = 0; lo < numDisparities && (acc += hist[lo]) <= cut; lo++ )
+                ;
+            for( int acc = 0; hi > lo && (acc += hist[hi]) <= cut; hi-- )
+                ;
+            bands[i] = Vec2i(minDisparity + lo, minDisparity + hi + 1);
+        }
+    }
+
+    bool lastWasKeyframe() const { return ranges.empty(); }
+    //share of the full disparity range x rows the last ranges search
+    double searchedFraction() const { return searched; }
+
+protected:
+    int bandHeight, margin, keyframeInterval;
+    int frame, height, minDisparity, numDisparities;
+    double searched;
+    std::vector<Vec2i> bands;       //(lowest, highest) disparity in pixels per band, lo > hi when unknown
+    std::vector<Vec2i> ranges;
+};
+
+#endif /* Stereo_Temporal_hpp */
@@ -0,0 +1,183 @@
+//
+//  Stereo_ThreadPool.hpp
+//  BMW_FM
+//
+//  Persistent work-stealing thread pool for coarse jobs such as whole
+//  stereo pairs. run(n, fn) hands every worker a contiguous block of task
+//  indices; a worker takes tasks from the front of its own queue and, once
+//  it is empty, steals from the back of the others, so slow pairs do not
+//  leave the remaining workers idle.
+//
+
+#ifndef Stereo_ThreadPool_hpp
+#define Stereo_ThreadPool_hpp
+
+#include "opencv2/core/utility.hpp"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+//set on the workers of a pool of several threads
+static inline bool& stereoOnPoolWorker()
+{
+    static thread_local bool on = false;
+    return on;
+}
+
+//threads the in-tree matchers split their loops over: one on the worker of a pool, which already
+//keeps every core busy, OpenCV's setting elsewhere. Per thread, unlike setNumThreads().
+static inline int stereoNumThreads()
+{
+    return stereoOnPoolWorker() ? 1 : std::max(cv::getNumThreads(), 1);
+}
+
+class StereoWorkStealingPool
+{
+public:
+    //fn(task, worker) with worker in [0, size())
+    typedef std::function<void(int, int)> Task;
+
+    //nthreads <= 0 uses one worker per CPU
+    explicit StereoWorkStealingPool(int nthreads = 0)
+    : queues(nthreads > 0 ? nthreads : std::max(cv::getNumberOfCPUs(), 1)), generation(0), pending(0), active(0), stopping(false)
+    {
+        for( size_t i = 0; i < queues.size(); i++ )
+            threads.push_back(std::thread(&StereoWorkStealingPool::workerLoop, this, (int)i));
+    }
+
+    ~StereoWorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for( size_t i = 0; i < threads.size(); i++ )
+            threads[i].join();
+    }
+
+    int size() const { return (int)queues.size(); }
+
+    //runs fn for every task in [0, ntasks) and returns once all of them finished;
+    //rethrows the first exception a task threw
+    void run(int ntasks, const Task& fn)
+    {
+        if( ntasks <= 0 )
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        int nworkers = size();
+        for( int w = 0; w < nworkers; w++ )
+        {
+            std::lock_guard<std::mutex> qlock(queues[w].mutex);
+            for( int t = (int)((int64)ntasks*w/nworkers); t < (int)((int64)ntasks*(w + 1)/nworkers); t++ )
+                queues[w].tasks.push_back(t);
+        }
+        task = fn;
+        error = std::exception_ptr();
+        pending = ntasks;
+        generation++;
+        wake.notify_all();
+        done.wait(lock, [this]{ return pending == 0 && active == 0; });
+        task = Task();
+        if( error )
+            std::rethrow_exception(error);
+    }
+
+protected:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    //own queue from the front, then the other queues from the back
+    bool takeTask(int worker, int& t)
+    {
+        int nworkers = size();
+        for( int i = 0; i < nworkers; i++ )
+        {
+            Queue& q = queues[(worker + i) % nworkers];
+            std::lock_guard<std::mutex> qlock(q.mutex);
+            if( q.tasks.empty() )
+                continue;
+            if( i == 0 )
+            {
+                t = q.tasks.front();
+                q.tasks.pop_front();
+            }
+            else
+            {
+                t = q.tasks.back();
+                q.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(int worker)
+    {
+        stereoOnPoolWorker() = size() > 1;
+        long long seen = 0;
+        for(;;)
+        {
+            Task fn;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]{ return stopping || generation != seen; });
+                if( stopping )
+                    return;
+                seen = generation;
+                //a worker that wakes after run() returned finds the job cleared:
+                //it sits the generation out instead of taking the next job's tasks
+                if( !task )
+                    continue;
+                fn = task;
+                active++;
+            }
+
+            int t;
+            while( takeTask(worker, t) )
+            {
+                try
+                {
+                    fn(t, worker);
+                }
+                catch(...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if( !error )
+                        error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                pending--;
+            }
+
+            //run() waits for every worker that joined the job to leave the loop, so
+            //none of them can pick up the next job's tasks with this job's fn; the
+            //job is set and cleared under the pool lock, so a late worker either
+            //sees it whole or not at all
+            std::lock_guard<std::mutex> lock(mutex);
+            if( --active == 0 && pending == 0 )
+                done.notify_all();
+        }
+    }
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    Task task;
+    std::exception_ptr error;
+    long long generation;
+    int pending;
+    int active;
+    bool stopping;
+};
+
+#endif /* Stereo_ThreadPool_hpp */
@@ -0,0 +1,126 @@
+//
+//  Stereo_Tiling.hpp
+//  BMW_FM
+//
+//  Tiled disparity computation for large frames. The rectified pair is cut
+//  into full-width bands or 2-D tiles; each tile is matched on its own with
+//  its input grown by the block radius, the disparity search range to the
+//  left and an extra margin for matchers whose costs reach further (the
+//  semi-global ones), so the pixels it keeps see the same neighbourhood as
+//  in a full-frame run. The tiles run on a persistent work-stealing pool,
+//  one matcher per worker, and write their inner part straight into the
+//  shared disparity map.
+//
+//  Every worker keeps its own crop and result buffers and is the first to
+//  write them (and its part of the output), so on NUMA machines the pages
+//  end up on the node of the core that uses them.
+//
+
+#ifndef Stereo_Tiling_hpp
+#define Stereo_Tiling_hpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_ThreadPool.hpp"
+
+#include <vector>
+#include <functional>
+
+using namespace cv;
+
+
+struct StereoTile
+{
+    Rect out;   //part of the disparity map the tile produces
+    Rect in;    //input it is matched on: out grown by the block, the search range and the margin
+};
+
+//tiles of tileSize covering size; a tileSize.width <= 0 gives full-width bands, a height <= 0 full-height columns
+static inline std::vector<StereoTile> stereoTileGrid(Size size, Size tileSize, int minDisparity, int numDisparities,
+                                                     int blockSize, int margin)
+{
+    int tw = tileSize.width > 0 ? tileSize.width : size.width;
+    int th = tileSize.height > 0 ? tileSize.height : size.height;
+    int r = blockSize/2 + std::max(margin, 0);
+    //a left pixel x is compared with right pixels x - minD - numD + 1 .. x - minD
+    int growLeft = r + std::max(minDisparity + numDisparities - 1, 0), growRight = r + std::max(-minDisparity, 0);
+    Rect image(0, 0, size.width, size.height);
+
+    std::vector<StereoTile> tiles;
+    for( int y = 0; y < size.height; y += th )
+        for( int x = 0; x < size.width; x += tw )
+        {
+            StereoTile t;
+            t.out = Rect(x, y, std::min(tw, size.width - x), std::min(th, size.height - y));
+            t.in = Rect(t.out.x - growLeft, t.out.y - r, t.out.width + growLeft + growRight, t.out.height + 2*r) & image;
+            tiles.push_back(t);
+        }
+    return tiles;
+}
+
+class StereoTiledExecutor
+{
+public:
+    //fn(worker, tile, left, right, disp): match the crops of tile.in into a CV_16S disp of
+    //the same size; called concurrently, with one worker index per thread
+    typedef std::function<void(int, const StereoTile&, const Mat&, const Mat&, Mat&)> Matcher;
+
+    //nthreads <= 0 uses one worker per CPU; tileSize as in stereoTileGrid, the default (0, 0)
+    //gives four full-width bands per worker
+    explicit StereoTiledExecutor(int nthreads = 0, Size tileSize_ = Size())
+    : pool(nthreads), tileSize(tileSize_), buffers(pool.size()) {}
+
+    int size() const { return pool.size(); }
+
+    Size getTileSize() const { return tileSize; }
+    void setTileSize(Size tileSize_) { tileSize = tileSize_; }
+
+    //the tiles of the last compute()
+    const std::vector<StereoTile>& getTiles() const { return tiles; }
+
+    //minDisparity, numDisparities, blockSize describe the matcher fn runs; margin adds context
+    //on every side for matchers whose result depends on more than the block
+    void compute(InputArray leftarr, InputArray rightarr, OutputArray disparr, int minDisparity, int numDisparities,
+                 int blockSize, int margin, const Matcher& fn)
+    {
+        Mat left = leftarr.getMat(), right = rightarr.getMat();
+        CV_Assert( left.size() == right.size() && left.type() == right.type() );
+
+        Size ts = tileSize;
+        if( ts.width <= 0 && ts.height <= 0 )
+            ts.height = std::max((left.rows + 4*size() - 1)/(4*size()), blockSize*4);
+        tiles = stereoTileGrid(left.size(), ts, minDisparity, numDisparities, blockSize, margin);
+
+        //fresh pages for the output, first touched by the workers that fill them
+        disparr.create(left.size(), CV_16S);
+        Mat disp = disparr.getMat();
+
+        //one matcher per worker: the in-tree matchers run serially on the pool (stereoNumThreads()),
+        //and OpenCV runs a parallel_for_ that starts while another is in flight in its caller; the
+        //process-wide setNumThreads() is left alone, other threads may be using OpenCV meanwhile
+        pool.run((int)tiles.size(), [&](int t, int w)
+        {
+            const StereoTile& tile = tiles[t];
+            Buffers& b = buffers[w];
+            left(tile.in).copyTo(b.left);
+            right(tile.in).copyTo(b.right);
+            fn(w, tile, b.left, b.right, b.disp);
+            CV_Assert( b.disp.type() == CV_16S && b.disp.size() == tile.in.size() );
+            b.disp(Rect(tile.out.tl() - tile.in.tl(), tile.out.size())).copyTo(disp(tile.out));
+        });
+    }
+
+protected:
+    struct Buffers
+    {
+        Mat left, right, disp;
+    };
+
+    StereoWorkStealingPool pool;
+    Size tileSize;
+    std::vector<Buffers> buffers;
+    std::vector<StereoTile> tiles;
+};
+
+#endif /* Stereo_Tiling_hpp */
@@ -0,0 +1,279 @@
+//
+//  Stereo_Trace.hpp
+//  BMW_FM
+//
+//  Scoped stage timers for the tools. STEREO_TRACE_SCOPE("remap") records
+//  the span of the enclosing block on the calling thread; spans go to a
+//  buffer per thread, so recording takes no lock. At the end of a run they
+//  are written as Chrome trace events (chrome://tracing, Perfetto) and/or
+//  as a per-stage summary with p50/p95/p99, see StereoTraceSession.
+//
+//  Tracing is compiled in only with STEREO_ENABLE_TRACE defined; otherwise
+//  the macros expand to nothing and the session only reports that the
+//  build has no tracing.
+//
+
+#ifndef Stereo_Trace_hpp
+#define Stereo_Trace_hpp
+
+#include "opencv2/core/utility.hpp"
+
+#include <string>
+#include <stdio.h>
+
+using namespace cv;
+
+#ifdef STEREO_ENABLE_TRACE
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#define STEREO_TRACE_CONCAT_(a, b) a##b
+#define STEREO_TRACE_CONCAT(a, b) STEREO_TRACE_CONCAT_(a, b)
+//name must be a string literal (or otherwise outlive the run)
+#define STEREO_TRACE_SCOPE(name) StereoTraceScope STEREO_TRACE_CONCAT(stereo_trace_scope_, __LINE__)(name)
+
+
+struct StereoTraceSpan
+{
+    const char* name;
+    int64 start, end;       //getTickCount()
+};
+
+//spans of one thread; appended to by that thread only
+struct StereoTraceBuffer
+{
+    int tid;
+    std::vector<StereoTraceSpan> spans;
+    int64 dropped;
+};
+
+//every buffer ever created, kept after its thread ends so pool threads still show up in the export
+class StereoTraceRegistry
+{
+public:
+    static StereoTraceRegistry& instance()
+    {
+        static StereoTraceRegistry r;
+        return r;
+    }
+
+    //the calling thread's buffer, created on first use
+    StereoTraceBuffer* local()
+    {
+        static __thread StereoTraceBuffer* buffer = 0;
+        if( !buffer )
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffer = new StereoTraceBuffer();
+            buffer->tid = (int)buffers.size();
+            buffer->dropped = 0;
+            buffer->spans.reserve(4096);
+            buffers.push_back(buffer);
+        }
+        return buffer;
+    }
+
+    //spans a thread keeps at most; older ones stay, newer ones are counted as dropped
+    static size_t capacity() { return (size_t)1 << 20; }
+
+    //scopes record only while enabled, so a tracing build run without a session pays one test per scope
+    static std::atomic<bool>& enabled()
+    {
+        static std::atomic<bool> on(false);
+        return on;
+    }
+
+    int64 origin() const { return startTicks; }
+
+    //copy of all spans so far; call while traced code is idle
+    void collect(std::vector<std::pair<int, StereoTraceSpan> >& spans, int64& dropped)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        spans.clear();
+        dropped = 0;
+        for( size_t b = 0; b < buffers.size(); b++ )
+        {
+            for( size_t i = 0; i < buffers[b]->spans.size(); i++ )
+                spans.push_back(std::make_pair(buffers[b]->tid, buffers[b]->spans[i]));
+            dropped += buffers[b]->dropped;
+        }
+    }
+
+protected:
+    StereoTraceRegistry() : startTicks(getTickCount()) {}
+
+    std::mutex mutex;
+    std::vector<StereoTraceBuffer*> buffers;
+    int64 startTicks;
+};
+
+class StereoTraceScope
+{
+public:
+    explicit StereoTraceScope(const char* name_) : name(name_), start(StereoTraceRegistry::enabled().load(std::memory_order_relaxed) ? getTickCount() : 0) {}
+
+    ~StereoTraceScope()
+    {
+        if( !start )
+            return;
+        StereoTraceSpan s;
+        s.name = name;
+        s.start = start;
+        s.end = getTickCount();
+        StereoTraceBuffer* b = StereoTraceRegistry::instance().local();
+        if( b->spans.size() < StereoTraceRegistry::capacity() )
+            b->spans.push_back(s);
+        else
+            b->dropped++;
+    }
+
+protected:
+    const char* name;
+    int64 start;
+
+private:
+    StereoTraceScope(const StereoTraceScope&);
+    StereoTraceScope& operator=(const StereoTraceScope&);
+};
+
+//Chrome trace event format: one complete ("X") event per span, times in microseconds
+static inline bool stereoTraceWriteChrome(const std::string& filename)
+{
+    std::vector<std::pair<int, StereoTraceSpan> > spans;
+    int64 dropped;
+    StereoTraceRegistry& r = StereoTraceRegistry::instance();
+    r.collect(spans, dropped);
+    FILE* f = fopen(filename.c_str(), "w");
+    if( !f )
+        return false;
+    double us = 1e6/getTickFrequency();
+    int threads = 0;
+    for( size_t i = 0; i < spans.size(); i++ )
+        threads = std::max(threads, spans[i].first + 1);
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped\": %lld}, \"traceEvents\": [", (long long)dropped);
+    for( int t = 0; t < threads; t++ )
+        fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                t ? "," : "", t, t ? "thread" : "main", t);
+    for( size_t i = 0; i < spans.size(); i++ )
+    {
+        const StereoTraceSpan& s = spans[i].second;
+        fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                threads || i ? "," : "", s.name, spans[i].first, (s.start - r.origin())*us, (s.end - s.start)*us);
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
+
+struct StereoTraceStats
+{
+    std::string name;
+    int64 count;
+    double totalMs, meanMs, p50Ms, p95Ms, p99Ms, maxMs;
+};
+
+//per stage, in order of total time
+static inline void stereoTraceSummary(std::vector<StereoTraceStats>& stats)
+{
+    std::vector<std::pair<int, StereoTraceSpan> > spans;
+    int64 dropped;
+    StereoTraceRegistry::instance().collect(spans, dropped);
+    std::map<std::string, std::vector<double> > durations;
+    double ms = 1000/getTickFrequency();
+    for( size_t i = 0; i < spans.size(); i++ )
+        durations[spans[i].second.name].push_back((spans[i].second.end - spans[i].second.start)*ms);
+    stats.clear();
+    for( std::map<std::string, std::vector<double> >::iterator it = durations.begin(); it != durations.end(); ++it )
+    {
+        std::vector<double>& d = it->second;
+        std::sort(d.begin(), d.end());
+        StereoTraceStats s;
+        s.name = it->first;
+        s.count = (int64)d.size();
+        s.totalMs = 0;
+        for( size_t i = 0; i < d.size(); i++ )
+            s.totalMs += d[i];
+        s.meanMs = s.totalMs/d.size();
+        //nearest rank
+        s.p50Ms = d[std::min(d.size() - 1, (size_t)(0.50*d.size()))];
+        s.p95Ms = d[std::min(d.size() - 1, (size_t)(0.95*d.size()))];
+        s.p99Ms = d[std::min(d.size() - 1, (size_t)(0.99*d.size()))];
+        s.maxMs = d.back();
+        stats.push_back(s);
+    }
+    struct ByTotal { bool operator()(const StereoTraceStats& a, const StereoTraceStats& b) const { return a.totalMs > b.totalMs; } };
+    std::sort(stats.begin(), stats.end(), ByTotal());
+}
+
+//the summary as a table on f, and as JSON to filename unless it is empty
+static inline bool stereoTraceWriteSummary(FILE* f, const std::string& filename)
+{
+    std::vector<StereoTraceStats> stats;
+    stereoTraceSummary(stats);
+    fprintf(f, "%-20s %8s %10s %9s %9s %9s %9s %9s\n", "stage", "count", "total ms", "mean", "p50", "p95", "p99", "max");
+    for( size_t i = 0; i < stats.size(); i++ )
+        fprintf(f, "%-20s %8lld %10.1f %9.3f %9.3f %9.3f %9.3f %9.3f\n", stats[i].name.c_str(), (long long)stats[i].count,
+                stats[i].totalMs, stats[i].meanMs, stats[i].p50Ms, stats[i].p95Ms, stats[i].p99Ms, stats[i].maxMs);
+    if( filename.empty() )
+        return true;
+    FILE* out = fopen(filename.c_str(), "w");
+    if( !out )
+        return false;
+    fprintf(out, "{\"stages\": [");
+    for( size_t i = 0; i < stats.size(); i++ )
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"count\": %lld, \"total_ms\": %.3f, \"mean_ms\": %.4f, \"p50_ms\": %.4f, "
+                "\"p95_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f}", i ? "," : "", stats[i].name.c_str(),
+                (long long)stats[i].count, stats[i].totalMs, stats[i].meanMs, stats[i].p50Ms, stats[i].p95Ms,
+                stats[i].p99Ms, stats[i].maxMs);
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
+
+#else
+
+#define STEREO_TRACE_SCOPE(name) do {} while(0)
+
+#endif
+
+//the trace of a tool's run: declared at the top of main() and opened once the options are
+//parsed, it records while either file name is set and writes the Chrome trace to traceFilename
+//and the summary to summaryFilename (and stdout) when main() returns
+class StereoTraceSession
+{
+public:
+    StereoTraceSession() {}
+
+    void open(const std::string& traceFilename_, const std::string& summaryFilename_)
+    {
+        traceFilename = traceFilename_;
+        summaryFilename = summaryFilename_;
+#ifdef STEREO_ENABLE_TRACE
+        StereoTraceRegistry::enabled() = !traceFilename.empty() || !summaryFilename.empty();
+#else
+        if( !traceFilename.empty() || !summaryFilename.empty() )
+            printf("trace: this build has no tracing, rebuild with STEREO_ENABLE_TRACE defined\n");
+#endif
+    }
+
+    ~StereoTraceSession()
+    {
+#ifdef STEREO_ENABLE_TRACE
+        if( !traceFilename.empty() && !stereoTraceWriteChrome(traceFilename) )
+            printf("Error: could not write the trace %s\n", traceFilename.c_str());
+        if( (!traceFilename.empty() || !summaryFilename.empty()) && !stereoTraceWriteSummary(stdout, summaryFilename) )
+            printf("Error: could not write the trace summary %s\n", summaryFilename.c_str());
+#endif
+    }
+
+protected:
+    std::string traceFilename, summaryFilename;
+
+private:
+    StereoTraceSession(const StereoTraceSession&);
+    StereoTraceSession& operator=(const StereoTraceSession&);
+};
+
+#endif /* Stereo_Trace_hpp */
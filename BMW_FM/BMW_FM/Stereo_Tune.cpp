@@ -0,0 +1,428 @@
+//
+//  Stereo_Tune.cpp
+//  BMW_FM
+//
+//  Headless parameter search for the matchers of Disp_Map. Candidate
+//  settings are sampled from a grid per algorithm and evaluated on a pool,
+//  one candidate per core, against the same decoded pairs; accuracy is the
+//  bad-pixel share against ground truth, or the left-right inconsistent
+//  share where there is none. The settings no other candidate beats on both
+//  accuracy and time per frame are timed again one at a time with OpenCV's
+//  usual thread count, as Disp_Map runs them, and written as a config
+//  Disp_Map loads with --config.
+//
+
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include "Stereo_Matchers.hpp"
+#include "Stereo_Metrics.hpp"
+#include "Stereo_Sequence.hpp"
+#include "Stereo_ThreadPool.hpp"
+#include "Stereo_Chessboard.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+
+static void print_help()
+{
+    printf("\nStereo parameter tuner: searches the matcher settings for the Pareto front of accuracy against time per frame\n");
+    printf("\nUsage: stereo_tune --pair=<left>,<right>[,<ground_truth>] [--pair=...]... [-o <config.yml>]\n"
+           "[--algorithms=bm,sgbm] [--samples=<n>] [--runs=<n>] [--threads=<n>] [--max-disparity=<n>]\n"
+           "[--bad=<pixels>] [--gt-scale=<factor>] [--lr-diff=<pixels>] [--seed=<n>]\n");
+    printf("\nThe pairs must be rectified; they are decoded once and shared by all candidates. Every algorithm's grid\n"
+           "(block size, pre-filter cap, uniqueness, speckle window, left-right check and, for bm/simdbm, texture\n"
+           "threshold) is sampled down to <n> candidates (default 256) plus Disp_Map's defaults, evaluated one per\n"
+           "core with single-threaded matchers and timed as the best of <n> runs (default 3). The settings on the front are\n"
+           "timed again one at a time with OpenCV's usual thread count, and those times go to the config.\n"
+           "Accuracy: bad pixels beyond --bad (default 2) when every pair has ground truth, else the share of pixels\n"
+           "missing or inconsistent with the right view's disparity by more than --lr-diff (default 1).\n"
+           "The front goes to -o (default disp_params.yml), most accurate first; load it with\n"
+           "Disp_Map --config=<config.yml> [--config-ms=<budget>].\n");
+}
+
+struct TunePair
+{
+    string name;
+    Mat gray1, gray2, color1, color2;
+    Mat gt;
+};
+
+struct TuneCandidate
+{
+    int alg;
+    DispParams params;
+    double ms;          //per frame, best of the runs, averaged over the pairs
+    double error;       //percent, averaged over the pairs
+};
+
+static vector<string> splitList(const string& s)
+{
+    vector<string> items;
+    size_t start = 0;
+    for(;;)
+    {
+        size_t comma = s.find(',', start);
+        items.push_back(s.substr(start, comma == string::npos ? string::npos : comma - start));
+        if( comma == string::npos )
+            return items;
+        start = comma + 1;
+    }
+}
+
+//every combination of the settings alg depends on, the fixed ones taken from base
+static void candidateGrid(int alg, const DispParams& base, vector<DispParams>& grid)
+{
+    //block sizes below 7 keep the matcher's own default, and configure() caps sgm at 11 and census
+    //at 31 (see DispMatchers::configure): larger ones would only repeat the capped candidates
+    const int blockSizes[] = { 5, 7, 9, 11, 15, 21 };
+    int maxBlockSize = alg == STEREO_SGM || alg == STEREO_SGM_STRIP ? 11 : alg == STEREO_CENSUS ? 31 : INT_MAX;
+    const int preFilterCaps[] = { 15, 31, 63 };
+    const int uniquenessRatios[] = { 0, 5, 10, 15 };
+    const int speckleWindows[] = { 0, 50, 100, 200 };
+    const int maxDiffs[] = { -100, 100, 200 };     //disp12MaxDiff x100, negative: no left-right check
+    const int textureThresholds[] = { 0, 10, 100, 500 };
+    bool texture = alg == STEREO_BM || alg == STEREO_SIMDBM;
+    bool preFilter = alg != STEREO_CENSUS;
+    grid.clear();
+    for( int b = 0; b < 6 && blockSizes[b] <= maxBlockSize; b++ )
+        for( int c = 0; c < (preFilter ? 3 : 1); c++ )
+            for( int u = 0; u < 4; u++ )
+                for( int s = 0; s < 4; s++ )
+                    for( int m = 0; m < 3; m++ )
+                        for( int t = 0; t < (texture ? 4 : 1); t++ )
+                        {
+                            DispParams p = base;
+                            p.BlockSize = blockSizes[b];
+                            if( preFilter )
+                                p.pre_filter_cap = preFilterCaps[c];
+                            p.uniqueness_ratio = uniquenessRatios[u];
+                            p.speckle_window_size = speckleWindows[s];
+                            p.max_diff = maxDiffs[m];
+                            if( texture )
+                                p.texture_threshold = textureThresholds[t];
+                            grid.push_back(p);
+                        }
+}
+
+//the matchers of Disp_Map take the color images except for these
+static bool candidateGray(int alg)
+{
+    return alg == STEREO_BM || alg == STEREO_SIMDBM || alg == STEREO_SGM || alg == STEREO_SGM_STRIP || alg == STEREO_CENSUS;
+}
+
+//time of c on one pair in ms, best of runs; dispcal gets the map and matchers must be configured for c
+static double timeCandidate(DispMatchers& matchers, const TuneCandidate& c, const TunePair& pair, int runs, Mat& dispcal)
+{
+    bool color = !candidateGray(c.alg);
+    const Mat& img1 = color ? pair.color1 : pair.gray1;
+    const Mat& img2 = color ? pair.color2 : pair.gray2;
+    double best = DBL_MAX;
+    for( int r = 0; r < runs; r++ )
+    {
+        int64 t = getTickCount();
+        matchers.compute(c.alg, img1, img2, dispcal);
+        best = std::min(best, (getTickCount() - t)*1000./getTickFrequency());
+    }
+    return best;
+}
+
+//bad-pixel or left-right error of one candidate on one pair, in percent
+static double candidateError(const Ptr<StereoMatcher>& m, const TunePair& pair, const Mat& img1, const Mat& img2,
+                             const Mat& dispcal, bool groundTruth, double badThreshold, double lrDiff)
+{
+    if( groundTruth )
+        return stereoEvaluateDisparity(dispcal, m->getMinDisparity(), pair.gt, badThreshold).bad*100;
+    Mat dispRight;
+    stereoRightDisparity(m, img1, img2, dispRight);
+    return stereoLeftRightError(dispcal, dispRight, m->getMinDisparity(), lrDiff)*100;
+}
+
+//the candidates no other one beats on both time and error, most accurate first
+static void paretoFront(vector<TuneCandidate> all, vector<TuneCandidate>& front)
+{
+    struct ByTime
+    {
+        bool operator()(const TuneCandidate& a, const TuneCandidate& b) const
+        {
+            return a.ms < b.ms || (a.ms == b.ms && a.error < b.error);
+        }
+    };
+    std::sort(all.begin(), all.end(), ByTime());
+    front.clear();
+    for( size_t i = 0; i < all.size(); i++ )
+        if( front.empty() || all[i].error < front.back().error )
+            front.push_back(all[i]);
+    std::reverse(front.begin(), front.end());
+}
+
+int main(int argc, char** argv)
+{
+    const char* pair_opt = "--pair=";
+    const char* algorithms_opt = "--algorithms=";
+    const char* samples_opt = "--samples=";
+    const char* runs_opt = "--runs=";
+    const char* threads_opt = "--threads=";
+    const char* maxdisp_opt = "--max-disparity=";
+    const char* bad_opt = "--bad=";
+    const char* gt_scale_opt = "--gt-scale=";
+    const char* lr_diff_opt = "--lr-diff=";
+    const char* seed_opt = "--seed=";
+
+    vector<vector<string> > pair_args;
+    vector<string> algorithms;
+    algorithms.push_back("bm");
+    algorithms.push_back("sgbm");
+    int samples = 256, runs = 3, nthreads = 0, seed = 1;
+    double bad_threshold = 2, gt_scale = 0, lr_diff = 1;
+    const char* output_filename = "disp_params.yml";
+    DispParams base;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0 )
+        {
+            print_help();
+            return 0;
+        }
+        else if( strncmp(argv[i], pair_opt, strlen(pair_opt)) == 0 )
+        {
+            vector<string> items = splitList(argv[i] + strlen(pair_opt));
+            if( items.size() < 2 || items.size() > 3 )
+            {
+                printf("Command-line parameter error: --pair=<left>,<right>[,<ground_truth>]\n");
+                return -1;
+            }
+            pair_args.push_back(items);
+        }
+        else if( strncmp(argv[i], algorithms_opt, strlen(algorithms_opt)) == 0 )
+        {
+            algorithms = splitList(argv[i] + strlen(algorithms_opt));
+            for( size_t k = 0; k < algorithms.size(); k++ )
+            {
+                int alg = dispAlgorithmFromName(algorithms[k]);
+                if( alg < 0 || alg == STEREO_VAR )
+                {
+                    printf("Command-line parameter error: Unknown or untunable stereo algorithm %s\n", algorithms[k].c_str());
+                    return -1;
+                }
+            }
+        }
+        else if( strncmp(argv[i], samples_opt, strlen(samples_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(samples_opt), "%d", &samples ) != 1 || samples < 1 )
+            {
+                printf("Command-line parameter error: The number of candidates (--samples=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], runs_opt, strlen(runs_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(runs_opt), "%d", &runs ) != 1 || runs < 1 )
+            {
+                printf("Command-line parameter error: The number of timed runs (--runs=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], threads_opt, strlen(threads_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(threads_opt), "%d", &nthreads ) != 1 || nthreads < 0 )
+            {
+                printf("Command-line parameter error: The number of threads (--threads=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], maxdisp_opt, strlen(maxdisp_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(maxdisp_opt), "%d", &base.number_of_disparities ) != 1 || base.number_of_disparities < 1 )
+            {
+                printf("Command-line parameter error: The max disparity (--max-disparity=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], bad_opt, strlen(bad_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(bad_opt), "%lf", &bad_threshold ) != 1 || bad_threshold <= 0 )
+            {
+                printf("Command-line parameter error: The bad-pixel threshold (--bad=<pixels>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], gt_scale_opt, strlen(gt_scale_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(gt_scale_opt), "%lf", &gt_scale ) != 1 || gt_scale <= 0 )
+            {
+                printf("Command-line parameter error: The ground-truth scale (--gt-scale=<...>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], lr_diff_opt, strlen(lr_diff_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(lr_diff_opt), "%lf", &lr_diff ) != 1 || lr_diff < 0 )
+            {
+                printf("Command-line parameter error: The left-right tolerance (--lr-diff=<pixels>) must be a non-negative number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], seed_opt, strlen(seed_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(seed_opt), "%d", &seed ) != 1 )
+            {
+                printf("Command-line parameter error: The sampling seed (--seed=<...>) must be an integer\n");
+                return -1;
+            }
+        }
+        else if( strcmp(argv[i], "-o") == 0 && i + 1 < argc )
+            output_filename = argv[++i];
+        else
+        {
+            printf("Command-line parameter error: unknown option %s\n", argv[i]);
+            print_help();
+            return -1;
+        }
+    }
+    if( pair_args.empty() )
+    {
+        print_help();
+        return -1;
+    }
+
+    //decoded once, read by every candidate
+    vector<TunePair> pairs(pair_args.size());
+    bool ground_truth = true;
+    for( size_t i = 0; i < pair_args.size(); i++ )
+    {
+        TunePair& p = pairs[i];
+        p.name = pair_args[i][0];
+        p.gray1 = stereoImread(pair_args[i][0], IMREAD_GRAYSCALE);
+        p.gray2 = stereoImread(pair_args[i][1], IMREAD_GRAYSCALE);
+        p.color1 = stereoImread(pair_args[i][0], IMREAD_UNCHANGED);
+        p.color2 = stereoImread(pair_args[i][1], IMREAD_UNCHANGED);
+        if( p.gray1.empty() || p.gray2.empty() || p.color1.empty() || p.color2.empty() || p.gray1.size() != p.gray2.size() )
+        {
+            printf("Error: could not load the pair %s / %s\n", pair_args[i][0].c_str(), pair_args[i][1].c_str());
+            return -1;
+        }
+        if( pair_args[i].size() == 3 && !stereoReadGroundTruth(pair_args[i][2], p.gt, gt_scale) )
+            printf("%s: not a ground-truth disparity map (PFM, 16-bit PNG or 8-bit gray), ignored\n", pair_args[i][2].c_str());
+        ground_truth = ground_truth && !p.gt.empty();
+    }
+
+    //a random sample of every algorithm's grid, plus the defaults Disp_Map starts from
+    vector<TuneCandidate> candidates;
+    RNG rng((uint64)seed);
+    for( size_t k = 0; k < algorithms.size(); k++ )
+    {
+        int alg = dispAlgorithmFromName(algorithms[k]);
+        vector<DispParams> grid;
+        candidateGrid(alg, base, grid);
+        while( (int)grid.size() > samples )
+        {
+            int j = rng.uniform(0, (int)grid.size());
+            grid[j] = grid.back();
+            grid.pop_back();
+        }
+        grid.push_back(base);
+        for( size_t i = 0; i < grid.size(); i++ )
+        {
+            TuneCandidate c;
+            c.alg = alg;
+            c.params = grid[i];
+            c.ms = c.error = 0;
+            candidates.push_back(c);
+        }
+    }
+
+    StereoWorkStealingPool pool(nthreads);
+    //one candidate per core: OpenCV's own threads would only distort the timings
+    int cv_threads = getNumThreads();
+    setNumThreads(1);
+    printf("tune: %d candidates on %d pairs, %d workers, %s\n", (int)candidates.size(), (int)pairs.size(), pool.size(),
+           ground_truth ? "bad pixels against ground truth" : "left-right consistency");
+    StereoProgress progress("evaluating", (int)candidates.size());
+    pool.run((int)candidates.size(), [&](int i, int)
+    {
+        TuneCandidate& c = candidates[i];
+        bool color = !candidateGray(c.alg);
+        //configure() keeps some settings when given the defaults, so every candidate starts from new matchers
+        DispMatchers matchers(false, STEREO_CENSUS_9x7);
+        matchers.configure(c.params, c.alg, Rect(), Rect());
+        Ptr<StereoMatcher> m = matchers.matcher(c.alg);
+        for( size_t k = 0; k < pairs.size(); k++ )
+        {
+            const TunePair& pair = pairs[k];
+            Mat dispcal;
+            c.ms += timeCandidate(matchers, c, pair, runs, dispcal)/pairs.size();
+            c.error += candidateError(m, pair, color ? pair.color1 : pair.gray1, color ? pair.color2 : pair.gray2, dispcal,
+                                      ground_truth, bad_threshold, lr_diff)/pairs.size();
+        }
+        progress.step();
+    });
+    setNumThreads(cv_threads);
+
+    //the sweep times carry the contention of every core matching at once and a single thread per
+    //matcher; the front is timed again alone, with the thread count Disp_Map runs at, and the
+    //settings that no longer make it are dropped
+    vector<TuneCandidate> front;
+    paretoFront(candidates, front);
+    StereoProgress retime("timing the front", (int)front.size());
+    for( size_t i = 0; i < front.size(); i++ )
+    {
+        TuneCandidate& c = front[i];
+        DispMatchers matchers(false, STEREO_CENSUS_9x7);
+        matchers.configure(c.params, c.alg, Rect(), Rect());
+        c.ms = 0;
+        for( size_t k = 0; k < pairs.size(); k++ )
+        {
+            Mat dispcal;
+            c.ms += timeCandidate(matchers, c, pairs[k], runs, dispcal)/pairs.size();
+        }
+        retime.step();
+    }
+    paretoFront(front, front);
+
+    FileStorage fs(output_filename, FileStorage::WRITE);
+    if( !fs.isOpened() )
+    {
+        printf("Error: could not write %s\n", output_filename);
+        return -1;
+    }
+    fs << "metric" << (ground_truth ? "bad pixels %" : "left-right inconsistent %");
+    fs << "threshold" << (ground_truth ? bad_threshold : lr_diff);
+    fs << "pairs" << (int)pairs.size();
+    fs << "candidates" << (int)candidates.size();
+    //the conditions of the ms of the front, what --config-ms compares against
+    fs << "threads" << getNumThreads();
+    fs << "concurrency" << 1;
+    fs << "front" << "[";
+    printf("%-9s %10s %8s %6s %6s %6s %8s %6s %8s\n", "algorithm", "ms", "error %", "block", "cap", "uniq", "speckle",
+           "lr", "texture");
+    for( size_t i = 0; i < front.size(); i++ )
+    {
+        const TuneCandidate& c = front[i];
+        fs << "{";
+        fs << "ms" << c.ms;
+        fs << "error" << c.error;
+        dispWriteParams(fs, c.alg, c.params);
+        fs << "}";
+        printf("%-9s %10.2f %8.3f %6d %6d %6d %8d %6d %8d\n", dispAlgorithmName(c.alg), c.ms, c.error, c.params.BlockSize,
+               c.params.pre_filter_cap, c.params.uniqueness_ratio, c.params.speckle_window_size, c.params.max_diff,
+               c.params.texture_threshold);
+    }
+    fs << "]";
+    fs.release();
+    printf("tune: %d settings on the front written to %s\n", (int)front.size(), output_filename);
+    return 0;
+}